@@ -0,0 +1,393 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Verify and benchmark the RAID-Z parity kernels.
+ *
+ * For each parity level and each implementation the CPU supports, parity
+ * is generated for one block and compared against the scalar result. Then
+ * every failure combination the parity level can survive (which parity
+ * columns are lost, and how many data columns) is reconstructed and the
+ * recovered data checked. Unless -v is given, each case is then timed and
+ * reported in GB/s of block data processed.
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/spa.h>
+#include <sys/vdev_impl.h>
+#include <sys/vdev_raidz.h>
+#include <sys/zio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "format.h"
+
+static char cmdname[] = "raidz_test";
+
+static uint64_t rzopt_ashift = SPA_MINBLOCKSHIFT;
+static uint64_t rzopt_cols = 8;
+static uint64_t rzopt_size = SPA_MAXBLOCKSIZE;
+static uint64_t rzopt_time = 500;	/* milliseconds per case */
+static char *rzopt_impl = NULL;		/* all supported */
+static int rzopt_verify_only = 0;
+
+extern int vdev_raidz_default_to_general;
+
+static void
+usage(boolean_t requested)
+{
+	FILE *fp = requested ? stdout : stderr;
+
+	(void) fprintf(fp, "Usage: %s\n"
+	    "\t[-a ashift (default: %llu)]\n"
+	    "\t[-c columns including parity (default: %llu)]\n"
+	    "\t[-s block size in bytes (default: %llu)]\n"
+	    "\t[-t milliseconds per benchmark case (default: %llu)]\n"
+	    "\t[-i implementation (default: all supported)]\n"
+	    "\t[-g] (always use the general reconstruction method)\n"
+	    "\t[-v] (verify only, no benchmark)\n"
+	    "\t[-h] (print help)\n",
+	    cmdname,
+	    (u_longlong_t)rzopt_ashift,
+	    (u_longlong_t)rzopt_cols,
+	    (u_longlong_t)rzopt_size,
+	    (u_longlong_t)rzopt_time);
+	exit(requested ? 0 : 1);
+}
+
+static void
+process_options(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:c:s:t:i:gvh")) != EOF) {
+		switch (opt) {
+		case 'a':
+			rzopt_ashift = strtoull(optarg, NULL, 0);
+			break;
+		case 'c':
+			rzopt_cols = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			rzopt_size = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			rzopt_time = MAX(1, strtoull(optarg, NULL, 0));
+			break;
+		case 'i':
+			rzopt_impl = strdup(optarg);
+			break;
+		case 'g':
+			vdev_raidz_default_to_general = 1;
+			break;
+		case 'v':
+			rzopt_verify_only = 1;
+			break;
+		case 'h':
+			usage(B_TRUE);
+			break;
+		case '?':
+		default:
+			usage(B_FALSE);
+			break;
+		}
+	}
+
+	if (rzopt_ashift < SPA_MINBLOCKSHIFT || rzopt_ashift > 16 ||
+	    rzopt_cols < 2 || rzopt_cols > 255 ||
+	    rzopt_size == 0 || rzopt_size > SPA_MAXBLOCKSIZE ||
+	    P2PHASE(rzopt_size, 1ULL << rzopt_ashift) != 0) {
+		(void) fprintf(stderr, "%s: invalid geometry\n", cmdname);
+		usage(B_FALSE);
+	}
+}
+
+static raidz_map_t *
+rz_map_alloc(zio_t *zio, void *data, uint64_t nparity)
+{
+	bzero(zio, sizeof (*zio));
+	zio->io_type = ZIO_TYPE_WRITE;
+	zio->io_offset = 0;
+	zio->io_size = rzopt_size;
+	zio->io_data = data;
+
+	return (vdev_raidz_map_alloc(zio, rzopt_ashift, rzopt_cols, nparity));
+}
+
+/*
+ * Copy the parity columns of rm into (or out of) buf.
+ */
+static void
+rz_parity_copy(raidz_map_t *rm, char *buf, boolean_t save)
+{
+	raidz_col_t *rc;
+	int c;
+
+	for (c = 0; c < rm->rm_firstdatacol; c++) {
+		rc = &rm->rm_col[c];
+		if (save)
+			bcopy(rc->rc_data, buf, rc->rc_size);
+		else
+			bcopy(buf, rc->rc_data, rc->rc_size);
+		buf += rc->rc_size;
+	}
+}
+
+static const char *
+rz_case_name(raidz_map_t *rm, int *tgts, int ntgts)
+{
+	static char name[16];
+	char *s = name;
+	int t;
+
+	for (t = 0; t < ntgts; t++)
+		*s++ = tgts[t] < rm->rm_firstdatacol ? "PQR"[tgts[t]] : 'D';
+	*s = '\0';
+
+	return (name);
+}
+
+static double
+rz_rate(uint64_t iters, hrtime_t elapsed)
+{
+	return ((double)iters * rzopt_size / (double)MAX(elapsed, 1));
+}
+
+static void
+rz_report(const char *impl, uint64_t nparity, const char *what,
+    uint64_t iters, hrtime_t elapsed)
+{
+	(void) printf("%-8s raidz%llu  %-8s %8.3f GB/s\n", impl,
+	    (u_longlong_t)nparity, what, rz_rate(iters, elapsed));
+}
+
+static void
+rz_bench_gen(const char *impl, raidz_map_t *rm)
+{
+	hrtime_t start, now, limit = rzopt_time * (NANOSEC / MILLISEC);
+	uint64_t iters = 0;
+
+	start = gethrtime();
+	do {
+		vdev_raidz_generate_parity(rm);
+		iters++;
+	} while ((now = gethrtime()) - start < limit);
+
+	rz_report(impl, rm->rm_firstdatacol, "gen", iters, now - start);
+}
+
+static void
+rz_bench_rec(const char *impl, raidz_map_t *rm, int *tgts, int ntgts)
+{
+	hrtime_t start, now, limit = rzopt_time * (NANOSEC / MILLISEC);
+	uint64_t iters = 0;
+
+	start = gethrtime();
+	do {
+		(void) vdev_raidz_reconstruct(rm, tgts, ntgts);
+		iters++;
+	} while ((now = gethrtime()) - start < limit);
+
+	rz_report(impl, rm->rm_firstdatacol, rz_case_name(rm, tgts, ntgts),
+	    iters, now - start);
+}
+
+/*
+ * Lose the target columns, reconstruct them and compare against the
+ * original data. The map is put back the way it was afterwards. Returns
+ * the number of failures.
+ */
+static int
+rz_verify_rec(raidz_map_t *rm, char *data, char *orig, char *parity,
+    int *tgts, int ntgts)
+{
+	int t, c, err = 0;
+
+	for (t = 0; t < ntgts; t++) {
+		c = tgts[t];
+		(void) memset(rm->rm_col[c].rc_data, 0xa5,
+		    rm->rm_col[c].rc_size);
+	}
+
+	(void) vdev_raidz_reconstruct(rm, tgts, ntgts);
+
+	if (bcmp(data, orig, rzopt_size) != 0) {
+		(void) fprintf(stderr, "%s: %s: raidz%llu reconstruction of "
+		    "%s failed\n", cmdname, vdev_raidz_math->rm_name,
+		    (u_longlong_t)rm->rm_firstdatacol,
+		    rz_case_name(rm, tgts, ntgts));
+		err++;
+	}
+
+	bcopy(orig, data, rzopt_size);
+	rz_parity_copy(rm, parity, B_FALSE);
+
+	return (err);
+}
+
+/*
+ * Walk every failure combination the map's parity level can survive: each
+ * subset of lost parity columns together with one up to all of the
+ * remaining redundancy in lost data columns. Every choice of data columns
+ * is verified; the benchmark uses the first data columns as representative.
+ */
+static int
+rz_rec_cases(raidz_map_t *rm, char *data, char *orig, char *parity)
+{
+	int tgts[VDEV_RAIDZ_MAXPARITY], d[VDEV_RAIDZ_MAXPARITY];
+	int nparity = rm->rm_firstdatacol;
+	int ndata = rm->rm_cols - nparity;
+	int pmask, np, nd, i, err = 0;
+
+	for (pmask = 0; pmask < (1 << nparity); pmask++) {
+		np = 0;
+		for (i = 0; i < nparity; i++) {
+			if (pmask & (1 << i))
+				tgts[np++] = i;
+		}
+
+		for (nd = 1; nd <= nparity - np && nd <= ndata; nd++) {
+			for (i = 0; i < nd; i++)
+				d[i] = i;
+
+			for (;;) {
+				for (i = 0; i < nd; i++)
+					tgts[np + i] = nparity + d[i];
+
+				err += rz_verify_rec(rm, data, orig, parity,
+				    tgts, np + nd);
+
+				/* advance to the next combination */
+				for (i = nd - 1; i >= 0 &&
+				    d[i] == ndata - nd + i; i--)
+					continue;
+				if (i < 0)
+					break;
+				d[i]++;
+				for (i++; i < nd; i++)
+					d[i] = d[i - 1] + 1;
+			}
+
+			if (rzopt_verify_only)
+				continue;
+
+			for (i = 0; i < nd; i++)
+				tgts[np + i] = nparity + i;
+			rz_bench_rec(vdev_raidz_math->rm_name, rm, tgts,
+			    np + nd);
+		}
+	}
+
+	return (err);
+}
+
+int
+main(int argc, char **argv)
+{
+	const vdev_raidz_math_ops_t *ops;
+	raidz_map_t *rm;
+	zio_t zio;
+	char *data, *orig, *ref, *parity;
+	size_t psize;
+	uint64_t nparity, i;
+	int impl, tested = 0, err = 0;
+
+	(void) setvbuf(stdout, NULL, _IOLBF, 0);
+
+	process_options(argc, argv);
+	psize = VDEV_RAIDZ_MAXPARITY * rzopt_size;
+
+	kernel_init(FREAD);
+
+	data = kmem_alloc(rzopt_size, KM_SLEEP);
+	orig = kmem_alloc(rzopt_size, KM_SLEEP);
+	ref = kmem_alloc(psize, KM_SLEEP);
+	parity = kmem_alloc(psize, KM_SLEEP);
+
+	srandom(getpid());
+	for (i = 0; i < rzopt_size; i++)
+		data[i] = random();
+	bcopy(data, orig, rzopt_size);
+
+	for (nparity = 1; nparity <= VDEV_RAIDZ_MAXPARITY &&
+	    nparity < rzopt_cols; nparity++) {
+		/*
+		 * The scalar implementation provides the reference parity.
+		 */
+		VERIFY(vdev_raidz_math_set("scalar") == 0);
+		rm = rz_map_alloc(&zio, data, nparity);
+		vdev_raidz_generate_parity(rm);
+		rz_parity_copy(rm, ref, B_TRUE);
+		vdev_raidz_map_free(rm);
+
+		for (impl = 0; (ops = vdev_raidz_math_impls[impl]) != NULL;
+		    impl++) {
+			if (rzopt_impl != NULL &&
+			    strcmp(rzopt_impl, ops->rm_name) != 0)
+				continue;
+			if (vdev_raidz_math_set(ops->rm_name) != 0)
+				continue;
+			tested++;
+
+			rm = rz_map_alloc(&zio, data, nparity);
+			vdev_raidz_generate_parity(rm);
+			rz_parity_copy(rm, parity, B_TRUE);
+
+			if (bcmp(parity, ref,
+			    nparity * rm->rm_col[0].rc_size) != 0) {
+				(void) fprintf(stderr, "%s: %s: raidz%llu "
+				    "parity differs from scalar\n", cmdname,
+				    ops->rm_name, (u_longlong_t)nparity);
+				err++;
+			}
+
+			if (!rzopt_verify_only)
+				rz_bench_gen(ops->rm_name, rm);
+
+			err += rz_rec_cases(rm, data, orig, parity);
+
+			vdev_raidz_map_free(rm);
+		}
+	}
+
+	kmem_free(data, rzopt_size);
+	kmem_free(orig, rzopt_size);
+	kmem_free(ref, psize);
+	kmem_free(parity, psize);
+
+	kernel_fini();
+
+	if (tested == 0) {
+		(void) fprintf(stderr, "%s: implementation '%s' is not "
+		    "supported\n", cmdname, rzopt_impl);
+		return (1);
+	}
+
+	if (err != 0) {
+		(void) fprintf(stderr, "%s: %d failures\n", cmdname, err);
+		return (1);
+	}
+
+	(void) printf("%s: %d implementation/parity combinations verified\n",
+	    cmdname, tested);
+
+	return (0);
+}
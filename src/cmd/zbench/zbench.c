@@ -0,0 +1,1438 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Microbenchmarks for the per-block kernels of the I/O pipeline.
+ *
+ * Every checksum and compression function in zio_checksum_table and
+ * zio_compress_table, RAID-Z parity generation and reconstruction, the
+ * DDT entry compressor and the zio buffer allocator are each timed on a
+ * range of block sizes. The input data is generated from a fixed seed, so
+ * two runs with the same options (on the same build) process exactly the
+ * same bytes.
+ *
+ * Output is meant for scripts: lines starting with '#' describe the run,
+ * every other line is one tab-separated result:
+ *
+ *	kernel	variant	size	iters	nsec/op	MB/s	ratio
+ *
+ * "ratio" is the compression ratio for the compressors and 1.00 for
+ * everything else. Each result is the best of -r repeats of at least -t
+ * milliseconds each.
+ *
+ * The object_alloc benchmark instead creates a scratch pool in -d and
+ * measures how fast 1, 2, 4, ... -T threads can create objects in it,
+ * one per transaction. Its variant is the thread count, its size that of
+ * a dnode, and nsec/op the wall time per create across all threads.
+ *
+ * The zil_commit benchmark uses the same kind of pool, plus a separate
+ * log device. 0, 1, 2, ... -T threads stream large asynchronous writes
+ * into their own files and log them, while one more thread writes and
+ * fsyncs (zil_commit()s) a small file in a loop. Its variant is the number
+ * of streaming writers, its size that of the fsynced write, nsec/op the
+ * mean zil_commit() latency and MB/s the streaming writers' throughput.
+ * The "Nfsyncs" variants then run 2, 4, ... -T fsync threads on files of
+ * their own with no streaming writers; nsec/op is the wall time per commit
+ * across all threads and MB/s the fsynced throughput. A '#' line after
+ * each result gives the latency percentiles.
+ *
+ * The space_map benchmark needs no pool. Its size is the number of free
+ * segments in a fragmented metaslab-sized map. The "load" variant builds
+ * the map the way space_map_load() replays an on-disk map plus the
+ * allocator's size index; nsec/op is the time per load and MB/s the rate
+ * at which on-disk entries are consumed. The "alloc" variant allocates a
+ * block from the loaded map and frees it again; nsec/op is the time per
+ * pair. A '#' line after each load gives the in-core bytes per segment.
+ *
+ * The microzap benchmark uses a scratch pool too. Its size is the number
+ * of entries in a microzap object. The "open" variant drops the in-core
+ * zap_t and opens the object again, which rebuilds the entry index; the
+ * "lookup" variant looks up a random existing name. nsec/op is the time
+ * per open or lookup and MB/s is in units of entries.
+ *
+ * The fatzap benchmark builds fat ZAP objects of 1K, 32K and 1M entries
+ * in the same kind of pool. "lookup" is as for microzap; "iterate" walks
+ * the whole object with a cursor, and its nsec/op and MB/s are per entry.
+ * A '#' line before each gives the number of leaf blocks.
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/spa.h>
+#include <sys/zio.h>
+#include <sys/zio_checksum.h>
+#include <sys/zio_compress.h>
+#include <sys/vdev_impl.h>
+#include <sys/vdev_raidz.h>
+#include <sys/ddt.h>
+#include <sys/dmu.h>
+#include <sys/dmu_objset.h>
+#include <sys/dmu_tx.h>
+#include <sys/spa_impl.h>
+#include <sys/zil.h>
+#include <sys/space_map.h>
+#include <sys/metaslab.h>
+#include <sys/zap.h>
+#include <sys/zap_impl.h>
+#include <sys/fs/zfs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define	ZBENCH_VERSION	1
+
+static char cmdname[] = "zbench";
+
+static uint64_t zbopt_minsize = SPA_MINBLOCKSIZE;
+static uint64_t zbopt_maxsize = 1ULL << 20;
+static uint64_t zbopt_time = 100;	/* milliseconds per repeat */
+static int zbopt_repeat = 3;
+static uint64_t zbopt_seed = 0x5eed;
+static char *zbopt_kernel = NULL;	/* all */
+static char *zbopt_pattern = "mixed";
+static char *zbopt_raidz_impl = NULL;	/* vdev_raidz_math_init() choice */
+static int zbopt_threads = 64;
+static char *zbopt_dir = "/tmp";
+
+#define	ZB_RAIDZ_COLS	8
+#define	ZB_POOL_NAME	"zbench"
+#define	ZB_POOL_SIZE	(1ULL << 30)
+#define	ZB_LOG_SIZE	(256ULL << 20)
+#define	ZB_ZIL_STREAM_SIZE	(64ULL << 10)	/* streaming write size */
+#define	ZB_ZIL_FSYNC_SIZE	(4ULL << 10)	/* fsynced write size */
+#define	ZB_ZIL_FILE_SIZE	(8ULL << 20)	/* streaming writes wrap */
+#define	ZB_ZIL_MAX_SAMPLES	(1 << 16)	/* latencies kept per run */
+#define	ZB_SM_SIZE		(1ULL << 36)	/* space map size */
+#define	ZB_SM_MIN_SEGS		(1ULL << 10)
+#define	ZB_SM_MAX_SEGS		(1ULL << 20)
+#define	ZB_SM_BLOCK		(4ULL << 10)	/* allocation size */
+#define	ZB_MZAP_MIN_ENTS	16
+#define	ZB_MZAP_MAX_ENTS	1024
+#define	ZB_FZAP_MIN_ENTS	1024
+#define	ZB_FZAP_MAX_ENTS	(1ULL << 20)
+#define	ZB_FZAP_BLOCKSHIFT	14	/* as fzap_default_block_shift */
+#define	ZB_ZAP_BATCH		256	/* zap_add()s per transaction */
+
+typedef struct zb_arg {
+	char		*za_src;
+	char		*za_dst;
+	size_t		za_size;
+	size_t		za_dlen;	/* compressed length, if any */
+	int		za_func;	/* table index */
+	raidz_map_t	*za_rm;
+	int		za_tgts[VDEV_RAIDZ_MAXPARITY];
+	int		za_ntgts;
+} zb_arg_t;
+
+typedef void zb_func_t(zb_arg_t *);
+
+static void
+usage(boolean_t requested)
+{
+	FILE *fp = requested ? stdout : stderr;
+
+	(void) fprintf(fp, "Usage: %s\n"
+	    "\t[-k kernel (checksum, compress, decompress, raidz_gen,\n"
+	    "\t    raidz_rec, ddt_compress, ddt_decompress, zio_buf,\n"
+	    "\t    zio_data_buf, object_alloc, zil_commit, space_map,\n"
+	    "\t    microzap, fatzap;\n"
+	    "\t    default: all)]\n"
+	    "\t[-m minimum block size (default: %llu)]\n"
+	    "\t[-M maximum block size (default: %llu)]\n"
+	    "\t[-t milliseconds per repeat (default: %llu)]\n"
+	    "\t[-r repeats, best is reported (default: %d)]\n"
+	    "\t[-p data pattern: zero, random or mixed (default: %s)]\n"
+	    "\t[-x random seed (default: %#llx)]\n"
+	    "\t[-i raidz implementation (default: fastest)]\n"
+	    "\t[-T maximum object_alloc and zil_commit threads "
+	    "(default: %d)]\n"
+	    "\t[-d directory for the scratch pool (default: %s)]\n"
+	    "\t[-h] (print help)\n",
+	    cmdname,
+	    (u_longlong_t)zbopt_minsize,
+	    (u_longlong_t)zbopt_maxsize,
+	    (u_longlong_t)zbopt_time,
+	    zbopt_repeat,
+	    zbopt_pattern,
+	    (u_longlong_t)zbopt_seed,
+	    zbopt_threads,
+	    zbopt_dir);
+	exit(requested ? 0 : 1);
+}
+
+static void
+process_options(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "k:m:M:t:r:p:x:i:T:d:h")) != EOF) {
+		switch (opt) {
+		case 'k':
+			zbopt_kernel = strdup(optarg);
+			break;
+		case 'm':
+			zbopt_minsize = strtoull(optarg, NULL, 0);
+			break;
+		case 'M':
+			zbopt_maxsize = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			zbopt_time = MAX(1, strtoull(optarg, NULL, 0));
+			break;
+		case 'r':
+			zbopt_repeat = MAX(1, atoi(optarg));
+			break;
+		case 'p':
+			zbopt_pattern = strdup(optarg);
+			break;
+		case 'x':
+			zbopt_seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'i':
+			zbopt_raidz_impl = strdup(optarg);
+			break;
+		case 'T':
+			zbopt_threads = MAX(1, atoi(optarg));
+			break;
+		case 'd':
+			zbopt_dir = strdup(optarg);
+			break;
+		case 'h':
+			usage(B_TRUE);
+			break;
+		case '?':
+		default:
+			usage(B_FALSE);
+			break;
+		}
+	}
+
+	if (!ISP2(zbopt_minsize) || !ISP2(zbopt_maxsize) ||
+	    zbopt_minsize < SPA_MINBLOCKSIZE || zbopt_minsize > zbopt_maxsize) {
+		(void) fprintf(stderr, "%s: block sizes must be powers of 2 "
+		    "no smaller than %llu\n", cmdname,
+		    (u_longlong_t)SPA_MINBLOCKSIZE);
+		usage(B_FALSE);
+	}
+
+	if (strcmp(zbopt_pattern, "zero") != 0 &&
+	    strcmp(zbopt_pattern, "random") != 0 &&
+	    strcmp(zbopt_pattern, "mixed") != 0) {
+		(void) fprintf(stderr, "%s: unknown pattern '%s'\n", cmdname,
+		    zbopt_pattern);
+		usage(B_FALSE);
+	}
+}
+
+/*
+ * xorshift64*: small, fast and, unlike random(3), guaranteed to produce
+ * the same sequence on every platform for a given seed.
+ */
+static uint64_t zb_rand_state;
+
+static uint64_t
+zb_rand(void)
+{
+	uint64_t x = zb_rand_state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	zb_rand_state = x;
+
+	return (x * 0x2545F4914F6CDD1DULL);
+}
+
+static void
+zb_fill_random(char *buf, size_t size)
+{
+	uint64_t r;
+	size_t i;
+
+	for (i = 0; i < size; i += sizeof (r)) {
+		r = zb_rand();
+		bcopy(&r, buf + i, MIN(sizeof (r), size - i));
+	}
+}
+
+static void
+zb_fill_text(char *buf, size_t size)
+{
+	static const char *words[] = {
+		"the ", "pool ", "block ", "of ", "data ", "and ", "file ",
+		"metadata ", "to ", "a ", "dataset ", "in ", "snapshot ",
+		"\n", "object ", "is "
+	};
+	const char *w;
+	size_t i = 0, len;
+
+	while (i < size) {
+		w = words[zb_rand() % (sizeof (words) / sizeof (words[0]))];
+		len = MIN(strlen(w), size - i);
+		bcopy(w, buf + i, len);
+		i += len;
+	}
+}
+
+/*
+ * Fill buf according to -p. The "mixed" pattern picks, for every 512-byte
+ * sector, one of zeroes, random bytes or English-like text, which gives
+ * the compressors something between their best and worst case.
+ */
+static void
+zb_fill(char *buf, size_t size)
+{
+	size_t off, len;
+
+	zb_rand_state = zbopt_seed | 1;
+
+	if (strcmp(zbopt_pattern, "zero") == 0) {
+		bzero(buf, size);
+		return;
+	}
+
+	if (strcmp(zbopt_pattern, "random") == 0) {
+		zb_fill_random(buf, size);
+		return;
+	}
+
+	for (off = 0; off < size; off += SPA_MINBLOCKSIZE) {
+		len = MIN(SPA_MINBLOCKSIZE, size - off);
+		switch (zb_rand() % 3) {
+		case 0:
+			bzero(buf + off, len);
+			break;
+		case 1:
+			zb_fill_random(buf + off, len);
+			break;
+		default:
+			zb_fill_text(buf + off, len);
+			break;
+		}
+	}
+}
+
+static boolean_t
+zb_selected(const char *kernel)
+{
+	return (zbopt_kernel == NULL || strcmp(zbopt_kernel, kernel) == 0);
+}
+
+/*
+ * Run func until at least -t milliseconds have passed, -r times, and
+ * return the nanoseconds per call of the fastest repeat.
+ */
+static double
+zb_time(zb_func_t *func, zb_arg_t *za, uint64_t *itersp)
+{
+	hrtime_t start, now, elapsed, limit = zbopt_time * (NANOSEC / MILLISEC);
+	uint64_t iters, best_iters = 0;
+	double nsec, best = 0;
+	int r;
+
+	for (r = 0; r < zbopt_repeat; r++) {
+		iters = 0;
+		start = gethrtime();
+		do {
+			func(za);
+			iters++;
+		} while ((now = gethrtime()) - start < limit);
+
+		elapsed = now - start;
+		nsec = (double)MAX(elapsed, 1) / iters;
+		if (best_iters == 0 || nsec < best) {
+			best = nsec;
+			best_iters = iters;
+		}
+	}
+
+	*itersp = best_iters;
+	return (best);
+}
+
+/*
+ * Time func with zb_time() and report it. bytes is the amount of data
+ * one call processes, used for the MB/s column.
+ */
+static void
+zb_run(const char *kernel, const char *variant, size_t bytes, double ratio,
+    zb_func_t *func, zb_arg_t *za)
+{
+	uint64_t best_iters;
+	double best = zb_time(func, za, &best_iters);
+
+	(void) printf("%s\t%s\t%llu\t%llu\t%.1f\t%.1f\t%.2f\n", kernel, variant,
+	    (u_longlong_t)bytes, (u_longlong_t)best_iters, best,
+	    (double)bytes * NANOSEC / best / (1 << 20), ratio);
+}
+
+static void
+zb_checksum(zb_arg_t *za)
+{
+	zio_cksum_t zc;
+
+	zio_checksum_table[za->za_func].ci_func[0](za->za_src, za->za_size,
+	    &zc);
+}
+
+static void
+zb_compress(zb_arg_t *za)
+{
+	zio_compress_info_t *ci = &zio_compress_table[za->za_func];
+
+	(void) ci->ci_compress(za->za_src, za->za_dst, za->za_size,
+	    za->za_size, ci->ci_level);
+}
+
+static void
+zb_decompress(zb_arg_t *za)
+{
+	zio_compress_info_t *ci = &zio_compress_table[za->za_func];
+
+	(void) ci->ci_decompress(za->za_dst, za->za_src, za->za_dlen,
+	    za->za_size, ci->ci_level);
+}
+
+static void
+zb_raidz_gen(zb_arg_t *za)
+{
+	vdev_raidz_generate_parity(za->za_rm);
+}
+
+static void
+zb_raidz_rec(zb_arg_t *za)
+{
+	(void) vdev_raidz_reconstruct(za->za_rm, za->za_tgts, za->za_ntgts);
+}
+
+static void
+zb_ddt_compress(zb_arg_t *za)
+{
+	(void) ddt_compress(za->za_src, (uchar_t *)za->za_dst, za->za_size,
+	    za->za_size + 1);
+}
+
+static void
+zb_ddt_decompress(zb_arg_t *za)
+{
+	ddt_decompress((uchar_t *)za->za_dst, za->za_src, za->za_dlen,
+	    za->za_size);
+}
+
+static void
+zb_zio_buf(zb_arg_t *za)
+{
+	zio_buf_free(zio_buf_alloc(za->za_size), za->za_size);
+}
+
+static void
+zb_zio_data_buf(zb_arg_t *za)
+{
+	zio_data_buf_free(zio_data_buf_alloc(za->za_size), za->za_size);
+}
+
+static void
+zb_bench_checksum(zb_arg_t *za)
+{
+	zio_checksum_info_t *ci;
+	int c;
+
+	for (c = 0; c < ZIO_CHECKSUM_FUNCTIONS; c++) {
+		ci = &zio_checksum_table[c];
+		if (ci->ci_func[0] == NULL)
+			continue;
+		za->za_func = c;
+		zb_run("checksum", ci->ci_name, za->za_size, 1.0,
+		    zb_checksum, za);
+	}
+}
+
+/*
+ * The compressors are timed the way zio_compress_data() calls them, but
+ * with room for the whole block so that the time spent on incompressible
+ * data is measured too. Decompression is only timed for blocks that
+ * zio_compress_data() would actually have stored compressed.
+ */
+static void
+zb_bench_compress(zb_arg_t *za)
+{
+	zio_compress_info_t *ci;
+	size_t d_len = za->za_size - (za->za_size >> 3);
+	double ratio;
+	int c;
+
+	for (c = 0; c < ZIO_COMPRESS_FUNCTIONS; c++) {
+		ci = &zio_compress_table[c];
+		if (ci->ci_compress == NULL)
+			continue;
+		za->za_func = c;
+
+		za->za_dlen = ci->ci_compress(za->za_src, za->za_dst,
+		    za->za_size, za->za_size, ci->ci_level);
+		if (za->za_dlen == 0 || za->za_dlen > za->za_size)
+			za->za_dlen = za->za_size;
+		ratio = (double)za->za_size / za->za_dlen;
+
+		if (zb_selected("compress"))
+			zb_run("compress", ci->ci_name, za->za_size, ratio,
+			    zb_compress, za);
+
+		if (!zb_selected("decompress") || za->za_dlen > d_len)
+			continue;
+
+		/* decompressing into the source buffer reproduces it */
+		zb_run("decompress", ci->ci_name, za->za_size, ratio,
+		    zb_decompress, za);
+	}
+}
+
+static void
+zb_bench_raidz(zb_arg_t *za)
+{
+	raidz_map_t *rm;
+	zio_t zio;
+	char variant[16];
+	uint64_t nparity;
+	int nd, t;
+
+	if (za->za_size > SPA_MAXBLOCKSIZE)
+		return;
+
+	for (nparity = 1; nparity <= VDEV_RAIDZ_MAXPARITY; nparity++) {
+		bzero(&zio, sizeof (zio));
+		zio.io_type = ZIO_TYPE_WRITE;
+		zio.io_size = za->za_size;
+		zio.io_data = za->za_src;
+		rm = vdev_raidz_map_alloc(&zio, SPA_MINBLOCKSHIFT,
+		    ZB_RAIDZ_COLS, nparity);
+		za->za_rm = rm;
+
+		(void) snprintf(variant, sizeof (variant), "raidz%llu",
+		    (u_longlong_t)nparity);
+		if (zb_selected("raidz_gen"))
+			zb_run("raidz_gen", variant, za->za_size, 1.0,
+			    zb_raidz_gen, za);
+
+		/*
+		 * Reconstruct as many data columns as the parity allows,
+		 * which exercises the most expensive path for each level.
+		 * Small blocks may not span enough columns; lose parity
+		 * columns instead to make up the difference.
+		 */
+		if (zb_selected("raidz_rec")) {
+			vdev_raidz_generate_parity(rm);
+			nd = MIN(nparity, rm->rm_cols - nparity);
+			za->za_ntgts = 0;
+			for (t = 0; t < nparity - nd; t++)
+				za->za_tgts[za->za_ntgts++] = t;
+			for (t = 0; t < nd; t++)
+				za->za_tgts[za->za_ntgts++] = nparity + t;
+			zb_run("raidz_rec", variant, za->za_size, 1.0,
+			    zb_raidz_rec, za);
+		}
+
+		vdev_raidz_map_free(rm);
+		za->za_rm = NULL;
+	}
+}
+
+/*
+ * DDT entries are arrays of ddt_phys_t in which typically only one or two
+ * of the DDT_PHYS_TYPES slots are in use; build a block of those rather
+ * than using the -p pattern, which is what ddt_compress() is tuned for.
+ */
+static void
+zb_bench_ddt(zb_arg_t *za)
+{
+	ddt_phys_t *ddp;
+	size_t n = za->za_size / sizeof (ddt_phys_t), i;
+	int d;
+
+	bzero(za->za_src, za->za_size);
+	zb_rand_state = zbopt_seed | 1;
+	for (i = 0; i < n; i += DDT_PHYS_TYPES) {
+		ddp = (ddt_phys_t *)za->za_src + i;
+		ddp->ddp_refcnt = 1 + zb_rand() % 4;
+		ddp->ddp_phys_birth = zb_rand() % (1ULL << 24);
+		/* usually a single copy; sometimes ditto blocks */
+		for (d = 0; d < 1 + (zb_rand() % 4 == 0); d++) {
+			ddp->ddp_dva[d].dva_word[0] = zb_rand() % (1ULL << 32);
+			ddp->ddp_dva[d].dva_word[1] = zb_rand() % (1ULL << 40);
+		}
+	}
+
+	za->za_dlen = ddt_compress(za->za_src, (uchar_t *)za->za_dst,
+	    za->za_size, za->za_size + 1);
+
+	if (zb_selected("ddt_compress"))
+		zb_run("ddt_compress", "zle", za->za_size,
+		    (double)za->za_size / za->za_dlen, zb_ddt_compress, za);
+	if (zb_selected("ddt_decompress"))
+		zb_run("ddt_decompress", "zle", za->za_size,
+		    (double)za->za_size / za->za_dlen, zb_ddt_decompress, za);
+}
+
+static void
+zb_bench_zio_buf(zb_arg_t *za)
+{
+	if (za->za_size > SPA_MAXBLOCKSIZE)
+		return;
+
+	if (zb_selected("zio_buf"))
+		zb_run("zio_buf", "alloc_free", za->za_size, 1.0,
+		    zb_zio_buf, za);
+	if (zb_selected("zio_data_buf"))
+		zb_run("zio_data_buf", "alloc_free", za->za_size, 1.0,
+		    zb_zio_data_buf, za);
+}
+
+/*
+ * Object creation. Every thread creates empty objects, one per
+ * transaction, until the deadline, and adds its count to the total.
+ */
+typedef struct zb_alloc_arg {
+	objset_t	*zaa_os;
+	hrtime_t	zaa_end;
+	uint64_t	zaa_count;
+	int		zaa_running;
+	kmutex_t	zaa_lock;
+	kcondvar_t	zaa_cv;
+} zb_alloc_arg_t;
+
+static void
+zb_object_alloc_thread(void *arg)
+{
+	zb_alloc_arg_t *zaa = arg;
+	dmu_tx_t *tx;
+	uint64_t n = 0;
+
+	while (gethrtime() < zaa->zaa_end) {
+		tx = dmu_tx_create(zaa->zaa_os);
+		dmu_tx_hold_bonus(tx, DMU_NEW_OBJECT);
+		if (dmu_tx_assign(tx, TXG_WAIT) != 0) {
+			dmu_tx_abort(tx);
+			break;
+		}
+		(void) dmu_object_alloc(zaa->zaa_os, DMU_OT_UINT64_OTHER, 0,
+		    DMU_OT_NONE, 0, tx);
+		dmu_tx_commit(tx);
+		n++;
+	}
+
+	mutex_enter(&zaa->zaa_lock);
+	zaa->zaa_count += n;
+	if (--zaa->zaa_running == 0)
+		cv_broadcast(&zaa->zaa_cv);
+	mutex_exit(&zaa->zaa_lock);
+
+	thread_exit();
+}
+
+static char zb_pool_tag[] = "zb_pool";
+
+/*
+ * Create a file for a scratch pool vdev and return its config in *nvp.
+ */
+static int
+zb_pool_file(const char *path, uint64_t size, boolean_t log, nvlist_t **nvp)
+{
+	int fd;
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666)) == -1 ||
+	    ftruncate(fd, size) != 0) {
+		(void) fprintf(stderr, "%s: can't create %s: %s\n", cmdname,
+		    path, strerror(errno));
+		if (fd != -1)
+			(void) close(fd);
+		return (-1);
+	}
+	(void) close(fd);
+
+	VERIFY(nvlist_alloc(nvp, NV_UNIQUE_NAME, 0) == 0);
+	VERIFY(nvlist_add_string(*nvp, ZPOOL_CONFIG_TYPE, VDEV_TYPE_FILE) == 0);
+	VERIFY(nvlist_add_string(*nvp, ZPOOL_CONFIG_PATH, path) == 0);
+	VERIFY(nvlist_add_uint64(*nvp, ZPOOL_CONFIG_ASHIFT,
+	    SPA_MINBLOCKSHIFT) == 0);
+	VERIFY(nvlist_add_uint64(*nvp, ZPOOL_CONFIG_IS_LOG, log) == 0);
+
+	return (0);
+}
+
+/*
+ * Create a scratch pool on a file in -d, with a separate log device on
+ * "<path>.log" if slog is set, and return the first file's path in path
+ * and the root objset held in *osp, to be released by zb_pool_destroy().
+ */
+static int
+zb_pool_create(char *path, size_t len, boolean_t slog, objset_t **osp)
+{
+	nvlist_t *root, *file[2];
+	char logpath[MAXPATHLEN];
+	int c, children = 1;
+
+	(void) snprintf(path, len, "%s/%s.%d.vdev", zbopt_dir,
+	    ZB_POOL_NAME, (int)getpid());
+	(void) snprintf(logpath, sizeof (logpath), "%s.log", path);
+	if (zb_pool_file(path, ZB_POOL_SIZE, B_FALSE, &file[0]) != 0)
+		return (-1);
+	if (slog) {
+		if (zb_pool_file(logpath, ZB_LOG_SIZE, B_TRUE, &file[1]) != 0) {
+			nvlist_free(file[0]);
+			(void) remove(path);
+			return (-1);
+		}
+		children++;
+	}
+
+	VERIFY(nvlist_alloc(&root, NV_UNIQUE_NAME, 0) == 0);
+	VERIFY(nvlist_add_string(root, ZPOOL_CONFIG_TYPE, VDEV_TYPE_ROOT) == 0);
+	VERIFY(nvlist_add_nvlist_array(root, ZPOOL_CONFIG_CHILDREN,
+	    file, children) == 0);
+
+	VERIFY3U(0, ==, spa_create(ZB_POOL_NAME, root, NULL, NULL, NULL));
+	VERIFY3U(0, ==, dmu_objset_hold(ZB_POOL_NAME, zb_pool_tag, osp));
+	nvlist_free(root);
+	for (c = 0; c < children; c++)
+		nvlist_free(file[c]);
+
+	return (0);
+}
+
+static void
+zb_pool_destroy(const char *path, objset_t *os)
+{
+	char logpath[MAXPATHLEN];
+
+	dmu_objset_rele(os, zb_pool_tag);
+	VERIFY3U(0, ==, spa_destroy(ZB_POOL_NAME));
+	(void) remove(path);
+	(void) snprintf(logpath, sizeof (logpath), "%s.log", path);
+	(void) remove(logpath);
+}
+
+static void
+zb_bench_object_alloc(void)
+{
+	zb_alloc_arg_t zaa;
+	char path[MAXPATHLEN], variant[16];
+	hrtime_t start, limit = zbopt_time * (NANOSEC / MILLISEC);
+	uint64_t best_count;
+	double nsec, best;
+	int threads, t, r;
+
+	bzero(&zaa, sizeof (zaa));
+	if (zb_pool_create(path, sizeof (path), B_FALSE, &zaa.zaa_os) != 0)
+		return;
+	mutex_init(&zaa.zaa_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&zaa.zaa_cv, NULL, CV_DEFAULT, NULL);
+
+	for (threads = 1; threads <= zbopt_threads; threads <<= 1) {
+		best = 0;
+		best_count = 0;
+		for (r = 0; r < zbopt_repeat; r++) {
+			zaa.zaa_count = 0;
+			zaa.zaa_running = threads;
+			start = gethrtime();
+			zaa.zaa_end = start + limit;
+			for (t = 0; t < threads; t++)
+				(void) thread_create(NULL, 0,
+				    zb_object_alloc_thread, &zaa, 0, NULL,
+				    TS_RUN, 0);
+
+			mutex_enter(&zaa.zaa_lock);
+			while (zaa.zaa_running != 0)
+				cv_wait(&zaa.zaa_cv, &zaa.zaa_lock);
+			mutex_exit(&zaa.zaa_lock);
+
+			nsec = (double)(gethrtime() - start) /
+			    MAX(zaa.zaa_count, 1);
+			if (best_count == 0 || nsec < best) {
+				best = nsec;
+				best_count = zaa.zaa_count;
+			}
+		}
+
+		(void) snprintf(variant, sizeof (variant), "%dthreads",
+		    threads);
+		(void) printf("object_alloc\t%s\t%d\t%llu\t%.1f\t%.1f\t"
+		    "1.00\n", variant, DNODE_SIZE, (u_longlong_t)best_count,
+		    best, (double)DNODE_SIZE * NANOSEC / best / (1 << 20));
+	}
+
+	zb_pool_destroy(path, zaa.zaa_os);
+
+	cv_destroy(&zaa.zaa_cv);
+	mutex_destroy(&zaa.zaa_lock);
+}
+
+/*
+ * Intent log commits. The writer threads stream ZB_ZIL_STREAM_SIZE writes
+ * through a file of their own and log them asynchronously, the way
+ * zfs_write() does without O_[D]SYNC; the fsync threads write
+ * ZB_ZIL_FSYNC_SIZE to a file of their own and zil_commit() it, timing
+ * each commit.
+ */
+typedef struct zb_zil_arg {
+	objset_t	*zza_os;
+	zilog_t		*zza_zilog;
+	char		*zza_buf;
+	hrtime_t	zza_end;
+	uint64_t	zza_bytes;	/* streamed by the writers */
+	uint64_t	zza_commits;	/* done by the fsync threads */
+	uint64_t	zza_lat_total;
+	uint64_t	zza_nlat;	/* next zza_lat[] slot */
+	hrtime_t	*zza_lat;	/* first ZB_ZIL_MAX_SAMPLES latencies */
+	int		zza_running;
+	kmutex_t	zza_lock;
+	kcondvar_t	zza_cv;
+} zb_zil_arg_t;
+
+static uint64_t
+zb_zil_object_create(objset_t *os)
+{
+	dmu_tx_t *tx;
+	uint64_t object;
+
+	tx = dmu_tx_create(os);
+	dmu_tx_hold_bonus(tx, DMU_NEW_OBJECT);
+	VERIFY3U(0, ==, dmu_tx_assign(tx, TXG_WAIT));
+	object = dmu_object_alloc(os, DMU_OT_UINT64_OTHER, SPA_MAXBLOCKSIZE,
+	    DMU_OT_NONE, 0, tx);
+	dmu_tx_commit(tx);
+
+	return (object);
+}
+
+static void
+zb_zil_object_free(objset_t *os, uint64_t object)
+{
+	dmu_tx_t *tx;
+
+	tx = dmu_tx_create(os);
+	dmu_tx_hold_free(tx, object, 0, DMU_OBJECT_END);
+	VERIFY3U(0, ==, dmu_tx_assign(tx, TXG_WAIT));
+	VERIFY3U(0, ==, dmu_object_free(os, object, tx));
+	dmu_tx_commit(tx);
+}
+
+/*
+ * Write len bytes at off and log them with a WR_COPIED TX_WRITE record.
+ * Returns the record's sequence number, or 0 if the tx failed.
+ */
+static uint64_t
+zb_zil_write(zb_zil_arg_t *zza, uint64_t object, uint64_t off, uint64_t len)
+{
+	objset_t *os = zza->zza_os;
+	lr_write_t *lr;
+	itx_t *itx;
+	dmu_tx_t *tx;
+	uint64_t seq;
+
+	tx = dmu_tx_create(os);
+	dmu_tx_hold_write(tx, object, off, len);
+	if (dmu_tx_assign(tx, TXG_WAIT) != 0) {
+		dmu_tx_abort(tx);
+		return (0);
+	}
+	dmu_write(os, object, off, len, zza->zza_buf, tx);
+
+	itx = zil_itx_create(TX_WRITE, sizeof (*lr) + len);
+	lr = (lr_write_t *)&itx->itx_lr;
+	lr->lr_foid = object;
+	lr->lr_offset = off;
+	lr->lr_length = len;
+	lr->lr_blkoff = 0;
+	BP_ZERO(&lr->lr_blkptr);
+	bcopy(zza->zza_buf, lr + 1, len);
+	itx->itx_private = NULL;
+	itx->itx_wr_state = WR_COPIED;
+	itx->itx_sync = B_FALSE;
+	seq = zil_itx_assign(zza->zza_zilog, itx, tx);
+
+	dmu_tx_commit(tx);
+
+	return (seq);
+}
+
+static void
+zb_zil_thread_done(zb_zil_arg_t *zza)
+{
+	mutex_enter(&zza->zza_lock);
+	if (--zza->zza_running == 0)
+		cv_broadcast(&zza->zza_cv);
+	mutex_exit(&zza->zza_lock);
+
+	thread_exit();
+}
+
+static void
+zb_zil_writer_thread(void *arg)
+{
+	zb_zil_arg_t *zza = arg;
+	uint64_t object = zb_zil_object_create(zza->zza_os);
+	uint64_t off = 0, bytes = 0;
+
+	while (gethrtime() < zza->zza_end) {
+		if (zb_zil_write(zza, object, off, ZB_ZIL_STREAM_SIZE) == 0)
+			break;
+		bytes += ZB_ZIL_STREAM_SIZE;
+		off = (off + ZB_ZIL_STREAM_SIZE) % ZB_ZIL_FILE_SIZE;
+	}
+	zb_zil_object_free(zza->zza_os, object);
+
+	atomic_add_64(&zza->zza_bytes, bytes);
+	zb_zil_thread_done(zza);
+}
+
+static void
+zb_zil_fsync_thread(void *arg)
+{
+	zb_zil_arg_t *zza = arg;
+	uint64_t object = zb_zil_object_create(zza->zza_os);
+	uint64_t seq, n = 0, slot;
+	hrtime_t start, lat, total = 0;
+
+	while (gethrtime() < zza->zza_end) {
+		seq = zb_zil_write(zza, object, 0, ZB_ZIL_FSYNC_SIZE);
+		if (seq == 0)
+			break;
+		start = gethrtime();
+		zil_commit(zza->zza_zilog, seq, object);
+		lat = gethrtime() - start;
+		slot = atomic_add_64_nv(&zza->zza_nlat, 1) - 1;
+		if (slot < ZB_ZIL_MAX_SAMPLES)
+			zza->zza_lat[slot] = lat;
+		total += lat;
+		n++;
+	}
+	zb_zil_object_free(zza->zza_os, object);
+
+	atomic_add_64(&zza->zza_commits, n);
+	atomic_add_64(&zza->zza_lat_total, total);
+	zb_zil_thread_done(zza);
+}
+
+static int
+zb_hrtime_compare(const void *x1, const void *x2)
+{
+	hrtime_t t1 = *(const hrtime_t *)x1;
+	hrtime_t t2 = *(const hrtime_t *)x2;
+
+	if (t1 < t2)
+		return (-1);
+	if (t1 > t2)
+		return (1);
+
+	return (0);
+}
+
+/*
+ * Run writers streaming threads against fsyncs fsync threads -r times,
+ * and report the run with the lowest nsec/op: the mean commit latency
+ * with a single fsync thread, or the time per commit overall with more.
+ */
+static void
+zb_zil_config(zb_zil_arg_t *zza, hrtime_t **best_lat, int writers,
+    int fsyncs)
+{
+	char variant[16];
+	hrtime_t start, elapsed, limit = zbopt_time * (NANOSEC / MILLISEC);
+	hrtime_t *lat;
+	uint64_t n, best_commits = 0;
+	double nsec, best = 0, best_mbs = 0;
+	int t, r;
+
+	for (r = 0; r < zbopt_repeat; r++) {
+		zza->zza_bytes = 0;
+		zza->zza_commits = 0;
+		zza->zza_lat_total = 0;
+		zza->zza_nlat = 0;
+		zza->zza_running = writers + fsyncs;
+		start = gethrtime();
+		zza->zza_end = start + limit;
+		for (t = 0; t < writers; t++)
+			(void) thread_create(NULL, 0, zb_zil_writer_thread,
+			    zza, 0, NULL, TS_RUN, 0);
+		for (t = 0; t < fsyncs; t++)
+			(void) thread_create(NULL, 0, zb_zil_fsync_thread,
+			    zza, 0, NULL, TS_RUN, 0);
+
+		mutex_enter(&zza->zza_lock);
+		while (zza->zza_running != 0)
+			cv_wait(&zza->zza_cv, &zza->zza_lock);
+		mutex_exit(&zza->zza_lock);
+		elapsed = gethrtime() - start;
+
+		if (fsyncs == 1)
+			nsec = (double)zza->zza_lat_total /
+			    MAX(zza->zza_commits, 1);
+		else
+			nsec = (double)elapsed / MAX(zza->zza_commits, 1);
+		if (best_commits == 0 || nsec < best) {
+			best = nsec;
+			best_commits = zza->zza_commits;
+			best_mbs = (double)(writers != 0 ? zza->zza_bytes :
+			    zza->zza_commits * ZB_ZIL_FSYNC_SIZE) * NANOSEC /
+			    elapsed / (1 << 20);
+			lat = *best_lat;
+			*best_lat = zza->zza_lat;
+			zza->zza_lat = lat;
+		}
+	}
+
+	if (fsyncs == 1)
+		(void) snprintf(variant, sizeof (variant), "%dwriters",
+		    writers);
+	else
+		(void) snprintf(variant, sizeof (variant), "%dfsyncs", fsyncs);
+	(void) printf("zil_commit\t%s\t%llu\t%llu\t%.1f\t%.1f\t1.00\n",
+	    variant, (u_longlong_t)ZB_ZIL_FSYNC_SIZE,
+	    (u_longlong_t)best_commits, best, best_mbs);
+
+	n = MIN(best_commits, ZB_ZIL_MAX_SAMPLES);
+	if (n != 0) {
+		lat = *best_lat;
+		qsort(lat, n, sizeof (hrtime_t), zb_hrtime_compare);
+		(void) printf("# zil_commit %s nsec p50 %llu p90 %llu "
+		    "p99 %llu max %llu\n", variant,
+		    (u_longlong_t)lat[n * 50 / 100],
+		    (u_longlong_t)lat[n * 90 / 100],
+		    (u_longlong_t)lat[n * 99 / 100],
+		    (u_longlong_t)lat[n - 1]);
+	}
+}
+
+static void
+zb_bench_zil_commit(void)
+{
+	zb_zil_arg_t zza;
+	char path[MAXPATHLEN];
+	hrtime_t *best_lat;
+	size_t latsize = ZB_ZIL_MAX_SAMPLES * sizeof (hrtime_t);
+	int threads;
+
+	bzero(&zza, sizeof (zza));
+	if (zb_pool_create(path, sizeof (path), B_TRUE, &zza.zza_os) != 0)
+		return;
+	mutex_init(&zza.zza_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&zza.zza_cv, NULL, CV_DEFAULT, NULL);
+
+	zza.zza_zilog = zil_open(zza.zza_os, NULL);
+	zza.zza_buf = umem_alloc(ZB_ZIL_STREAM_SIZE, UMEM_NOFAIL);
+	zb_fill(zza.zza_buf, ZB_ZIL_STREAM_SIZE);
+	zza.zza_lat = umem_alloc(latsize, UMEM_NOFAIL);
+	best_lat = umem_alloc(latsize, UMEM_NOFAIL);
+
+	for (threads = 0; threads <= zbopt_threads;
+	    threads = MAX(threads << 1, 1))
+		zb_zil_config(&zza, &best_lat, threads, 1);
+	for (threads = 2; threads <= zbopt_threads; threads <<= 1)
+		zb_zil_config(&zza, &best_lat, 0, threads);
+
+	zil_close(zza.zza_zilog);
+	umem_free(best_lat, latsize);
+	umem_free(zza.zza_lat, latsize);
+	umem_free(zza.zza_buf, ZB_ZIL_STREAM_SIZE);
+	zb_pool_destroy(path, zza.zza_os);
+
+	cv_destroy(&zza.zza_cv);
+	mutex_destroy(&zza.zza_lock);
+}
+
+/*
+ * Space maps. The map is cut into equal slots, each starting with a free
+ * segment of random length and ending with allocated space. Like an
+ * SM_FREE space map on disk, the load starts from a fully free map and
+ * then removes the allocated part of every slot, in random order.
+ */
+typedef struct zb_sm_arg {
+	space_map_t	zsa_map;
+	kmutex_t	zsa_lock;
+	uint64_t	zsa_nsegs;
+	uint64_t	*zsa_order;	/* slots in load order */
+	uint64_t	*zsa_free;	/* free bytes at the start of a slot */
+} zb_sm_arg_t;
+
+static zb_sm_arg_t zb_sm;
+
+/* ARGSUSED */
+static void
+zb_sm_load(zb_arg_t *za)
+{
+	space_map_t *sm = &zb_sm.zsa_map;
+	uint64_t slot = ZB_SM_SIZE / zb_sm.zsa_nsegs;
+	uint64_t i, s;
+
+	mutex_enter(&zb_sm.zsa_lock);
+	space_map_unload(sm);
+
+	space_map_add(sm, sm->sm_start, sm->sm_size);
+	for (i = 0; i < zb_sm.zsa_nsegs; i++) {
+		s = zb_sm.zsa_order[i];
+		space_map_remove(sm, s * slot + zb_sm.zsa_free[s],
+		    slot - zb_sm.zsa_free[s]);
+	}
+
+	sm->sm_loaded = B_TRUE;
+	sm->sm_ops = zfs_metaslab_ops;
+	sm->sm_ops->smop_load(sm);
+	mutex_exit(&zb_sm.zsa_lock);
+}
+
+/* ARGSUSED */
+static void
+zb_sm_alloc(zb_arg_t *za)
+{
+	space_map_t *sm = &zb_sm.zsa_map;
+	uint64_t offset;
+
+	mutex_enter(&zb_sm.zsa_lock);
+	offset = space_map_alloc(sm, ZB_SM_BLOCK);
+	VERIFY(offset != -1ULL);
+	space_map_free(sm, offset, ZB_SM_BLOCK);
+	mutex_exit(&zb_sm.zsa_lock);
+}
+
+static void
+zb_bench_space_map(void)
+{
+	space_map_t *sm = &zb_sm.zsa_map;
+	uint64_t nsegs, slot, i, j, t, iters;
+	size_t bytes;
+	double nsec;
+
+	mutex_init(&zb_sm.zsa_lock, NULL, MUTEX_DEFAULT, NULL);
+	space_map_create(sm, 0, ZB_SM_SIZE, SPA_MINBLOCKSHIFT,
+	    &zb_sm.zsa_lock);
+	zb_sm.zsa_order = umem_alloc(ZB_SM_MAX_SEGS * sizeof (uint64_t),
+	    UMEM_NOFAIL);
+	zb_sm.zsa_free = umem_alloc(ZB_SM_MAX_SEGS * sizeof (uint64_t),
+	    UMEM_NOFAIL);
+
+	for (nsegs = ZB_SM_MIN_SEGS; nsegs <= ZB_SM_MAX_SEGS; nsegs <<= 2) {
+		zb_rand_state = zbopt_seed | 1;
+		zb_sm.zsa_nsegs = nsegs;
+		slot = ZB_SM_SIZE / nsegs;
+		for (i = 0; i < nsegs; i++) {
+			zb_sm.zsa_free[i] = (1 + zb_rand() %
+			    ((slot >> SPA_MINBLOCKSHIFT) - 1)) <<
+			    SPA_MINBLOCKSHIFT;
+			zb_sm.zsa_order[i] = i;
+		}
+		for (i = nsegs - 1; i > 0; i--) {
+			j = zb_rand() % (i + 1);
+			t = zb_sm.zsa_order[i];
+			zb_sm.zsa_order[i] = zb_sm.zsa_order[j];
+			zb_sm.zsa_order[j] = t;
+		}
+
+		nsec = zb_time(zb_sm_load, NULL, &iters);
+		(void) printf("space_map\tload\t%llu\t%llu\t%.1f\t%.1f\t"
+		    "1.00\n", (u_longlong_t)nsegs, (u_longlong_t)iters, nsec,
+		    (double)(nsegs + 1) * sizeof (uint64_t) * NANOSEC / nsec /
+		    (1 << 20));
+
+		bytes = btree_memory(&sm->sm_root) +
+		    btree_memory(sm->sm_pp_root);
+		(void) printf("# space_map load %llu segments: %llu bytes in "
+		    "core, %.1f bytes/segment\n", (u_longlong_t)nsegs,
+		    (u_longlong_t)bytes, (double)bytes / nsegs);
+
+		nsec = zb_time(zb_sm_alloc, NULL, &iters);
+		(void) printf("space_map\talloc\t%llu\t%llu\t%.1f\t%.1f\t"
+		    "1.00\n", (u_longlong_t)nsegs, (u_longlong_t)iters, nsec,
+		    (double)ZB_SM_BLOCK * NANOSEC / nsec / (1 << 20));
+
+		mutex_enter(&zb_sm.zsa_lock);
+		space_map_unload(sm);
+		mutex_exit(&zb_sm.zsa_lock);
+	}
+
+	space_map_destroy(sm);
+	umem_free(zb_sm.zsa_order, ZB_SM_MAX_SEGS * sizeof (uint64_t));
+	umem_free(zb_sm.zsa_free, ZB_SM_MAX_SEGS * sizeof (uint64_t));
+	mutex_destroy(&zb_sm.zsa_lock);
+}
+
+typedef struct zb_zap_arg {
+	objset_t	*zpa_os;
+	uint64_t	zpa_obj;
+	uint64_t	zpa_nents;
+} zb_zap_arg_t;
+
+static zb_zap_arg_t zb_zap;
+
+static void
+zb_zap_name(char *buf, size_t len, uint64_t i)
+{
+	(void) snprintf(buf, len, "zbench.entry.%llu", (u_longlong_t)i);
+}
+
+/*
+ * Create a ZAP object holding nents names, adding up to ZB_ZAP_BATCH of
+ * them per transaction. A fat ZAP is created as one from the start, with
+ * ZAP_FLAG_HASH64, even if it would fit in a microzap.
+ */
+static void
+zb_zap_create(objset_t *os, uint64_t nents, boolean_t fat)
+{
+	char name[MZAP_NAME_LEN];
+	dmu_tx_t *tx;
+	uint64_t i, j;
+
+	tx = dmu_tx_create(os);
+	dmu_tx_hold_zap(tx, DMU_NEW_OBJECT, B_TRUE, NULL);
+	VERIFY3U(0, ==, dmu_tx_assign(tx, TXG_WAIT));
+	zb_zap.zpa_os = os;
+	if (fat) {
+		zb_zap.zpa_obj = zap_create_flags(os, 0, ZAP_FLAG_HASH64,
+		    DMU_OT_UINT64_OTHER, ZB_FZAP_BLOCKSHIFT,
+		    ZB_FZAP_BLOCKSHIFT, DMU_OT_NONE, 0, tx);
+	} else {
+		zb_zap.zpa_obj = zap_create(os, DMU_OT_UINT64_OTHER,
+		    DMU_OT_NONE, 0, tx);
+	}
+	zb_zap.zpa_nents = nents;
+	dmu_tx_commit(tx);
+
+	for (i = 0; i < nents; i += ZB_ZAP_BATCH) {
+		tx = dmu_tx_create(os);
+		for (j = i; j < MIN(i + ZB_ZAP_BATCH, nents); j++) {
+			zb_zap_name(name, sizeof (name), j);
+			dmu_tx_hold_zap(tx, zb_zap.zpa_obj, B_TRUE, name);
+		}
+		VERIFY3U(0, ==, dmu_tx_assign(tx, TXG_WAIT));
+		for (j = i; j < MIN(i + ZB_ZAP_BATCH, nents); j++) {
+			zb_zap_name(name, sizeof (name), j);
+			VERIFY3U(0, ==, zap_add(os, zb_zap.zpa_obj, name,
+			    sizeof (uint64_t), 1, &j, tx));
+		}
+		dmu_tx_commit(tx);
+	}
+}
+
+static void
+zb_zap_destroy(void)
+{
+	dmu_tx_t *tx;
+
+	tx = dmu_tx_create(zb_zap.zpa_os);
+	dmu_tx_hold_free(tx, zb_zap.zpa_obj, 0, DMU_OBJECT_END);
+	VERIFY3U(0, ==, dmu_tx_assign(tx, TXG_WAIT));
+	VERIFY3U(0, ==, zap_destroy(zb_zap.zpa_os, zb_zap.zpa_obj, tx));
+	dmu_tx_commit(tx);
+}
+
+/*
+ * Detach and free the cached zap_t, then count the entries, which has to
+ * open the microzap from scratch.
+ */
+/* ARGSUSED */
+static void
+zb_mzap_open(zb_arg_t *za)
+{
+	dmu_buf_t *db;
+	zap_t *zap;
+	uint64_t count;
+
+	VERIFY3U(0, ==, dmu_buf_hold(zb_zap.zpa_os, zb_zap.zpa_obj, 0,
+	    FTAG, &db));
+	if ((zap = dmu_buf_get_user(db)) != NULL) {
+		VERIFY(dmu_buf_update_user(db, zap, NULL, NULL, NULL) == zap);
+		zap_evict(db, zap);
+	}
+	dmu_buf_rele(db, FTAG);
+
+	VERIFY3U(0, ==, zap_count(zb_zap.zpa_os, zb_zap.zpa_obj, &count));
+	ASSERT3U(count, ==, zb_zap.zpa_nents);
+}
+
+/* ARGSUSED */
+static void
+zb_zap_lookup(zb_arg_t *za)
+{
+	char name[MZAP_NAME_LEN];
+	uint64_t value;
+
+	zb_zap_name(name, sizeof (name), zb_rand() % zb_zap.zpa_nents);
+	VERIFY3U(0, ==, zap_lookup(zb_zap.zpa_os, zb_zap.zpa_obj, name,
+	    sizeof (uint64_t), 1, &value));
+}
+
+/* ARGSUSED */
+static void
+zb_zap_iterate(zb_arg_t *za)
+{
+	zap_cursor_t zc;
+	zap_attribute_t zattr;
+	uint64_t n = 0;
+
+	for (zap_cursor_init(&zc, zb_zap.zpa_os, zb_zap.zpa_obj);
+	    zap_cursor_retrieve(&zc, &zattr) == 0;
+	    zap_cursor_advance(&zc))
+		n++;
+	zap_cursor_fini(&zc);
+	VERIFY3U(n, ==, zb_zap.zpa_nents);
+}
+
+static void
+zb_bench_microzap(void)
+{
+	char path[MAXPATHLEN];
+	objset_t *os;
+	uint64_t nents, iters;
+	double nsec;
+
+	if (zb_pool_create(path, sizeof (path), B_FALSE, &os) != 0)
+		return;
+
+	for (nents = ZB_MZAP_MIN_ENTS; nents <= ZB_MZAP_MAX_ENTS;
+	    nents <<= 2) {
+		zb_rand_state = zbopt_seed | 1;
+		zb_zap_create(os, nents, B_FALSE);
+
+		nsec = zb_time(zb_mzap_open, NULL, &iters);
+		(void) printf("microzap\topen\t%llu\t%llu\t%.1f\t%.1f\t"
+		    "1.00\n", (u_longlong_t)nents, (u_longlong_t)iters, nsec,
+		    (double)nents * NANOSEC / nsec / (1 << 20));
+
+		nsec = zb_time(zb_zap_lookup, NULL, &iters);
+		(void) printf("microzap\tlookup\t%llu\t%llu\t%.1f\t%.1f\t"
+		    "1.00\n", (u_longlong_t)nents, (u_longlong_t)iters, nsec,
+		    (double)NANOSEC / nsec / (1 << 20));
+
+		zb_zap_destroy();
+	}
+
+	zb_pool_destroy(path, os);
+}
+
+static void
+zb_bench_fatzap(void)
+{
+	char path[MAXPATHLEN];
+	objset_t *os;
+	zap_stats_t zs;
+	uint64_t nents, iters;
+	double nsec;
+
+	if (zb_pool_create(path, sizeof (path), B_FALSE, &os) != 0)
+		return;
+
+	for (nents = ZB_FZAP_MIN_ENTS; nents <= ZB_FZAP_MAX_ENTS;
+	    nents <<= 5) {
+		zb_rand_state = zbopt_seed | 1;
+		zb_zap_create(os, nents, B_TRUE);
+		VERIFY3U(0, ==, zap_get_stats(os, zb_zap.zpa_obj, &zs));
+		(void) printf("# fatzap %llu entries: %llu leafs of %llu "
+		    "bytes\n", (u_longlong_t)nents,
+		    (u_longlong_t)zs.zs_num_leafs,
+		    (u_longlong_t)zs.zs_blocksize);
+
+		nsec = zb_time(zb_zap_lookup, NULL, &iters);
+		(void) printf("fatzap\tlookup\t%llu\t%llu\t%.1f\t%.1f\t"
+		    "1.00\n", (u_longlong_t)nents, (u_longlong_t)iters, nsec,
+		    (double)NANOSEC / nsec / (1 << 20));
+
+		nsec = zb_time(zb_zap_iterate, NULL, &iters) / nents;
+		(void) printf("fatzap\titerate\t%llu\t%llu\t%.1f\t%.1f\t"
+		    "1.00\n", (u_longlong_t)nents, (u_longlong_t)iters, nsec,
+		    (double)NANOSEC / nsec / (1 << 20));
+
+		zb_zap_destroy();
+	}
+
+	zb_pool_destroy(path, os);
+}
+
+int
+main(int argc, char **argv)
+{
+	zb_arg_t za;
+	size_t size;
+
+	(void) setvbuf(stdout, NULL, _IOLBF, 0);
+
+	process_options(argc, argv);
+
+	/* keep the scratch pool out of the system's pool cache */
+	(void) asprintf((char **)&spa_config_path, "%s/%s.%d.cache",
+	    zbopt_dir, ZB_POOL_NAME, (int)getpid());
+
+	kernel_init(FREAD | FWRITE);
+
+	if (zbopt_raidz_impl != NULL &&
+	    vdev_raidz_math_set(zbopt_raidz_impl) != 0) {
+		(void) fprintf(stderr, "%s: raidz implementation '%s' is not "
+		    "supported\n", cmdname, zbopt_raidz_impl);
+		kernel_fini();
+		return (1);
+	}
+
+	(void) printf("# zbench version %d\n", ZBENCH_VERSION);
+	(void) printf("# seed %#llx pattern %s time %llu repeat %d\n",
+	    (u_longlong_t)zbopt_seed, zbopt_pattern,
+	    (u_longlong_t)zbopt_time, zbopt_repeat);
+	(void) printf("# raidz %s cols %d\n", vdev_raidz_math->rm_name,
+	    ZB_RAIDZ_COLS);
+	(void) printf("# kernel\tvariant\tsize\titers\tnsec/op\tMB/s\t"
+	    "ratio\n");
+
+	bzero(&za, sizeof (za));
+	za.za_src = umem_alloc(zbopt_maxsize, UMEM_NOFAIL);
+	/* room for a ddt_compress() header byte past a full block */
+	za.za_dst = umem_alloc(zbopt_maxsize + 1, UMEM_NOFAIL);
+
+	for (size = zbopt_minsize; size <= zbopt_maxsize; size <<= 1) {
+		za.za_size = size;
+		zb_fill(za.za_src, size);
+
+		if (zb_selected("checksum"))
+			zb_bench_checksum(&za);
+		if (zb_selected("compress") || zb_selected("decompress"))
+			zb_bench_compress(&za);
+		if (zb_selected("raidz_gen") || zb_selected("raidz_rec"))
+			zb_bench_raidz(&za);
+		if (zb_selected("ddt_compress") ||
+		    zb_selected("ddt_decompress"))
+			zb_bench_ddt(&za);
+		if (zb_selected("zio_buf") || zb_selected("zio_data_buf"))
+			zb_bench_zio_buf(&za);
+	}
+
+	if (zb_selected("object_alloc"))
+		zb_bench_object_alloc();
+	if (zb_selected("zil_commit"))
+		zb_bench_zil_commit();
+	if (zb_selected("space_map"))
+		zb_bench_space_map();
+	if (zb_selected("microzap"))
+		zb_bench_microzap();
+	if (zb_selected("fatzap"))
+		zb_bench_fatzap();
+	(void) remove(spa_config_path);
+
+	umem_free(za.za_src, zbopt_maxsize);
+	umem_free(za.za_dst, zbopt_maxsize + 1);
+
+	kernel_fini();
+
+	return (0);
+}
@@ -471,13 +471,13 @@ dump_metaslab_stats(metaslab_t *msp)
 {
 	char maxbuf[32];
 	space_map_t *sm = &msp->ms_map;
-	avl_tree_t *t = sm->sm_pp_root;
+	btree_t *t = sm->sm_pp_root;
 	int free_pct = sm->sm_space * 100 / sm->sm_size;
 
   	zdb_nicenum(space_map_maxsize(sm), maxbuf);
 
 	(void) printf("\t %25s %10lu   %7s  %6s   %4s %4d%%\n",
-	    "segments", avl_numnodes(t), "maxsize", maxbuf,
+	    "segments", btree_numnodes(t), "maxsize", maxbuf,
 	    "freepct", free_pct);
 }
 
@@ -629,14 +629,22 @@ dump_ddt(ddt_t *ddt, enum ddt_type type, enum ddt_class class)
 		return;
 	ASSERT(error == 0);
 
-	count = ddt_object_count(ddt, type, class);
+	count = ddt_entry_count(ddt, type, class);
 	dspace = doi.doi_physical_blocks_512 << 9;
 	mspace = doi.doi_fill_count * doi.doi_data_block_size;
 
-	ASSERT(count != 0);	/* we should have destroyed it */
-
 	ddt_object_name(ddt, type, class, name);
 
+	/*
+	 * The DDT log may have moved every entry elsewhere; the object goes
+	 * once the log is flushed.  Otherwise we should have destroyed it.
+	 */
+	if (count == 0) {
+		ASSERT(ddt_object_count(ddt, type, class) != 0);
+		(void) printf("%s: 0 entries\n", name);
+		return;
+	}
+
 	(void) printf("%s: %llu entries, size %llu on disk, %llu in core\n",
 	    name,
 	    (u_longlong_t)count,
@@ -661,6 +669,13 @@ dump_ddt(ddt_t *ddt, enum ddt_type type, enum ddt_class class)
 
 	ASSERT(error == ENOENT);
 
+	/* entries the DDT log has added since its last flush */
+	walk = 0;
+	while ((error = ddt_log_walk(ddt, type, class, &walk, &dde)) == 0)
+		dump_dde(ddt, &dde, walk);
+
+	ASSERT(error == ENOENT);
+
 	(void) printf("\n");
 }
 
@@ -1772,9 +1787,11 @@ zdb_count_block(spa_t *spa, zilog_t *zilog, zdb_cb_t *zcb, const blkptr_t *bp,
 	if (BP_GET_DEDUP(bp)) {
 		ddt_t *ddt;
 		ddt_entry_t *dde;
+		ddt_key_t ddk;
 
 		ddt = ddt_select(spa, bp);
-		ddt_enter(ddt);
+		ddt_key_fill(&ddk, bp);
+		ddt_enter(ddt, &ddk);
 		dde = ddt_lookup(ddt, bp, B_FALSE);
 
 		if (dde == NULL) {
@@ -1786,7 +1803,7 @@ zdb_count_block(spa_t *spa, zilog_t *zilog, zdb_cb_t *zcb, const blkptr_t *bp,
 			if (ddt_phys_total_refcnt(dde) == 0)
 				ddt_remove(ddt, dde);
 		}
-		ddt_exit(ddt);
+		ddt_exit(ddt, &ddk);
 	}
 
 	VERIFY3U(zio_wait(zio_claim(NULL, spa,
@@ -1901,6 +1918,35 @@ static space_map_ops_t zdb_space_map_ops = {
 	NULL	/* maxsize */
 };
 
+static void
+zdb_ddt_leak_entry(spa_t *spa, zdb_cb_t *zcb, enum zio_checksum checksum,
+    ddt_entry_t *dde)
+{
+	blkptr_t blk;
+	ddt_phys_t *ddp = dde->dde_phys;
+
+	ASSERT(ddt_phys_total_refcnt(dde) > 1);
+
+	for (int p = 0; p < DDT_PHYS_TYPES; p++, ddp++) {
+		if (ddp->ddp_phys_birth == 0)
+			continue;
+		ddt_bp_create(checksum, &dde->dde_key, ddp, &blk);
+		if (p == DDT_PHYS_DITTO) {
+			zdb_count_block(spa, NULL, zcb, &blk, ZDB_OT_DITTO);
+		} else {
+			zcb->zcb_dedup_asize +=
+			    BP_GET_ASIZE(&blk) * (ddp->ddp_refcnt - 1);
+			zcb->zcb_dedup_blocks++;
+		}
+	}
+	if (!dump_opt['L']) {
+		ddt_t *ddt = spa->spa_ddt[checksum];
+		ddt_enter(ddt, &dde->dde_key);
+		VERIFY(ddt_lookup(ddt, &blk, B_TRUE) != NULL);
+		ddt_exit(ddt, &dde->dde_key);
+	}
+}
+
 static void
 zdb_ddt_leak_init(spa_t *spa, zdb_cb_t *zcb)
 {
@@ -1909,37 +1955,29 @@ zdb_ddt_leak_init(spa_t *spa, zdb_cb_t *zcb)
 	int error;
 
 	while ((error = ddt_walk(spa, &ddb, &dde)) == 0) {
-		blkptr_t blk;
-		ddt_phys_t *ddp = dde.dde_phys;
-
 		if (ddb.ddb_class == DDT_CLASS_UNIQUE)
-			return;
+			break;
+		zdb_ddt_leak_entry(spa, zcb, ddb.ddb_checksum, &dde);
+	}
 
-		ASSERT(ddt_phys_total_refcnt(&dde) > 1);
+	ASSERT(error == 0 || error == ENOENT);
 
-		for (int p = 0; p < DDT_PHYS_TYPES; p++, ddp++) {
-			if (ddp->ddp_phys_birth == 0)
-				continue;
-			ddt_bp_create(ddb.ddb_checksum,
-			    &dde.dde_key, ddp, &blk);
-			if (p == DDT_PHYS_DITTO) {
-				zdb_count_block(spa, NULL, zcb, &blk,
-				    ZDB_OT_DITTO);
-			} else {
-				zcb->zcb_dedup_asize +=
-				    BP_GET_ASIZE(&blk) * (ddp->ddp_refcnt - 1);
-				zcb->zcb_dedup_blocks++;
+	/*
+	 * ddt_walk() leaves out what the DDT log has added to the ZAP
+	 * objects since it was last flushed.
+	 */
+	for (enum zio_checksum c = 0; c < ZIO_CHECKSUM_FUNCTIONS; c++) {
+		for (enum ddt_type type = 0; type < DDT_TYPES; type++) {
+			for (enum ddt_class class = 0;
+			    class < DDT_CLASS_UNIQUE; class++) {
+				uint64_t walk = 0;
+
+				while (ddt_log_walk(spa->spa_ddt[c], type,
+				    class, &walk, &dde) == 0)
+					zdb_ddt_leak_entry(spa, zcb, c, &dde);
 			}
 		}
-		if (!dump_opt['L']) {
-			ddt_t *ddt = spa->spa_ddt[ddb.ddb_checksum];
-			ddt_enter(ddt);
-			VERIFY(ddt_lookup(ddt, &blk, B_TRUE) != NULL);
-			ddt_exit(ddt);
-		}
 	}
-
-	ASSERT(error == ENOENT);
 }
 
 static void
@@ -2059,8 +2097,10 @@ dump_block_stats(spa_t *spa)
 
 	tzb = &zcb.zcb_type[ZB_TOTAL][ZDB_OT_TOTAL];
 
-	norm_alloc = metaslab_class_get_alloc(spa_normal_class(spa));
-	norm_space = metaslab_class_get_space(spa_normal_class(spa));
+	norm_alloc = metaslab_class_get_alloc(spa_normal_class(spa)) +
+	    metaslab_class_get_alloc(spa_special_class(spa));
+	norm_space = metaslab_class_get_space(spa_normal_class(spa)) +
+	    metaslab_class_get_space(spa_special_class(spa));
 
 	total_alloc = norm_alloc + metaslab_class_get_alloc(spa_log_class(spa));
 	total_found = tzb->zb_asize - zcb.zcb_dedup_asize;
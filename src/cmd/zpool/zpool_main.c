@@ -213,7 +213,7 @@ get_usage(zpool_help_t idx) {
 		return (gettext("\tiostat [-v] [-T d|u] [pool] ... [interval "
 		    "[count]]\n"));
 	case HELP_LIST:
-		return (gettext("\tlist [-H] [-o property[,...]] "
+		return (gettext("\tlist [-Hv] [-o property[,...]] "
 		    "[-T d|u] [pool] ... [interval [count]]\n"));
 	case HELP_OFFLINE:
 		return (gettext("\toffline [-t] <pool> <device> ...\n"));
@@ -328,9 +328,27 @@ usage(boolean_t requested)
 	exit(requested ? 0 : 2);
 }
 
+/*
+ * Return whether the top-level vdev 'nv' belongs to allocation class
+ * 'class' (VDEV_TYPE_LOG, VDEV_TYPE_SPECIAL, or NULL for normal).
+ */
+static boolean_t
+vdev_in_class(nvlist_t *nv, const char *class)
+{
+	const char *vclass = vdev_alloc_class(nv);
+
+	if (vclass == NULL || class == NULL)
+		return (vclass == class);
+	return (strcmp(vclass, class) == 0);
+}
+
+/*
+ * Print the vdev tree below 'nv', restricted at the top level to the
+ * vdevs of allocation class 'class'.
+ */
 void
 print_vdev_tree(zpool_handle_t *zhp, const char *name, nvlist_t *nv, int indent,
-    boolean_t print_logs)
+    const char *class)
 {
 	nvlist_t **child;
 	uint_t c, children;
@@ -344,16 +362,11 @@ print_vdev_tree(zpool_handle_t *zhp, const char *name, nvlist_t *nv, int indent,
 		return;
 
 	for (c = 0; c < children; c++) {
-		uint64_t is_log = B_FALSE;
-
-		(void) nvlist_lookup_uint64(child[c], ZPOOL_CONFIG_IS_LOG,
-		    &is_log);
-		if ((is_log && !print_logs) || (!is_log && print_logs))
+		if (!vdev_in_class(child[c], class))
 			continue;
 
 		vname = zpool_vdev_name(g_zfs, zhp, child[c], B_FALSE);
-		print_vdev_tree(zhp, vname, child[c], indent + 2,
-		    B_FALSE);
+		print_vdev_tree(zhp, vname, child[c], indent + 2, NULL);
 		free(vname);
 	}
 }
@@ -496,15 +509,25 @@ zpool_do_add(int argc, char **argv)
 		    "configuration:\n"), zpool_get_name(zhp));
 
 		/* print original main pool and new tree */
-		print_vdev_tree(zhp, poolname, poolnvroot, 0, B_FALSE);
-		print_vdev_tree(zhp, NULL, nvroot, 0, B_FALSE);
-
-		/* Do the same for the logs */
+		print_vdev_tree(zhp, poolname, poolnvroot, 0, NULL);
+		print_vdev_tree(zhp, NULL, nvroot, 0, NULL);
+
+		/* Do the same for the special vdevs and the logs */
+		if (num_special(poolnvroot) > 0) {
+			print_vdev_tree(zhp, "special", poolnvroot, 0,
+			    VDEV_TYPE_SPECIAL);
+			print_vdev_tree(zhp, NULL, nvroot, 0,
+			    VDEV_TYPE_SPECIAL);
+		} else if (num_special(nvroot) > 0) {
+			print_vdev_tree(zhp, "special", nvroot, 0,
+			    VDEV_TYPE_SPECIAL);
+		}
 		if (num_logs(poolnvroot) > 0) {
-			print_vdev_tree(zhp, "logs", poolnvroot, 0, B_TRUE);
-			print_vdev_tree(zhp, NULL, nvroot, 0, B_TRUE);
+			print_vdev_tree(zhp, "logs", poolnvroot, 0,
+			    VDEV_TYPE_LOG);
+			print_vdev_tree(zhp, NULL, nvroot, 0, VDEV_TYPE_LOG);
 		} else if (num_logs(nvroot) > 0) {
-			print_vdev_tree(zhp, "logs", nvroot, 0, B_TRUE);
+			print_vdev_tree(zhp, "logs", nvroot, 0, VDEV_TYPE_LOG);
 		}
 
 		ret = 0;
@@ -765,9 +788,13 @@ zpool_do_create(int argc, char **argv)
 		(void) printf(gettext("would create '%s' with the "
 		    "following layout:\n\n"), poolname);
 
-		print_vdev_tree(NULL, poolname, nvroot, 0, B_FALSE);
+		print_vdev_tree(NULL, poolname, nvroot, 0, NULL);
+		if (num_special(nvroot) > 0)
+			print_vdev_tree(NULL, "special", nvroot, 0,
+			    VDEV_TYPE_SPECIAL);
 		if (num_logs(nvroot) > 0)
-			print_vdev_tree(NULL, "logs", nvroot, 0, B_TRUE);
+			print_vdev_tree(NULL, "logs", nvroot, 0,
+			    VDEV_TYPE_LOG);
 
 		ret = 0;
 	} else {
@@ -1162,14 +1189,12 @@ print_status_config(zpool_handle_t *zhp, const char *name, nvlist_t *nv,
 	(void) printf("\n");
 
 	for (c = 0; c < children; c++) {
-		uint64_t islog = B_FALSE, ishole = B_FALSE;
+		uint64_t ishole = B_FALSE;
 
-		/* Don't print logs or holes here */
-		(void) nvlist_lookup_uint64(child[c], ZPOOL_CONFIG_IS_LOG,
-		    &islog);
+		/* Don't print logs, special vdevs or holes here */
 		(void) nvlist_lookup_uint64(child[c], ZPOOL_CONFIG_IS_HOLE,
 		    &ishole);
-		if (islog || ishole)
+		if (vdev_alloc_class(child[c]) != NULL || ishole)
 			continue;
 		vname = zpool_vdev_name(g_zfs, zhp, child[c], B_TRUE);
 		print_status_config(zhp, vname, child[c],
@@ -1238,11 +1263,7 @@ print_import_config(const char *name, nvlist_t *nv, int namewidth, int depth)
 		return;
 
 	for (c = 0; c < children; c++) {
-		uint64_t is_log = B_FALSE;
-
-		(void) nvlist_lookup_uint64(child[c], ZPOOL_CONFIG_IS_LOG,
-		    &is_log);
-		if (is_log)
+		if (vdev_alloc_class(child[c]) != NULL)
 			continue;
 
 		vname = zpool_vdev_name(g_zfs, NULL, child[c], B_TRUE);
@@ -1272,15 +1293,17 @@ print_import_config(const char *name, nvlist_t *nv, int namewidth, int depth)
 }
 
 /*
- * Print log vdevs.
+ * Print log or special vdevs.
  * Logs are recorded as top level vdevs in the main pool child array
- * but with "is_log" set to 1. We use either print_status_config() or
- * print_import_config() to print the top level logs then any log
+ * but with "is_log" set to 1, and special vdevs likewise with
+ * "is_special". We use either print_status_config() or
+ * print_import_config() to print the top level vdevs then any
  * children (eg mirrored slogs) are printed recursively - which
- * works because only the top level vdev is marked "is_log"
+ * works because only the top level vdev carries the flag.
  */
 static void
-print_logs(zpool_handle_t *zhp, nvlist_t *nv, int namewidth, boolean_t verbose)
+print_class_vdevs(zpool_handle_t *zhp, nvlist_t *nv, int namewidth,
+    boolean_t verbose, const char *class)
 {
 	uint_t c, children;
 	nvlist_t **child;
@@ -1289,15 +1312,13 @@ print_logs(zpool_handle_t *zhp, nvlist_t *nv, int namewidth, boolean_t verbose)
 	    &children) != 0)
 		return;
 
-	(void) printf(gettext("\tlogs\n"));
+	(void) printf("\t%s\n", strcmp(class, VDEV_TYPE_LOG) == 0 ?
+	    gettext("logs") : gettext("special"));
 
 	for (c = 0; c < children; c++) {
-		uint64_t is_log = B_FALSE;
 		char *name;
 
-		(void) nvlist_lookup_uint64(child[c], ZPOOL_CONFIG_IS_LOG,
-		    &is_log);
-		if (!is_log)
+		if (!vdev_in_class(child[c], class))
 			continue;
 		name = zpool_vdev_name(g_zfs, zhp, child[c], B_TRUE);
 		if (verbose)
@@ -1483,8 +1504,12 @@ show_import(nvlist_t *config)
 		namewidth = 10;
 
 	print_import_config(name, nvroot, namewidth, 0);
+	if (num_special(nvroot) > 0)
+		print_class_vdevs(NULL, nvroot, namewidth, B_FALSE,
+		    VDEV_TYPE_SPECIAL);
 	if (num_logs(nvroot) > 0)
-		print_logs(NULL, nvroot, namewidth, B_FALSE);
+		print_class_vdevs(NULL, nvroot, namewidth, B_FALSE,
+		    VDEV_TYPE_LOG);
 
 	if (reason == ZPOOL_STATUS_BAD_GUID_SUM) {
 		(void) printf(gettext("\n\tAdditional devices are known to "
@@ -2390,6 +2415,7 @@ zpool_do_iostat(int argc, char **argv)
 }
 
 typedef struct list_cbdata {
+	boolean_t	cb_verbose;
 	boolean_t	cb_scripted;
 	boolean_t	cb_first;
 	zprop_list_t	*cb_proplist;
@@ -2482,6 +2508,131 @@ print_pool(zpool_handle_t *zhp, zprop_list_t *pl, int scripted)
 	(void) printf("\n");
 }
 
+/*
+ * Print one line of 'zpool list -v' output: the space statistics of a
+ * vdev, or of a whole allocation class, in the columns of the pool line.
+ * Properties that don't apply to a vdev are shown as "-".
+ */
+static void
+print_list_stats(const char *name, uint64_t space, uint64_t alloc,
+    int depth, zprop_list_t *pl, boolean_t scripted)
+{
+	boolean_t first = B_TRUE;
+	char propstr[ZPOOL_MAXPROPLEN];
+	boolean_t right_justify;
+	int width;
+
+	for (; pl != NULL; pl = pl->pl_next) {
+		if (!first) {
+			if (scripted)
+				(void) printf("\t");
+			else
+				(void) printf("  ");
+		} else {
+			first = B_FALSE;
+		}
+
+		right_justify = B_FALSE;
+		width = pl->pl_width;
+		(void) strlcpy(propstr, "-", sizeof (propstr));
+
+		switch (pl->pl_prop) {
+		case ZPOOL_PROP_NAME:
+			if (scripted) {
+				(void) printf("%s", name);
+			} else {
+				(void) printf("%*s%-*s", depth, "",
+				    width > depth ? width - depth : 0, name);
+			}
+			continue;
+		case ZPOOL_PROP_SIZE:
+			zfs_nicenum(space, propstr, sizeof (propstr));
+			break;
+		case ZPOOL_PROP_ALLOCATED:
+			zfs_nicenum(alloc, propstr, sizeof (propstr));
+			break;
+		case ZPOOL_PROP_FREE:
+			zfs_nicenum(space - alloc, propstr, sizeof (propstr));
+			break;
+		case ZPOOL_PROP_CAPACITY:
+			(void) snprintf(propstr, sizeof (propstr), "%llu%%",
+			    (u_longlong_t)(space == 0 ? 0 :
+			    alloc * 100 / space));
+			break;
+		}
+
+		if (pl->pl_prop != ZPROP_INVAL)
+			right_justify = zpool_prop_align_right(pl->pl_prop);
+
+		if (scripted || (pl->pl_next == NULL && !right_justify))
+			(void) printf("%s", propstr);
+		else if (right_justify)
+			(void) printf("%*s", width, propstr);
+		else
+			(void) printf("%-*s", width, propstr);
+	}
+
+	(void) printf("\n");
+}
+
+/*
+ * Print the top-level vdevs of allocation class 'class' with their space
+ * statistics.  The special and log classes get a heading line carrying
+ * the class totals; normal vdevs are listed directly below the pool.
+ */
+static void
+print_list_class(zpool_handle_t *zhp, nvlist_t *nvroot, const char *class,
+    list_cbdata_t *cbp)
+{
+	nvlist_t **child;
+	uint_t c, children;
+	uint64_t space = 0, alloc = 0;
+	vdev_stat_t *vs;
+	uint_t nstats;
+	char *vname;
+	int depth = 2;
+
+	if (nvlist_lookup_nvlist_array(nvroot, ZPOOL_CONFIG_CHILDREN,
+	    &child, &children) != 0)
+		return;
+
+	if (class != NULL) {
+		if ((strcmp(class, VDEV_TYPE_LOG) == 0 ?
+		    num_logs(nvroot) : num_special(nvroot)) == 0)
+			return;
+
+		for (c = 0; c < children; c++) {
+			if (!vdev_in_class(child[c], class) ||
+			    nvlist_lookup_uint64_array(child[c],
+			    ZPOOL_CONFIG_VDEV_STATS, (uint64_t **)&vs,
+			    &nstats) != 0)
+				continue;
+			space += vs->vs_space;
+			alloc += vs->vs_alloc;
+		}
+		print_list_stats(strcmp(class, VDEV_TYPE_LOG) == 0 ?
+		    "logs" : class, space, alloc, depth, cbp->cb_proplist,
+		    cbp->cb_scripted);
+		depth += 2;
+	}
+
+	for (c = 0; c < children; c++) {
+		uint64_t ishole = B_FALSE;
+
+		(void) nvlist_lookup_uint64(child[c], ZPOOL_CONFIG_IS_HOLE,
+		    &ishole);
+		if (ishole || !vdev_in_class(child[c], class) ||
+		    nvlist_lookup_uint64_array(child[c],
+		    ZPOOL_CONFIG_VDEV_STATS, (uint64_t **)&vs, &nstats) != 0)
+			continue;
+
+		vname = zpool_vdev_name(g_zfs, zhp, child[c], B_FALSE);
+		print_list_stats(vname, vs->vs_space, vs->vs_alloc, depth,
+		    cbp->cb_proplist, cbp->cb_scripted);
+		free(vname);
+	}
+}
+
 /*
  * Generic callback function to list a pool.
  */
@@ -2489,6 +2640,7 @@ int
 list_callback(zpool_handle_t *zhp, void *data)
 {
 	list_cbdata_t *cbp = data;
+	nvlist_t *config, *nvroot;
 
 	if (cbp->cb_first) {
 		if (!cbp->cb_scripted)
@@ -2498,14 +2650,25 @@ list_callback(zpool_handle_t *zhp, void *data)
 
 	print_pool(zhp, cbp->cb_proplist, cbp->cb_scripted);
 
+	if (cbp->cb_verbose &&
+	    (config = zpool_get_config(zhp, NULL)) != NULL &&
+	    nvlist_lookup_nvlist(config, ZPOOL_CONFIG_VDEV_TREE,
+	    &nvroot) == 0) {
+		print_list_class(zhp, nvroot, NULL, cbp);
+		print_list_class(zhp, nvroot, VDEV_TYPE_SPECIAL, cbp);
+		print_list_class(zhp, nvroot, VDEV_TYPE_LOG, cbp);
+	}
+
 	return (0);
 }
 
 /*
- * zpool list [-H] [-o prop[,prop]*] [-T d|u] [pool] ... [interval [count]]
+ * zpool list [-Hv] [-o prop[,prop]*] [-T d|u] [pool] ... [interval [count]]
  *
  *	-H	Scripted mode.  Don't display headers, and separate properties
  *		by a single tab.
+ *	-v	Verbose.  Also list the space statistics of each top-level
+ *		vdev, grouped by allocation class.
  *	-o	List of properties to display.  Defaults to
  *		"name,size,allocated,free,capacity,health,altroot"
  *	-T	Display a timestamp in date(1) or Unix format
@@ -2525,11 +2688,14 @@ zpool_do_list(int argc, char **argv)
 	unsigned long interval = 0, count = 0;
 
 	/* check options */
-	while ((c = getopt(argc, argv, ":Ho:T:")) != -1) {
+	while ((c = getopt(argc, argv, ":Ho:T:v")) != -1) {
 		switch (c) {
 		case 'H':
 			cb.cb_scripted = B_TRUE;
 			break;
+		case 'v':
+			cb.cb_verbose = B_TRUE;
+			break;
 		case 'o':
 			props = optarg;
 			break;
@@ -2897,7 +3063,7 @@ zpool_do_split(int argc, char **argv)
 		if (flags.dryrun) {
 			(void) printf(gettext("would create '%s' with the "
 			    "following layout:\n\n"), newpool);
-			print_vdev_tree(NULL, newpool, config, 0, B_FALSE);
+			print_vdev_tree(NULL, newpool, config, 0, NULL);
 		}
 		nvlist_free(config);
 	}
@@ -3231,6 +3397,7 @@ print_scan_status(pool_scan_stat_t *ps)
 	uint_t rate;
 	double fraction_done;
 	char processed_buf[7], examined_buf[7], total_buf[7], rate_buf[7];
+	char issued_buf[7], queued_buf[7];
 
 	(void) printf(gettext(" scan: "));
 
@@ -3313,6 +3480,17 @@ print_scan_status(pool_scan_stat_t *ps)
 	    (u_longlong_t)(mins_left / 60),
 	    (uint_t)(mins_left % 60));
 
+	/* reads are queued and issued in disk order, so show both rates */
+	if (ps->pss_pass_issued != 0 || ps->pss_queued != 0) {
+		zfs_nicenum(ps->pss_pass_issued, issued_buf,
+		    sizeof (issued_buf));
+		zfs_nicenum(ps->pss_pass_issued / elapsed, rate_buf,
+		    sizeof (rate_buf));
+		zfs_nicenum(ps->pss_queued, queued_buf, sizeof (queued_buf));
+		(void) printf(gettext("    %s issued at %s/s, %s queued\n"),
+		    issued_buf, rate_buf, queued_buf);
+	}
+
 	if (ps->pss_func == POOL_SCAN_RESILVER) {
 		(void) printf(gettext("    %s resilvered, %.2f%% done\n"),
 		    processed_buf, 100 * fraction_done);
@@ -3649,10 +3827,17 @@ status_callback(zpool_handle_t *zhp, void *data)
 		uint64_t nerr;
 		nvlist_t **spares, **l2cache;
 		uint_t nspares, nl2cache;
-		pool_scan_stat_t *ps = NULL;
+		pool_scan_stat_t *ps = NULL, pss;
 
 		(void) nvlist_lookup_uint64_array(nvroot,
 		    ZPOOL_CONFIG_SCAN_STATS, (uint64_t **)&ps, &c);
+		if (ps != NULL &&
+		    c < sizeof (pool_scan_stat_t) / sizeof (uint64_t)) {
+			/* an older daemon reports fewer scan stats */
+			bzero(&pss, sizeof (pss));
+			bcopy(ps, &pss, c * sizeof (uint64_t));
+			ps = &pss;
+		}
 		print_scan_status(ps);
 
 		namewidth = max_width(zhp, nvroot, 0, 0);
@@ -3665,8 +3850,12 @@ status_callback(zpool_handle_t *zhp, void *data)
 		print_status_config(zhp, zpool_get_name(zhp), nvroot,
 		    namewidth, 0, B_FALSE);
 
+		if (num_special(nvroot) > 0)
+			print_class_vdevs(zhp, nvroot, namewidth, B_TRUE,
+			    VDEV_TYPE_SPECIAL);
 		if (num_logs(nvroot) > 0)
-			print_logs(zhp, nvroot, namewidth, B_TRUE);
+			print_class_vdevs(zhp, nvroot, namewidth, B_TRUE,
+			    VDEV_TYPE_LOG);
 		if (nvlist_lookup_nvlist_array(nvroot, ZPOOL_CONFIG_L2CACHE,
 		    &l2cache, &nl2cache) == 0)
 			print_l2cache(zhp, l2cache, nl2cache, namewidth);
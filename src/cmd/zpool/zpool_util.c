@@ -86,3 +86,46 @@ num_logs(nvlist_t *nv)
 	}
 	return (nlogs);
 }
+
+/*
+ * Return the number of special class vdevs in supplied nvlist
+ */
+uint_t
+num_special(nvlist_t *nv)
+{
+	uint_t nspecial = 0;
+	uint_t c, children;
+	nvlist_t **child;
+
+	if (nvlist_lookup_nvlist_array(nv, ZPOOL_CONFIG_CHILDREN,
+	    &child, &children) != 0)
+		return (0);
+
+	for (c = 0; c < children; c++) {
+		uint64_t is_special = B_FALSE;
+
+		(void) nvlist_lookup_uint64(child[c], ZPOOL_CONFIG_IS_SPECIAL,
+		    &is_special);
+		if (is_special)
+			nspecial++;
+	}
+	return (nspecial);
+}
+
+/*
+ * Return the allocation class of a top-level vdev: VDEV_TYPE_LOG,
+ * VDEV_TYPE_SPECIAL, or NULL for the normal class.
+ */
+const char *
+vdev_alloc_class(nvlist_t *nv)
+{
+	uint64_t is_log = B_FALSE, is_special = B_FALSE;
+
+	(void) nvlist_lookup_uint64(nv, ZPOOL_CONFIG_IS_LOG, &is_log);
+	(void) nvlist_lookup_uint64(nv, ZPOOL_CONFIG_IS_SPECIAL, &is_special);
+	if (is_log)
+		return (VDEV_TYPE_LOG);
+	if (is_special)
+		return (VDEV_TYPE_SPECIAL);
+	return (NULL);
+}
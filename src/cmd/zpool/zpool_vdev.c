@@ -567,16 +567,19 @@ get_replication(nvlist_t *nvroot, boolean_t fatal)
 
 	lastrep.zprl_type = NULL;
 	for (t = 0; t < toplevels; t++) {
-		uint64_t is_log = B_FALSE;
+		uint64_t is_log = B_FALSE, is_special = B_FALSE;
 
 		nv = top[t];
 
 		/*
-		 * For separate logs we ignore the top level vdev replication
-		 * constraints.
+		 * For separate logs and special vdevs we ignore the top level
+		 * vdev replication constraints; a mirrored special class on a
+		 * raidz pool is the expected layout.
 		 */
 		(void) nvlist_lookup_uint64(nv, ZPOOL_CONFIG_IS_LOG, &is_log);
-		if (is_log)
+		(void) nvlist_lookup_uint64(nv, ZPOOL_CONFIG_IS_SPECIAL,
+		    &is_special);
+		if (is_log || is_special)
 			continue;
 
 		verify(nvlist_lookup_string(nv, ZPOOL_CONFIG_TYPE,
@@ -829,9 +832,10 @@ check_replication(nvlist_t *config, nvlist_t *newroot)
 	}
 
 	/*
-	 * If all we have is logs then there's no replication level to check.
+	 * If all we have is logs and special vdevs then there's no
+	 * replication level to check.
 	 */
-	if (num_logs(newroot) == children) {
+	if (num_logs(newroot) + num_special(newroot) == children) {
 		free(current);
 		return (0);
 	}
@@ -1145,6 +1149,12 @@ is_grouping(const char *type, int *mindev, int *maxdev)
 		return (VDEV_TYPE_LOG);
 	}
 
+	if (strcmp(type, "special") == 0) {
+		if (mindev != NULL)
+			*mindev = 1;
+		return (VDEV_TYPE_SPECIAL);
+	}
+
 	if (strcmp(type, "cache") == 0) {
 		if (mindev != NULL)
 			*mindev = 1;
@@ -1164,10 +1174,10 @@ nvlist_t *
 construct_spec(int argc, char **argv)
 {
 	nvlist_t *nvroot, *nv, **top, **spares, **l2cache;
-	int t, toplevels, mindev, maxdev, nspares, nlogs, nl2cache;
+	int t, toplevels, mindev, maxdev, nspares, nlogs, nl2cache, nspecial;
 	const char *type;
-	uint64_t is_log;
-	boolean_t seen_logs;
+	uint64_t is_log, is_special;
+	boolean_t seen_logs, seen_special;
 
 	top = NULL;
 	toplevels = 0;
@@ -1176,8 +1186,11 @@ construct_spec(int argc, char **argv)
 	nspares = 0;
 	nlogs = 0;
 	nl2cache = 0;
+	nspecial = 0;
 	is_log = B_FALSE;
 	seen_logs = B_FALSE;
+	is_special = B_FALSE;
+	seen_special = B_FALSE;
 
 	while (argc > 0) {
 		nv = NULL;
@@ -1199,6 +1212,7 @@ construct_spec(int argc, char **argv)
 					return (NULL);
 				}
 				is_log = B_FALSE;
+				is_special = B_FALSE;
 			}
 
 			if (strcmp(type, VDEV_TYPE_LOG) == 0) {
@@ -1211,6 +1225,7 @@ construct_spec(int argc, char **argv)
 				}
 				seen_logs = B_TRUE;
 				is_log = B_TRUE;
+				is_special = B_FALSE;
 				argc--;
 				argv++;
 				/*
@@ -1220,6 +1235,27 @@ construct_spec(int argc, char **argv)
 				continue;
 			}
 
+			if (strcmp(type, VDEV_TYPE_SPECIAL) == 0) {
+				if (seen_special) {
+					(void) fprintf(stderr,
+					    gettext("invalid vdev "
+					    "specification: 'special' can be "
+					    "specified only once\n"));
+					return (NULL);
+				}
+				seen_special = B_TRUE;
+				is_special = B_TRUE;
+				is_log = B_FALSE;
+				argc--;
+				argv++;
+				/*
+				 * Like a log, special is not a real grouping
+				 * device; the vdevs that follow are ordinary
+				 * top-level vdevs flagged as special.
+				 */
+				continue;
+			}
+
 			if (strcmp(type, VDEV_TYPE_L2CACHE) == 0) {
 				if (l2cache != NULL) {
 					(void) fprintf(stderr,
@@ -1229,6 +1265,7 @@ construct_spec(int argc, char **argv)
 					return (NULL);
 				}
 				is_log = B_FALSE;
+				is_special = B_FALSE;
 			}
 
 			if (is_log) {
@@ -1241,6 +1278,8 @@ construct_spec(int argc, char **argv)
 				}
 				nlogs++;
 			}
+			if (is_special)
+				nspecial++;
 
 			for (c = 1; c < argc; c++) {
 				if (is_grouping(argv[c], NULL, NULL) != NULL)
@@ -1288,6 +1327,10 @@ construct_spec(int argc, char **argv)
 				    type) == 0);
 				verify(nvlist_add_uint64(nv,
 				    ZPOOL_CONFIG_IS_LOG, is_log) == 0);
+				if (is_special)
+					verify(nvlist_add_uint64(nv,
+					    ZPOOL_CONFIG_IS_SPECIAL,
+					    is_special) == 0);
 				if (strcmp(type, VDEV_TYPE_RAIDZ) == 0) {
 					verify(nvlist_add_uint64(nv,
 					    ZPOOL_CONFIG_NPARITY,
@@ -1310,6 +1353,11 @@ construct_spec(int argc, char **argv)
 				return (NULL);
 			if (is_log)
 				nlogs++;
+			if (is_special) {
+				verify(nvlist_add_uint64(nv,
+				    ZPOOL_CONFIG_IS_SPECIAL, is_special) == 0);
+				nspecial++;
+			}
 			argc--;
 			argv++;
 		}
@@ -1334,6 +1382,12 @@ construct_spec(int argc, char **argv)
 		return (NULL);
 	}
 
+	if (seen_special && nspecial == 0) {
+		(void) fprintf(stderr, gettext("invalid vdev specification: "
+		    "special requires at least 1 device\n"));
+		return (NULL);
+	}
+
 	/*
 	 * Finally, create nvroot and add all top-level vdevs to it.
 	 */
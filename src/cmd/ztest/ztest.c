@@ -345,6 +345,13 @@ static ztest_cb_list_t zcl;
 
 extern uint64_t metaslab_gang_bang;
 extern uint64_t metaslab_df_alloc_threshold;
+extern int zfs_arc_compressed;
+extern int zfs_arc_warmstart;
+extern int zfs_arc_warmstart_interval;
+extern int zfs_sync_dnodes_min;
+extern uint64_t zfs_dirty_data_max;
+extern int zfs_txg_synctime_ms;
+extern uint64_t zfs_ddt_log_max;
 static uint64_t metaslab_sz;
 
 enum ztest_object {
@@ -4090,7 +4097,7 @@ ztest_dmu_commit_callbacks(ztest_ds_t *zd, uint64_t id)
 	dmu_tx_t *tx;
 	ztest_cb_data_t *cb_data[3], *tmp_cb;
 	uint64_t old_txg, txg;
-	int i, error;
+	int i, error = 0;
 
 	ztest_od_init(&od[0], id, FTAG, 0, DMU_OT_UINT64_OTHER, 0, 0);
 
@@ -4208,6 +4215,17 @@ ztest_dmu_commit_callbacks(ztest_ds_t *zd, uint64_t id)
 	(void) mutex_unlock(&zcl.zcl_callbacks_lock);
 
 	dmu_tx_commit(tx);
+
+	/*
+	 * Also ask to be called back when this txg or one of the two before
+	 * it, which may be on disk already, is synced.
+	 */
+	txg -= ztest_random(3);
+	tmp_cb = ztest_create_cb_data(os, txg);
+	VERIFY(txg_register_synced(dmu_objset_pool(os), txg,
+	    ztest_commit_callback, tmp_cb) == 0);
+	VERIFY(txg_register_synced(dmu_objset_pool(os), txg + 1000000,
+	    ztest_commit_callback, NULL) == EINVAL);
 }
 
 /* ARGSUSED */
@@ -5459,6 +5477,45 @@ main(int argc, char **argv)
 		/* Set the allocation switch size */
 		metaslab_df_alloc_threshold = ztest_random(metaslab_sz / 4) + 1;
 
+		/* Run half of the passes with the compressed ARC */
+		zfs_arc_compressed = ztest_random(2);
+
+		/* And half with ARC warm start, saving the hot list often */
+		zfs_arc_warmstart = ztest_random(2);
+		zfs_arc_warmstart_interval = 1 + ztest_random(5);
+
+		/* Sync dirty dnodes on the sync taskq even for small txgs */
+		zfs_sync_dnodes_min = ztest_random(2) ? 0 : 64;
+
+		/*
+		 * And half with a dirty data limit small enough that the
+		 * write throttle delays and blocks writers all the time.
+		 * Zero lets arc_init() pick the usual default.
+		 */
+		zfs_dirty_data_max = ztest_random(2) ?
+		    (4 + ztest_random(28)) << 20 : 0;
+
+		/* And half with tiny txgs closed on the learned sync rate */
+		zfs_txg_synctime_ms = ztest_random(2) ?
+		    1000 : 1 + ztest_random(100);
+
+		/*
+		 * Run a third of the passes without the dedup log, a third
+		 * with a log small enough to be applied every few txgs,
+		 * and a third with a large one.
+		 */
+		switch (ztest_random(3)) {
+		case 0:
+			zfs_ddt_log_max = 0;
+			break;
+		case 1:
+			zfs_ddt_log_max = 1 + ztest_random(64);
+			break;
+		default:
+			zfs_ddt_log_max = 1ULL << 16;
+			break;
+		}
+
 		pid = fork();
 
 		if (pid == -1)
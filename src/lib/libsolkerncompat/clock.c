@@ -27,8 +27,25 @@
 
 #include <sys/systm.h>
 #include <sys/poll.h>
+#include <time.h>
 
 void delay(clock_t ticks)
 {
 	poll(0, 0, ticks * (1000 / hz));
 }
+
+/*
+ * Sleep until gethrtime() reaches wakeup.  Unlike delay() this is not
+ * rounded up to whole clock ticks.
+ */
+void zfs_sleep_until(hrtime_t wakeup)
+{
+	struct timespec ts;
+	hrtime_t now;
+
+	while ((now = gethrtime()) < wakeup) {
+		ts.tv_sec = (wakeup - now) / NANOSEC;
+		ts.tv_nsec = (wakeup - now) % NANOSEC;
+		(void) nanosleep(&ts, NULL);
+	}
+}
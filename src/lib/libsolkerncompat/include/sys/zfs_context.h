@@ -62,7 +62,12 @@ extern "C" {
 #include <sys/fm/util.h>
 #include <sys/sunddi.h>
 
-#define	CPU_SEQID (thr_self() & (max_ncpus - 1))
+/*
+ * pthread_t values are aligned addresses whose low bits are the same for
+ * every thread, so hash the id to spread threads over the CPU slots.
+ */
+#define	CPU_SEQID	((uint_t)(((((uint64_t)thr_self() >> 12) * \
+	0x9e3779b97f4a7c15ULL) >> 32) & (max_ncpus - 1)))
 
 extern char *kmem_asprintf(const char *fmt, ...);
 #define	strfree(str) kmem_free((str), strlen(str)+1)
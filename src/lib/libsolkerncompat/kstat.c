@@ -53,6 +53,7 @@ struct dir_s {
 	dir_t **dirs,*parent;
 	int nb_files;
 	kstat_named_t **files;
+	kstat_t *ksp;
 };
 
 static int used_files;
@@ -75,7 +76,7 @@ add_dir(dir_t *root, const char *name)
 		// XXX check failure
 	}
 	dir_t *dir = calloc(1, sizeof(dir_t));
-	dir->name = name;
+	dir->name = strdup(name); // may be on the caller's stack (txgs.<pool>)
 	dir->inode = next_inode++;
 	dir->parent = root;
 	root->dirs[root->nb_dirs++] = dir;
@@ -169,6 +170,7 @@ kstat_install(kstat_t *ksp)
 		dir->files[n] = names;
 		names++;
 	}
+	dir->ksp = ksp;
 	if (!mounted)
 		mount_kstat();
 }
@@ -201,6 +203,7 @@ kstat_delete(kstat_t *ksp)
 				    (parent->nb_dirs-n-1)*sizeof(dir_t*));
 			}
 			parent->nb_dirs--;
+			free((char *)dir->name);
 			free(dir);
 			break;
 		}
@@ -213,10 +216,23 @@ kstat_delete(kstat_t *ksp)
 
 static char kstat_str[80];
 
-static void
+/*
+ * Returns the text of a file, refreshing the kstat first if it has a
+ * ks_update routine.  KSTAT_DATA_STRING values are returned as is, so they
+ * can be longer than kstat_str (the txg history for instance).
+ */
+static const char *
 get_value(dir_t *dir, fuse_ino_t ino)
 {
 	kstat_named_t *file = dir->files[ino-1-dir->inode];
+	kstat_t *ksp = dir->ksp;
+
+	if (ksp != NULL && ksp->ks_update != NULL) {
+		KSTAT_ENTER(ksp);
+		(void) KSTAT_UPDATE(ksp, KSTAT_READ);
+		KSTAT_EXIT(ksp);
+	}
+
 	switch (file->data_type) {
 	case KSTAT_DATA_INT32:
 	case KSTAT_DATA_UINT32:
@@ -228,9 +244,15 @@ get_value(dir_t *dir, fuse_ino_t ino)
 	case KSTAT_DATA_UINT64:
 		sprintf(kstat_str,FU64 "\n",file->value.ui64);
 		break;
+	case KSTAT_DATA_STRING:
+		if (KSTAT_NAMED_STR_PTR(file) != NULL)
+			return (KSTAT_NAMED_STR_PTR(file));
+		kstat_str[0] = '\0';
+		break;
 	default:
 		sprintf(kstat_str,"data type %d not handled\n",file->data_type);
 	}
+	return (kstat_str);
 }
 
 static int
@@ -248,8 +270,7 @@ kstat_stat(fuse_ino_t ino, struct stat *stbuf)
 	} else {
 		stbuf->st_mode = S_IFREG | 0444;
 		stbuf->st_nlink = 1;
-		get_value(dir,ino);
-		stbuf->st_size = strlen(kstat_str);
+		stbuf->st_size = strlen(get_value(dir,ino));
 	}
 
 	return 0;
@@ -385,8 +406,8 @@ kstat_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
 	(void) fi;
 
 	dir_t *dir = find_dir(root,ino);
-	get_value(dir,ino);
-	reply_buf_limited(req, kstat_str, strlen(kstat_str), off, size);
+	const char *val = get_value(dir,ino);
+	reply_buf_limited(req, val, strlen(val), off, size);
 }
 
 static struct fuse_lowlevel_ops kstat_ll_oper = {
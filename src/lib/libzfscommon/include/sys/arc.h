@@ -82,6 +82,7 @@ typedef enum arc_space_type {
 
 void arc_space_consume(uint64_t space, arc_space_type_t type);
 void arc_space_return(uint64_t space, arc_space_type_t type);
+boolean_t arc_meta_full(void);
 void *arc_data_buf_alloc(uint64_t space);
 void arc_data_buf_free(void *buf, uint64_t space);
 arc_buf_t *arc_buf_alloc(spa_t *spa, int size, void *tag,
@@ -124,6 +125,9 @@ int arc_tempreserve_space(uint64_t reserve, uint64_t txg);
 void arc_init(void);
 void arc_fini(void);
 
+void arc_warmstart_create(spa_t *spa);
+void arc_warmstart_destroy(spa_t *spa);
+
 /*
  * Level 2 ARC
  */
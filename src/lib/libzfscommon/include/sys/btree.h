@@ -0,0 +1,175 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+#ifndef _SYS_BTREE_H
+#define	_SYS_BTREE_H
+
+#include <sys/zfs_context.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * An in-core B-tree of small fixed-size elements.
+ *
+ * Unlike an AVL tree, whose nodes are embedded in individually allocated
+ * structures, a B-tree copies its elements into arrays held by large
+ * nodes: leaves hold BTREE_LEAF_SIZE bytes of elements and interior
+ * ("core") nodes hold BTREE_CORE_ELEMS elements plus their children.  Each
+ * element is stored exactly once, in either kind of node.  For the
+ * 16-byte segments of a space map this costs a little over 16 bytes per
+ * element instead of the 64 bytes of a space_seg_t plus allocator
+ * overhead, and searches and walks touch a few contiguous arrays
+ * instead of chasing a pointer per element.
+ *
+ * The price is that elements move: a pointer returned by any of the
+ * routines below is only valid until the next insertion or removal.
+ * Callers may modify an element in place as long as its position in
+ * the sort order does not change.
+ *
+ * A tree with a single leaf grows that leaf geometrically, so small
+ * trees don't pay for a full one.
+ *
+ * The usage scenario mirrors avl.h:
+ * 1. Create the tree with btree_create().
+ * 2. Add elements with btree_add(), or btree_find() and btree_insert().
+ *    Visit them with btree_first(), btree_last(), btree_next() and
+ *    btree_prev().  Remove them with btree_remove() or
+ *    btree_remove_idx().
+ * 3. Empty the tree with btree_clear() and tear it down with
+ *    btree_destroy().
+ */
+
+#define	BTREE_LEAF_SIZE		1024	/* bytes in a full leaf node */
+#define	BTREE_CORE_ELEMS	126	/* elements in a core node */
+#define	BTREE_LEAF_MIN_CAP	4	/* elements in the smallest root leaf */
+
+typedef struct btree_core btree_core_t;
+
+typedef struct btree_hdr {
+	btree_core_t	*bth_parent;	/* parent core node, NULL at root */
+	uint32_t	bth_count;	/* number of elements in the node */
+	uint16_t	bth_cap;	/* capacity of the node in elements */
+	uint16_t	bth_core;	/* core node? */
+} btree_hdr_t;
+
+struct btree_core {
+	btree_hdr_t	btc_hdr;
+	btree_hdr_t	*btc_children[BTREE_CORE_ELEMS + 1];
+	uint8_t		btc_elems[];
+};
+
+typedef struct btree_leaf {
+	btree_hdr_t	btl_hdr;
+	uint8_t		btl_elems[];
+} btree_leaf_t;
+
+/*
+ * A position in the tree: either an element, or, when bti_before is
+ * set, the slot in a leaf before which a missing element would go.
+ */
+typedef struct btree_index {
+	btree_hdr_t	*bti_node;
+	uint32_t	bti_offset;
+	boolean_t	bti_before;
+} btree_index_t;
+
+typedef struct btree {
+	btree_hdr_t	*bt_root;
+	int		bt_height;	/* -1 if empty, 0 for a lone leaf */
+	size_t		bt_elem_size;
+	uint32_t	bt_leaf_cap;	/* capacity of a full leaf */
+	uint64_t	bt_num_elems;
+	size_t		bt_memory;	/* bytes held by nodes */
+	int		(*bt_compar)(const void *, const void *);
+} btree_t;
+
+/*
+ * Initialize a tree of elements of "size" bytes, ordered by "compar",
+ * which must return exactly -1, 0 or +1.
+ */
+extern void btree_create(btree_t *tree,
+    int (*compar)(const void *, const void *), size_t size);
+extern void btree_destroy(btree_t *tree);
+
+/*
+ * Find the element equal to "value".  If there is none, return NULL and
+ * set "where", if not NULL, to the position at which it would be
+ * inserted; btree_next() and btree_prev() of that position are its
+ * nearest neighbours.
+ */
+extern void *btree_find(btree_t *tree, const void *value,
+    btree_index_t *where);
+
+/*
+ * Copy "value" into the tree at "where", as returned by a failed
+ * btree_find(), or look its position up first.  "value" must not point
+ * into the tree itself.
+ */
+extern void btree_insert(btree_t *tree, const void *value,
+    const btree_index_t *where);
+extern void btree_add(btree_t *tree, const void *value);
+
+/*
+ * Remove the element equal to "value", or the element at "where".
+ */
+extern void btree_remove(btree_t *tree, const void *value);
+extern void btree_remove_idx(btree_t *tree, btree_index_t *where);
+
+/*
+ * Return the lowest or highest element, or NULL if the tree is empty,
+ * and set "where", if not NULL, to its position.
+ */
+extern void *btree_first(btree_t *tree, btree_index_t *where);
+extern void *btree_last(btree_t *tree, btree_index_t *where);
+
+/*
+ * Return the element after or before position "idx", or NULL at either
+ * end of the tree, and set "out", if not NULL, to its position.  "idx"
+ * and "out" may point to the same index.
+ */
+extern void *btree_next(btree_t *tree, const btree_index_t *idx,
+    btree_index_t *out);
+extern void *btree_prev(btree_t *tree, const btree_index_t *idx,
+    btree_index_t *out);
+
+/*
+ * Return the element at position "idx".
+ */
+extern void *btree_get(btree_t *tree, const btree_index_t *idx);
+
+/*
+ * Return the number of elements in the tree, and the bytes its nodes use.
+ */
+extern ulong_t btree_numnodes(btree_t *tree);
+extern size_t btree_memory(btree_t *tree);
+
+/*
+ * Free every node, leaving an empty tree.
+ */
+extern void btree_clear(btree_t *tree);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _SYS_BTREE_H */
@@ -228,12 +228,26 @@ typedef struct dmu_buf_impl {
 } dmu_buf_impl_t;
 
 /* Note: the dbuf hash table is exposed only for the mdb module */
-#define	DBUF_MUTEXES 256
-#define	DBUF_HASH_MUTEX(h, idx) (&(h)->hash_mutexes[(idx) & (DBUF_MUTEXES-1)])
+#define	DBUF_HASH_MUTEX(h, idx) (&(h)->hash_mutexes[(idx) & (h)->hash_mutex_mask])
 typedef struct dbuf_hash_table {
 	uint64_t hash_table_mask;
 	dmu_buf_impl_t **hash_table;
-	kmutex_t hash_mutexes[DBUF_MUTEXES];
+	/*
+	 * While the table grows, the buckets of the old one are moved to
+	 * the new one a few at a time, and lookups search both.  These
+	 * change only under hash_resize_lock, and the tables are swapped
+	 * with all of hash_mutexes held as well.
+	 */
+	uint64_t hash_old_mask;
+	dmu_buf_impl_t **hash_old_table;
+	uint64_t hash_migrate_next;	/* next old bucket to move */
+	kmutex_t hash_resize_lock;
+	/*
+	 * A hash mutex covers the buckets of both tables with the same low
+	 * bits, so there are never more of them than buckets.
+	 */
+	uint64_t hash_mutex_mask;
+	kmutex_t *hash_mutexes;
 } dbuf_hash_table_t;
 
 
@@ -249,6 +263,7 @@ int dbuf_hold_impl(struct dnode *dn, uint8_t level, uint64_t blkid, int create,
     const void *tag, dmu_buf_impl_t **dbp);
 
 void dbuf_prefetch(struct dnode *dn, uint64_t blkid);
+boolean_t dbuf_arc_blkptr(arc_buf_t *buf, blkptr_t *bp, zbookmark_t *zb);
 
 void dbuf_add_ref(dmu_buf_impl_t *db, void *tag);
 uint64_t dbuf_refcount(dmu_buf_impl_t *db);
@@ -118,17 +118,98 @@ struct ddt_entry {
 	avl_node_t	dde_node;
 };
 
+/*
+ * Clean ddt entry, kept in core across txgs so that a later lookup of the
+ * same block doesn't have to go back to the DDT ZAP.  Most entries have
+ * a single populated phys (one reference, or a constant copies= setting),
+ * in which case only that phys is kept and ddc_phys_type says which one.
+ */
+typedef struct ddt_cached {
+	ddt_key_t	ddc_key;
+	avl_node_t	ddc_node;
+	list_node_t	ddc_lru_node;
+	uint8_t		ddc_type;
+	uint8_t		ddc_class;
+	uint8_t		ddc_phys_type;	/* DDT_PHYS_TYPES if all are kept */
+	ddt_phys_t	ddc_phys[1];	/* 1 or DDT_PHYS_TYPES entries */
+} ddt_cached_t;
+
+#define	DDT_CACHED_SIZE(ptype)	(offsetof(ddt_cached_t, ddc_phys) + \
+	((ptype) == DDT_PHYS_TYPES ? DDT_PHYS_TYPES : 1) * sizeof (ddt_phys_t))
+
+/*
+ * Dedup log record.  Rather than updating the DDT ZAP objects in place
+ * every txg, ddt_sync() appends the new state of each changed entry to a
+ * per-checksum log object, and applies the log to the ZAP objects in key
+ * order once it gets large.  A later record for a key supersedes earlier
+ * ones.  dlr_loc says where the ZAP objects currently have the entry and
+ * where it belongs now (DDT_TYPES if nowhere).
+ */
+typedef struct ddt_log_record {
+	ddt_key_t	dlr_key;
+	ddt_phys_t	dlr_phys[DDT_PHYS_TYPES];
+	uint64_t	dlr_loc;
+} ddt_log_record_t;
+
+/*
+ * dlr_loc layout:
+ *
+ *	+-------+-------+-------+-------+-------+-------+-------+-------+
+ *	|   0	|   0	|   0	|   0	| class	| type	| zclass| ztype	|
+ *	+-------+-------+-------+-------+-------+-------+-------+-------+
+ */
+#define	DLR_GET_ZTYPE(dlr)		BF64_GET((dlr)->dlr_loc, 0, 8)
+#define	DLR_SET_ZTYPE(dlr, x)		BF64_SET((dlr)->dlr_loc, 0, 8, x)
+#define	DLR_GET_ZCLASS(dlr)		BF64_GET((dlr)->dlr_loc, 8, 8)
+#define	DLR_SET_ZCLASS(dlr, x)		BF64_SET((dlr)->dlr_loc, 8, 8, x)
+#define	DLR_GET_TYPE(dlr)		BF64_GET((dlr)->dlr_loc, 16, 8)
+#define	DLR_SET_TYPE(dlr, x)		BF64_SET((dlr)->dlr_loc, 16, 8, x)
+#define	DLR_GET_CLASS(dlr)		BF64_GET((dlr)->dlr_loc, 24, 8)
+#define	DLR_SET_CLASS(dlr, x)		BF64_SET((dlr)->dlr_loc, 24, 8, x)
+
+/*
+ * In-core state of a logged entry that hasn't been applied to the ZAP
+ * objects yet.
+ */
+typedef struct ddt_log_entry {
+	ddt_key_t	dle_key;
+	avl_node_t	dle_node;
+	ddt_phys_t	dle_phys[DDT_PHYS_TYPES];
+	uint8_t		dle_ztype;	/* where the ZAP objects have it */
+	uint8_t		dle_zclass;
+	uint8_t		dle_type;	/* where it belongs */
+	uint8_t		dle_class;
+} ddt_log_entry_t;
+
+/*
+ * The in-core ddt is split into shards by checksum bits, each with its
+ * own lock, so that lookups of unrelated blocks don't serialize.
+ */
+#define	DDT_SHARDS	16
+
+typedef struct ddt_shard {
+	kmutex_t	dsh_lock;
+	avl_tree_t	dsh_tree;	/* entries dirtied this txg */
+	avl_tree_t	dsh_cache;	/* clean ddt_cached_t's */
+	list_t		dsh_cache_lru;	/* same, least recently used first */
+	uint64_t	dsh_cache_size;
+	avl_tree_t	dsh_log;	/* unapplied ddt_log_entry_t's */
+} ddt_shard_t;
+
 /*
  * In-core ddt
  */
 struct ddt {
-	kmutex_t	ddt_lock;
-	avl_tree_t	ddt_tree;
+	kmutex_t	ddt_lock;	/* histograms and repair tree */
+	ddt_shard_t	ddt_shard[DDT_SHARDS];
 	avl_tree_t	ddt_repair_tree;
 	enum zio_checksum ddt_checksum;
 	spa_t		*ddt_spa;
 	objset_t	*ddt_os;
 	uint64_t	ddt_stat_object;
+	uint64_t	ddt_log_object;
+	uint64_t	ddt_log_records;	/* on disk */
+	uint64_t	ddt_log_entries;	/* in core, all shards */
 	uint64_t	ddt_object[DDT_TYPES][DDT_CLASSES];
 	ddt_histogram_t	ddt_histogram[DDT_TYPES][DDT_CLASSES];
 	ddt_histogram_t	ddt_histogram_cache[DDT_TYPES][DDT_CLASSES];
@@ -155,6 +236,8 @@ typedef struct ddt_ops {
 	    boolean_t prehash);
 	int (*ddt_op_destroy)(objset_t *os, uint64_t object, dmu_tx_t *tx);
 	int (*ddt_op_lookup)(objset_t *os, uint64_t object, ddt_entry_t *dde);
+	void (*ddt_op_prefetch)(objset_t *os, uint64_t object,
+	    ddt_entry_t *dde);
 	int (*ddt_op_update)(objset_t *os, uint64_t object, ddt_entry_t *dde,
 	    dmu_tx_t *tx);
 	int (*ddt_op_remove)(objset_t *os, uint64_t object, ddt_entry_t *dde,
@@ -170,6 +253,10 @@ extern void ddt_object_name(ddt_t *ddt, enum ddt_type type,
     enum ddt_class class, char *name);
 extern int ddt_object_walk(ddt_t *ddt, enum ddt_type type,
     enum ddt_class class, uint64_t *walk, ddt_entry_t *dde);
+extern int ddt_log_walk(ddt_t *ddt, enum ddt_type type,
+    enum ddt_class class, uint64_t *walk, ddt_entry_t *dde);
+extern uint64_t ddt_entry_count(ddt_t *ddt, enum ddt_type type,
+    enum ddt_class class);
 extern uint64_t ddt_object_count(ddt_t *ddt, enum ddt_type type,
     enum ddt_class class);
 extern int ddt_object_info(ddt_t *ddt, enum ddt_type type,
@@ -213,10 +300,12 @@ extern size_t ddt_compress(void *src, uchar_t *dst, size_t s_len, size_t d_len);
 extern void ddt_decompress(uchar_t *src, void *dst, size_t s_len, size_t d_len);
 
 extern ddt_t *ddt_select(spa_t *spa, const blkptr_t *bp);
-extern void ddt_enter(ddt_t *ddt);
-extern void ddt_exit(ddt_t *ddt);
+extern void ddt_enter(ddt_t *ddt, const ddt_key_t *ddk);
+extern void ddt_exit(ddt_t *ddt, const ddt_key_t *ddk);
 extern ddt_entry_t *ddt_lookup(ddt_t *ddt, const blkptr_t *bp, boolean_t add);
+extern void ddt_prefetch(spa_t *spa, const blkptr_t *bp);
 extern void ddt_remove(ddt_t *ddt, ddt_entry_t *dde);
+extern uint64_t ddt_dirty_count(ddt_t *ddt);
 
 extern boolean_t ddt_class_contains(spa_t *spa, enum ddt_class max_class,
     const blkptr_t *bp);
@@ -226,9 +315,12 @@ extern void ddt_repair_done(ddt_t *ddt, ddt_entry_t *dde);
 
 extern int ddt_entry_compare(const void *x1, const void *x2);
 
+extern void ddt_io_stat_init(void);
+extern void ddt_io_stat_fini(void);
 extern void ddt_create(spa_t *spa);
 extern int ddt_load(spa_t *spa);
 extern void ddt_unload(spa_t *spa);
+extern void ddt_log_flush_all(spa_t *spa, dmu_tx_t *tx);
 extern void ddt_sync(spa_t *spa, uint64_t txg);
 extern int ddt_walk(spa_t *spa, ddt_bookmark_t *ddb, ddt_entry_t *dde);
 extern int ddt_object_update(ddt_t *ddt, enum ddt_type type,
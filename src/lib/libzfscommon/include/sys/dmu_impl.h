@@ -43,8 +43,7 @@ extern "C" {
  * bplist is self-contained
  * refcount is self-contained
  * txg is self-contained (hopefully!)
- * zst_lock
- * zf_rwlock
+ * zf_lock
  *
  * XXX try to improve evicting path?
  *
@@ -65,7 +64,7 @@ extern "C" {
  * os_obj_lock
  *   must be held before:
  *   	everything except dp_config_rwlock
- *   protects os_obj_next
+ *   protects os_obj_next_chunk
  *   held from:
  *   	dmu_object_alloc: dn_dbufs_mtx, db_mtx, hash_mutexes, dn_struct_rwlock
  *
@@ -83,7 +82,7 @@ extern "C" {
  *   	dmu_object_info_from_dnode: dn_dirty_mtx (dn_datablksz)
  *   	dmu_tx_count_free:
  *   	dbuf_read_impl: db_mtx, dmu_zfetch()
- *   	dmu_zfetch: zf_rwlock/r, zst_lock, dbuf_prefetch()
+ *   	dmu_zfetch: zf_lock, dbuf_prefetch()
  *   	dbuf_new_size: db_mtx
  *   	dbuf_dirty: db_mtx
  *	dbuf_findbp: (callers, phys? - the real need)
@@ -110,6 +109,14 @@ extern "C" {
  *    	dbuf_create: hash_mutexes, db_mtx (dn_dbufs)
  *    	dnode_set_blksz: (dn_dbufs)
  *
+ * hash_resize_lock (global)
+ *   must be held before:
+ *   	hash_mutexes (one, or all of them in order)
+ *   protects the old table of dbuf_hash_table (global) while it grows
+ *   held from:
+ *   	dbuf_hash_insert: hash_mutexes, callees:
+ *   		dbuf_hash_grow: hash_mutexes
+ *
  * hash_mutexes (global)
  *   must be held before:
  *   	db_mtx
@@ -80,6 +80,7 @@ struct objset {
 	uint8_t os_logbias;
 	uint8_t os_primary_cache;
 	uint8_t os_secondary_cache;
+	uint64_t os_special_smallblk;
 
 	/* no lock needed: */
 	struct dmu_tx *os_synctx; /* XXX sketchy */
@@ -90,7 +91,10 @@ struct objset {
 
 	/* Protected by os_obj_lock */
 	kmutex_t os_obj_lock;
-	uint64_t os_obj_next;
+	uint64_t os_obj_next_chunk;
+
+	/* Updated atomically, see dmu_object_alloc() */
+	uint64_t *os_obj_next_percpu;
 
 	/* Protected by os_lock */
 	kmutex_t os_lock;
@@ -45,6 +45,7 @@ struct dsl_dir;
 #define	TX_NONE		0x0
 #define	TX_WAIT		0x1
 #define	TX_SPECIAL	0x2
+#define	TX_NOTHROTTLE	0x4	/* not delayed by the write throttle */
 
 struct dmu_tx {
 	/*
@@ -61,6 +62,9 @@ struct dmu_tx {
 	txg_handle_t tx_txgh;
 	void *tx_tempreserve_cookie;
 	struct dmu_tx_hold *tx_needassign_txh;
+	hrtime_t tx_start;		/* when the tx was created */
+	boolean_t tx_wait_dirty;	/* dmu_tx_wait() for dirty data */
+	boolean_t tx_dirty_delayed;	/* already throttled once */
 	list_t tx_callbacks; /* list of dmu_tx_callback_t on this dmu_tx */
 	uint8_t tx_anyobj;
 	int tx_err;
@@ -131,6 +135,8 @@ extern dmu_tx_t *dmu_tx_create_assigned(struct dsl_pool *dp, uint64_t txg);
 /*
  * These routines are only called by the DMU.
  */
+void dmu_tx_init(void);
+void dmu_tx_fini(void);
 dmu_tx_t *dmu_tx_create_dd(dsl_dir_t *dd);
 int dmu_tx_is_syncing(dmu_tx_t *tx);
 int dmu_tx_private_ok(dmu_tx_t *tx);
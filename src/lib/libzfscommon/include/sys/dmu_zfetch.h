@@ -43,24 +43,44 @@ typedef enum zfetch_dirn {
 	ZFETCH_BACKWARD	= -1		/* prefetch decreasing block numbers */
 } zfetch_dirn_t;
 
+/*
+ * A stream follows one reader through a dnode.  Contiguous streams see each
+ * read start where the previous one ended (or, going backwards, end where
+ * it started); strided streams see reads of the same size a fixed number of
+ * blocks apart.  Streams are indexed by the block the next read is expected
+ * to start at, or for backward contiguous streams, to end at.
+ */
 typedef struct zstream {
-	uint64_t	zst_offset;	/* offset of starting block in range */
-	uint64_t	zst_len;	/* length of range, in blocks */
-	zfetch_dirn_t	zst_direction;	/* direction of prefetch */
-	uint64_t	zst_stride;	/* length of stride, in blocks */
-	uint64_t	zst_ph_offset;	/* prefetch offset, in blocks */
-	uint64_t	zst_cap;	/* prefetch limit (cap), in blocks */
-	kmutex_t	zst_lock;	/* protects stream */
-	clock_t		zst_last;	/* lbolt of last prefetch */
-	avl_node_t	zst_node;	/* embed avl node here */
+	avl_node_t	zs_node;	/* in zf_streams, by zs_key */
+	list_node_t	zs_lru;		/* in zf_lru, least recently used 1st */
+	uint64_t	zs_key;		/* block the next read starts/ends at */
+	boolean_t	zs_contig;	/* reads are back to back */
+	zfetch_dirn_t	zs_dir;		/* direction of prefetch */
+	int64_t		zs_stride;	/* blocks between read starts */
+	uint64_t	zs_nblks;	/* blocks per read */
+	int64_t		zs_next;	/* start of the next expected read */
+	int64_t		zs_pf;		/* start of the next read to prefetch */
+	uint64_t	zs_dist;	/* prefetch distance, in reads */
+	hrtime_t	zs_atime;	/* time of the last read */
+	hrtime_t	zs_gap;		/* average time between reads */
 } zstream_t;
 
+#define	ZFETCH_HISTORY	8		/* unmatched reads kept per zfetch */
+
+typedef struct zfetch_hist {
+	uint64_t	zh_blkid;	/* first block read */
+	uint64_t	zh_nblks;	/* blocks read, 0 if unused */
+} zfetch_hist_t;
+
 typedef struct zfetch {
-	krwlock_t	zf_rwlock;	/* protects zfetch structure */
-	list_t		zf_stream;	/* AVL tree of zstream_t's */
+	kmutex_t	zf_lock;	/* protects zfetch structure */
+	avl_tree_t	zf_streams;	/* AVL tree of zstream_t's */
+	list_t		zf_lru;		/* zstream_t's by last use */
 	struct dnode	*zf_dnode;	/* dnode that owns this zfetch */
 	uint32_t	zf_stream_cnt;	/* # of active streams */
 	uint64_t	zf_alloc_fail;	/* # of failed attempts to alloc strm */
+	uint32_t	zf_hist_next;	/* next zf_hist slot to fill */
+	zfetch_hist_t	zf_hist[ZFETCH_HISTORY]; /* recent unmatched reads */
 } zfetch_t;
 
 void		zfetch_init(void);
@@ -47,6 +47,16 @@ struct dmu_tx;
 
 struct dsl_scan;
 
+extern int zfs_no_write_throttle;
+extern uint64_t zfs_dirty_data_max;
+extern uint64_t zfs_dirty_data_max_max;
+extern int zfs_dirty_data_max_percent;
+extern int zfs_delay_min_dirty_percent;
+extern uint64_t zfs_delay_scale;
+extern uint64_t zfs_delay_max_ns;
+extern int zfs_dirty_data_sync_percent;
+extern int zfs_txg_synctime_ms;
+
 /* These macros are for indexing into the zfs_all_blkstats_t. */
 #define	DMU_OT_DEFERRED	DMU_OT_NONE
 #define	DMU_OT_TOTAL	DMU_OT_NUMTYPES
@@ -76,21 +86,23 @@ typedef struct dsl_pool {
 	struct dsl_dataset *dp_origin_snap;
 	uint64_t dp_root_dir_obj;
 	struct taskq *dp_vnrele_taskq;
+	struct taskq *dp_sync_taskq;
 
 	/* No lock needed - sync context only */
 	blkptr_t dp_meta_rootbp;
 	list_t dp_synced_datasets;
 	hrtime_t dp_read_overhead;
-	uint64_t dp_throughput; /* bytes per millisec */
-	uint64_t dp_write_limit;
 	uint64_t dp_tmp_userrefs_obj;
 
 	struct dsl_scan *dp_scan;
 
 	/* Uses dp_lock */
 	kmutex_t dp_lock;
-	uint64_t dp_space_towrite[TXG_SIZE];
-	uint64_t dp_tempreserved[TXG_SIZE];
+	kcondvar_t dp_spaceavail_cv;
+	uint64_t dp_space_towrite[TXG_SIZE];	/* dirty bytes per txg */
+	uint64_t dp_dirty_total;	/* sum of dp_space_towrite[] */
+	hrtime_t dp_last_wakeup;	/* see dmu_tx_delay() */
+	uint64_t dp_sync_bw;		/* bytes/s synced, recent txgs */
 
 	/* Has its own locking */
 	tx_state_t dp_tx;
@@ -114,13 +126,17 @@ void dsl_pool_close(dsl_pool_t *dp);
 dsl_pool_t *dsl_pool_create(spa_t *spa, nvlist_t *zplprops, uint64_t txg);
 void dsl_pool_sync(dsl_pool_t *dp, uint64_t txg);
 void dsl_pool_sync_done(dsl_pool_t *dp, uint64_t txg);
+void dsl_pool_sync_stat_dnodes(uint64_t ndnodes, uint64_t ntasks);
+void dsl_pool_stat_init(void);
+void dsl_pool_stat_fini(void);
 int dsl_pool_sync_context(dsl_pool_t *dp);
 uint64_t dsl_pool_adjustedsize(dsl_pool_t *dp, boolean_t netfree);
 uint64_t dsl_pool_adjustedfree(dsl_pool_t *dp, boolean_t netfree);
-int dsl_pool_tempreserve_space(dsl_pool_t *dp, uint64_t space, dmu_tx_t *tx);
-void dsl_pool_tempreserve_clear(dsl_pool_t *dp, int64_t space, dmu_tx_t *tx);
-void dsl_pool_memory_pressure(dsl_pool_t *dp);
 void dsl_pool_willuse_space(dsl_pool_t *dp, int64_t space, dmu_tx_t *tx);
+boolean_t dsl_pool_need_dirty_delay(dsl_pool_t *dp);
+uint64_t dsl_pool_dirty_sync_target(dsl_pool_t *dp);
+void dsl_pool_sync_rate_update(dsl_pool_t *dp, uint64_t dirty,
+    hrtime_t sync_time);
 void dsl_free(dsl_pool_t *dp, uint64_t txg, const blkptr_t *bpp);
 int dsl_read(zio_t *pio, spa_t *spa, const blkptr_t *bpp, arc_buf_t *pbuf,
     arc_done_func_t *done, void *private, int priority, int zio_flags,
@@ -29,6 +29,7 @@
 #include <sys/zio.h>
 #include <sys/ddt.h>
 #include <sys/bplist.h>
+#include <sys/kstat.h>
 
 #ifdef	__cplusplus
 extern "C" {
@@ -79,6 +80,22 @@ typedef struct dsl_scan {
 	uint64_t scn_sync_start_time;
 	zio_t *scn_prefetch_zio_root;
 
+	/* sorted scrub/resilver I/O, drained before each txg's state sync */
+	boolean_t scn_sorting;
+	uint64_t scn_queued_mem;
+	uint64_t scn_queued_bytes;
+
+	/* latency-aware pacing, see dsl_scan_pace() */
+	hrtime_t scn_pace_time;
+	uint64_t scn_pace_inflight;
+	boolean_t scn_pace_idle;
+	boolean_t scn_pace_over;
+	uint64_t scn_pace_idles;
+	uint64_t scn_pace_backoffs;
+	uint64_t scn_pace_increases;
+	uint64_t scn_pace_delays;
+	kstat_t *scn_ksp;
+
 	/* for debugging / information */
 	uint64_t scn_visited_this_txg;
 
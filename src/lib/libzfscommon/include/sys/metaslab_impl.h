@@ -31,6 +31,8 @@
 #include <sys/vdev.h>
 #include <sys/txg.h>
 #include <sys/avl.h>
+#include <sys/list.h>
+#include <sys/kstat.h>
 
 #ifdef	__cplusplus
 extern "C" {
@@ -45,6 +47,11 @@ struct metaslab_class {
 	uint64_t		mc_deferred;	/* total deferred frees */
 	uint64_t		mc_space;	/* total space (alloc + free) */
 	uint64_t		mc_dspace;	/* total deflated space */
+	kmutex_t		mc_lock;	/* protects mc_loaded_* */
+	list_t			mc_loaded_list;	/* loaded, most recent first */
+	uint64_t		mc_loaded_size;	/* in-core bytes of those */
+	uint64_t		mc_groups;	/* active groups in rotor */
+	uint64_t		mc_alloc_queued; /* sum of mg_alloc_queued */
 };
 
 struct metaslab_group {
@@ -58,6 +65,17 @@ struct metaslab_group {
 	vdev_t			*mg_vd;
 	metaslab_group_t	*mg_prev;
 	metaslab_group_t	*mg_next;
+	taskq_t			*mg_taskq;	/* background preloads */
+
+	/*
+	 * Allocation queue: blocks allocated here whose writes have not
+	 * completed yet.  Updated atomically; see metaslab_alloc_queue_add().
+	 */
+	uint64_t		mg_alloc_queue_depth;
+	uint64_t		mg_alloc_queued;	/* bytes of those */
+	uint64_t		mg_allocs;		/* total, for kstat */
+	uint64_t		mg_throttled;		/* times skipped */
+	kstat_t			*mg_ksp;	/* alloc_queue.<pool>.<id> */
 };
 
 /*
@@ -66,6 +84,10 @@ struct metaslab_group {
  * we append the allocs and frees from that txg to the space map object.
  * When the txg is done syncing, metaslab_sync_done() updates ms_smo
  * to ms_smo_syncing.  Everything in ms_smo is always safe to allocate.
+ *
+ * Once loaded, ms_map stays in core after the metaslab is passivated, on
+ * its class's mc_loaded_list, until the maps there outgrow
+ * metaslab_loaded_max and the least recently used ones are unloaded.
  */
 struct metaslab {
 	kmutex_t	ms_lock;	/* metaslab lock		*/
@@ -80,6 +102,8 @@ struct metaslab {
 	metaslab_group_t *ms_group;	/* metaslab group		*/
 	avl_node_t	ms_group_node;	/* node in metaslab group tree	*/
 	txg_node_t	ms_txg_node;	/* per-txg dirty metaslab links	*/
+	list_node_t	ms_loaded_node;	/* node in class's loaded list	*/
+	uint64_t	ms_loaded_size;	/* map bytes counted in class	*/
 };
 
 #ifdef	__cplusplus
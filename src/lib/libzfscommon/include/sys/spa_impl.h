@@ -107,6 +107,7 @@ struct spa {
 	dsl_pool_t	*spa_dsl_pool;
 	metaslab_class_t *spa_normal_class;	/* normal data class */
 	metaslab_class_t *spa_log_class;	/* intent log data class */
+	metaslab_class_t *spa_special_class;	/* metadata/small blocks */
 	uint64_t	spa_first_txg;		/* first txg after spa_open() */
 	uint64_t	spa_final_txg;		/* txg of export/destroy */
 	uint64_t	spa_freeze_txg;		/* freeze pool at this txg */
@@ -140,6 +141,7 @@ struct spa {
 	uint8_t		spa_scrub_reopen;	/* scrub doing vdev_reopen */
 	uint64_t	spa_scan_pass_start;	/* start time per pass/reboot */
 	uint64_t	spa_scan_pass_exam;	/* examined bytes per pass */
+	uint64_t	spa_scan_pass_issued;	/* issued bytes per pass */
 	kmutex_t	spa_async_lock;		/* protect async state */
 	kthread_t	*spa_async_thread;	/* thread doing async task */
 	int		spa_async_suspended;	/* async tasks suspended */
@@ -186,12 +188,19 @@ struct spa {
 	ddt_t		*spa_ddt[ZIO_CHECKSUM_FUNCTIONS]; /* in-core DDTs */
 	uint64_t	spa_ddt_stat_object;	/* DDT statistics */
 	uint64_t	spa_dedup_ditto;	/* dedup ditto threshold */
+	uint64_t	spa_scan_latency;	/* scan pacing target (ms) */
+	hrtime_t	spa_fg_io_last;		/* last foreground I/O done */
+	uint64_t	spa_fg_io_latency;	/* foreground I/O latency (ns) */
 	uint64_t	spa_dedup_checksum;	/* default dedup checksum */
 	uint64_t	spa_dspace;		/* dspace in normal class */
 	kmutex_t	spa_vdev_top_lock;	/* dueling offline/remove */
 	kthread_t	*spa_trim_thread;	/* thread sending TRIM I/Os */
 	kmutex_t	spa_trim_lock;		/* protects spa_trim_cv */
 	kcondvar_t	spa_trim_cv;		/* used to notify TRIM thread */
+	kthread_t	*spa_warmstart_thread;	/* ARC hot list thread */
+	kmutex_t	spa_warmstart_lock;	/* protects warmstart state */
+	kcondvar_t	spa_warmstart_cv;	/* warmstart thread wakeup */
+	boolean_t	spa_warmstart_exit;	/* stop warmstart thread */
 	boolean_t	spa_autoreplace;	/* autoreplace set in open */
 	int		spa_vdev_locks;		/* locks grabbed */
 	uint64_t	spa_creation_version;	/* version at pool creation */
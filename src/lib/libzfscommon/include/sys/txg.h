@@ -44,6 +44,7 @@ extern "C" {
 
 #define	TXG_WAIT		1ULL
 #define	TXG_NOWAIT		2ULL
+#define	TXG_WAITED		3ULL	/* TXG_NOWAIT after a dmu_tx_wait() */
 
 typedef struct tx_cpu tx_cpu_t;
 
@@ -77,12 +78,11 @@ extern void txg_register_callbacks(txg_handle_t *txghp, list_t *tx_callbacks);
 extern void txg_slash2_wait(struct dsl_pool *dp);
 
 /*
- * Delay the caller by the specified number of ticks or until
- * the txg closes (whichever comes first).  This is intended
- * to be used to throttle writers when the system nears its
- * capacity.
+ * Close the open txg without waiting for it, as soon as the previous
+ * one has been handed to the sync thread.  Used by the write throttle
+ * when dirty data builds up.
  */
-extern void txg_delay(struct dsl_pool *dp, uint64_t txg, int ticks);
+extern void txg_kick(struct dsl_pool *dp);
 
 /*
  * Wait until the given transaction group has finished syncing.
@@ -94,6 +94,27 @@ extern void txg_wait_synced(struct dsl_pool *dp, uint64_t txg);
 
 extern uint64_t txg_return_synced(struct dsl_pool *dp);
 
+/*
+ * Call func(arg, 0) once the given transaction group is on disk, without
+ * waiting for it: the callbacks of a txg run in one batch on the pool's
+ * txg_synced_cb taskq, in the order they were registered, after those of
+ * earlier txgs.  If txg==0, use the open txg.  A txg that is already
+ * synced calls back right away (still on the taskq); one that has not
+ * been opened yet fails with EINVAL.  Like txg_wait_synced() this asks
+ * for the txg to be synced as soon as possible.  Callbacks still pending
+ * when the pool is closed are called with ECANCELED.
+ *
+ * txg_notify_synced() does the same by adding 1 to an eventfd(2) counter
+ * (any fd taking 8-byte writes will do).  Registering the fd that was
+ * registered last for the same txg is a no-op, so a journal waiting on
+ * one eventfd costs one write per txg however many records it has.
+ */
+typedef void txg_synced_func_t(void *arg, int error);
+
+extern int txg_register_synced(struct dsl_pool *dp, uint64_t txg,
+    txg_synced_func_t *func, void *arg);
+extern int txg_notify_synced(struct dsl_pool *dp, uint64_t txg, int fd);
+
 /*
  * Wait until the given transaction group, or one after it, is
  * the open transaction group.  Try to make this happen as soon
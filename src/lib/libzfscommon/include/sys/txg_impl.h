@@ -28,6 +28,7 @@
 
 #include <sys/spa.h>
 #include <sys/txg.h>
+#include <sys/kstat.h>
 
 #ifdef	__cplusplus
 extern "C" {
@@ -41,6 +42,20 @@ struct tx_cpu {
 	char		tc_pad[16];
 };
 
+/*
+ * What happened to one txg, kept in tx_history[] and exported through the
+ * txgs.<pool> kstat.  Times are in nanoseconds.
+ */
+typedef struct txg_history {
+	uint64_t	txh_txg;
+	uint64_t	txh_dirty;	/* dirty bytes when the sync started */
+	hrtime_t	txh_open_time;	/* time spent open */
+	hrtime_t	txh_quiesce_time; /* time spent quiescing */
+	hrtime_t	txh_sync_time;	/* time spent in spa_sync() */
+} txg_history_t;
+
+#define	TXG_HISTORY_SIZE	32	/* txgs kept in tx_history[] */
+
 typedef struct tx_state {
 	tx_cpu_t	*tx_cpu;	/* protects right to enter txg	*/
 	kmutex_t	tx_sync_lock;	/* protects tx_state_t */
@@ -71,6 +86,15 @@ typedef struct tx_state {
 	kthread_t	*tx_quiesce_thread;
 
 	taskq_t		*tx_commit_cb_taskq; /* commit callback taskq */
+
+	/* Uses tx_sync_lock, see txg_register_synced() */
+	list_t		tx_synced_cbs[TXG_SIZE]; /* dmu_tx_callback_t by txg */
+	taskq_t		*tx_synced_cb_taskq;
+
+	/* Uses tx_sync_lock */
+	hrtime_t	tx_open_time;	/* when tx_open_txg was opened */
+	txg_history_t	tx_history[TXG_HISTORY_SIZE]; /* indexed by txg */
+	kstat_t		*tx_ksp;	/* txgs.<pool> */
 } tx_state_t;
 
 #ifdef	__cplusplus
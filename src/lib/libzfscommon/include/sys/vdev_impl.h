@@ -96,9 +96,11 @@ struct vdev_cache {
 
 struct vdev_queue {
 	avl_tree_t	vq_deadline_tree;
+	avl_tree_t	vq_async_deadline_tree;	/* async writes only */
 	avl_tree_t	vq_read_tree;
 	avl_tree_t	vq_write_tree;
 	avl_tree_t	vq_pending_tree;
+	uint64_t	vq_pending_writes;
 	kmutex_t	vq_lock;
 };
 
@@ -145,6 +147,7 @@ struct vdev {
 	txg_list_t	vdev_ms_list;	/* per-txg dirty metaslab lists	*/
 	txg_list_t	vdev_dtl_list;	/* per-txg dirty DTL lists	*/
 	txg_node_t	vdev_txg_node;	/* per-txg dirty vdev linkage	*/
+	avl_tree_t	*vdev_scan_queue; /* offset-sorted scan I/O	*/
 	boolean_t	vdev_remove_wanted; /* async remove wanted?	*/
 	boolean_t	vdev_probe_wanted; /* async probe wanted?	*/
 	uint64_t	vdev_removing;	/* device is being removed?	*/
@@ -152,6 +155,7 @@ struct vdev {
 	list_node_t	vdev_state_dirty_node; /* state dirty list	*/
 	uint64_t	vdev_deflate_ratio; /* deflation ratio (x512)	*/
 	uint64_t	vdev_islog;	/* is an intent log device	*/
+	uint64_t	vdev_isspecial;	/* is a special class device	*/
 	uint64_t	vdev_ishole;	/* is a hole in the namespace 	*/
 
 	/*
@@ -0,0 +1,112 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright (c) 2005, 2010, Oracle and/or its affiliates. All rights reserved.
+ */
+
+#ifndef _SYS_VDEV_RAIDZ_H
+#define	_SYS_VDEV_RAIDZ_H
+
+#include <sys/types.h>
+#include <sys/zio.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+typedef struct raidz_col {
+	uint64_t rc_devidx;		/* child device index for I/O */
+	uint64_t rc_offset;		/* device offset */
+	uint64_t rc_size;		/* I/O size */
+	void *rc_data;			/* I/O data */
+	void *rc_gdata;			/* used to store the "good" version */
+	int rc_error;			/* I/O error for this device */
+	uint8_t rc_tried;		/* Did we attempt this I/O column? */
+	uint8_t rc_skipped;		/* Did we skip this I/O column? */
+} raidz_col_t;
+
+typedef struct raidz_map {
+	uint64_t rm_cols;		/* Regular column count */
+	uint64_t rm_scols;		/* Count including skipped columns */
+	uint64_t rm_bigcols;		/* Number of oversized columns */
+	uint64_t rm_asize;		/* Actual total I/O size */
+	uint64_t rm_missingdata;	/* Count of missing data devices */
+	uint64_t rm_missingparity;	/* Count of missing parity devices */
+	uint64_t rm_firstdatacol;	/* First data column/parity count */
+	uint64_t rm_nskip;		/* Skipped sectors for padding */
+	uint64_t rm_skipstart;	/* Column index of padding start */
+	void *rm_datacopy;		/* rm_asize-buffer of copied data */
+	uintptr_t rm_reports;		/* # of referencing checksum reports */
+	uint8_t	rm_freed;		/* map no longer has referencing ZIO */
+	uint8_t	rm_ecksuminjected;	/* checksum error was injected */
+	raidz_col_t rm_col[1];		/* Flexible array of I/O columns */
+} raidz_map_t;
+
+#define	VDEV_RAIDZ_P		0
+#define	VDEV_RAIDZ_Q		1
+#define	VDEV_RAIDZ_R		2
+
+/*
+ * Galois field kernels used for parity generation and reconstruction.
+ * Buffer sizes are in bytes and are always a multiple of 8; the vector
+ * implementations fall back to the scalar code for any unaligned tail.
+ * Addition in GF(2^8) is XOR, so "add" below means XOR into the target.
+ */
+typedef struct vdev_raidz_math_ops {
+	const char *rm_name;
+	boolean_t (*rm_is_supported)(void);
+	/* dst += src */
+	void (*rm_add)(void *dst, const void *src, size_t size);
+	/* q = 2 * q + src */
+	void (*rm_q_add)(void *q, const void *src, size_t size);
+	/* p += src, q = 2 * q + src */
+	void (*rm_pq_add)(void *p, void *q, const void *src, size_t size);
+	/* p += src, q = 2 * q + src, r = 4 * r + src */
+	void (*rm_pqr_add)(void *p, void *q, void *r, const void *src,
+	    size_t size);
+	/* dst = c * src (dst may equal src) */
+	void (*rm_mul)(void *dst, const void *src, uint8_t c, size_t size);
+	/* dst += c * src */
+	void (*rm_mul_add)(void *dst, const void *src, uint8_t c, size_t size);
+} vdev_raidz_math_ops_t;
+
+/*
+ * Name of the implementation to select at vdev_raidz_math_init() time,
+ * or "fastest" (the default) to pick the widest one the CPU supports.
+ */
+extern char *zfs_vdev_raidz_impl;
+
+extern const vdev_raidz_math_ops_t *vdev_raidz_math;
+extern const vdev_raidz_math_ops_t *vdev_raidz_math_impls[];
+
+extern int vdev_raidz_math_set(const char *name);
+
+extern raidz_map_t *vdev_raidz_map_alloc(zio_t *zio, uint64_t unit_shift,
+    uint64_t dcols, uint64_t nparity);
+extern void vdev_raidz_map_free(raidz_map_t *rm);
+extern void vdev_raidz_generate_parity(raidz_map_t *rm);
+extern int vdev_raidz_reconstruct(raidz_map_t *rm, int *t, int nt);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _SYS_VDEV_RAIDZ_H */
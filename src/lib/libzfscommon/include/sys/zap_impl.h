@@ -62,11 +62,17 @@ typedef struct mzap_phys {
 	/* actually variable size depending on block size */
 } mzap_phys_t;
 
+/*
+ * The in-core index of a microzap is a flat array with one mzap_ent_t per
+ * used chunk, sorted by (hash, cd).  zap_buckets[b] is the index of the
+ * first entry whose hash starts with the zap_bucket_bits-bit prefix b, so
+ * a lookup only scans the few adjacent entries of a single bucket.
+ */
 typedef struct mzap_ent {
-	avl_node_t mze_node;
-	int mze_chunkid;
 	uint64_t mze_hash;
 	uint32_t mze_cd; /* copy from mze_phys->mze_cd */
+	uint16_t mze_chunkid;
+	uint16_t mze_pad;
 } mzap_ent_t;
 
 #define	MZE_PHYS(zap, mze) \
@@ -163,7 +169,10 @@ typedef struct zap {
 			int16_t zap_num_entries;
 			int16_t zap_num_chunks;
 			int16_t zap_alloc_next;
-			avl_tree_t zap_avl;
+			int16_t zap_ents_max;	/* zap_ents[] capacity */
+			int zap_bucket_bits;
+			mzap_ent_t *zap_ents;
+			uint16_t *zap_buckets;	/* 2^zap_bucket_bits + 1 */
 		} zap_micro;
 	} zap_u;
 } zap_t;
@@ -201,6 +210,7 @@ int fzap_count(zap_t *zap, uint64_t *count);
 int fzap_lookup(zap_name_t *zn,
     uint64_t integer_size, uint64_t num_integers, void *buf,
     char *realname, int rn_len, boolean_t *normalization_conflictp);
+void fzap_prefetch(zap_name_t *zn);
 int fzap_count_write(zap_name_t *zn, int add, uint64_t *towrite,
     uint64_t *tooverwrite);
 int fzap_add(zap_name_t *zn, uint64_t integer_size, uint64_t num_integers,
@@ -151,12 +151,28 @@ typedef union zap_leaf_chunk {
 	} l_free;
 } zap_leaf_chunk_t;
 
+/*
+ * In-core index of a leaf's entries, sorted by (hash, cd).  Lookups
+ * search these packed hashes before touching any chunk, and a cursor
+ * finds the next entry with a binary search instead of walking every
+ * hash chain after it.
+ */
+typedef struct zap_leaf_ent {
+	uint64_t zle_hash;
+	uint32_t zle_cd;
+	uint16_t zle_chunk;		/* the ZAP_CHUNK_ENTRY */
+	uint16_t zle_pad;
+} zap_leaf_ent_t;
+
 typedef struct zap_leaf {
 	krwlock_t l_rwlock;
 	uint64_t l_blkid;		/* 1<<ZAP_BLOCK_SHIFT byte block off */
 	int l_bs;			/* block size shift */
 	dmu_buf_t *l_dbuf;
 	zap_leaf_phys_t *l_phys;
+	zap_leaf_ent_t *l_ents;		/* index, protected by l_rwlock */
+	uint16_t l_nents;
+	uint16_t l_ents_max;
 } zap_leaf_t;
 
 
@@ -233,6 +249,8 @@ extern boolean_t zap_entry_normalization_conflict(zap_entry_handle_t *zeh,
  */
 
 extern void zap_leaf_init(zap_leaf_t *l, boolean_t sort);
+extern void zap_leaf_index_build(zap_leaf_t *l);
+extern void zap_leaf_index_free(zap_leaf_t *l);
 extern void zap_leaf_byteswap(zap_leaf_phys_t *buf, int len);
 extern void zap_leaf_split(zap_leaf_t *l, zap_leaf_t *nl, boolean_t sort);
 extern void zap_leaf_stats(struct zap *zap, zap_leaf_t *l,
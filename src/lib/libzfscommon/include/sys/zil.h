@@ -366,7 +366,7 @@ typedef enum {
 } itx_wr_state_t;
 
 typedef struct itx {
-	list_node_t	itx_node;	/* linkage on zl_itx_list */
+	list_node_t	itx_node;	/* linkage on an in-memory itx list */
 	void		*itx_private;	/* type-specific opaque data */
 	itx_wr_state_t	itx_wr_state;	/* write state */
 	uint8_t		itx_sync;	/* synchronous transaction */
@@ -45,18 +45,33 @@ typedef struct lwb {
 	zio_t		*lwb_zio;	/* zio for this buffer */
 	dmu_tx_t	*lwb_tx;	/* tx for log block allocation */
 	uint64_t	lwb_max_txg;	/* highest txg in this lwb */
+	uint64_t	lwb_issue_seq;	/* issue order, 0 while still open */
+	uint64_t	lwb_lr_seq;	/* highest lr seq in this lwb */
+	int		lwb_error;	/* write error, once written */
 	list_node_t	lwb_node;	/* zilog->zl_lwb_list linkage */
 } lwb_t;
 
 /*
- * Vdev flushing: during a zil_commit(), we build up an AVL tree of the vdevs
- * we've touched so we know which ones need a write cache flush at the end.
+ * Vdev flushing: as log blocks (and the blocks dmu_sync() wrote for them)
+ * are written, we build up an AVL tree of the vdevs they went to so
+ * zil_commit() knows which ones need a write cache flush at the end.
  */
 typedef struct zil_vdev_node {
 	uint64_t	zv_vdev;	/* vdev to be flushed */
 	avl_node_t	zv_node;	/* AVL tree linkage */
 } zil_vdev_node_t;
 
+/*
+ * Out-of-order itxs (see TX_OOO()) that aren't O_[D]SYNC are kept on a
+ * list per object, so that zil_commit() for one file only has to look at
+ * that file's records and the namespace records on zl_itx_list.
+ */
+typedef struct itx_obj {
+	uint64_t	io_foid;	/* object the itxs are about */
+	list_t		io_list;	/* itxs, in lrc_seq order */
+	avl_node_t	io_node;	/* zl_itx_obj_tree linkage */
+} itx_obj_t;
+
 #define	ZIL_PREV_BLKS 16
 
 /*
@@ -69,7 +84,6 @@ struct zilog {
 	const zil_header_t *zl_header;	/* log header buffer */
 	objset_t	*zl_os;		/* object set we're logging */
 	zil_get_data_t	*zl_get_data;	/* callback to get object content */
-	zio_t		*zl_root_zio;	/* log writer root zio */
 	uint64_t	zl_itx_seq;	/* next in-core itx sequence number */
 	uint64_t	zl_lr_seq;	/* on-disk log record sequence number */
 	uint64_t	zl_commit_seq;	/* committed upto this number */
@@ -79,12 +93,14 @@ struct zilog {
 	uint64_t	zl_replaying_seq; /* current replay seq number */
 	uint32_t	zl_suspend;	/* log suspend count */
 	kcondvar_t	zl_cv_writer;	/* log writer thread completion */
+	kcondvar_t	zl_cv_lwb;	/* log block write completion */
 	kcondvar_t	zl_cv_suspend;	/* log suspend completion */
 	uint8_t		zl_suspending;	/* log is currently suspending */
 	uint8_t		zl_keep_first;	/* keep first log block in destroy */
 	uint8_t		zl_replay;	/* replaying records while set */
 	uint8_t		zl_stop_sync;	/* for debugging */
 	uint8_t		zl_writer;	/* boolean: write setup in progress */
+	uint8_t		zl_flushing;	/* boolean: vdev flush in progress */
 	uint8_t		zl_logbias;	/* latency or throughput */
 	int		zl_parse_error;	/* last zil_parse() error */
 	uint64_t	zl_parse_blk_seq; /* highest blk seq on last parse */
@@ -92,10 +108,15 @@ struct zilog {
 	uint64_t	zl_parse_blk_count; /* number of blocks parsed */
 	uint64_t	zl_parse_lr_count; /* number of log records parsed */
 	list_t		zl_itx_list;	/* in-memory itx list */
-	uint64_t	zl_itx_list_sz;	/* total size of records on list */
+	avl_tree_t	zl_itx_obj_tree; /* per-object itx lists, itx_obj_t */
+	uint64_t	zl_itx_list_sz;	/* total size of records on lists */
 	uint64_t	zl_cur_used;	/* current commit log size used */
 	uint64_t	zl_prev_used;	/* previous commit log size used */
 	list_t		zl_lwb_list;	/* in-flight log write list */
+	uint64_t	zl_lwb_issued_seq; /* last lwb_issue_seq handed out */
+	uint64_t	zl_lwb_done_seq; /* lwbs written, in issue order */
+	uint64_t	zl_lwb_flushed_seq; /* and on stable storage */
+	uint64_t	zl_lwb_failed_txg; /* open txg when an lwb failed */
 	kmutex_t	zl_vdev_lock;	/* protects zl_vdev_tree */
 	avl_tree_t	zl_vdev_tree;	/* vdevs to flush in zil_commit() */
 	taskq_t		*zl_clean_taskq; /* runs lwb and itx clean tasks */
@@ -103,7 +124,7 @@ struct zilog {
 	clock_t		zl_replay_time;	/* lbolt of when replay started */
 	uint64_t	zl_replay_blks;	/* number of log blocks replayed */
 	zil_header_t	zl_old_header;	/* debugging aid */
-	uint_t		zl_prev_blks[ZIL_PREV_BLKS]; /* size - sector rounded */
+	uint_t		zl_prev_blks[ZIL_PREV_BLKS]; /* recent commit sizes */
 	uint_t		zl_prev_rotor;	/* rotor for zl_prev[] */
 };
 
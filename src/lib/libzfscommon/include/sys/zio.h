@@ -190,7 +190,8 @@ enum zio_flag {
 	ZIO_FLAG_RAW		= 1 << 21,
 	ZIO_FLAG_GANG_CHILD	= 1 << 22,
 	ZIO_FLAG_DDT_CHILD	= 1 << 23,
-	ZIO_FLAG_GODFATHER	= 1 << 24
+	ZIO_FLAG_GODFATHER	= 1 << 24,
+	ZIO_FLAG_IO_ALLOCATING	= 1 << 25	/* in metaslab alloc queues */
 };
 
 #define	ZIO_FLAG_MUSTSUCCEED		0
@@ -282,6 +283,7 @@ typedef struct zio_prop {
 	uint8_t			zp_copies;
 	uint8_t			zp_dedup;
 	uint8_t			zp_dedup_verify;
+	uint64_t		zp_special_smallblk;
 } zio_prop_t;
 
 typedef struct zio_cksum_report zio_cksum_report_t;
@@ -428,6 +430,7 @@ struct zio {
 
 	uint64_t	io_offset;
 	uint64_t	io_deadline;
+	hrtime_t	io_timestamp;	/* when queued to the leaf vdev */
 	avl_node_t	io_offset_node;
 	avl_node_t	io_deadline_node;
 	avl_tree_t	*io_vdev_tree;
@@ -338,6 +338,9 @@ zfs_prop_init(void)
 	register_number(ZFS_PROP_RECORDSIZE, "recordsize", SPA_MAXBLOCKSIZE,
 	    PROP_INHERIT,
 	    ZFS_TYPE_FILESYSTEM, "512 to 128k, power of 2", "RECSIZE");
+	register_number(ZFS_PROP_SPECIAL_SMALL_BLOCKS, "special_small_blocks",
+	    0, PROP_INHERIT, ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME,
+	    "zero or 512 to 128k, power of 2", "SPECIAL_SMALL_BLOCKS");
 
 	/* hidden properties */
 	register_hidden(ZFS_PROP_CREATETXG, "createtxg", PROP_TYPE_NUMBER,
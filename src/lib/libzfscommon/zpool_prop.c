@@ -92,6 +92,8 @@ zpool_prop_init(void)
 	    PROP_DEFAULT, ZFS_TYPE_POOL, "<version>", "VERSION");
 	register_number(ZPOOL_PROP_DEDUPDITTO, "dedupditto", 0,
 	    PROP_DEFAULT, ZFS_TYPE_POOL, "<threshold (min 100)>", "DEDUPDITTO");
+	register_number(ZPOOL_PROP_SCANLATENCY, "scanlatency", 0,
+	    PROP_DEFAULT, ZFS_TYPE_POOL, "<milliseconds>", "SCANLAT");
 
 	/* default index (boolean) properties */
 	register_index(ZPOOL_PROP_DELEGATION, "delegation", 1, PROP_DEFAULT,
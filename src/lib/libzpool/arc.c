@@ -117,9 +117,13 @@
  */
 
 #include <sys/spa.h>
+#include <sys/spa_impl.h>
 #include <sys/zio.h>
+#include <sys/zio_compress.h>
 #include <sys/zfs_context.h>
 #include <sys/arc.h>
+#include <sys/dbuf.h>
+#include <sys/dsl_pool.h>
 #include <sys/refcount.h>
 #include <sys/vdev.h>
 #include <sys/vdev_impl.h>
@@ -146,10 +150,6 @@ static kmutex_t		arc_reclaim_thr_lock;
 static kcondvar_t	arc_reclaim_thr_cv;	/* used to signal reclaim thr */
 static uint8_t		arc_thread_exit;
 
-extern int zfs_write_limit_shift;
-extern uint64_t zfs_write_limit_max;
-extern kmutex_t zfs_write_limit_lock;
-
 #define	ARC_REDUCE_DNLC_PERCENT	3
 uint_t arc_reduce_dnlc_percent = ARC_REDUCE_DNLC_PERCENT;
 
@@ -193,6 +193,21 @@ int zfs_arc_grow_retry = 0;
 int zfs_arc_shrink_shift = 0;
 int zfs_arc_p_min_shift = 0;
 
+/*
+ * Keep compressed blocks in the ARC in their on-disk form, see
+ * arc_cdata_alloc().
+ */
+int zfs_arc_compressed = 0;
+
+/*
+ * Record the pool's hot buffers and prefetch them again at the next
+ * import, see arc_warmstart_thread().
+ */
+int zfs_arc_warmstart = 0;
+int zfs_arc_warmstart_interval = 300;	/* seconds between hot list saves */
+uint64_t zfs_arc_warmstart_max = 32768;	/* entries in the hot list */
+int zfs_arc_warmstart_inflight = 16;	/* prefetch reads outstanding */
+
 /*
  * Note that buffers can be in one of 6 states:
  *	ARC_anon	- anonymous (discussed below)
@@ -275,6 +290,10 @@ typedef struct arc_stats {
 	kstat_named_t arcstat_hdr_size;
 	kstat_named_t arcstat_data_size;
 	kstat_named_t arcstat_other_size;
+	kstat_named_t arcstat_compressed_size;
+	kstat_named_t arcstat_uncompressed_size;
+	kstat_named_t arcstat_compressed_hits;
+	kstat_named_t arcstat_compressed_evict;
 	kstat_named_t arcstat_l2_hits;
 	kstat_named_t arcstat_l2_misses;
 	kstat_named_t arcstat_l2_feeds;
@@ -293,6 +312,25 @@ typedef struct arc_stats {
 	kstat_named_t arcstat_l2_io_error;
 	kstat_named_t arcstat_l2_size;
 	kstat_named_t arcstat_l2_hdr_size;
+	kstat_named_t arcstat_l2_log_blk_writes;
+	kstat_named_t arcstat_l2_rebuild_active;
+	kstat_named_t arcstat_l2_rebuild_successes;
+	kstat_named_t arcstat_l2_rebuild_unsupported;
+	kstat_named_t arcstat_l2_rebuild_io_errors;
+	kstat_named_t arcstat_l2_rebuild_cksum_errors;
+	kstat_named_t arcstat_l2_rebuild_lowmem;
+	kstat_named_t arcstat_l2_rebuild_log_blks;
+	kstat_named_t arcstat_l2_rebuild_bufs;
+	kstat_named_t arcstat_l2_rebuild_bufs_precached;
+	kstat_named_t arcstat_l2_rebuild_size;
+	kstat_named_t arcstat_l2_rebuild_time_ms;
+	kstat_named_t arcstat_warmstart_active;
+	kstat_named_t arcstat_warmstart_saves;
+	kstat_named_t arcstat_warmstart_saved;
+	kstat_named_t arcstat_warmstart_loaded;
+	kstat_named_t arcstat_warmstart_prefetched;
+	kstat_named_t arcstat_warmstart_cached;
+	kstat_named_t arcstat_warmstart_skipped;
 	kstat_named_t arcstat_memory_throttle_count;
 } arc_stats_t;
 
@@ -331,6 +369,10 @@ static arc_stats_t arc_stats = {
 	{ "hdr_size",			KSTAT_DATA_UINT64 },
 	{ "data_size",			KSTAT_DATA_UINT64 },
 	{ "other_size",			KSTAT_DATA_UINT64 },
+	{ "compressed_size",		KSTAT_DATA_UINT64 },
+	{ "uncompressed_size",		KSTAT_DATA_UINT64 },
+	{ "compressed_hits",		KSTAT_DATA_UINT64 },
+	{ "compressed_evict",		KSTAT_DATA_UINT64 },
 	{ "l2_hits",			KSTAT_DATA_UINT64 },
 	{ "l2_misses",			KSTAT_DATA_UINT64 },
 	{ "l2_feeds",			KSTAT_DATA_UINT64 },
@@ -349,6 +391,25 @@ static arc_stats_t arc_stats = {
 	{ "l2_io_error",		KSTAT_DATA_UINT64 },
 	{ "l2_size",			KSTAT_DATA_UINT64 },
 	{ "l2_hdr_size",		KSTAT_DATA_UINT64 },
+	{ "l2_log_blk_writes",		KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_active",		KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_successes",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_unsupported",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_io_errors",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_cksum_errors",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_lowmem",		KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_log_blks",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_bufs",		KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_bufs_precached",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_size",		KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_time_ms",		KSTAT_DATA_UINT64 },
+	{ "warmstart_active",		KSTAT_DATA_UINT64 },
+	{ "warmstart_saves",		KSTAT_DATA_UINT64 },
+	{ "warmstart_saved",		KSTAT_DATA_UINT64 },
+	{ "warmstart_loaded",		KSTAT_DATA_UINT64 },
+	{ "warmstart_prefetched",	KSTAT_DATA_UINT64 },
+	{ "warmstart_cached",		KSTAT_DATA_UINT64 },
+	{ "warmstart_skipped",		KSTAT_DATA_UINT64 },
 	{ "memory_throttle_count",	KSTAT_DATA_UINT64 }
 };
 
@@ -473,6 +534,11 @@ struct arc_buf_hdr {
 	arc_callback_t		*b_acb;
 	kcondvar_t		b_cv;
 
+	/* compressed copy of the block, see arc_cdata_alloc() */
+	void			*b_cdata;
+	uint32_t		b_psize;
+	uint8_t			b_compress;
+
 	/* immutable */
 	arc_buf_contents_t	b_type;
 	uint64_t		b_size;
@@ -546,6 +612,18 @@ static boolean_t l2arc_write_eligible(uint64_t spa_guid, arc_buf_hdr_t *ab);
 #define	HDR_SIZE ((int64_t)sizeof (arc_buf_hdr_t))
 #define	L2HDR_SIZE ((int64_t)sizeof (l2arc_buf_hdr_t))
 
+/*
+ * Data held by a header in a non-ghost state: its arc_buf_t copies plus
+ * the compressed copy, if any.  This is what the header contributes to
+ * its state's arcs_size (and arcs_lsize, while it is evictable).
+ */
+static uint64_t
+arc_hdr_size(arc_buf_hdr_t *hdr)
+{
+	return (hdr->b_size * hdr->b_datacnt +
+	    (hdr->b_cdata != NULL ? hdr->b_psize : 0));
+}
+
 /*
  * Hash table routines
  */
@@ -600,11 +678,63 @@ uint64_t l2arc_feed_min_ms = L2ARC_FEED_MIN_MS;	/* min interval milliseconds */
 boolean_t l2arc_noprefetch = B_TRUE;		/* don't cache prefetch bufs */
 boolean_t l2arc_feed_again = B_TRUE;		/* turbo warmup */
 boolean_t l2arc_norw = B_TRUE;			/* no reads during writes */
+boolean_t l2arc_rebuild_enabled = B_TRUE;	/* restore contents at add */
 uint64_t max_arc_size = 0;
 
 /*
  * L2ARC Internals
  */
+
+/*
+ * On-disk format of a persistent L2ARC device, see l2arc_rebuild().
+ * Everything is stored in native byte order.
+ */
+#define	L2ARC_DEV_HDR_MAGIC	0x4c32415243484452ULL	/* "L2ARCHDR" */
+#define	L2ARC_LOG_BLK_MAGIC	0x4c324152434c4f47ULL	/* "L2ARCLOG" */
+#define	L2ARC_LOG_BLK_ENTRIES	1022
+
+typedef struct l2arc_log_blkptr {
+	uint64_t	lbp_daddr;		/* device address */
+	uint64_t	lbp_psize;		/* bytes written */
+	uint64_t	lbp_start;		/* first buffer it describes */
+	zio_cksum_t	lbp_cksum;		/* fletcher-4 of log block */
+} l2arc_log_blkptr_t;
+
+typedef struct l2arc_log_ent_phys {
+	dva_t		le_dva;			/* identity of the block */
+	uint64_t	le_birth;
+	uint64_t	le_daddr;		/* device address of the copy */
+	uint64_t	le_size;		/* logical size */
+	uint32_t	le_type;		/* arc_buf_contents_t */
+	uint32_t	le_flags;		/* ARC_INDIRECT */
+	zio_cksum_t	le_freeze_cksum;	/* fletcher-2 of the copy */
+} l2arc_log_ent_phys_t;
+
+typedef struct l2arc_log_blk_phys {
+	uint64_t		lb_magic;
+	uint64_t		lb_nents;
+	l2arc_log_blkptr_t	lb_prev;	/* previous log block */
+	l2arc_log_ent_phys_t	lb_entries[L2ARC_LOG_BLK_ENTRIES];
+} l2arc_log_blk_phys_t;
+
+typedef struct l2arc_dev_hdr_phys {
+	uint64_t		dh_magic;
+	uint64_t		dh_spa_guid;
+	uint64_t		dh_vdev_guid;
+	uint64_t		dh_hand;	/* l2ad_hand */
+	uint64_t		dh_evict;	/* l2ad_evict */
+	uint64_t		dh_first;	/* l2ad_first */
+	l2arc_log_blkptr_t	dh_lb;		/* newest log block */
+	zio_cksum_t		dh_cksum;	/* fletcher-4 of the above */
+} l2arc_dev_hdr_phys_t;
+
+#define	L2ARC_LOG_BLK_SIZE(nents)	P2ROUNDUP( \
+	offsetof(l2arc_log_blk_phys_t, lb_entries) + \
+	(nents) * sizeof (l2arc_log_ent_phys_t), SPA_MINBLOCKSIZE)
+#define	L2ARC_LOG_BLK_MAX_SIZE	L2ARC_LOG_BLK_SIZE(L2ARC_LOG_BLK_ENTRIES)
+#define	L2ARC_DEV_HDR_SIZE	\
+	P2ROUNDUP(sizeof (l2arc_dev_hdr_phys_t), SPA_MINBLOCKSIZE)
+
 typedef struct l2arc_dev {
 	vdev_t			*l2ad_vdev;	/* vdev */
 	spa_t			*l2ad_spa;	/* spa */
@@ -616,6 +746,12 @@ typedef struct l2arc_dev {
 	uint64_t		l2ad_evict;	/* last addr eviction reached */
 	boolean_t		l2ad_first;	/* first sweep through */
 	boolean_t		l2ad_writing;	/* currently writing */
+	uint64_t		l2ad_dh_evict;	/* l2ad_evict in dev header */
+	l2arc_log_blkptr_t	l2ad_lb_last;	/* newest log block */
+	boolean_t		l2ad_rebuild;	/* rebuild in progress */
+	uint64_t		l2ad_rebuild_txg; /* last txg to restore */
+	boolean_t		l2ad_rebuild_cancel; /* device being removed */
+	boolean_t		l2ad_rebuild_stale; /* log has lost txgs */
 	list_t			*l2ad_buflist;	/* buffer list */
 	list_node_t		l2ad_node;	/* device list node */
 } l2arc_dev_t;
@@ -629,6 +765,7 @@ static list_t L2ARC_free_on_write;		/* free after write buf list */
 static list_t *l2arc_free_on_write;		/* free after write list ptr */
 static kmutex_t l2arc_free_on_write_mtx;	/* mutex for list */
 static uint64_t l2arc_ndev;			/* number of devices */
+static kcondvar_t l2arc_rebuild_cv;		/* rebuild finished */
 
 typedef struct l2arc_read_callback {
 	arc_buf_t	*l2rcb_buf;		/* read buffer */
@@ -1058,7 +1195,7 @@ add_reference(arc_buf_hdr_t *ab, kmutex_t *hash_lock, void *tag)
 
 	if ((refcount_add(&ab->b_refcnt, tag) == 1) &&
 	    (ab->b_state != arc_anon)) {
-		uint64_t delta = ab->b_size * ab->b_datacnt;
+		uint64_t delta = arc_hdr_size(ab);
 		list_t *list = &ab->b_state->arcs_list[ab->b_type];
 		uint64_t *size = &ab->b_state->arcs_lsize[ab->b_type];
 
@@ -1099,7 +1236,7 @@ remove_reference(arc_buf_hdr_t *ab, kmutex_t *hash_lock, void *tag)
 		ASSERT(!list_link_active(&ab->b_arc_node));
 		list_insert_head(&state->arcs_list[ab->b_type], ab);
 		ASSERT(ab->b_datacnt > 0);
-		atomic_add_64(size, ab->b_size * ab->b_datacnt);
+		atomic_add_64(size, arc_hdr_size(ab));
 		mutex_exit(&state->arcs_mtx);
 	}
 	return (cnt);
@@ -1120,9 +1257,10 @@ arc_change_state(arc_state_t *new_state, arc_buf_hdr_t *ab, kmutex_t *hash_lock)
 	ASSERT(new_state != old_state);
 	ASSERT(refcnt == 0 || ab->b_datacnt > 0);
 	ASSERT(ab->b_datacnt == 0 || !GHOST_STATE(new_state));
+	ASSERT(ab->b_cdata == NULL || !GHOST_STATE(new_state));
 	ASSERT(ab->b_datacnt <= 1 || old_state != arc_anon);
 
-	from_delta = to_delta = ab->b_datacnt * ab->b_size;
+	from_delta = to_delta = arc_hdr_size(ab);
 
 	/*
 	 * If this buffer is evictable, transfer it from the
@@ -1248,6 +1386,16 @@ arc_space_return(uint64_t space, arc_space_type_t type)
 	atomic_add_64(&arc_size, -space);
 }
 
+/*
+ * True once metadata has used up its share of the cache; consumers that
+ * charge in-core state as ARC_SPACE_OTHER use it to decide to shrink.
+ */
+boolean_t
+arc_meta_full(void)
+{
+	return (arc_meta_used >= arc_meta_limit);
+}
+
 void *
 arc_data_buf_alloc(uint64_t size)
 {
@@ -1265,6 +1413,99 @@ arc_data_buf_free(void *buf, uint64_t size)
 	atomic_add_64(&arc_size, -size);
 }
 
+/*
+ * Compressed ARC.
+ *
+ * With zfs_arc_compressed set, a compressed block is read raw: its
+ * physical data is kept in the header (b_cdata) and arc_read_done()
+ * decompresses it into the arc_buf_t.  When such a header reaches the
+ * tail of its list, arc_evict() frees only the decompressed buffers and
+ * requeues the header at the head, so the block stays cached for another
+ * trip through the list at b_psize bytes; an arc_read() in the meantime
+ * decompresses a new buffer from b_cdata instead of going to disk.  The
+ * header goes to the ghost state when it reaches the tail again.
+ *
+ * The compressed copy is charged to arc_size and to the header's state
+ * like any data buffer (see arc_hdr_size()); arcstats compressed_size
+ * and uncompressed_size show how much it is saving.
+ */
+static boolean_t
+arc_cdata_eligible(const blkptr_t *bp)
+{
+	return (zfs_arc_compressed &&
+	    BP_GET_COMPRESS(bp) != ZIO_COMPRESS_OFF &&
+	    BP_GET_PSIZE(bp) < BP_GET_LSIZE(bp) &&
+	    !BP_SHOULD_BYTESWAP(bp));
+}
+
+static void
+arc_cdata_alloc(arc_buf_hdr_t *hdr, const blkptr_t *bp)
+{
+	arc_state_t *state = hdr->b_state;
+	uint64_t psize = BP_GET_PSIZE(bp);
+
+	ASSERT(hdr->b_cdata == NULL);
+	ASSERT(!GHOST_STATE(state));
+
+	if (hdr->b_type == ARC_BUFC_METADATA) {
+		hdr->b_cdata = zio_buf_alloc(psize);
+		arc_space_consume(psize, ARC_SPACE_DATA);
+	} else {
+		ASSERT(hdr->b_type == ARC_BUFC_DATA);
+		hdr->b_cdata = zio_data_buf_alloc(psize);
+		ARCSTAT_INCR(arcstat_data_size, psize);
+		atomic_add_64(&arc_size, psize);
+	}
+	hdr->b_psize = psize;
+	hdr->b_compress = BP_GET_COMPRESS(bp);
+
+	atomic_add_64(&state->arcs_size, psize);
+	if (list_link_active(&hdr->b_arc_node))
+		atomic_add_64(&state->arcs_lsize[hdr->b_type], psize);
+	ARCSTAT_INCR(arcstat_compressed_size, psize);
+	ARCSTAT_INCR(arcstat_uncompressed_size, hdr->b_size);
+}
+
+static void
+arc_cdata_free(arc_buf_hdr_t *hdr)
+{
+	arc_state_t *state = hdr->b_state;
+	uint64_t psize = hdr->b_psize;
+
+	ASSERT(hdr->b_cdata != NULL);
+	ASSERT(!GHOST_STATE(state));
+
+	if (hdr->b_type == ARC_BUFC_METADATA) {
+		zio_buf_free(hdr->b_cdata, psize);
+		arc_space_return(psize, ARC_SPACE_DATA);
+	} else {
+		ASSERT(hdr->b_type == ARC_BUFC_DATA);
+		zio_data_buf_free(hdr->b_cdata, psize);
+		ARCSTAT_INCR(arcstat_data_size, -psize);
+		ASSERT(arc_size >= psize);
+		atomic_add_64(&arc_size, -psize);
+	}
+	hdr->b_cdata = NULL;
+
+	if (list_link_active(&hdr->b_arc_node)) {
+		uint64_t *cnt = &state->arcs_lsize[hdr->b_type];
+
+		ASSERT3U(*cnt, >=, psize);
+		atomic_add_64(cnt, -psize);
+	}
+	ASSERT3U(state->arcs_size, >=, psize);
+	atomic_add_64(&state->arcs_size, -psize);
+	ARCSTAT_INCR(arcstat_compressed_size, -psize);
+	ARCSTAT_INCR(arcstat_uncompressed_size, -hdr->b_size);
+}
+
+static int
+arc_cdata_decompress(arc_buf_hdr_t *hdr, void *dst)
+{
+	return (zio_decompress_data(hdr->b_compress, hdr->b_cdata, dst,
+	    hdr->b_psize, hdr->b_size));
+}
+
 arc_buf_t *
 arc_buf_alloc(spa_t *spa, int size, void *tag, arc_buf_contents_t type)
 {
@@ -1508,6 +1749,9 @@ arc_hdr_destroy(arc_buf_hdr_t *hdr)
 			mutex_exit(&l2arc_buflist_mtx);
 	}
 
+	if (hdr->b_cdata != NULL)
+		arc_cdata_free(hdr);
+
 	if (!BUF_EMPTY(hdr)) {
 		ASSERT(!HDR_IN_HASH_TABLE(hdr));
 		buf_discard_identity(hdr);
@@ -1644,6 +1888,11 @@ arc_buf_size(arc_buf_t *buf)
  * This function makes a "best effort".  It skips over any buffers
  * it can't get a hash_lock on, and so may not catch all candidates.
  * It may also return without evicting as much space as requested.
+ *
+ * A header that also holds a compressed copy (see arc_cdata_alloc())
+ * loses only its data buffers on the first eviction; the second one
+ * frees the compressed copy and moves it to the ghost state.  Headers
+ * requeued that way are not evicted again in the same pass.
  */
 static long evict_skipped;
 static void *
@@ -1652,11 +1901,12 @@ arc_evict(arc_state_t *state, uint64_t spa, int64_t bytes, boolean_t recycle,
 {
 	arc_state_t *evicted_state;
 	uint64_t bytes_evicted = 0, skipped = 0, missed = 0;
-	arc_buf_hdr_t *ab, *ab_prev = NULL;
+	arc_buf_hdr_t *ab, *ab_prev = NULL, *requeued = NULL;
 	list_t *list = &state->arcs_list[type];
 	kmutex_t *hash_lock;
 	boolean_t have_lock;
 	void *stolen = NULL;
+	uint32_t datacnt;
 
 	ASSERT(state == arc_mru || state == arc_mfu);
 
@@ -1666,6 +1916,9 @@ arc_evict(arc_state_t *state, uint64_t spa, int64_t bytes, boolean_t recycle,
 	mutex_enter(&evicted_state->arcs_mtx);
 
 	for (ab = list_tail(list); ab; ab = ab_prev) {
+		/* the rest of the list was requeued by this pass */
+		if (ab == requeued)
+			break;
 		ab_prev = list_prev(list, ab);
 		/* prefetch buffers have a minimum lifespan */
 		if (HDR_IO_IN_PROGRESS(ab) ||
@@ -1688,7 +1941,8 @@ arc_evict(arc_state_t *state, uint64_t spa, int64_t bytes, boolean_t recycle,
 		have_lock = MUTEX_HELD(hash_lock);
 		if (have_lock || mutex_tryenter(hash_lock)) {
 			ASSERT3U(refcount_count(&ab->b_refcnt), ==, 0);
-			ASSERT(ab->b_datacnt > 0);
+			ASSERT(ab->b_datacnt > 0 || ab->b_cdata != NULL);
+			datacnt = ab->b_datacnt;
 			while (ab->b_buf) {
 				arc_buf_t *buf = ab->b_buf;
 				if (!mutex_tryenter(&buf->b_evict_lock)) {
@@ -1721,6 +1975,28 @@ arc_evict(arc_state_t *state, uint64_t spa, int64_t bytes, boolean_t recycle,
 				}
 			}
 
+			if (ab->b_datacnt == 0 && datacnt > 0 &&
+			    ab->b_cdata != NULL && zfs_arc_compressed &&
+			    bytes >= 0) {
+				/*
+				 * Only the data buffers go; the block stays
+				 * cached in compressed form and makes another
+				 * trip through the list at its physical size.
+				 */
+				list_remove(list, ab);
+				list_insert_head(list, ab);
+				if (requeued == NULL)
+					requeued = ab;
+				ab->b_flags &= ~ARC_BUF_AVAILABLE;
+				ARCSTAT_INCR(arcstat_compressed_evict,
+				    ab->b_size);
+				if (!have_lock)
+					mutex_exit(hash_lock);
+				if (bytes_evicted >= bytes)
+					break;
+				continue;
+			}
+
 			if (ab->b_l2hdr) {
 				ARCSTAT_INCR(arcstat_evict_l2_cached,
 				    ab->b_size);
@@ -1736,6 +2012,10 @@ arc_evict(arc_state_t *state, uint64_t spa, int64_t bytes, boolean_t recycle,
 			}
 
 			if (ab->b_datacnt == 0) {
+				if (ab->b_cdata != NULL) {
+					bytes_evicted += ab->b_psize;
+					arc_cdata_free(ab);
+				}
 				arc_change_state(evicted_state, ab, hash_lock);
 				ASSERT(HDR_IN_HASH_TABLE(ab));
 				ab->b_flags |= ARC_IN_HASH_TABLE;
@@ -2645,6 +2925,11 @@ arc_read_done(zio_t *zio)
 	if (l2arc_noprefetch && (hdr->b_flags & ARC_PREFETCH))
 		hdr->b_flags &= ~ARC_L2CACHE;
 
+	/* a raw read of a compressed block, see arc_cdata_alloc() */
+	if (hdr->b_cdata != NULL && zio->io_error == 0 &&
+	    arc_cdata_decompress(hdr, buf->b_data) != 0)
+		zio->io_error = EIO;
+
 	/* byteswap if necessary */
 	callback_list = hdr->b_acb;
 	ASSERT(callback_list != NULL);
@@ -2690,6 +2975,8 @@ arc_read_done(zio_t *zio)
 
 	if (zio->io_error != 0) {
 		hdr->b_flags |= ARC_IO_ERROR;
+		if (hdr->b_cdata != NULL)
+			arc_cdata_free(hdr);
 		if (hdr->b_state != arc_anon)
 			arc_change_state(arc_anon, hdr, hash_lock);
 		if (HDR_IN_HASH_TABLE(hdr))
@@ -2869,6 +3156,47 @@ top:
 		    demand, prefetch, hdr->b_type != ARC_BUFC_METADATA,
 		    data, metadata, hits);
 
+		if (done)
+			done(NULL, buf, private);
+	} else if (hdr != NULL && hdr->b_cdata != NULL) {
+		/*
+		 * Only the compressed copy of this block is cached;
+		 * decompress a new buffer from it.
+		 */
+		ASSERT(hdr->b_state == arc_mru || hdr->b_state == arc_mfu);
+		ASSERT(hdr->b_buf == NULL);
+
+		*arc_flags |= ARC_CACHED;
+		buf = NULL;
+
+		if (done) {
+			add_reference(hdr, hash_lock, private);
+			buf = kmem_cache_alloc(buf_cache, KM_PUSHPAGE);
+			buf->b_hdr = hdr;
+			buf->b_data = NULL;
+			buf->b_efunc = NULL;
+			buf->b_private = NULL;
+			buf->b_next = NULL;
+			hdr->b_buf = buf;
+			hdr->b_datacnt = 1;
+			arc_get_data_buf(buf);
+			VERIFY(arc_cdata_decompress(hdr, buf->b_data) == 0);
+			arc_cksum_compute(buf, B_FALSE);
+		} else if (*arc_flags & ARC_PREFETCH &&
+		    refcount_count(&hdr->b_refcnt) == 0) {
+			hdr->b_flags |= ARC_PREFETCH;
+		}
+		DTRACE_PROBE1(arc__hit, arc_buf_hdr_t *, hdr);
+		arc_access(hdr, hash_lock);
+		if (*arc_flags & ARC_L2CACHE)
+			hdr->b_flags |= ARC_L2CACHE;
+		mutex_exit(hash_lock);
+		ARCSTAT_BUMP(arcstat_hits);
+		ARCSTAT_BUMP(arcstat_compressed_hits);
+		ARCSTAT_CONDSTAT(!(hdr->b_flags & ARC_PREFETCH),
+		    demand, prefetch, hdr->b_type != ARC_BUFC_METADATA,
+		    data, metadata, hits);
+
 		if (done)
 			done(NULL, buf, private);
 	} else {
@@ -3032,8 +3360,21 @@ top:
 			}
 		}
 
-		rzio = zio_read(pio, spa, bp, buf->b_data, size,
-		    arc_read_done, buf, priority, zio_flags, zb);
+		if (arc_cdata_eligible(bp)) {
+			/*
+			 * Read the block raw into a compressed copy kept
+			 * in the header; arc_read_done() decompresses it.
+			 */
+			mutex_enter(hash_lock);
+			arc_cdata_alloc(hdr, bp);
+			mutex_exit(hash_lock);
+			rzio = zio_read(pio, spa, bp, hdr->b_cdata,
+			    hdr->b_psize, arc_read_done, buf, priority,
+			    zio_flags | ZIO_FLAG_RAW, zb);
+		} else {
+			rzio = zio_read(pio, spa, bp, buf->b_data, size,
+			    arc_read_done, buf, priority, zio_flags, zb);
+		}
 
 		if (*arc_flags & ARC_WAIT)
 			return (zio_wait(rzio));
@@ -3108,7 +3449,10 @@ arc_buf_evict(arc_buf_t *buf)
 	ASSERT(buf->b_data != NULL);
 	arc_buf_destroy(buf, FALSE, FALSE);
 
-	if (hdr->b_datacnt == 0) {
+	if (hdr->b_datacnt == 0 && hdr->b_cdata != NULL) {
+		/* still cached in compressed form */
+		hdr->b_flags &= ~ARC_BUF_AVAILABLE;
+	} else if (hdr->b_datacnt == 0) {
 		arc_state_t *old_state = hdr->b_state;
 		arc_state_t *evicted_state;
 
@@ -3239,6 +3583,8 @@ arc_release(arc_buf_t *buf, void *tag)
 		ASSERT(refcount_count(&hdr->b_refcnt) == 1);
 		ASSERT(!list_link_active(&hdr->b_arc_node));
 		ASSERT(!HDR_IO_IN_PROGRESS(hdr));
+		if (hdr->b_cdata != NULL)
+			arc_cdata_free(hdr);
 		if (hdr->b_state != arc_anon)
 			arc_change_state(arc_anon, hdr, hash_lock);
 		hdr->b_arc_access = 0;
@@ -3476,60 +3822,6 @@ arc_free(spa_t *spa, const blkptr_t *bp)
 	}
 }
 
-static int
-arc_memory_throttle(uint64_t reserve, uint64_t inflight_data, uint64_t txg)
-{
-#if 0
-	uint64_t available_memory = ptob(freemem);
-	static uint64_t page_load = 0;
-	static uint64_t last_txg = 0;
-
-#if defined(__i386)
-	available_memory =
-	    MIN(available_memory, vmem_size(heap_arena, VMEM_FREE));
-#endif
-	if (available_memory >= zfs_write_limit_max)
-		return (0);
-
-	if (txg > last_txg) {
-		last_txg = txg;
-		page_load = 0;
-	}
-	/*
-	 * If we are in pageout, we know that memory is already tight,
-	 * the arc is already going to be evicting, so we just want to
-	 * continue to let page writes occur as quickly as possible.
-	 */
-	if (curproc == proc_pageout) {
-		if (page_load > MAX(ptob(minfree), available_memory) / 4)
-			return (ERESTART);
-		/* Note: reserve is inflated, so we deflate */
-		page_load += reserve / 8;
-		return (0);
-	} else if (page_load > 0 && arc_reclaim_needed()) {
-		/* memory is low, delay before restarting */
-		ARCSTAT_INCR(arcstat_memory_throttle_count, 1);
-		return (EAGAIN);
-	}
-	page_load = 0;
-
-	if (arc_size > arc_c_min) {
-		uint64_t evictable_memory =
-		    arc_mru->arcs_lsize[ARC_BUFC_DATA] +
-		    arc_mru->arcs_lsize[ARC_BUFC_METADATA] +
-		    arc_mfu->arcs_lsize[ARC_BUFC_DATA] +
-		    arc_mfu->arcs_lsize[ARC_BUFC_METADATA];
-		available_memory += MIN(evictable_memory, arc_size - arc_c_min);
-	}
-
-	if (inflight_data > available_memory / 4) {
-		ARCSTAT_INCR(arcstat_memory_throttle_count, 1);
-		return (ERESTART);
-	}
-#endif
-	return (0);
-}
-
 void
 arc_tempreserve_clear(uint64_t reserve)
 {
@@ -3540,7 +3832,6 @@ arc_tempreserve_clear(uint64_t reserve)
 int
 arc_tempreserve_space(uint64_t reserve, uint64_t txg)
 {
-	int error;
 	uint64_t anon_size;
 
 #ifdef ZFS_DEBUG
@@ -3564,14 +3855,6 @@ arc_tempreserve_space(uint64_t reserve, uint64_t txg)
 	 */
 	anon_size = MAX((int64_t)(arc_anon->arcs_size - arc_loaned_bytes), 0);
 
-	/*
-	 * Writes will, almost always, require additional memory allocations
-	 * in order to compress/encrypt/etc the data.  We therefor need to
-	 * make sure that there is sufficient available memory for this.
-	 */
-	if (error = arc_memory_throttle(reserve, anon_size, txg))
-		return (error);
-
 	/*
 	 * Throttle writes when the amount of dirty data in the cache
 	 * gets too large.  We try to keep the cache less than half full
@@ -3755,11 +4038,15 @@ arc_init(void)
 	arc_dead = FALSE;
 	arc_warm = B_FALSE;
 
-	if (zfs_write_limit_max == 0)
-		zfs_write_limit_max = ptob(physmem) >> zfs_write_limit_shift;
-	else
-		zfs_write_limit_shift = 0;
-	mutex_init(&zfs_write_limit_lock, NULL, MUTEX_DEFAULT, NULL);
+	/*
+	 * Dirty data for the write throttle is held in the ARC, so do not
+	 * let it take more than a quarter of it, see dsl_pool.c.
+	 */
+	if (zfs_dirty_data_max == 0) {
+		zfs_dirty_data_max = MIN(zfs_dirty_data_max_max,
+		    ptob(physmem) * zfs_dirty_data_max_percent / 100);
+		zfs_dirty_data_max = MIN(zfs_dirty_data_max, arc_c_max / 4);
+	}
 }
 
 void
@@ -3800,7 +4087,6 @@ arc_fini(void)
 	mutex_destroy(&arc_mfu_ghost->arcs_mtx);
 	mutex_destroy(&arc_l2c_only->arcs_mtx);
 
-	mutex_destroy(&zfs_write_limit_lock);
 
 	buf_fini();
 
@@ -3939,6 +4225,14 @@ arc_set_maxsize(uint64_t newmax)
  * 8. If an ARC buffer is written (and dirtied) which also exists in the
  * L2ARC, the now stale L2ARC buffer is immediately dropped.
  *
+ * 9. The L2ARC contents survive a restart or pool import.  Every write
+ * ends with log blocks describing the buffers just written (those from
+ * synced txgs), chained newest to oldest, and a device header ahead of
+ * the data area points to the newest one.  When a device is added,
+ * l2arc_rebuild_thread() walks the chain and recreates ARC_l2c_only
+ * headers; the device is kept out of the feed rotation until it is done.
+ * See l2arc_rebuild().
+ *
  * The performance of the L2ARC can be tweaked by a number of tunables, which
  * may be necessary for different workloads:
  *
@@ -3947,6 +4241,7 @@ arc_set_maxsize(uint64_t newmax)
  *	l2arc_noprefetch	skip caching prefetched buffers
  *	l2arc_headroom		number of max device writes to precache
  *	l2arc_feed_secs		seconds between L2ARC writing
+ *	l2arc_rebuild_enabled	restore device contents when it is added
  *
  * Tunables may be removed or added as future performance improvements are
  * integrated, and also may become zpool properties.
@@ -4066,10 +4361,13 @@ l2arc_dev_get_next(void)
 		else if (next == first)
 			break;
 
-	} while (vdev_is_dead(next->l2ad_vdev));
+	} while (vdev_is_dead(next->l2ad_vdev) || next->l2ad_rebuild);
 
-	/* if we were unable to find any usable vdevs, return NULL */
-	if (vdev_is_dead(next->l2ad_vdev))
+	/*
+	 * If we were unable to find any usable vdevs, return NULL.  Devices
+	 * are not written to while their contents are being rebuilt.
+	 */
+	if (vdev_is_dead(next->l2ad_vdev) || next->l2ad_rebuild)
 		next = NULL;
 
 	l2arc_dev_last = next;
@@ -4112,6 +4410,41 @@ l2arc_do_free_on_write()
 	mutex_exit(&l2arc_free_on_write_mtx);
 }
 
+/*
+ * The L2ARC holds blocks in their logical form, so a header that only has
+ * a compressed copy is decompressed into a temporary buffer for the write.
+ * The buffer is freed by l2arc_do_free_on_write() when the write is done.
+ */
+static void *
+l2arc_cdata_copy(arc_buf_hdr_t *ab)
+{
+	l2arc_data_free_t *df;
+	void *data;
+
+	ASSERT(ab->b_cdata != NULL);
+
+	data = zio_data_buf_alloc(ab->b_size);
+	VERIFY(arc_cdata_decompress(ab, data) == 0);
+
+	mutex_enter(&ab->b_freeze_lock);
+	if (ab->b_freeze_cksum == NULL) {
+		ab->b_freeze_cksum = kmem_alloc(sizeof (zio_cksum_t),
+		    KM_SLEEP);
+		fletcher_2_native(data, ab->b_size, ab->b_freeze_cksum);
+	}
+	mutex_exit(&ab->b_freeze_lock);
+
+	df = kmem_alloc(sizeof (l2arc_data_free_t), KM_SLEEP);
+	df->l2df_data = data;
+	df->l2df_size = ab->b_size;
+	df->l2df_func = zio_data_buf_free;
+	mutex_enter(&l2arc_free_on_write_mtx);
+	list_insert_head(l2arc_free_on_write, df);
+	mutex_exit(&l2arc_free_on_write_mtx);
+
+	return (data);
+}
+
 /*
  * A write to a cache device has completed.  Update all headers to allow
  * reads from these buffers to begin.
@@ -4433,29 +4766,127 @@ top:
 	dev->l2ad_evict = taddr;
 }
 
+/*
+ * Write the device header describing the current write and eviction hands
+ * and the newest log block.  This is synchronous; the caller holds the
+ * SCL_L2ARC config lock.
+ */
+static int
+l2arc_dev_hdr_update(l2arc_dev_t *dev)
+{
+	l2arc_dev_hdr_phys_t *dh;
+	int err;
+
+	dh = zio_buf_alloc(L2ARC_DEV_HDR_SIZE);
+	bzero(dh, L2ARC_DEV_HDR_SIZE);
+	dh->dh_magic = L2ARC_DEV_HDR_MAGIC;
+	dh->dh_spa_guid = spa_guid(dev->l2ad_spa);
+	dh->dh_vdev_guid = dev->l2ad_vdev->vdev_guid;
+	dh->dh_hand = dev->l2ad_hand;
+	dh->dh_evict = dev->l2ad_evict;
+	dh->dh_first = dev->l2ad_first;
+	dh->dh_lb = dev->l2ad_lb_last;
+	fletcher_4_native(dh, offsetof(l2arc_dev_hdr_phys_t, dh_cksum),
+	    &dh->dh_cksum);
+
+	err = zio_wait(zio_write_phys(NULL, dev->l2ad_vdev,
+	    VDEV_LABEL_START_SIZE, L2ARC_DEV_HDR_SIZE, dh, ZIO_CHECKSUM_OFF,
+	    NULL, NULL, ZIO_PRIORITY_ASYNC_WRITE, ZIO_FLAG_CANFAIL, B_FALSE));
+	zio_buf_free(dh, L2ARC_DEV_HDR_SIZE);
+
+	if (err == 0)
+		dev->l2ad_dh_evict = dev->l2ad_evict;
+
+	return (err);
+}
+
+/*
+ * Size on the device of a log block holding nents entries.
+ */
+static uint64_t
+l2arc_log_blk_asize(l2arc_dev_t *dev, uint64_t nents)
+{
+	return (vdev_psize_to_asize(dev->l2ad_vdev, L2ARC_LOG_BLK_SIZE(nents)));
+}
+
+/*
+ * Write out a log block describing the buffers written since 'start' at
+ * the device write hand, and make it the newest log block.  The log block
+ * memory is freed by l2arc_write_done().  Returns the device space used.
+ */
+static uint64_t
+l2arc_log_blk_commit(l2arc_dev_t *dev, zio_t *pio, l2arc_log_blk_phys_t *lb,
+    uint64_t start)
+{
+	l2arc_log_blkptr_t *lbp = &dev->l2ad_lb_last;
+	l2arc_data_free_t *df;
+	uint64_t psize, asize;
+	char *tail;
+
+	ASSERT(lb->lb_nents > 0 && lb->lb_nents <= L2ARC_LOG_BLK_ENTRIES);
+
+	psize = L2ARC_LOG_BLK_SIZE(lb->lb_nents);
+	tail = (char *)&lb->lb_entries[lb->lb_nents];
+	bzero(tail, (char *)lb + psize - tail);
+	lb->lb_magic = L2ARC_LOG_BLK_MAGIC;
+	lb->lb_prev = *lbp;
+
+	lbp->lbp_daddr = dev->l2ad_hand;
+	lbp->lbp_psize = psize;
+	lbp->lbp_start = start;
+	fletcher_4_native(lb, psize, &lbp->lbp_cksum);
+
+	(void) zio_nowait(zio_write_phys(pio, dev->l2ad_vdev,
+	    dev->l2ad_hand, psize, lb, ZIO_CHECKSUM_OFF, NULL, NULL,
+	    ZIO_PRIORITY_ASYNC_WRITE, ZIO_FLAG_CANFAIL, B_FALSE));
+
+	df = kmem_alloc(sizeof (l2arc_data_free_t), KM_SLEEP);
+	df->l2df_data = lb;
+	df->l2df_size = L2ARC_LOG_BLK_MAX_SIZE;
+	df->l2df_func = zio_buf_free;
+	mutex_enter(&l2arc_free_on_write_mtx);
+	list_insert_head(l2arc_free_on_write, df);
+	mutex_exit(&l2arc_free_on_write_mtx);
+
+	asize = vdev_psize_to_asize(dev->l2ad_vdev, psize);
+	dev->l2ad_hand += asize;
+	ARCSTAT_BUMP(arcstat_l2_log_blk_writes);
+
+	return (asize);
+}
+
 /*
  * Find and write ARC buffers to the L2ARC device.
  *
  * An ARC_L2_WRITING flag is set so that the L2ARC buffers are not valid
  * for reading until they have completed writing.
+ *
+ * The buffers written are recorded in log blocks, which are written after
+ * them and count towards target_sz.
  */
 static uint64_t
 l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 {
 	arc_buf_hdr_t *ab, *ab_prev, *head;
 	l2arc_buf_hdr_t *hdrl2;
+	l2arc_log_blk_phys_t *lb;
+	l2arc_log_ent_phys_t *le;
 	list_t *list;
-	uint64_t passed_sz, write_sz, buf_sz, headroom;
+	uint64_t passed_sz, write_sz, buf_sz, headroom, lb_start, lb_sz;
 	void *buf_data;
 	kmutex_t *hash_lock, *list_lock;
 	boolean_t have_lock, full;
 	l2arc_write_callback_t *cb;
 	zio_t *pio, *wzio;
 	uint64_t guid = spa_guid(spa);
+	uint64_t synced_txg = spa_last_synced_txg(spa);
 
 	ASSERT(dev->l2ad_vdev != NULL);
 
 	pio = NULL;
+	lb = NULL;
+	lb_start = 0;
+	lb_sz = 0;
 	write_sz = 0;
 	full = B_FALSE;
 	head = kmem_cache_alloc(hdr_cache, KM_PUSHPAGE);
@@ -4510,7 +4941,8 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 				continue;
 			}
 
-			if ((write_sz + ab->b_size) > target_sz) {
+			if ((write_sz + ab->b_size + l2arc_log_blk_asize(dev,
+			    (lb != NULL ? lb->lb_nents : 0) + 1)) > target_sz) {
 				full = B_TRUE;
 				mutex_exit(hash_lock);
 				break;
@@ -4542,15 +4974,47 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 			ab->b_flags |= ARC_L2_WRITING;
 			ab->b_l2hdr = hdrl2;
 			list_insert_head(dev->l2ad_buflist, ab);
-			buf_data = ab->b_buf->b_data;
 			buf_sz = ab->b_size;
 
+			if (ab->b_buf == NULL) {
+				/* only cached in compressed form */
+				buf_data = l2arc_cdata_copy(ab);
+			} else {
+				buf_data = ab->b_buf->b_data;
+
+				/*
+				 * Compute and store the buffer cksum before
+				 * writing.  On debug the cksum is verified
+				 * first.
+				 */
+				arc_cksum_verify(ab->b_buf);
+				arc_cksum_compute(ab->b_buf, B_TRUE);
+			}
+
 			/*
-			 * Compute and store the buffer cksum before
-			 * writing.  On debug the cksum is verified first.
+			 * Only log blocks whose txg has synced.  A txg that
+			 * is still open may be lost to a crash and then
+			 * reused, and a rebuilt header would alias the
+			 * block that was born in it the second time round.
 			 */
-			arc_cksum_verify(ab->b_buf);
-			arc_cksum_compute(ab->b_buf, B_TRUE);
+			if (ab->b_birth <= synced_txg) {
+				if (lb == NULL) {
+					lb = zio_buf_alloc(
+					    L2ARC_LOG_BLK_MAX_SIZE);
+					lb->lb_nents = 0;
+					lb_start = dev->l2ad_hand;
+				}
+				le = &lb->lb_entries[lb->lb_nents++];
+				le->le_dva = ab->b_dva;
+				le->le_birth = ab->b_birth;
+				le->le_daddr = dev->l2ad_hand;
+				le->le_size = ab->b_size;
+				le->le_type = ab->b_type;
+				le->le_flags = ab->b_flags & ARC_INDIRECT;
+				mutex_enter(&ab->b_freeze_lock);
+				le->le_freeze_cksum = *ab->b_freeze_cksum;
+				mutex_exit(&ab->b_freeze_lock);
+			}
 
 			mutex_exit(hash_lock);
 
@@ -4570,6 +5034,15 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 
 			write_sz += buf_sz;
 			dev->l2ad_hand += buf_sz;
+
+			if (lb != NULL &&
+			    lb->lb_nents == L2ARC_LOG_BLK_ENTRIES) {
+				buf_sz = l2arc_log_blk_commit(dev, pio, lb,
+				    lb_start);
+				write_sz += buf_sz;
+				lb_sz += buf_sz;
+				lb = NULL;
+			}
 		}
 
 		mutex_exit(list_lock);
@@ -4581,14 +5054,21 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 
 	if (pio == NULL) {
 		ASSERT3U(write_sz, ==, 0);
+		ASSERT(lb == NULL);
 		kmem_cache_free(hdr_cache, head);
 		return (0);
 	}
 
+	if (lb != NULL) {
+		buf_sz = l2arc_log_blk_commit(dev, pio, lb, lb_start);
+		write_sz += buf_sz;
+		lb_sz += buf_sz;
+	}
+
 	ASSERT3U(write_sz, <=, target_sz);
 	ARCSTAT_BUMP(arcstat_l2_writes_sent);
 	ARCSTAT_INCR(arcstat_l2_write_bytes, write_sz);
-	ARCSTAT_INCR(arcstat_l2_size, write_sz);
+	ARCSTAT_INCR(arcstat_l2_size, write_sz - lb_sz);
 	vdev_space_update(dev->l2ad_vdev, write_sz, 0, 0);
 
 	/*
@@ -4604,9 +5084,17 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 	}
 
 	dev->l2ad_writing = B_TRUE;
-	(void) zio_wait(pio);
+	if (zio_wait(pio) != 0) {
+		/*
+		 * The log blocks may not have made it; start a new chain
+		 * rather than point the device header at them.
+		 */
+		bzero(&dev->l2ad_lb_last, sizeof (l2arc_log_blkptr_t));
+	}
 	dev->l2ad_writing = B_FALSE;
 
+	(void) l2arc_dev_hdr_update(dev);
+
 	return (write_sz);
 }
 
@@ -4679,6 +5167,16 @@ l2arc_feed_thread(void)
 		 */
 		l2arc_evict(dev, size, B_FALSE);
 
+		/*
+		 * The device header must stop describing the evicted
+		 * buffers before they are overwritten.
+		 */
+		if (dev->l2ad_evict != dev->l2ad_dh_evict &&
+		    l2arc_dev_hdr_update(dev) != 0) {
+			spa_config_exit(spa, SCL_L2ARC, dev);
+			continue;
+		}
+
 		/*
 		 * Write ARC buffers.
 		 */
@@ -4713,6 +5211,349 @@ l2arc_vdev_present(vdev_t *vd)
 	return (dev != NULL);
 }
 
+/*
+ * Take the config lock for one step of a rebuild.  A rebuild may not hold
+ * it for long, and must give up if the device is being removed (which is
+ * done with the config lock held as writer).
+ */
+static boolean_t
+l2arc_rebuild_enter(l2arc_dev_t *dev)
+{
+	while (!spa_config_tryenter(dev->l2ad_spa, SCL_L2ARC, dev,
+	    RW_READER)) {
+		if (dev->l2ad_rebuild_cancel)
+			return (B_FALSE);
+		delay(1);
+	}
+	if (dev->l2ad_rebuild_cancel || vdev_is_dead(dev->l2ad_vdev)) {
+		spa_config_exit(dev->l2ad_spa, SCL_L2ARC, dev);
+		return (B_FALSE);
+	}
+	return (B_TRUE);
+}
+
+/*
+ * Read and check the device header.  On success the device hands and the
+ * newest log block are set from it.
+ */
+static int
+l2arc_dev_hdr_read(l2arc_dev_t *dev)
+{
+	l2arc_dev_hdr_phys_t *dh;
+	zio_cksum_t cksum;
+	int err;
+
+	dh = zio_buf_alloc(L2ARC_DEV_HDR_SIZE);
+	err = zio_wait(zio_read_phys(NULL, dev->l2ad_vdev,
+	    VDEV_LABEL_START_SIZE, L2ARC_DEV_HDR_SIZE, dh, ZIO_CHECKSUM_OFF,
+	    NULL, NULL, ZIO_PRIORITY_ASYNC_READ, ZIO_FLAG_CANFAIL |
+	    ZIO_FLAG_DONT_CACHE | ZIO_FLAG_DONT_RETRY, B_FALSE));
+	if (err != 0) {
+		ARCSTAT_BUMP(arcstat_l2_rebuild_io_errors);
+		goto out;
+	}
+
+	fletcher_4_native(dh, offsetof(l2arc_dev_hdr_phys_t, dh_cksum),
+	    &cksum);
+	if (dh->dh_magic != L2ARC_DEV_HDR_MAGIC ||
+	    !ZIO_CHECKSUM_EQUAL(cksum, dh->dh_cksum) ||
+	    dh->dh_spa_guid != spa_guid(dev->l2ad_spa) ||
+	    dh->dh_vdev_guid != dev->l2ad_vdev->vdev_guid ||
+	    dh->dh_hand < dev->l2ad_start || dh->dh_hand >= dev->l2ad_end ||
+	    dh->dh_evict < dev->l2ad_start || dh->dh_evict > dev->l2ad_end ||
+	    (!dh->dh_first && dh->dh_evict < dh->dh_hand)) {
+		/* not ours, or written by an older version */
+		ARCSTAT_BUMP(arcstat_l2_rebuild_unsupported);
+		err = ENOTSUP;
+		goto out;
+	}
+
+	dev->l2ad_hand = dh->dh_hand;
+	dev->l2ad_evict = dh->dh_evict;
+	dev->l2ad_dh_evict = dh->dh_evict;
+	dev->l2ad_first = (dh->dh_first != 0);
+	dev->l2ad_lb_last = dh->dh_lb;
+out:
+	zio_buf_free(dh, L2ARC_DEV_HDR_SIZE);
+	return (err);
+}
+
+/*
+ * Check that the device range [start, end) has not been written since
+ * the device header was: it lies behind the write hand, or beyond the
+ * eviction hand in what is left of the previous sweep.
+ */
+static boolean_t
+l2arc_range_valid(l2arc_dev_t *dev, uint64_t start, uint64_t end)
+{
+	if (start < dev->l2ad_start || end > dev->l2ad_end || start >= end)
+		return (B_FALSE);
+	if (end <= dev->l2ad_hand)
+		return (B_TRUE);
+	return (!dev->l2ad_first && start >= dev->l2ad_evict);
+}
+
+static boolean_t
+l2arc_log_blkptr_valid(l2arc_dev_t *dev, const l2arc_log_blkptr_t *lbp)
+{
+	if (lbp->lbp_psize == 0 || lbp->lbp_psize > L2ARC_LOG_BLK_MAX_SIZE ||
+	    P2PHASE(lbp->lbp_psize, SPA_MINBLOCKSIZE) != 0 ||
+	    lbp->lbp_start > lbp->lbp_daddr)
+		return (B_FALSE);
+
+	return (l2arc_range_valid(dev, lbp->lbp_start, lbp->lbp_daddr +
+	    vdev_psize_to_asize(dev->l2ad_vdev, lbp->lbp_psize)));
+}
+
+static int
+l2arc_log_blk_verify(const l2arc_log_blkptr_t *lbp,
+    const l2arc_log_blk_phys_t *lb)
+{
+	zio_cksum_t cksum;
+
+	fletcher_4_native(lb, lbp->lbp_psize, &cksum);
+	if (!ZIO_CHECKSUM_EQUAL(cksum, lbp->lbp_cksum) ||
+	    lb->lb_magic != L2ARC_LOG_BLK_MAGIC ||
+	    lb->lb_nents == 0 || lb->lb_nents > L2ARC_LOG_BLK_ENTRIES ||
+	    L2ARC_LOG_BLK_SIZE(lb->lb_nents) != lbp->lbp_psize)
+		return (ECKSUM);
+
+	return (0);
+}
+
+/*
+ * Recreate an ARC_l2c_only header for one log entry, unless the block is
+ * already cached.
+ */
+static void
+l2arc_hdr_restore(l2arc_dev_t *dev, const l2arc_log_blkptr_t *lbp,
+    const l2arc_log_ent_phys_t *le)
+{
+	arc_buf_hdr_t *hdr, *exists;
+	l2arc_buf_hdr_t *l2hdr;
+	kmutex_t *hash_lock;
+
+	/*
+	 * Only blocks from synced txgs are logged, but the pool may have
+	 * been rewound since.  Blocks born after the txg the pool was opened
+	 * at were lost with that txg, and their identity may already be in
+	 * use again.
+	 */
+	if (le->le_birth > dev->l2ad_rebuild_txg) {
+		dev->l2ad_rebuild_stale = B_TRUE;
+		return;
+	}
+
+	if (le->le_size == 0 || le->le_size > SPA_MAXBLOCKSIZE ||
+	    le->le_type >= ARC_BUFC_NUMTYPES || le->le_daddr < lbp->lbp_start ||
+	    le->le_daddr + vdev_psize_to_asize(dev->l2ad_vdev, le->le_size) >
+	    lbp->lbp_daddr)
+		return;
+
+	hdr = kmem_cache_alloc(hdr_cache, KM_PUSHPAGE);
+	ASSERT(BUF_EMPTY(hdr));
+	hdr->b_dva = le->le_dva;
+	hdr->b_birth = le->le_birth;
+	hdr->b_size = le->le_size;
+	hdr->b_type = le->le_type;
+	hdr->b_spa = spa_guid(dev->l2ad_spa);
+	hdr->b_state = arc_anon;
+	hdr->b_arc_access = 0;
+	hdr->b_buf = NULL;
+	hdr->b_datacnt = 0;
+	hdr->b_flags = ARC_L2CACHE | (le->le_flags & ARC_INDIRECT);
+
+	exists = buf_hash_insert(hdr, &hash_lock);
+	if (exists != NULL) {
+		/* in the ARC already, or in a newer log block */
+		mutex_exit(hash_lock);
+		buf_discard_identity(hdr);
+		hdr->b_flags = 0;
+		kmem_cache_free(hdr_cache, hdr);
+		ARCSTAT_BUMP(arcstat_l2_rebuild_bufs_precached);
+		return;
+	}
+
+	hdr->b_freeze_cksum = kmem_alloc(sizeof (zio_cksum_t), KM_SLEEP);
+	*hdr->b_freeze_cksum = le->le_freeze_cksum;
+
+	l2hdr = kmem_zalloc(sizeof (l2arc_buf_hdr_t), KM_SLEEP);
+	l2hdr->b_dev = dev;
+	l2hdr->b_daddr = le->le_daddr;
+	hdr->b_l2hdr = l2hdr;
+
+	/* log blocks are read newest first, so the oldest go to the tail */
+	mutex_enter(&l2arc_buflist_mtx);
+	list_insert_tail(dev->l2ad_buflist, hdr);
+	mutex_exit(&l2arc_buflist_mtx);
+
+	arc_change_state(arc_l2c_only, hdr, hash_lock);
+	mutex_exit(hash_lock);
+
+	ARCSTAT_INCR(arcstat_l2_size, hdr->b_size);
+	ARCSTAT_BUMP(arcstat_l2_rebuild_bufs);
+	ARCSTAT_INCR(arcstat_l2_rebuild_size, hdr->b_size);
+}
+
+/*
+ * Rebuild the L2ARC headers of a device from its log blocks.
+ *
+ * The chain is followed from the newest log block back, one block being
+ * read ahead while the entries of the previous one are restored.  It ends
+ * at the first log block that fails its checksum, or that lies (or
+ * describes buffers) in space overwritten since the device header was
+ * written; l2arc_range_valid() decides that from the hands recorded in
+ * the header, which is rewritten ahead of every overwrite.  The chain
+ * runs backwards through the device and may wrap around only once.
+ *
+ * The config lock is dropped between log blocks so that the rebuild does
+ * not hold up configuration changes, and the rebuild stops early once the
+ * restored headers take up half of the ARC.  Returns 0 if the whole chain
+ * was restored.
+ */
+static int
+l2arc_rebuild(l2arc_dev_t *dev)
+{
+	l2arc_log_blk_phys_t *lb, *next_lb, *tmp;
+	l2arc_log_blkptr_t lbp, next_lbp;
+	vdev_t *vd = dev->l2ad_vdev;
+	boolean_t wrapped = B_FALSE, have_next;
+	zio_t *pio;
+	int err;
+
+	lbp = dev->l2ad_lb_last;
+	if (!l2arc_log_blkptr_valid(dev, &lbp))
+		return (0);
+
+	lb = zio_buf_alloc(L2ARC_LOG_BLK_MAX_SIZE);
+	next_lb = zio_buf_alloc(L2ARC_LOG_BLK_MAX_SIZE);
+
+	if (!l2arc_rebuild_enter(dev)) {
+		err = EINTR;
+		goto out;
+	}
+	err = zio_wait(zio_read_phys(NULL, vd, lbp.lbp_daddr, lbp.lbp_psize,
+	    lb, ZIO_CHECKSUM_OFF, NULL, NULL, ZIO_PRIORITY_ASYNC_READ,
+	    ZIO_FLAG_CANFAIL | ZIO_FLAG_DONT_CACHE | ZIO_FLAG_DONT_RETRY,
+	    B_FALSE));
+	spa_config_exit(dev->l2ad_spa, SCL_L2ARC, dev);
+
+	for (;;) {
+		if (err == 0)
+			err = l2arc_log_blk_verify(&lbp, lb);
+		if (err != 0) {
+			if (err == ECKSUM) {
+				ARCSTAT_BUMP(arcstat_l2_rebuild_cksum_errors);
+			} else {
+				ARCSTAT_BUMP(arcstat_l2_rebuild_io_errors);
+			}
+			break;
+		}
+		if (arc_reclaim_needed() ||
+		    ARCSTAT(arcstat_l2_hdr_size) > arc_c / 2) {
+			ARCSTAT_BUMP(arcstat_l2_rebuild_lowmem);
+			err = ENOMEM;
+			break;
+		}
+
+		next_lbp = lb->lb_prev;
+		have_next = l2arc_log_blkptr_valid(dev, &next_lbp);
+		if (have_next && next_lbp.lbp_daddr >= lbp.lbp_daddr) {
+			if (wrapped || lbp.lbp_daddr >= dev->l2ad_hand)
+				have_next = B_FALSE;
+			wrapped = B_TRUE;
+		}
+
+		if (!l2arc_rebuild_enter(dev)) {
+			err = EINTR;
+			break;
+		}
+		pio = NULL;
+		if (have_next) {
+			pio = zio_root(dev->l2ad_spa, NULL, NULL,
+			    ZIO_FLAG_CANFAIL);
+			(void) zio_nowait(zio_read_phys(pio, vd,
+			    next_lbp.lbp_daddr, next_lbp.lbp_psize, next_lb,
+			    ZIO_CHECKSUM_OFF, NULL, NULL,
+			    ZIO_PRIORITY_ASYNC_READ, ZIO_FLAG_CANFAIL |
+			    ZIO_FLAG_DONT_CACHE | ZIO_FLAG_DONT_RETRY,
+			    B_FALSE));
+		}
+
+		for (int i = lb->lb_nents - 1; i >= 0; i--)
+			l2arc_hdr_restore(dev, &lbp, &lb->lb_entries[i]);
+		ARCSTAT_BUMP(arcstat_l2_rebuild_log_blks);
+
+		if (pio != NULL)
+			err = zio_wait(pio);
+		spa_config_exit(dev->l2ad_spa, SCL_L2ARC, dev);
+
+		if (!have_next)
+			break;
+		tmp = lb;
+		lb = next_lb;
+		next_lb = tmp;
+		lbp = next_lbp;
+	}
+out:
+	zio_buf_free(lb, L2ARC_LOG_BLK_MAX_SIZE);
+	zio_buf_free(next_lb, L2ARC_LOG_BLK_MAX_SIZE);
+	return (err);
+}
+
+/*
+ * Started for every device added to the L2ARC.  Restores what the device
+ * held when it was last used, then writes a fresh device header (so that
+ * the feed thread always has one describing the device) and lets the
+ * device join the feed rotation.
+ */
+static void
+l2arc_rebuild_thread(l2arc_dev_t *dev)
+{
+	hrtime_t start = gethrtime();
+	vdev_t *vd = dev->l2ad_vdev;
+
+	ARCSTAT_BUMP(arcstat_l2_rebuild_active);
+
+	if (l2arc_rebuild_enter(dev)) {
+		if (l2arc_rebuild_enabled && l2arc_dev_hdr_read(dev) == 0) {
+			vdev_space_update(vd, dev->l2ad_hand - dev->l2ad_start +
+			    (dev->l2ad_first ? 0 :
+			    dev->l2ad_end - dev->l2ad_evict), 0, 0);
+			spa_config_exit(dev->l2ad_spa, SCL_L2ARC, dev);
+
+			if (l2arc_rebuild(dev) == 0)
+				ARCSTAT_BUMP(arcstat_l2_rebuild_successes);
+			ARCSTAT(arcstat_l2_rebuild_time_ms) =
+			    (gethrtime() - start) / (NANOSEC / MILLISEC);
+
+			/*
+			 * The log holds blocks from txgs the pool was rewound
+			 * past, which will be reused from now on.  Cut the
+			 * chain so that a later rebuild cannot see them.
+			 */
+			if (dev->l2ad_rebuild_stale)
+				bzero(&dev->l2ad_lb_last,
+				    sizeof (l2arc_log_blkptr_t));
+
+			if (!l2arc_rebuild_enter(dev))
+				goto out;
+		}
+		if (spa_writeable(dev->l2ad_spa))
+			(void) l2arc_dev_hdr_update(dev);
+		spa_config_exit(dev->l2ad_spa, SCL_L2ARC, dev);
+	}
+out:
+	ARCSTAT_BUMPDOWN(arcstat_l2_rebuild_active);
+
+	mutex_enter(&l2arc_dev_mtx);
+	dev->l2ad_rebuild = B_FALSE;
+	cv_broadcast(&l2arc_rebuild_cv);
+	mutex_exit(&l2arc_dev_mtx);
+
+	thread_exit();
+}
+
 /*
  * Add a vdev for use by the L2ARC.  By this point the spa has already
  * validated the vdev and opened it.
@@ -4732,12 +5573,17 @@ l2arc_add_vdev(spa_t *spa, vdev_t *vd)
 	adddev->l2ad_vdev = vd;
 	adddev->l2ad_write = l2arc_write_max;
 	adddev->l2ad_boost = l2arc_write_boost;
-	adddev->l2ad_start = VDEV_LABEL_START_SIZE;
+	adddev->l2ad_start = VDEV_LABEL_START_SIZE +
+	    vdev_psize_to_asize(vd, L2ARC_DEV_HDR_SIZE);
 	adddev->l2ad_end = VDEV_LABEL_START_SIZE + vdev_get_min_asize(vd);
 	adddev->l2ad_hand = adddev->l2ad_start;
 	adddev->l2ad_evict = adddev->l2ad_start;
+	adddev->l2ad_dh_evict = adddev->l2ad_start;
 	adddev->l2ad_first = B_TRUE;
 	adddev->l2ad_writing = B_FALSE;
+	adddev->l2ad_rebuild = B_TRUE;
+	adddev->l2ad_rebuild_txg = MIN(spa_last_synced_txg(spa),
+	    spa_first_txg(spa) - 1);
 	ASSERT3U(adddev->l2ad_write, >, 0);
 
 	/*
@@ -4757,6 +5603,13 @@ l2arc_add_vdev(spa_t *spa, vdev_t *vd)
 	list_insert_head(l2arc_dev_list, adddev);
 	atomic_inc_64(&l2arc_ndev);
 	mutex_exit(&l2arc_dev_mtx);
+
+	/*
+	 * Restore the device contents in the background; the device is
+	 * not written to until that is done.
+	 */
+	(void) thread_create(NULL, 0, l2arc_rebuild_thread, adddev, 0, &p0,
+	    TS_RUN, minclsyspri);
 }
 
 /*
@@ -4786,6 +5639,13 @@ l2arc_remove_vdev(vdev_t *vd)
 	list_remove(l2arc_dev_list, remdev);
 	l2arc_dev_last = NULL;		/* may have been invalidated */
 	atomic_dec_64(&l2arc_ndev);
+
+	/*
+	 * Wait for a rebuild still in progress to give up.
+	 */
+	remdev->l2ad_rebuild_cancel = B_TRUE;
+	while (remdev->l2ad_rebuild)
+		cv_wait(&l2arc_rebuild_cv, &l2arc_dev_mtx);
 	mutex_exit(&l2arc_dev_mtx);
 
 	/*
@@ -4807,6 +5667,7 @@ l2arc_init(void)
 
 	mutex_init(&l2arc_feed_thr_lock, NULL, MUTEX_DEFAULT, NULL);
 	cv_init(&l2arc_feed_thr_cv, NULL, CV_DEFAULT, NULL);
+	cv_init(&l2arc_rebuild_cv, NULL, CV_DEFAULT, NULL);
 	mutex_init(&l2arc_dev_mtx, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&l2arc_buflist_mtx, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&l2arc_free_on_write_mtx, NULL, MUTEX_DEFAULT, NULL);
@@ -4832,6 +5693,7 @@ l2arc_fini(void)
 
 	mutex_destroy(&l2arc_feed_thr_lock);
 	cv_destroy(&l2arc_feed_thr_cv);
+	cv_destroy(&l2arc_rebuild_cv);
 	mutex_destroy(&l2arc_dev_mtx);
 	mutex_destroy(&l2arc_buflist_mtx);
 	mutex_destroy(&l2arc_free_on_write_mtx);
@@ -4863,3 +5725,378 @@ l2arc_stop(void)
 		cv_wait(&l2arc_feed_thr_cv, &l2arc_feed_thr_lock);
 	mutex_exit(&l2arc_feed_thr_lock);
 }
+
+/*
+ * ARC warm start
+ *
+ * After a restart the ARC is empty, and the dnode, indirect and ZAP blocks
+ * that made up the working set come back one synchronous miss at a time.
+ * With zfs_arc_warmstart set, each pool gets a thread that keeps a "hot
+ * list" of the block pointers behind its MFU and MRU buffers in a file
+ * next to the pool cache file, and that prefetches the list again when the
+ * pool is next imported.
+ *
+ * The ARC itself only knows a buffer's identity, not its block pointer, so
+ * only buffers cached on behalf of a dbuf can be recorded (see
+ * dbuf_arc_blkptr()).  This is also why the list is saved every
+ * zfs_arc_warmstart_interval seconds rather than at export: by the time a
+ * pool is exported its datasets have been unmounted and their buffers
+ * evicted.
+ *
+ * The list is walked in the same order the L2ARC feeds from (MFU then MRU,
+ * metadata before data) and written out in native byte order, since it
+ * never leaves the host.  Entries are replayed as ordinary speculative
+ * prefetches, so the block's checksum is verified on the way in and a
+ * stale entry costs one wasted read.
+ *
+ * What a checksum cannot catch is a block from a txg that was rolled back
+ * and is then reused: the new block can have the same identity as the old
+ * one.  So the list only ever holds blocks born no later than its header
+ * txg, which is a txg known to be on disk, and an import that opens the
+ * pool at an earlier txg rewrites the list before anything new can sync.
+ */
+
+#define	ARC_WARMSTART_MAGIC	0x61726377726d7374ULL	/* "arcwrmst" */
+
+typedef struct arc_warmstart_hdr {
+	uint64_t	wh_magic;	/* ARC_WARMSTART_MAGIC */
+	uint64_t	wh_spa_guid;	/* pool the list belongs to */
+	uint64_t	wh_txg;		/* no entry is born after this */
+	uint64_t	wh_nents;	/* number of entries that follow */
+	zio_cksum_t	wh_cksum;	/* fletcher4 of the entries */
+} arc_warmstart_hdr_t;
+
+typedef struct arc_warmstart_ent {
+	blkptr_t	we_bp;
+	zbookmark_t	we_zb;
+} arc_warmstart_ent_t;
+
+typedef struct arc_warmstart_arg {
+	spa_t			*wa_spa;
+	arc_warmstart_ent_t	*wa_ents;	/* list to prefetch */
+	uint64_t		wa_nents;
+	size_t			wa_size;	/* allocated size of wa_ents */
+	char			wa_path[MAXPATHLEN];
+} arc_warmstart_arg_t;
+
+static void
+arc_warmstart_path(spa_t *spa, char *path)
+{
+	const char *slash = strrchr(spa_config_path, '/');
+	int dirlen = (slash != NULL) ? slash - spa_config_path + 1 : 0;
+
+	(void) snprintf(path, MAXPATHLEN, "%.*s%016llx.arcwarm", dirlen,
+	    spa_config_path, (u_longlong_t)spa_guid(spa));
+}
+
+/*
+ * Collect up to max hot list entries for the pool, leaving out anything
+ * born after max_txg.
+ */
+static uint64_t
+arc_warmstart_collect(spa_t *spa, arc_warmstart_ent_t *ents, uint64_t max,
+    uint64_t max_txg)
+{
+	uint64_t guid = spa_guid(spa);
+	uint64_t n = 0;
+
+	for (int try = 0; try <= 3 && n < max; try++) {
+		arc_buf_hdr_t *ab;
+		kmutex_t *list_lock, *hash_lock;
+		list_t *list;
+
+		list = l2arc_list_locked(try, &list_lock);
+
+		for (ab = list_head(list); ab != NULL && n < max;
+		    ab = list_next(list, ab)) {
+			arc_warmstart_ent_t *we = &ents[n];
+
+			if (ab->b_spa != guid || ab->b_birth > max_txg)
+				continue;
+
+			hash_lock = HDR_LOCK(ab);
+			if (!mutex_tryenter(hash_lock))
+				continue;
+
+			if (ab->b_buf != NULL && dbuf_arc_blkptr(ab->b_buf,
+			    &we->we_bp, &we->we_zb) &&
+			    DVA_EQUAL(BP_IDENTITY(&we->we_bp), &ab->b_dva) &&
+			    BP_PHYSICAL_BIRTH(&we->we_bp) == ab->b_birth)
+				n++;
+
+			mutex_exit(hash_lock);
+		}
+
+		mutex_exit(list_lock);
+	}
+
+	return (n);
+}
+
+/*
+ * Write a hot list, using the same write, sync and rename dance as
+ * spa_config_write().  If that fails the old list is removed instead, as
+ * it may no longer be safe to use.
+ */
+static void
+arc_warmstart_write(spa_t *spa, const char *path, uint64_t txg,
+    arc_warmstart_ent_t *ents, uint64_t nents)
+{
+	arc_warmstart_hdr_t wh;
+	int oflags = FWRITE | FTRUNC | FCREAT | FOFFMAX;
+	size_t size = nents * sizeof (arc_warmstart_ent_t);
+	boolean_t written = B_FALSE;
+	vnode_t *vp;
+	char *temp;
+
+	bzero(&wh, sizeof (wh));
+	wh.wh_magic = ARC_WARMSTART_MAGIC;
+	wh.wh_spa_guid = spa_guid(spa);
+	wh.wh_txg = txg;
+	wh.wh_nents = nents;
+	fletcher_4_native(ents, size, &wh.wh_cksum);
+
+	temp = kmem_alloc(MAXPATHLEN, KM_SLEEP);
+	(void) snprintf(temp, MAXPATHLEN, "%s.tmp", path);
+
+	if (vn_open(temp, UIO_SYSSPACE, oflags, 0644, &vp, CRCREAT, 0) == 0) {
+		if (vn_rdwr(UIO_WRITE, vp, (caddr_t)&wh, sizeof (wh), 0,
+		    UIO_SYSSPACE, 0, RLIM64_INFINITY, kcred, NULL) == 0 &&
+		    vn_rdwr(UIO_WRITE, vp, (caddr_t)ents, size, sizeof (wh),
+		    UIO_SYSSPACE, 0, RLIM64_INFINITY, kcred, NULL) == 0 &&
+		    VOP_FSYNC(vp, FSYNC, kcred, NULL) == 0 &&
+		    vn_rename(temp, (char *)path, UIO_SYSSPACE) == 0)
+			written = B_TRUE;
+		(void) VOP_CLOSE(vp, oflags, 1, 0, kcred, NULL);
+		VN_RELE(vp);
+	}
+
+	(void) vn_remove(temp, UIO_SYSSPACE, RMFILE);
+	if (!written)
+		(void) vn_remove((char *)path, UIO_SYSSPACE, RMFILE);
+
+	kmem_free(temp, MAXPATHLEN);
+}
+
+static void
+arc_warmstart_save(spa_t *spa, const char *path)
+{
+	uint64_t max = zfs_arc_warmstart_max;
+	uint64_t txg = spa_last_synced_txg(spa);
+	arc_warmstart_ent_t *ents;
+	uint64_t nents;
+
+	if (max == 0)
+		return;
+
+	ents = kmem_alloc(max * sizeof (arc_warmstart_ent_t), KM_SLEEP);
+	nents = arc_warmstart_collect(spa, ents, max, txg);
+	arc_warmstart_write(spa, path, txg, ents, nents);
+	ARCSTAT_BUMP(arcstat_warmstart_saves);
+	ARCSTAT(arcstat_warmstart_saved) = nents;
+	kmem_free(ents, max * sizeof (arc_warmstart_ent_t));
+}
+
+/*
+ * Read and verify the pool's hot list.  Returns the entries, or NULL if
+ * there is no usable list.
+ */
+static arc_warmstart_ent_t *
+arc_warmstart_read(spa_t *spa, const char *path, uint64_t *nentsp,
+    uint64_t *txgp)
+{
+	arc_warmstart_ent_t *ents = NULL;
+	arc_warmstart_hdr_t wh;
+	zio_cksum_t cksum;
+	vnode_t *vp;
+	ssize_t resid;
+	size_t size;
+
+	if (vn_open((char *)path, UIO_SYSSPACE, FREAD, 0, &vp, 0, 0) != 0)
+		return (NULL);
+
+	if (vn_rdwr(UIO_READ, vp, (caddr_t)&wh, sizeof (wh), 0,
+	    UIO_SYSSPACE, 0, RLIM64_INFINITY, kcred, &resid) != 0 ||
+	    resid != 0 || wh.wh_magic != ARC_WARMSTART_MAGIC ||
+	    wh.wh_spa_guid != spa_guid(spa) || wh.wh_nents == 0 ||
+	    wh.wh_nents > zfs_arc_warmstart_max)
+		goto out;
+
+	size = wh.wh_nents * sizeof (arc_warmstart_ent_t);
+	ents = kmem_alloc(size, KM_SLEEP);
+
+	if (vn_rdwr(UIO_READ, vp, (caddr_t)ents, size, sizeof (wh),
+	    UIO_SYSSPACE, 0, RLIM64_INFINITY, kcred, &resid) != 0 ||
+	    resid != 0) {
+		kmem_free(ents, size);
+		ents = NULL;
+		goto out;
+	}
+
+	fletcher_4_native(ents, size, &cksum);
+	if (!ZIO_CHECKSUM_EQUAL(cksum, wh.wh_cksum)) {
+		kmem_free(ents, size);
+		ents = NULL;
+		goto out;
+	}
+
+	*nentsp = wh.wh_nents;
+	*txgp = wh.wh_txg;
+out:
+	(void) VOP_CLOSE(vp, FREAD, 1, 0, kcred, NULL);
+	VN_RELE(vp);
+	return (ents);
+}
+
+/*
+ * Check that a hot list entry only points at top-level vdevs that exist.
+ */
+static boolean_t
+arc_warmstart_ent_valid(spa_t *spa, const blkptr_t *bp)
+{
+	ASSERT(spa_config_held(spa, SCL_VDEV, RW_READER));
+
+	if (BP_IS_HOLE(bp) || BP_GET_TYPE(bp) >= DMU_OT_NUMTYPES ||
+	    BP_GET_CHECKSUM(bp) >= ZIO_CHECKSUM_FUNCTIONS ||
+	    BP_GET_COMPRESS(bp) >= ZIO_COMPRESS_FUNCTIONS)
+		return (B_FALSE);
+
+	for (int d = 0; d < BP_GET_NDVAS(bp); d++) {
+		if (vdev_lookup_top(spa, DVA_GET_VDEV(&bp->blk_dva[d])) == NULL)
+			return (B_FALSE);
+	}
+
+	return (B_TRUE);
+}
+
+/*
+ * Replay the hot list as prefetches, at most zfs_arc_warmstart_inflight at
+ * a time.  We give up once the ARC is full, since from then on every
+ * prefetch would displace something the pool has actually asked for since
+ * import.
+ */
+static void
+arc_warmstart_prefetch(spa_t *spa, arc_warmstart_ent_t *ents, uint64_t nents)
+{
+	uint64_t i = 0;
+
+	while (i < nents && !spa->spa_warmstart_exit && arc_size < arc_c) {
+		zio_t *pio = zio_root(spa, NULL, NULL, ZIO_FLAG_CANFAIL);
+		int inflight = 0;
+
+		spa_config_enter(spa, SCL_VDEV, FTAG, RW_READER);
+		for (; i < nents && inflight < zfs_arc_warmstart_inflight;
+		    i++) {
+			arc_warmstart_ent_t *we = &ents[i];
+			uint32_t aflags = ARC_NOWAIT | ARC_PREFETCH;
+
+			if (!arc_warmstart_ent_valid(spa, &we->we_bp)) {
+				ARCSTAT_BUMP(arcstat_warmstart_skipped);
+				continue;
+			}
+
+			(void) arc_read_nolock(pio, spa, &we->we_bp, NULL,
+			    NULL, ZIO_PRIORITY_ASYNC_READ,
+			    ZIO_FLAG_CANFAIL | ZIO_FLAG_SPECULATIVE,
+			    &aflags, &we->we_zb);
+
+			if (aflags & ARC_CACHED) {
+				ARCSTAT_BUMP(arcstat_warmstart_cached);
+			} else {
+				ARCSTAT_BUMP(arcstat_warmstart_prefetched);
+				inflight++;
+			}
+		}
+		spa_config_exit(spa, SCL_VDEV, FTAG);
+
+		(void) zio_wait(pio);
+	}
+}
+
+static void
+arc_warmstart_thread(void *arg)
+{
+	arc_warmstart_arg_t *wa = arg;
+	spa_t *spa = wa->wa_spa;
+
+	if (wa->wa_ents != NULL) {
+		ARCSTAT_BUMP(arcstat_warmstart_active);
+		arc_warmstart_prefetch(spa, wa->wa_ents, wa->wa_nents);
+		ARCSTAT_BUMPDOWN(arcstat_warmstart_active);
+		kmem_free(wa->wa_ents, wa->wa_size);
+	}
+
+	mutex_enter(&spa->spa_warmstart_lock);
+	while (!spa->spa_warmstart_exit) {
+		(void) cv_timedwait(&spa->spa_warmstart_cv,
+		    &spa->spa_warmstart_lock,
+		    lbolt + hz * zfs_arc_warmstart_interval);
+		if (spa->spa_warmstart_exit)
+			break;
+		mutex_exit(&spa->spa_warmstart_lock);
+		arc_warmstart_save(spa, wa->wa_path);
+		mutex_enter(&spa->spa_warmstart_lock);
+	}
+	spa->spa_warmstart_thread = NULL;
+	cv_broadcast(&spa->spa_warmstart_cv);
+	mutex_exit(&spa->spa_warmstart_lock);
+
+	kmem_free(wa, sizeof (arc_warmstart_arg_t));
+	thread_exit();
+}
+
+/*
+ * Called once a pool has been opened, before anything new is synced: read
+ * its hot list, trim it back to the txg the pool was opened at, and start
+ * the thread that prefetches it and then keeps it up to date until
+ * arc_warmstart_destroy().
+ */
+void
+arc_warmstart_create(spa_t *spa)
+{
+	uint64_t max_txg = MIN(spa_last_synced_txg(spa),
+	    spa_first_txg(spa) - 1);
+	arc_warmstart_arg_t *wa;
+	uint64_t i, n, txg;
+
+	if (!zfs_arc_warmstart || rootdir == NULL ||
+	    !(spa_mode_global & FWRITE))
+		return;
+
+	wa = kmem_zalloc(sizeof (arc_warmstart_arg_t), KM_SLEEP);
+	wa->wa_spa = spa;
+	arc_warmstart_path(spa, wa->wa_path);
+	wa->wa_ents = arc_warmstart_read(spa, wa->wa_path, &wa->wa_nents,
+	    &txg);
+	wa->wa_size = wa->wa_nents * sizeof (arc_warmstart_ent_t);
+
+	if (wa->wa_ents != NULL && txg > max_txg) {
+		for (i = 0, n = 0; i < wa->wa_nents; i++) {
+			if (BP_PHYSICAL_BIRTH(&wa->wa_ents[i].we_bp) <= max_txg)
+				wa->wa_ents[n++] = wa->wa_ents[i];
+			else
+				ARCSTAT_BUMP(arcstat_warmstart_skipped);
+		}
+		wa->wa_nents = n;
+		arc_warmstart_write(spa, wa->wa_path, max_txg, wa->wa_ents, n);
+	}
+	ARCSTAT_INCR(arcstat_warmstart_loaded, wa->wa_nents);
+
+	mutex_enter(&spa->spa_warmstart_lock);
+	ASSERT(spa->spa_warmstart_thread == NULL);
+	spa->spa_warmstart_exit = B_FALSE;
+	spa->spa_warmstart_thread = thread_create(NULL, 0,
+	    arc_warmstart_thread, wa, 0, &p0, TS_RUN, minclsyspri);
+	mutex_exit(&spa->spa_warmstart_lock);
+}
+
+void
+arc_warmstart_destroy(spa_t *spa)
+{
+	mutex_enter(&spa->spa_warmstart_lock);
+	spa->spa_warmstart_exit = B_TRUE;
+	cv_broadcast(&spa->spa_warmstart_cv);
+	while (spa->spa_warmstart_thread != NULL)
+		cv_wait(&spa->spa_warmstart_cv, &spa->spa_warmstart_lock);
+	mutex_exit(&spa->spa_warmstart_lock);
+}
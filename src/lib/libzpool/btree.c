@@ -0,0 +1,688 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/btree.h>
+
+/*
+ * B-tree routines; see btree.h for the interface.
+ * NOTE: caller is responsible for all locking.
+ *
+ * This is a classic B-tree: every element lives in exactly one node, and
+ * a core node with n elements has n + 1 children, the elements of child i
+ * sorting between elements i - 1 and i of the core node.  Insertions
+ * always happen in leaves; a full leaf or core node is split around its
+ * median, which moves up into the parent.  Removing an element from a
+ * core node replaces it with its predecessor, which is then removed from
+ * its leaf.  A node left with fewer than half its capacity borrows an
+ * element from a sibling through the parent or is merged with one.
+ * Appending to the right edge of the tree can leave nodes there below
+ * half full (see btree_split_point()); that is harmless, since two
+ * siblings that can't lend an element always fit in one node.
+ */
+
+#define	BT_LEAF_BYTES(tree, cap)	\
+	(offsetof(btree_leaf_t, btl_elems) + (cap) * (tree)->bt_elem_size)
+#define	BT_CORE_BYTES(tree)		\
+	(offsetof(btree_core_t, btc_elems) + \
+	BTREE_CORE_ELEMS * (tree)->bt_elem_size)
+
+#define	BT_CORE(hdr)		((btree_core_t *)(hdr))
+#define	BT_CHILD(hdr, i)	(BT_CORE(hdr)->btc_children[i])
+
+static inline uint8_t *
+btree_elem(btree_t *tree, btree_hdr_t *hdr, uint32_t i)
+{
+	uint8_t *elems = hdr->bth_core ? BT_CORE(hdr)->btc_elems :
+	    ((btree_leaf_t *)hdr)->btl_elems;
+
+	return (elems + (size_t)i * tree->bt_elem_size);
+}
+
+/*
+ * Move "n" elements of "src" starting at "si" to "dst" starting at "di".
+ */
+static inline void
+btree_move_elems(btree_t *tree, btree_hdr_t *dst, uint32_t di,
+    btree_hdr_t *src, uint32_t si, uint32_t n)
+{
+	(void) memmove(btree_elem(tree, dst, di), btree_elem(tree, src, si),
+	    (size_t)n * tree->bt_elem_size);
+}
+
+/*
+ * Move "n" children of core node "src" starting at "si" to "dst" starting
+ * at "di", and make "dst" their parent.
+ */
+static inline void
+btree_move_children(btree_hdr_t *dst, uint32_t di, btree_hdr_t *src,
+    uint32_t si, uint32_t n)
+{
+	(void) memmove(&BT_CHILD(dst, di), &BT_CHILD(src, si),
+	    n * sizeof (btree_hdr_t *));
+	if (dst != src) {
+		for (uint32_t i = di; i < di + n; i++)
+			BT_CHILD(dst, i)->bth_parent = BT_CORE(dst);
+	}
+}
+
+static size_t
+btree_node_bytes(btree_t *tree, btree_hdr_t *hdr)
+{
+	if (hdr->bth_core)
+		return (BT_CORE_BYTES(tree));
+	return (BT_LEAF_BYTES(tree, hdr->bth_cap));
+}
+
+static btree_hdr_t *
+btree_node_alloc(btree_t *tree, boolean_t core, uint32_t cap)
+{
+	size_t size = core ? BT_CORE_BYTES(tree) : BT_LEAF_BYTES(tree, cap);
+	btree_hdr_t *hdr = kmem_alloc(size, KM_SLEEP);
+
+	hdr->bth_parent = NULL;
+	hdr->bth_count = 0;
+	hdr->bth_cap = core ? BTREE_CORE_ELEMS : cap;
+	hdr->bth_core = core;
+	tree->bt_memory += size;
+
+	return (hdr);
+}
+
+static void
+btree_node_free(btree_t *tree, btree_hdr_t *hdr)
+{
+	size_t size = btree_node_bytes(tree, hdr);
+
+	ASSERT3U(tree->bt_memory, >=, size);
+	tree->bt_memory -= size;
+	kmem_free(hdr, size);
+}
+
+/*
+ * Return the index of "child" among the children of "parent".
+ */
+static uint32_t
+btree_child_idx(btree_core_t *parent, btree_hdr_t *child)
+{
+	uint32_t i;
+
+	for (i = 0; i <= parent->btc_hdr.bth_count; i++) {
+		if (parent->btc_children[i] == child)
+			return (i);
+	}
+	panic("btree node %p not a child of %p", (void *)child,
+	    (void *)parent);
+	return (0);
+}
+
+void
+btree_create(btree_t *tree, int (*compar)(const void *, const void *),
+    size_t size)
+{
+	ASSERT(size != 0);
+	ASSERT3U(size, <=, BTREE_LEAF_SIZE / 8);
+
+	tree->bt_root = NULL;
+	tree->bt_height = -1;
+	tree->bt_elem_size = size;
+	tree->bt_leaf_cap = (BTREE_LEAF_SIZE -
+	    offsetof(btree_leaf_t, btl_elems)) / size;
+	tree->bt_num_elems = 0;
+	tree->bt_memory = 0;
+	tree->bt_compar = compar;
+}
+
+void
+btree_destroy(btree_t *tree)
+{
+	ASSERT(tree->bt_root == NULL);
+	ASSERT3U(tree->bt_num_elems, ==, 0);
+	ASSERT3U(tree->bt_memory, ==, 0);
+}
+
+/*
+ * Binary search one node.  Return the index of the first element not less
+ * than "value", and whether it is equal to "value".
+ */
+static uint32_t
+btree_node_search(btree_t *tree, btree_hdr_t *hdr, const void *value,
+    boolean_t *found)
+{
+	uint8_t *elems = btree_elem(tree, hdr, 0);
+	size_t size = tree->bt_elem_size;
+	uint32_t lo = 0;
+	uint32_t hi = hdr->bth_count;
+
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		int c = tree->bt_compar(value, elems + mid * size);
+
+		if (c == 0) {
+			*found = B_TRUE;
+			return (mid);
+		}
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	*found = B_FALSE;
+	return (lo);
+}
+
+void *
+btree_find(btree_t *tree, const void *value, btree_index_t *where)
+{
+	btree_hdr_t *hdr = tree->bt_root;
+	boolean_t found;
+	uint32_t i;
+
+	if (hdr == NULL) {
+		if (where != NULL) {
+			where->bti_node = NULL;
+			where->bti_offset = 0;
+			where->bti_before = B_TRUE;
+		}
+		return (NULL);
+	}
+
+	for (;;) {
+		i = btree_node_search(tree, hdr, value, &found);
+		if (found || !hdr->bth_core)
+			break;
+		hdr = BT_CHILD(hdr, i);
+	}
+
+	if (where != NULL) {
+		where->bti_node = hdr;
+		where->bti_offset = i;
+		where->bti_before = !found;
+	}
+	return (found ? btree_elem(tree, hdr, i) : NULL);
+}
+
+/*
+ * Return the element index around which to split full node "hdr" when
+ * inserting at "idx".  Normally that is the middle, but a node on the
+ * right edge of the tree that is being appended to keeps all of its
+ * elements, so that trees built in ascending order end up with full
+ * nodes rather than half-full ones.
+ */
+static uint32_t
+btree_split_point(btree_t *tree, btree_hdr_t *hdr, uint32_t idx)
+{
+	btree_hdr_t *p;
+
+	if (idx == hdr->bth_count) {
+		for (p = tree->bt_root; p != hdr && p->bth_core;
+		    p = BT_CHILD(p, p->bth_count))
+			continue;
+		if (p == hdr)
+			return (hdr->bth_count - 1);
+	}
+	return (hdr->bth_count / 2);
+}
+
+static void btree_insert_into_core(btree_t *tree, btree_hdr_t *hdr,
+    uint32_t idx, const void *value, btree_hdr_t *child);
+
+/*
+ * "left" has just been split; add the median and the new node "right"
+ * to its parent, growing the tree if "left" was the root.
+ */
+static void
+btree_insert_into_parent(btree_t *tree, btree_hdr_t *left,
+    const void *median, btree_hdr_t *right)
+{
+	btree_core_t *parent = left->bth_parent;
+	btree_hdr_t *root;
+
+	if (parent != NULL) {
+		btree_insert_into_core(tree, &parent->btc_hdr,
+		    btree_child_idx(parent, left), median, right);
+		return;
+	}
+
+	ASSERT3P(left, ==, tree->bt_root);
+	root = btree_node_alloc(tree, B_TRUE, BTREE_CORE_ELEMS);
+	bcopy(median, btree_elem(tree, root, 0), tree->bt_elem_size);
+	BT_CHILD(root, 0) = left;
+	BT_CHILD(root, 1) = right;
+	root->bth_count = 1;
+	left->bth_parent = right->bth_parent = BT_CORE(root);
+	tree->bt_root = root;
+	tree->bt_height++;
+}
+
+/*
+ * Insert "value" as element "idx" of core node "hdr", with "child" as the
+ * child to its right.
+ */
+static void
+btree_insert_into_core(btree_t *tree, btree_hdr_t *hdr, uint32_t idx,
+    const void *value, btree_hdr_t *child)
+{
+	uint32_t count = hdr->bth_count;
+	uint32_t m;
+	btree_hdr_t *right;
+
+	ASSERT(hdr->bth_core);
+	ASSERT3U(idx, <=, count);
+
+	if (count < BTREE_CORE_ELEMS) {
+		btree_move_elems(tree, hdr, idx + 1, hdr, idx, count - idx);
+		btree_move_children(hdr, idx + 2, hdr, idx + 1, count - idx);
+		bcopy(value, btree_elem(tree, hdr, idx), tree->bt_elem_size);
+		BT_CHILD(hdr, idx + 1) = child;
+		child->bth_parent = BT_CORE(hdr);
+		hdr->bth_count++;
+		return;
+	}
+
+	/*
+	 * Split around element m: the elements and children above it move
+	 * to a new node, element m moves up into the parent (which may
+	 * split in turn), and then there is room for the new element.
+	 */
+	m = btree_split_point(tree, hdr, idx);
+	right = btree_node_alloc(tree, B_TRUE, BTREE_CORE_ELEMS);
+	right->bth_count = count - m - 1;
+	btree_move_elems(tree, right, 0, hdr, m + 1, right->bth_count);
+	btree_move_children(right, 0, hdr, m + 1, right->bth_count + 1);
+	btree_insert_into_parent(tree, hdr, btree_elem(tree, hdr, m), right);
+	hdr->bth_count = m;
+
+	if (idx <= m)
+		btree_insert_into_core(tree, hdr, idx, value, child);
+	else
+		btree_insert_into_core(tree, right, idx - m - 1, value, child);
+}
+
+static void
+btree_insert_into_leaf(btree_t *tree, btree_hdr_t *hdr, uint32_t idx,
+    const void *value)
+{
+	uint32_t count = hdr->bth_count;
+	uint32_t m;
+	btree_hdr_t *right;
+
+	ASSERT(!hdr->bth_core);
+	ASSERT3U(idx, <=, count);
+
+	if (count == hdr->bth_cap && hdr->bth_cap < tree->bt_leaf_cap) {
+		btree_hdr_t *leaf;
+
+		/*
+		 * Only a lone root leaf is ever smaller than a page.
+		 */
+		ASSERT3P(hdr, ==, tree->bt_root);
+		leaf = btree_node_alloc(tree, B_FALSE,
+		    MIN(hdr->bth_cap * 2, tree->bt_leaf_cap));
+		btree_move_elems(tree, leaf, 0, hdr, 0, count);
+		leaf->bth_count = count;
+		btree_node_free(tree, hdr);
+		tree->bt_root = hdr = leaf;
+	}
+
+	if (count < hdr->bth_cap) {
+		btree_move_elems(tree, hdr, idx + 1, hdr, idx, count - idx);
+		bcopy(value, btree_elem(tree, hdr, idx), tree->bt_elem_size);
+		hdr->bth_count++;
+		return;
+	}
+
+	/*
+	 * Split the full leaf the same way as a core node.
+	 */
+	m = btree_split_point(tree, hdr, idx);
+	right = btree_node_alloc(tree, B_FALSE, tree->bt_leaf_cap);
+	right->bth_count = count - m - 1;
+	btree_move_elems(tree, right, 0, hdr, m + 1, right->bth_count);
+	btree_insert_into_parent(tree, hdr, btree_elem(tree, hdr, m), right);
+	hdr->bth_count = m;
+
+	if (idx <= m)
+		btree_insert_into_leaf(tree, hdr, idx, value);
+	else
+		btree_insert_into_leaf(tree, right, idx - m - 1, value);
+}
+
+void
+btree_insert(btree_t *tree, const void *value, const btree_index_t *where)
+{
+	ASSERT(where->bti_before);
+
+	if (tree->bt_root == NULL) {
+		ASSERT(where->bti_node == NULL);
+		tree->bt_root = btree_node_alloc(tree, B_FALSE,
+		    MIN(BTREE_LEAF_MIN_CAP, tree->bt_leaf_cap));
+		tree->bt_height = 0;
+		btree_insert_into_leaf(tree, tree->bt_root, 0, value);
+	} else {
+		btree_insert_into_leaf(tree, where->bti_node,
+		    where->bti_offset, value);
+	}
+	tree->bt_num_elems++;
+}
+
+void
+btree_add(btree_t *tree, const void *value)
+{
+	btree_index_t where;
+
+	VERIFY(btree_find(tree, value, &where) == NULL);
+	btree_insert(tree, value, &where);
+}
+
+static void btree_remove_from_node(btree_t *tree, btree_hdr_t *hdr,
+    uint32_t idx);
+
+/*
+ * Fold element "sep" of "parent" and all of its right neighbour "right"
+ * into "left", then remove both from the parent.
+ */
+static void
+btree_merge(btree_t *tree, btree_hdr_t *parent, uint32_t sep,
+    btree_hdr_t *left, btree_hdr_t *right)
+{
+	uint32_t lc = left->bth_count;
+	uint32_t rc = right->bth_count;
+
+	ASSERT3U(lc + 1 + rc, <=, left->bth_cap);
+
+	btree_move_elems(tree, left, lc, parent, sep, 1);
+	btree_move_elems(tree, left, lc + 1, right, 0, rc);
+	if (left->bth_core)
+		btree_move_children(left, lc + 1, right, 0, rc + 1);
+	left->bth_count = lc + 1 + rc;
+	btree_node_free(tree, right);
+
+	btree_remove_from_node(tree, parent, sep);
+}
+
+/*
+ * Remove element "idx" from a leaf, or element "idx" and child "idx + 1"
+ * from a core node, and rebalance the tree.
+ */
+static void
+btree_remove_from_node(btree_t *tree, btree_hdr_t *hdr, uint32_t idx)
+{
+	btree_core_t *parent = hdr->bth_parent;
+	btree_hdr_t *l, *r;
+	uint32_t count = hdr->bth_count;
+	uint32_t min, ci;
+
+	ASSERT3U(idx, <, count);
+	btree_move_elems(tree, hdr, idx, hdr, idx + 1, count - idx - 1);
+	if (hdr->bth_core) {
+		btree_move_children(hdr, idx + 1, hdr, idx + 2,
+		    count - idx - 1);
+	}
+	hdr->bth_count = --count;
+
+	if (parent == NULL) {
+		ASSERT3P(hdr, ==, tree->bt_root);
+		if (count != 0)
+			return;
+		if (hdr->bth_core) {
+			tree->bt_root = BT_CHILD(hdr, 0);
+			tree->bt_root->bth_parent = NULL;
+		} else {
+			tree->bt_root = NULL;
+		}
+		tree->bt_height--;
+		btree_node_free(tree, hdr);
+		return;
+	}
+
+	min = ((hdr->bth_core ? BTREE_CORE_ELEMS : tree->bt_leaf_cap) - 1) / 2;
+	if (count >= min)
+		return;
+
+	ci = btree_child_idx(parent, hdr);
+	l = ci > 0 ? parent->btc_children[ci - 1] : NULL;
+	r = ci < parent->btc_hdr.bth_count ? parent->btc_children[ci + 1] :
+	    NULL;
+
+	if (l != NULL && l->bth_count > min) {
+		/*
+		 * Rotate the last element of the left sibling through the
+		 * parent.
+		 */
+		btree_move_elems(tree, hdr, 1, hdr, 0, count);
+		btree_move_elems(tree, hdr, 0, &parent->btc_hdr, ci - 1, 1);
+		btree_move_elems(tree, &parent->btc_hdr, ci - 1,
+		    l, l->bth_count - 1, 1);
+		if (hdr->bth_core) {
+			btree_move_children(hdr, 1, hdr, 0, count + 1);
+			btree_move_children(hdr, 0, l, l->bth_count, 1);
+		}
+		l->bth_count--;
+		hdr->bth_count++;
+	} else if (r != NULL && r->bth_count > min) {
+		/*
+		 * Rotate the first element of the right sibling through the
+		 * parent.
+		 */
+		btree_move_elems(tree, hdr, count, &parent->btc_hdr, ci, 1);
+		btree_move_elems(tree, &parent->btc_hdr, ci, r, 0, 1);
+		btree_move_elems(tree, r, 0, r, 1, r->bth_count - 1);
+		if (hdr->bth_core) {
+			btree_move_children(hdr, count + 1, r, 0, 1);
+			btree_move_children(r, 0, r, 1, r->bth_count);
+		}
+		r->bth_count--;
+		hdr->bth_count++;
+	} else if (l != NULL) {
+		btree_merge(tree, &parent->btc_hdr, ci - 1, l, hdr);
+	} else {
+		ASSERT(r != NULL);
+		btree_merge(tree, &parent->btc_hdr, ci, hdr, r);
+	}
+}
+
+void
+btree_remove_idx(btree_t *tree, btree_index_t *where)
+{
+	btree_hdr_t *hdr = where->bti_node;
+	uint32_t idx = where->bti_offset;
+
+	ASSERT(!where->bti_before);
+	ASSERT3U(idx, <, hdr->bth_count);
+
+	if (hdr->bth_core) {
+		btree_hdr_t *leaf = BT_CHILD(hdr, idx);
+
+		/*
+		 * Overwrite the element with its predecessor, which is the
+		 * last element of the rightmost leaf of its left subtree,
+		 * and remove that instead.
+		 */
+		while (leaf->bth_core)
+			leaf = BT_CHILD(leaf, leaf->bth_count);
+		btree_move_elems(tree, hdr, idx, leaf, leaf->bth_count - 1, 1);
+		hdr = leaf;
+		idx = leaf->bth_count - 1;
+	}
+
+	btree_remove_from_node(tree, hdr, idx);
+	tree->bt_num_elems--;
+}
+
+void
+btree_remove(btree_t *tree, const void *value)
+{
+	btree_index_t where;
+
+	VERIFY(btree_find(tree, value, &where) != NULL);
+	btree_remove_idx(tree, &where);
+}
+
+static void *
+btree_set_idx(btree_t *tree, btree_hdr_t *hdr, uint32_t i,
+    btree_index_t *out)
+{
+	if (out != NULL) {
+		out->bti_node = hdr;
+		out->bti_offset = i;
+		out->bti_before = B_FALSE;
+	}
+	return (btree_elem(tree, hdr, i));
+}
+
+void *
+btree_first(btree_t *tree, btree_index_t *where)
+{
+	btree_hdr_t *hdr = tree->bt_root;
+
+	if (hdr == NULL)
+		return (NULL);
+	while (hdr->bth_core)
+		hdr = BT_CHILD(hdr, 0);
+	return (btree_set_idx(tree, hdr, 0, where));
+}
+
+void *
+btree_last(btree_t *tree, btree_index_t *where)
+{
+	btree_hdr_t *hdr = tree->bt_root;
+
+	if (hdr == NULL)
+		return (NULL);
+	while (hdr->bth_core)
+		hdr = BT_CHILD(hdr, hdr->bth_count);
+	return (btree_set_idx(tree, hdr, hdr->bth_count - 1, where));
+}
+
+void *
+btree_next(btree_t *tree, const btree_index_t *idx, btree_index_t *out)
+{
+	btree_hdr_t *hdr = idx->bti_node;
+	uint32_t off = idx->bti_offset;
+
+	if (hdr == NULL)
+		return (NULL);
+
+	if (hdr->bth_core) {
+		ASSERT(!idx->bti_before);
+		hdr = BT_CHILD(hdr, off + 1);
+		while (hdr->bth_core)
+			hdr = BT_CHILD(hdr, 0);
+		return (btree_set_idx(tree, hdr, 0, out));
+	}
+
+	if (!idx->bti_before)
+		off++;
+	if (off < hdr->bth_count)
+		return (btree_set_idx(tree, hdr, off, out));
+
+	/*
+	 * Climb until we come up from a child with an element to its right.
+	 */
+	while (hdr->bth_parent != NULL) {
+		btree_core_t *parent = hdr->bth_parent;
+		uint32_t ci = btree_child_idx(parent, hdr);
+
+		if (ci < parent->btc_hdr.bth_count)
+			return (btree_set_idx(tree, &parent->btc_hdr, ci, out));
+		hdr = &parent->btc_hdr;
+	}
+	return (NULL);
+}
+
+void *
+btree_prev(btree_t *tree, const btree_index_t *idx, btree_index_t *out)
+{
+	btree_hdr_t *hdr = idx->bti_node;
+	uint32_t off = idx->bti_offset;
+
+	if (hdr == NULL)
+		return (NULL);
+
+	if (hdr->bth_core) {
+		ASSERT(!idx->bti_before);
+		hdr = BT_CHILD(hdr, off);
+		while (hdr->bth_core)
+			hdr = BT_CHILD(hdr, hdr->bth_count);
+		return (btree_set_idx(tree, hdr, hdr->bth_count - 1, out));
+	}
+
+	if (off > 0)
+		return (btree_set_idx(tree, hdr, off - 1, out));
+
+	/*
+	 * Climb until we come up from a child with an element to its left.
+	 */
+	while (hdr->bth_parent != NULL) {
+		btree_core_t *parent = hdr->bth_parent;
+		uint32_t ci = btree_child_idx(parent, hdr);
+
+		if (ci > 0) {
+			return (btree_set_idx(tree, &parent->btc_hdr, ci - 1,
+			    out));
+		}
+		hdr = &parent->btc_hdr;
+	}
+	return (NULL);
+}
+
+void *
+btree_get(btree_t *tree, const btree_index_t *idx)
+{
+	ASSERT(!idx->bti_before);
+	ASSERT3U(idx->bti_offset, <, idx->bti_node->bth_count);
+
+	return (btree_elem(tree, idx->bti_node, idx->bti_offset));
+}
+
+ulong_t
+btree_numnodes(btree_t *tree)
+{
+	return (tree->bt_num_elems);
+}
+
+size_t
+btree_memory(btree_t *tree)
+{
+	return (tree->bt_memory);
+}
+
+static void
+btree_free_subtree(btree_t *tree, btree_hdr_t *hdr)
+{
+	if (hdr->bth_core) {
+		for (uint32_t i = 0; i <= hdr->bth_count; i++)
+			btree_free_subtree(tree, BT_CHILD(hdr, i));
+	}
+	btree_node_free(tree, hdr);
+}
+
+void
+btree_clear(btree_t *tree)
+{
+	if (tree->bt_root != NULL)
+		btree_free_subtree(tree, tree->bt_root);
+	tree->bt_root = NULL;
+	tree->bt_height = -1;
+	tree->bt_num_elems = 0;
+	ASSERT3U(tree->bt_memory, ==, 0);
+}
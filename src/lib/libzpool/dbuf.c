@@ -74,26 +74,73 @@ static dbuf_hash_table_t dbuf_hash_table;
 
 static uint64_t dbuf_hash_count;
 
+/*
+ * The hash table starts with dbuf_hash_initial buckets and doubles in
+ * size whenever it holds more than dbuf_hash_load dbufs per bucket.  The
+ * old buckets are moved over dbuf_hash_migrate_batch at a time, by the
+ * threads that insert new dbufs.  There are dbuf_hash_mutexes_per_cpu
+ * hash mutexes per CPU, at least 256.
+ */
+uint64_t dbuf_hash_initial = 1ULL << 16;
+int dbuf_hash_load = 2;
+int dbuf_hash_migrate_batch = 64;
+int dbuf_hash_mutexes_per_cpu = 64;
+
+typedef struct dbuf_stats {
+	kstat_named_t hash_elements;
+	kstat_named_t hash_buckets;
+	kstat_named_t hash_mutexes;
+	kstat_named_t hash_collisions;
+	kstat_named_t hash_chain_max;
+	kstat_named_t hash_lock_waits;
+	kstat_named_t hash_resizes;
+	kstat_named_t hash_migrating;
+} dbuf_stats_t;
+
+static dbuf_stats_t dbuf_stats = {
+	{ "hash_elements",	KSTAT_DATA_UINT64 },
+	{ "hash_buckets",	KSTAT_DATA_UINT64 },
+	{ "hash_mutexes",	KSTAT_DATA_UINT64 },
+	{ "hash_collisions",	KSTAT_DATA_UINT64 },
+	{ "hash_chain_max",	KSTAT_DATA_UINT64 },
+	{ "hash_lock_waits",	KSTAT_DATA_UINT64 },
+	{ "hash_resizes",	KSTAT_DATA_UINT64 },
+	{ "hash_migrating",	KSTAT_DATA_UINT64 }
+};
+
+#define	DBUFSTAT(stat)		(dbuf_stats.stat.value.ui64)
+#define	DBUFSTAT_BUMP(stat)	atomic_add_64(&dbuf_stats.stat.value.ui64, 1)
+#define	DBUFSTAT_MAX(stat, val) {					\
+	uint64_t m;							\
+	while ((val) > (m = dbuf_stats.stat.value.ui64) &&		\
+	    (m != atomic_cas_64(&dbuf_stats.stat.value.ui64, m, (val))))	\
+		continue;						\
+}
+
+static kstat_t *dbuf_ksp;
+
+/*
+ * A multiplicative mix of the dbuf's identity, finished with the 64-bit
+ * MurmurHash3 avalanche so that all bits of the result are usable.
+ */
 static uint64_t
 dbuf_hash(void *os, uint64_t obj, uint8_t lvl, uint64_t blkid)
 {
-	uintptr_t osv = (uintptr_t)os;
-	uint64_t crc = -1ULL;
+	uint64_t h = ((uintptr_t)os >> 6) ^ ((uint64_t)lvl << 56);
 
-	ASSERT(zfs_crc64_table[128] == ZFS_CRC64_POLY);
-	crc = (crc >> 8) ^ zfs_crc64_table[(crc ^ (lvl)) & 0xFF];
-	crc = (crc >> 8) ^ zfs_crc64_table[(crc ^ (osv >> 6)) & 0xFF];
-	crc = (crc >> 8) ^ zfs_crc64_table[(crc ^ (obj >> 0)) & 0xFF];
-	crc = (crc >> 8) ^ zfs_crc64_table[(crc ^ (obj >> 8)) & 0xFF];
-	crc = (crc >> 8) ^ zfs_crc64_table[(crc ^ (blkid >> 0)) & 0xFF];
-	crc = (crc >> 8) ^ zfs_crc64_table[(crc ^ (blkid >> 8)) & 0xFF];
+	h ^= obj * 0x9e3779b97f4a7c15ULL;
+	h ^= (h >> 29) ^ (blkid * 0xc2b2ae3d27d4eb4fULL);
 
-	crc ^= (osv>>14) ^ (obj>>16) ^ (blkid>>16);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
 
-	return (crc);
+	return (h);
 }
 
-#define	DBUF_HASH(os, obj, level, blkid) dbuf_hash(os, obj, level, blkid);
+#define	DBUF_HASH(os, obj, level, blkid) dbuf_hash(os, obj, level, blkid)
 
 #define	DBUF_EQUAL(dbuf, os, obj, level, blkid)		\
 	((dbuf)->db.db_object == (obj) &&		\
@@ -101,6 +148,144 @@ dbuf_hash(void *os, uint64_t obj, uint8_t lvl, uint64_t blkid)
 	(dbuf)->db_level == (level) &&			\
 	(dbuf)->db_blkid == (blkid))
 
+static kmutex_t *
+dbuf_hash_enter(dbuf_hash_table_t *h, uint64_t hv)
+{
+	kmutex_t *mp = DBUF_HASH_MUTEX(h, hv);
+
+	if (!mutex_tryenter(mp)) {
+		DBUFSTAT_BUMP(hash_lock_waits);
+		mutex_enter(mp);
+	}
+	return (mp);
+}
+
+static void
+dbuf_hash_enter_all(dbuf_hash_table_t *h)
+{
+	uint64_t i;
+
+	for (i = 0; i <= h->hash_mutex_mask; i++)
+		mutex_enter(&h->hash_mutexes[i]);
+}
+
+static void
+dbuf_hash_exit_all(dbuf_hash_table_t *h)
+{
+	uint64_t i;
+
+	for (i = 0; i <= h->hash_mutex_mask; i++)
+		mutex_exit(&h->hash_mutexes[i]);
+}
+
+/*
+ * Find a dbuf that is not being evicted and return it with db_mtx held.
+ * The caller holds the hash mutex for hv.
+ */
+static dmu_buf_impl_t *
+dbuf_hash_search(dbuf_hash_table_t *h, uint64_t hv, objset_t *os,
+    uint64_t obj, uint8_t level, uint64_t blkid)
+{
+	dmu_buf_impl_t **table = h->hash_table;
+	uint64_t mask = h->hash_table_mask;
+	dmu_buf_impl_t *db;
+	uint64_t len;
+
+	ASSERT(MUTEX_HELD(DBUF_HASH_MUTEX(h, hv)));
+
+	for (;;) {
+		len = 0;
+		for (db = table[hv & mask]; db != NULL; db = db->db_hash_next) {
+			len++;
+			if (DBUF_EQUAL(db, os, obj, level, blkid)) {
+				mutex_enter(&db->db_mtx);
+				if (db->db_state != DB_EVICTING) {
+					DBUFSTAT_MAX(hash_chain_max, len);
+					return (db);
+				}
+				mutex_exit(&db->db_mtx);
+			}
+		}
+		DBUFSTAT_MAX(hash_chain_max, len);
+
+		/* not moved out of the old table yet? */
+		if (table == h->hash_old_table || h->hash_old_table == NULL)
+			return (NULL);
+		table = h->hash_old_table;
+		mask = h->hash_old_mask;
+	}
+}
+
+/*
+ * Start doubling the table once it is loaded past dbuf_hash_load, and
+ * move the next dbuf_hash_migrate_batch buckets of the old table while
+ * there is one.  Called without a hash mutex held; only one thread does
+ * this at a time and the others just go on.
+ */
+static void
+dbuf_hash_grow(dbuf_hash_table_t *h)
+{
+	dmu_buf_impl_t **table, *db;
+	uint64_t size, b, end, idx;
+	kmutex_t *mp;
+
+	if (h->hash_old_table == NULL &&
+	    dbuf_hash_count <= (h->hash_table_mask + 1) * dbuf_hash_load)
+		return;
+	if (!mutex_tryenter(&h->hash_resize_lock))
+		return;
+
+	if (h->hash_old_table == NULL) {
+		size = h->hash_table_mask + 1;
+		if (dbuf_hash_count <= size * dbuf_hash_load ||
+		    (table = kmem_zalloc(2 * size * sizeof (void *),
+		    KM_NOSLEEP)) == NULL) {
+			mutex_exit(&h->hash_resize_lock);
+			return;
+		}
+		dbuf_hash_enter_all(h);
+		h->hash_old_table = h->hash_table;
+		h->hash_old_mask = h->hash_table_mask;
+		h->hash_table = table;
+		h->hash_table_mask = 2 * size - 1;
+		dbuf_hash_exit_all(h);
+		h->hash_migrate_next = 0;
+		DBUFSTAT_BUMP(hash_resizes);
+	}
+
+	/*
+	 * The dbufs of an old bucket all go to new buckets with the same
+	 * low bits, so one hash mutex covers the move.
+	 */
+	end = MIN(h->hash_migrate_next + dbuf_hash_migrate_batch,
+	    h->hash_old_mask + 1);
+	for (b = h->hash_migrate_next; b < end; b++) {
+		mp = DBUF_HASH_MUTEX(h, b);
+		mutex_enter(mp);
+		while ((db = h->hash_old_table[b]) != NULL) {
+			idx = DBUF_HASH(db->db_objset, db->db.db_object,
+			    db->db_level, db->db_blkid) & h->hash_table_mask;
+			ASSERT3P(DBUF_HASH_MUTEX(h, idx), ==, mp);
+			h->hash_old_table[b] = db->db_hash_next;
+			db->db_hash_next = h->hash_table[idx];
+			h->hash_table[idx] = db;
+		}
+		mutex_exit(mp);
+	}
+	h->hash_migrate_next = end;
+
+	if (end == h->hash_old_mask + 1) {
+		table = h->hash_old_table;
+		size = h->hash_old_mask + 1;
+		dbuf_hash_enter_all(h);
+		h->hash_old_table = NULL;
+		h->hash_old_mask = 0;
+		dbuf_hash_exit_all(h);
+		kmem_free(table, size * sizeof (void *));
+	}
+	mutex_exit(&h->hash_resize_lock);
+}
+
 dmu_buf_impl_t *
 dbuf_find(dnode_t *dn, uint8_t level, uint64_t blkid)
 {
@@ -108,22 +293,13 @@ dbuf_find(dnode_t *dn, uint8_t level, uint64_t blkid)
 	objset_t *os = dn->dn_objset;
 	uint64_t obj = dn->dn_object;
 	uint64_t hv = DBUF_HASH(os, obj, level, blkid);
-	uint64_t idx = hv & h->hash_table_mask;
+	kmutex_t *mp;
 	dmu_buf_impl_t *db;
 
-	mutex_enter(DBUF_HASH_MUTEX(h, idx));
-	for (db = h->hash_table[idx]; db != NULL; db = db->db_hash_next) {
-		if (DBUF_EQUAL(db, os, obj, level, blkid)) {
-			mutex_enter(&db->db_mtx);
-			if (db->db_state != DB_EVICTING) {
-				mutex_exit(DBUF_HASH_MUTEX(h, idx));
-				return (db);
-			}
-			mutex_exit(&db->db_mtx);
-		}
-	}
-	mutex_exit(DBUF_HASH_MUTEX(h, idx));
-	return (NULL);
+	mp = dbuf_hash_enter(h, hv);
+	db = dbuf_hash_search(h, hv, os, obj, level, blkid);
+	mutex_exit(mp);
+	return (db);
 }
 
 /*
@@ -141,25 +317,25 @@ dbuf_hash_insert(dmu_buf_impl_t *db)
 	int level = db->db_level;
 	uint64_t blkid = db->db_blkid;
 	uint64_t hv = DBUF_HASH(os, obj, level, blkid);
-	uint64_t idx = hv & h->hash_table_mask;
-	dmu_buf_impl_t *dbf;
-
-	mutex_enter(DBUF_HASH_MUTEX(h, idx));
-	for (dbf = h->hash_table[idx]; dbf != NULL; dbf = dbf->db_hash_next) {
-		if (DBUF_EQUAL(dbf, os, obj, level, blkid)) {
-			mutex_enter(&dbf->db_mtx);
-			if (dbf->db_state != DB_EVICTING) {
-				mutex_exit(DBUF_HASH_MUTEX(h, idx));
-				return (dbf);
-			}
-			mutex_exit(&dbf->db_mtx);
-		}
+	dmu_buf_impl_t *dbf, **bucket;
+	kmutex_t *mp;
+
+	dbuf_hash_grow(h);
+
+	mp = dbuf_hash_enter(h, hv);
+	dbf = dbuf_hash_search(h, hv, os, obj, level, blkid);
+	if (dbf != NULL) {
+		mutex_exit(mp);
+		return (dbf);
 	}
 
 	mutex_enter(&db->db_mtx);
-	db->db_hash_next = h->hash_table[idx];
-	h->hash_table[idx] = db;
-	mutex_exit(DBUF_HASH_MUTEX(h, idx));
+	bucket = &h->hash_table[hv & h->hash_table_mask];
+	if (*bucket != NULL)
+		DBUFSTAT_BUMP(hash_collisions);
+	db->db_hash_next = *bucket;
+	*bucket = db;
+	mutex_exit(mp);
 	atomic_add_64(&dbuf_hash_count, 1);
 
 	return (NULL);
@@ -175,8 +351,8 @@ dbuf_hash_remove(dmu_buf_impl_t *db)
 	dbuf_hash_table_t *h = &dbuf_hash_table;
 	uint64_t hv = DBUF_HASH(db->db_objset, db->db.db_object,
 	    db->db_level, db->db_blkid);
-	uint64_t idx = hv & h->hash_table_mask;
-	dmu_buf_impl_t *dbf, **dbp;
+	dmu_buf_impl_t **dbp;
+	kmutex_t *mp;
 
 	/*
 	 * We musn't hold db_mtx to maintin lock ordering:
@@ -186,18 +362,42 @@ dbuf_hash_remove(dmu_buf_impl_t *db)
 	ASSERT(db->db_state == DB_EVICTING);
 	ASSERT(!MUTEX_HELD(&db->db_mtx));
 
-	mutex_enter(DBUF_HASH_MUTEX(h, idx));
-	dbp = &h->hash_table[idx];
-	while ((dbf = *dbp) != db) {
-		dbp = &dbf->db_hash_next;
-		ASSERT(dbf != NULL);
+	mp = dbuf_hash_enter(h, hv);
+	dbp = &h->hash_table[hv & h->hash_table_mask];
+	while (*dbp != NULL && *dbp != db)
+		dbp = &(*dbp)->db_hash_next;
+	if (*dbp == NULL) {
+		/* not moved out of the old table yet */
+		ASSERT(h->hash_old_table != NULL);
+		dbp = &h->hash_old_table[hv & h->hash_old_mask];
+		while (*dbp != db) {
+			ASSERT(*dbp != NULL);
+			dbp = &(*dbp)->db_hash_next;
+		}
 	}
 	*dbp = db->db_hash_next;
 	db->db_hash_next = NULL;
-	mutex_exit(DBUF_HASH_MUTEX(h, idx));
+	mutex_exit(mp);
 	atomic_add_64(&dbuf_hash_count, -1);
 }
 
+static int
+dbuf_stats_update(kstat_t *ksp, int rw)
+{
+	dbuf_hash_table_t *h = &dbuf_hash_table;
+	dbuf_stats_t *ds = ksp->ks_data;
+
+	if (rw == KSTAT_WRITE)
+		return (EACCES);
+
+	ds->hash_elements.value.ui64 = dbuf_hash_count;
+	ds->hash_buckets.value.ui64 = h->hash_table_mask + 1;
+	ds->hash_mutexes.value.ui64 = h->hash_mutex_mask + 1;
+	ds->hash_migrating.value.ui64 = h->hash_old_table == NULL ? 0 :
+	    h->hash_old_mask + 1 - h->hash_migrate_next;
+	return (0);
+}
+
 static arc_evict_func_t dbuf_do_evict;
 
 static void
@@ -230,17 +430,21 @@ dbuf_evict(dmu_buf_impl_t *db)
 void
 dbuf_init(void)
 {
-	uint64_t hsize = 1ULL << 16;
+	uint64_t hsize = dbuf_hash_initial;
+	uint64_t nmutexes = 256;
 	dbuf_hash_table_t *h = &dbuf_hash_table;
 	int i;
 
 	/*
-	 * The hash table is big enough to fill all of physical memory
-	 * with an average 4K block size.  The table will take up
-	 * totalmem*sizeof(void*)/4K (i.e. 2MB/GB with 8-byte pointers).
+	 * The table grows with the number of cached dbufs, see
+	 * dbuf_hash_grow(), so it only needs to start out big enough for
+	 * the hash mutexes.
 	 */
-	while (hsize * 4096 < physmem * PAGESIZE)
-		hsize <<= 1;
+	if (!ISP2(hsize))
+		hsize = 1ULL << highbit(hsize);
+	while (nmutexes < (uint64_t)MAX(ncpus, 1) * dbuf_hash_mutexes_per_cpu)
+		nmutexes <<= 1;
+	hsize = MAX(hsize, nmutexes);
 
 retry:
 	h->hash_table_mask = hsize - 1;
@@ -249,15 +453,31 @@ retry:
 		/* XXX - we should really return an error instead of assert */
 		ASSERT(hsize > (1ULL << 10));
 		hsize >>= 1;
+		nmutexes = MIN(nmutexes, hsize);
 		goto retry;
 	}
+	h->hash_old_table = NULL;
+	h->hash_old_mask = 0;
+	h->hash_migrate_next = 0;
+	mutex_init(&h->hash_resize_lock, NULL, MUTEX_DEFAULT, NULL);
 
 	dbuf_cache = kmem_cache_create("dmu_buf_impl_t",
 	    sizeof (dmu_buf_impl_t),
 	    0, dbuf_cons, dbuf_dest, NULL, NULL, NULL, 0);
 
-	for (i = 0; i < DBUF_MUTEXES; i++)
+	h->hash_mutex_mask = nmutexes - 1;
+	h->hash_mutexes = kmem_zalloc(nmutexes * sizeof (kmutex_t), KM_SLEEP);
+	for (i = 0; i < nmutexes; i++)
 		mutex_init(&h->hash_mutexes[i], NULL, MUTEX_DEFAULT, NULL);
+
+	dbuf_ksp = kstat_create("zfs", 0, "dbufstats", "misc",
+	    KSTAT_TYPE_NAMED, sizeof (dbuf_stats) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_VIRTUAL);
+	if (dbuf_ksp != NULL) {
+		dbuf_ksp->ks_data = &dbuf_stats;
+		dbuf_ksp->ks_update = dbuf_stats_update;
+		kstat_install(dbuf_ksp);
+	}
 }
 
 void
@@ -266,9 +486,21 @@ dbuf_fini(void)
 	dbuf_hash_table_t *h = &dbuf_hash_table;
 	int i;
 
-	for (i = 0; i < DBUF_MUTEXES; i++)
+	if (dbuf_ksp != NULL) {
+		kstat_delete(dbuf_ksp);
+		dbuf_ksp = NULL;
+	}
+
+	for (i = 0; i <= h->hash_mutex_mask; i++)
 		mutex_destroy(&h->hash_mutexes[i]);
+	kmem_free(h->hash_mutexes, (h->hash_mutex_mask + 1) *
+	    sizeof (kmutex_t));
+	if (h->hash_old_table != NULL) {
+		kmem_free(h->hash_old_table,
+		    (h->hash_old_mask + 1) * sizeof (void *));
+	}
 	kmem_free(h->hash_table, (h->hash_table_mask + 1) * sizeof (void *));
+	mutex_destroy(&h->hash_resize_lock);
 	kmem_cache_destroy(dbuf_cache);
 }
 
@@ -1694,6 +1926,33 @@ dbuf_prefetch(dnode_t *dn, uint64_t blkid)
 	}
 }
 
+/*
+ * If buf is cached on behalf of a dbuf, copy out that dbuf's block pointer
+ * and bookmark.  The caller holds the buffer's hash lock, which keeps the
+ * ARC from evicting it, and dbuf_clear() from getting past arc_buf_evict(),
+ * while we look.  dbuf_clear() may still be clearing db_blkptr underneath
+ * us, so the caller must check the copy against the buffer's identity.
+ */
+boolean_t
+dbuf_arc_blkptr(arc_buf_t *buf, blkptr_t *bp, zbookmark_t *zb)
+{
+	dmu_buf_impl_t *db;
+	blkptr_t *dbp;
+
+	if (buf->b_efunc != dbuf_do_evict)
+		return (B_FALSE);
+
+	db = buf->b_private;
+	dbp = db->db_blkptr;
+	if (dbp == NULL || db->db_blkid == DB_BONUS_BLKID)
+		return (B_FALSE);
+
+	*bp = *dbp;
+	SET_BOOKMARK(zb, dmu_objset_id(db->db_objset), db->db.db_object,
+	    db->db_level, db->db_blkid);
+	return (B_TRUE);
+}
+
 /*
  * Returns with db_holds incremented, and db_mtx not held.
  * Note: dn_struct_rwlock must be held.
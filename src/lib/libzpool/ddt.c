@@ -46,6 +46,62 @@ static const char *ddt_class_name[DDT_CLASSES] = {
 	"unique",
 };
 
+/*
+ * Bytes of clean entries each table keeps in core between txgs;
+ * zero disables the entry cache.
+ */
+uint64_t zfs_ddt_cache_max = 32ULL << 20;
+
+/*
+ * Entries a table may have in its dedup log before the log is applied
+ * to the ZAP objects; zero, the default, updates the ZAP objects
+ * directly every txg.  The log is not part of any pool version, so other
+ * implementations ignore it: only enable it for pools that are always
+ * exported cleanly before being imported elsewhere.
+ */
+uint64_t zfs_ddt_log_max = 0;
+int ddt_log_blockshift = 17;
+
+/*
+ * Records the log object may hold, as a multiple of zfs_ddt_log_max,
+ * before it is applied regardless of its entry count.  Entries that are
+ * updated every txg add a record each time without adding an entry, so
+ * this bounds the log's size on disk and the work to replay it.
+ */
+int zfs_ddt_log_records_ratio = 4;
+
+/*
+ * What the table syncs write, so the ZAP and log I/O per sync can be
+ * compared with the dedup log on and off.
+ */
+kstat_t *ddt_ksp = NULL;
+
+typedef struct ddt_stats {
+	kstat_named_t ddt_stat_syncs;
+	kstat_named_t ddt_stat_zap_updates;
+	kstat_named_t ddt_stat_zap_removes;
+	kstat_named_t ddt_stat_log_records;
+	kstat_named_t ddt_stat_log_bytes;
+	kstat_named_t ddt_stat_log_flushes;
+	kstat_named_t ddt_stat_log_flush_entries;
+} ddt_stats_t;
+
+static ddt_stats_t ddt_stats = {
+	{ "syncs",		KSTAT_DATA_UINT64 },
+	{ "zap_updates",	KSTAT_DATA_UINT64 },
+	{ "zap_removes",	KSTAT_DATA_UINT64 },
+	{ "log_records",	KSTAT_DATA_UINT64 },
+	{ "log_bytes",		KSTAT_DATA_UINT64 },
+	{ "log_flushes",	KSTAT_DATA_UINT64 },
+	{ "log_flush_entries",	KSTAT_DATA_UINT64 }
+};
+
+#define	DDTSTAT_INCR(stat, val)	\
+	atomic_add_64(&ddt_stats.stat.value.ui64, (val))
+#define	DDTSTAT_BUMP(stat)	DDTSTAT_INCR(stat, 1)
+
+static int ddt_log_lookup(ddt_t *ddt, ddt_entry_t *dde);
+
 static void
 ddt_object_create(ddt_t *ddt, enum ddt_type type, enum ddt_class class,
     dmu_tx_t *tx)
@@ -160,12 +216,24 @@ ddt_object_lookup(ddt_t *ddt, enum ddt_type type, enum ddt_class class,
 	    ddt->ddt_object[type][class], dde));
 }
 
+static void
+ddt_object_prefetch(ddt_t *ddt, enum ddt_type type, enum ddt_class class,
+    ddt_entry_t *dde)
+{
+	if (!ddt_object_exists(ddt, type, class))
+		return;
+
+	ddt_ops[type]->ddt_op_prefetch(ddt->ddt_os,
+	    ddt->ddt_object[type][class], dde);
+}
+
 int
 ddt_object_update(ddt_t *ddt, enum ddt_type type, enum ddt_class class,
     ddt_entry_t *dde, dmu_tx_t *tx)
 {
 	ASSERT(ddt_object_exists(ddt, type, class));
 
+	DDTSTAT_BUMP(ddt_stat_zap_updates);
 	return (ddt_ops[type]->ddt_op_update(ddt->ddt_os,
 	    ddt->ddt_object[type][class], dde, tx));
 }
@@ -176,18 +244,33 @@ ddt_object_remove(ddt_t *ddt, enum ddt_type type, enum ddt_class class,
 {
 	ASSERT(ddt_object_exists(ddt, type, class));
 
+	DDTSTAT_BUMP(ddt_stat_zap_removes);
 	return (ddt_ops[type]->ddt_op_remove(ddt->ddt_os,
 	    ddt->ddt_object[type][class], dde, tx));
 }
 
+/*
+ * Walk the entries of a ZAP object as the dedup log has them: entries the
+ * log has since moved to another object, or freed, are skipped, and those
+ * still here come back with their logged phys.  ddt_log_walk() returns the
+ * logged entries that belong in the object but aren't in it yet.
+ */
 int
 ddt_object_walk(ddt_t *ddt, enum ddt_type type, enum ddt_class class,
     uint64_t *walk, ddt_entry_t *dde)
 {
+	int error;
+
 	ASSERT(ddt_object_exists(ddt, type, class));
 
-	return (ddt_ops[type]->ddt_op_walk(ddt->ddt_os,
-	    ddt->ddt_object[type][class], dde, walk));
+	while ((error = ddt_ops[type]->ddt_op_walk(ddt->ddt_os,
+	    ddt->ddt_object[type][class], dde, walk)) == 0) {
+		if (ddt_log_lookup(ddt, dde) != 0 ||
+		    (dde->dde_type == type && dde->dde_class == class))
+			break;
+	}
+
+	return (error);
 }
 
 uint64_t
@@ -600,16 +683,23 @@ ddt_select(spa_t *spa, const blkptr_t *bp)
 	return (spa->spa_ddt[BP_GET_CHECKSUM(bp)]);
 }
 
+static ddt_shard_t *
+ddt_shard(ddt_t *ddt, const ddt_key_t *ddk)
+{
+	/* The key is a block checksum, so its low bits are well mixed. */
+	return (&ddt->ddt_shard[ddk->ddk_cksum.zc_word[0] & (DDT_SHARDS - 1)]);
+}
+
 void
-ddt_enter(ddt_t *ddt)
+ddt_enter(ddt_t *ddt, const ddt_key_t *ddk)
 {
-	mutex_enter(&ddt->ddt_lock);
+	mutex_enter(&ddt_shard(ddt, ddk)->dsh_lock);
 }
 
 void
-ddt_exit(ddt_t *ddt)
+ddt_exit(ddt_t *ddt, const ddt_key_t *ddk)
 {
-	mutex_exit(&ddt->ddt_lock);
+	mutex_exit(&ddt_shard(ddt, ddk)->dsh_lock);
 }
 
 static ddt_entry_t *
@@ -644,42 +734,524 @@ ddt_free(ddt_entry_t *dde)
 void
 ddt_remove(ddt_t *ddt, ddt_entry_t *dde)
 {
-	ASSERT(MUTEX_HELD(&ddt->ddt_lock));
+	ddt_shard_t *dsh = ddt_shard(ddt, &dde->dde_key);
+
+	ASSERT(MUTEX_HELD(&dsh->dsh_lock));
 
-	avl_remove(&ddt->ddt_tree, dde);
+	avl_remove(&dsh->dsh_tree, dde);
 	ddt_free(dde);
 }
 
+static void
+ddt_cache_insert(ddt_shard_t *dsh, const ddt_entry_t *dde)
+{
+	ddt_cached_t *ddc;
+	int ptype = DDT_PHYS_TYPES;
+	int nphys = 0;
+	size_t size;
+
+	for (int p = 0; p < DDT_PHYS_TYPES; p++) {
+		if (dde->dde_phys[p].ddp_phys_birth != 0) {
+			ptype = p;
+			nphys++;
+		}
+	}
+	if (nphys != 1)
+		ptype = DDT_PHYS_TYPES;
+
+	size = DDT_CACHED_SIZE(ptype);
+	ddc = kmem_alloc(size, KM_SLEEP);
+	ddc->ddc_key = dde->dde_key;
+	ddc->ddc_type = dde->dde_type;
+	ddc->ddc_class = dde->dde_class;
+	ddc->ddc_phys_type = ptype;
+	if (ptype == DDT_PHYS_TYPES)
+		bcopy(dde->dde_phys, ddc->ddc_phys, sizeof (dde->dde_phys));
+	else
+		ddc->ddc_phys[0] = dde->dde_phys[ptype];
+
+	avl_add(&dsh->dsh_cache, ddc);
+	list_insert_tail(&dsh->dsh_cache_lru, ddc);
+	dsh->dsh_cache_size += size;
+	arc_space_consume(size, ARC_SPACE_OTHER);
+}
+
+static void
+ddt_cache_remove(ddt_shard_t *dsh, ddt_cached_t *ddc)
+{
+	size_t size = DDT_CACHED_SIZE(ddc->ddc_phys_type);
+
+	avl_remove(&dsh->dsh_cache, ddc);
+	list_remove(&dsh->dsh_cache_lru, ddc);
+	ASSERT3U(dsh->dsh_cache_size, >=, size);
+	dsh->dsh_cache_size -= size;
+	arc_space_return(size, ARC_SPACE_OTHER);
+	kmem_free(ddc, size);
+}
+
+/*
+ * Trim each shard's cache to its share of zfs_ddt_cache_max, and give
+ * half of it back whenever the ARC is short on room for metadata.
+ */
+static void
+ddt_cache_trim(ddt_t *ddt)
+{
+	boolean_t meta_full = arc_meta_full();
+
+	for (int s = 0; s < DDT_SHARDS; s++) {
+		ddt_shard_t *dsh = &ddt->ddt_shard[s];
+		uint64_t target = zfs_ddt_cache_max / DDT_SHARDS;
+		ddt_cached_t *ddc;
+
+		mutex_enter(&dsh->dsh_lock);
+		if (meta_full)
+			target = MIN(target, dsh->dsh_cache_size / 2);
+		while (dsh->dsh_cache_size > target &&
+		    (ddc = list_head(&dsh->dsh_cache_lru)) != NULL)
+			ddt_cache_remove(dsh, ddc);
+		mutex_exit(&dsh->dsh_lock);
+	}
+}
+
+static int
+ddt_log_compare(const void *x1, const void *x2)
+{
+	const ddt_log_entry_t *dle1 = x1;
+	const ddt_log_entry_t *dle2 = x2;
+	const uint64_t *u1 = (const uint64_t *)&dle1->dle_key;
+	const uint64_t *u2 = (const uint64_t *)&dle2->dle_key;
+
+	for (int i = 0; i < DDT_KEY_WORDS; i++) {
+		if (u1[i] < u2[i])
+			return (-1);
+		if (u1[i] > u2[i])
+			return (1);
+	}
+
+	return (0);
+}
+
+static void
+ddt_log_name(ddt_t *ddt, char *name)
+{
+	(void) sprintf(name, DMU_POOL_DDT_LOG,
+	    zio_checksum_table[ddt->ddt_checksum].ci_name);
+}
+
+static void
+ddt_log_remove(ddt_t *ddt, ddt_shard_t *dsh, ddt_log_entry_t *dle)
+{
+	ASSERT(MUTEX_HELD(&dsh->dsh_lock));
+
+	avl_remove(&dsh->dsh_log, dle);
+	ASSERT(ddt->ddt_log_entries > 0);
+	ddt->ddt_log_entries--;
+	arc_space_return(sizeof (*dle), ARC_SPACE_OTHER);
+	kmem_free(dle, sizeof (*dle));
+}
+
+/*
+ * Fold a log record into the in-core log, both for records written by
+ * ddt_sync() and for those replayed by ddt_load().  Only syncing context
+ * changes the log, but ddt_log_lookup() may read it from anywhere.
+ */
+static void
+ddt_log_apply(ddt_t *ddt, const ddt_log_record_t *dlr)
+{
+	ddt_shard_t *dsh = ddt_shard(ddt, &dlr->dlr_key);
+	ddt_log_entry_t *dle, dle_search;
+	avl_index_t where;
+
+	dle_search.dle_key = dlr->dlr_key;
+	mutex_enter(&dsh->dsh_lock);
+	dle = avl_find(&dsh->dsh_log, &dle_search, &where);
+	if (dle == NULL) {
+		dle = kmem_alloc(sizeof (*dle), KM_SLEEP);
+		dle->dle_key = dlr->dlr_key;
+		dle->dle_ztype = DLR_GET_ZTYPE(dlr);
+		dle->dle_zclass = DLR_GET_ZCLASS(dlr);
+		avl_insert(&dsh->dsh_log, dle, where);
+		ddt->ddt_log_entries++;
+		arc_space_consume(sizeof (*dle), ARC_SPACE_OTHER);
+	}
+	bcopy(dlr->dlr_phys, dle->dle_phys, sizeof (dle->dle_phys));
+	dle->dle_type = DLR_GET_TYPE(dlr);
+	dle->dle_class = DLR_GET_CLASS(dlr);
+
+	/* Created and freed within the log: the ZAP objects never had it. */
+	if (dle->dle_ztype == DDT_TYPES && dle->dle_type == DDT_TYPES)
+		ddt_log_remove(ddt, dsh, dle);
+	mutex_exit(&dsh->dsh_lock);
+}
+
+/*
+ * Look dde's key up in the log, which is newer than the ZAP objects.
+ * Returns ENOENT if the log has nothing for it.
+ */
+static int
+ddt_log_lookup(ddt_t *ddt, ddt_entry_t *dde)
+{
+	ddt_shard_t *dsh = ddt_shard(ddt, &dde->dde_key);
+	ddt_log_entry_t *dle, dle_search;
+	int error = ENOENT;
+
+	dle_search.dle_key = dde->dde_key;
+	mutex_enter(&dsh->dsh_lock);
+	if ((dle = avl_find(&dsh->dsh_log, &dle_search, NULL)) != NULL) {
+		bcopy(dle->dle_phys, dde->dde_phys, sizeof (dde->dde_phys));
+		dde->dde_type = dle->dle_type;
+		dde->dde_class = dle->dle_class;
+		error = 0;
+	}
+	mutex_exit(&dsh->dsh_lock);
+
+	return (error);
+}
+
+/*
+ * Does the log move dle into (type, class) from somewhere else (in > 0),
+ * or out of it (in < 0)?
+ */
+static int
+ddt_log_moves(const ddt_log_entry_t *dle, enum ddt_type type,
+    enum ddt_class class)
+{
+	boolean_t was = (dle->dle_ztype == type && dle->dle_zclass == class);
+	boolean_t is = (dle->dle_type == type && dle->dle_class == class);
+
+	return (is - was);
+}
+
+/*
+ * Return, in key order, the logged entries that belong in (type, class)
+ * but that its ZAP object doesn't have yet.  *walk is zero to start and
+ * the walk resumes after dde's key; returns ENOENT at the end.
+ */
+int
+ddt_log_walk(ddt_t *ddt, enum ddt_type type, enum ddt_class class,
+    uint64_t *walk, ddt_entry_t *dde)
+{
+	ddt_log_entry_t *dle, *best = NULL, dle_search;
+	avl_index_t where;
+
+	dle_search.dle_key = dde->dde_key;
+
+	for (int s = 0; s < DDT_SHARDS; s++) {
+		ddt_shard_t *dsh = &ddt->ddt_shard[s];
+
+		mutex_enter(&dsh->dsh_lock);
+		if (*walk == 0) {
+			dle = avl_first(&dsh->dsh_log);
+		} else if ((dle = avl_find(&dsh->dsh_log, &dle_search,
+		    &where)) != NULL) {
+			dle = AVL_NEXT(&dsh->dsh_log, dle);
+		} else {
+			dle = avl_nearest(&dsh->dsh_log, where, AVL_AFTER);
+		}
+		while (dle != NULL && ddt_log_moves(dle, type, class) <= 0)
+			dle = AVL_NEXT(&dsh->dsh_log, dle);
+		if (dle != NULL &&
+		    (best == NULL || ddt_log_compare(dle, best) < 0))
+			best = dle;
+		mutex_exit(&dsh->dsh_lock);
+	}
+
+	if (best == NULL)
+		return (ENOENT);
+
+	dde->dde_key = best->dle_key;
+	bcopy(best->dle_phys, dde->dde_phys, sizeof (dde->dde_phys));
+	dde->dde_type = type;
+	dde->dde_class = class;
+	(*walk)++;
+
+	return (0);
+}
+
+/*
+ * The number of entries in (type, class), counting the log.
+ */
+uint64_t
+ddt_entry_count(ddt_t *ddt, enum ddt_type type, enum ddt_class class)
+{
+	int64_t count = ddt_object_count(ddt, type, class);
+
+	for (int s = 0; s < DDT_SHARDS; s++) {
+		ddt_shard_t *dsh = &ddt->ddt_shard[s];
+
+		mutex_enter(&dsh->dsh_lock);
+		for (ddt_log_entry_t *dle = avl_first(&dsh->dsh_log);
+		    dle != NULL; dle = AVL_NEXT(&dsh->dsh_log, dle))
+			count += ddt_log_moves(dle, type, class);
+		mutex_exit(&dsh->dsh_lock);
+	}
+	ASSERT(count >= 0);
+
+	return (count);
+}
+
+static void
+ddt_log_set_records(ddt_t *ddt, uint64_t records, dmu_tx_t *tx)
+{
+	dmu_buf_t *db;
+
+	VERIFY(dmu_bonus_hold(ddt->ddt_os, ddt->ddt_log_object,
+	    FTAG, &db) == 0);
+	dmu_buf_will_dirty(db, tx);
+	*(uint64_t *)db->db_data = records;
+	dmu_buf_rele(db, FTAG);
+
+	ddt->ddt_log_records = records;
+}
+
+static void
+ddt_log_write(ddt_t *ddt, const ddt_log_record_t *dlr, uint64_t n,
+    dmu_tx_t *tx)
+{
+	objset_t *os = ddt->ddt_os;
+
+	if (ddt->ddt_log_object == 0) {
+		char name[DDT_NAMELEN];
+
+		ddt_log_name(ddt, name);
+		ddt->ddt_log_object = dmu_object_alloc(os, DMU_OT_OBJECT_ARRAY,
+		    1 << ddt_log_blockshift, DMU_OT_OBJECT_ARRAY,
+		    sizeof (uint64_t), tx);
+		VERIFY(zap_add(os, DMU_POOL_DIRECTORY_OBJECT, name,
+		    sizeof (uint64_t), 1, &ddt->ddt_log_object, tx) == 0);
+	}
+
+	dmu_write(os, ddt->ddt_log_object,
+	    ddt->ddt_log_records * sizeof (*dlr), n * sizeof (*dlr), dlr, tx);
+	ddt_log_set_records(ddt, ddt->ddt_log_records + n, tx);
+
+	DDTSTAT_INCR(ddt_stat_log_records, n);
+	DDTSTAT_INCR(ddt_stat_log_bytes, n * sizeof (*dlr));
+}
+
+/*
+ * Apply the whole log to the ZAP objects and empty it.  The shards are
+ * merged so that the updates go out in key order, which for the
+ * pre-hashed dedup checksums is also ZAP leaf order.
+ */
+static void
+ddt_log_flush(ddt_t *ddt, dmu_tx_t *tx)
+{
+	ddt_log_entry_t *cur[DDT_SHARDS];
+	ddt_entry_t dde;
+
+	if (ddt->ddt_log_records == 0) {
+		ASSERT(ddt->ddt_log_entries == 0);
+		return;
+	}
+
+	DDTSTAT_BUMP(ddt_stat_log_flushes);
+	DDTSTAT_INCR(ddt_stat_log_flush_entries, ddt->ddt_log_entries);
+
+	for (int s = 0; s < DDT_SHARDS; s++)
+		cur[s] = avl_first(&ddt->ddt_shard[s].dsh_log);
+
+	for (;;) {
+		ddt_log_entry_t *dle;
+		int best = -1;
+
+		for (int s = 0; s < DDT_SHARDS; s++) {
+			if (cur[s] != NULL && (best == -1 ||
+			    ddt_log_compare(cur[s], cur[best]) < 0))
+				best = s;
+		}
+		if (best == -1)
+			break;
+
+		dle = cur[best];
+		cur[best] = AVL_NEXT(&ddt->ddt_shard[best].dsh_log, dle);
+
+		dde.dde_key = dle->dle_key;
+		bcopy(dle->dle_phys, dde.dde_phys, sizeof (dde.dde_phys));
+
+		if (dle->dle_ztype != DDT_TYPES &&
+		    (dle->dle_ztype != dle->dle_type ||
+		    dle->dle_zclass != dle->dle_class)) {
+			VERIFY(ddt_object_remove(ddt, dle->dle_ztype,
+			    dle->dle_zclass, &dde, tx) == 0);
+		}
+		if (dle->dle_type != DDT_TYPES) {
+			VERIFY(ddt_object_update(ddt, dle->dle_type,
+			    dle->dle_class, &dde, tx) == 0);
+		}
+
+		mutex_enter(&ddt->ddt_shard[best].dsh_lock);
+		ddt_log_remove(ddt, &ddt->ddt_shard[best], dle);
+		mutex_exit(&ddt->ddt_shard[best].dsh_lock);
+	}
+	ASSERT(ddt->ddt_log_entries == 0);
+
+	VERIFY(dmu_free_range(ddt->ddt_os, ddt->ddt_log_object,
+	    0, DMU_OBJECT_END, tx) == 0);
+	ddt_log_set_records(ddt, 0, tx);
+}
+
+static int
+ddt_log_load(ddt_t *ddt)
+{
+	objset_t *os = ddt->ddt_os;
+	ddt_log_record_t *dlr;
+	char name[DDT_NAMELEN];
+	dmu_buf_t *db;
+	uint64_t records;
+	uint64_t chunk = SPA_MAXBLOCKSIZE / sizeof (*dlr);
+	int error;
+
+	ddt_log_name(ddt, name);
+
+	error = zap_lookup(os, DMU_POOL_DIRECTORY_OBJECT, name,
+	    sizeof (uint64_t), 1, &ddt->ddt_log_object);
+	if (error)
+		return (error);
+
+	error = dmu_bonus_hold(os, ddt->ddt_log_object, FTAG, &db);
+	if (error)
+		return (error);
+	records = *(uint64_t *)db->db_data;
+	dmu_buf_rele(db, FTAG);
+
+	dlr = kmem_alloc(chunk * sizeof (*dlr), KM_SLEEP);
+	for (uint64_t r = 0; r < records && error == 0; r += chunk) {
+		uint64_t n = MIN(chunk, records - r);
+
+		error = dmu_read(os, ddt->ddt_log_object, r * sizeof (*dlr),
+		    n * sizeof (*dlr), dlr, DMU_READ_PREFETCH);
+		for (uint64_t i = 0; i < n && error == 0; i++)
+			ddt_log_apply(ddt, &dlr[i]);
+	}
+	kmem_free(dlr, chunk * sizeof (*dlr));
+
+	ddt->ddt_log_records = records;
+
+	return (error);
+}
+
+/*
+ * The log is emptied and bypassed while the pool is being exported, so
+ * that an exported pool needs no replay and any version 25 software can
+ * import it, and while dsl_scan_ddt() walks the ZAP objects directly.
+ */
+static boolean_t
+ddt_log_enabled(ddt_t *ddt)
+{
+	spa_t *spa = ddt->ddt_spa;
+	dsl_scan_t *scn = spa->spa_dsl_pool->dp_scan;
+
+	if (zfs_ddt_log_max == 0 || spa_state(spa) == POOL_STATE_EXPORTED)
+		return (B_FALSE);
+
+	return (scn == NULL || scn->scn_phys.scn_state != DSS_SCANNING ||
+	    scn->scn_phys.scn_ddt_bookmark.ddb_class >
+	    scn->scn_phys.scn_ddt_class_max);
+}
+
+void
+ddt_prefetch(spa_t *spa, const blkptr_t *bp)
+{
+	ddt_t *ddt;
+	ddt_entry_t dde;
+
+	if (!BP_GET_DEDUP(bp))
+		return;
+
+	/*
+	 * The DDT objects only come and go in ddt_sync(), so there is
+	 * nothing to lock; the worst a race can cost is a useless read.
+	 */
+	ddt = ddt_select(spa, bp);
+	ddt_key_fill(&dde.dde_key, bp);
+
+	for (enum ddt_type type = 0; type < DDT_TYPES; type++)
+		for (enum ddt_class class = 0; class < DDT_CLASSES; class++)
+			ddt_object_prefetch(ddt, type, class, &dde);
+}
+
 ddt_entry_t *
 ddt_lookup(ddt_t *ddt, const blkptr_t *bp, boolean_t add)
 {
 	ddt_entry_t *dde, dde_search;
+	ddt_cached_t *ddc, ddc_search;
+	ddt_log_entry_t *dle, dle_search;
+	ddt_shard_t *dsh;
 	enum ddt_type type;
 	enum ddt_class class;
 	avl_index_t where;
 	int error;
 
-	ASSERT(MUTEX_HELD(&ddt->ddt_lock));
-
 	ddt_key_fill(&dde_search.dde_key, bp);
+	dsh = ddt_shard(ddt, &dde_search.dde_key);
 
-	dde = avl_find(&ddt->ddt_tree, &dde_search, &where);
+	ASSERT(MUTEX_HELD(&dsh->dsh_lock));
+
+	dde = avl_find(&dsh->dsh_tree, &dde_search, &where);
 	if (dde == NULL) {
-		if (!add)
+		ddc_search.ddc_key = dde_search.dde_key;
+		ddc = avl_find(&dsh->dsh_cache, &ddc_search, NULL);
+		dle = NULL;
+		if (ddc == NULL) {
+			dle_search.dle_key = dde_search.dde_key;
+			dle = avl_find(&dsh->dsh_log, &dle_search, NULL);
+		}
+		if (!add && ddc == NULL &&
+		    (dle == NULL || dle->dle_type == DDT_TYPES))
 			return (NULL);
 		dde = ddt_alloc(&dde_search.dde_key);
-		avl_insert(&ddt->ddt_tree, dde, where);
+		avl_insert(&dsh->dsh_tree, dde, where);
+		if (ddc != NULL || dle != NULL) {
+			/*
+			 * The cache and the log hold the entry as of the
+			 * last sync, which is newer than the ZAP objects;
+			 * take it out of the histogram like a load would.
+			 */
+			if (ddc == NULL) {
+				bcopy(dle->dle_phys, dde->dde_phys,
+				    sizeof (dde->dde_phys));
+				dde->dde_type = dle->dle_type;
+				dde->dde_class = dle->dle_class;
+			} else {
+				if (ddc->ddc_phys_type == DDT_PHYS_TYPES)
+					bcopy(ddc->ddc_phys, dde->dde_phys,
+					    sizeof (dde->dde_phys));
+				else
+					dde->dde_phys[ddc->ddc_phys_type] =
+					    ddc->ddc_phys[0];
+				dde->dde_type = ddc->ddc_type;
+				dde->dde_class = ddc->ddc_class;
+				ddt_cache_remove(dsh, ddc);
+			}
+			dde->dde_loaded = B_TRUE;
+
+			if (dde->dde_type != DDT_TYPES) {
+				mutex_enter(&ddt->ddt_lock);
+				ddt_stat_update(ddt, dde, -1ULL);
+				mutex_exit(&ddt->ddt_lock);
+			}
+			return (dde);
+		}
 	}
 
 	while (dde->dde_loading)
-		cv_wait(&dde->dde_cv, &ddt->ddt_lock);
+		cv_wait(&dde->dde_cv, &dsh->dsh_lock);
 
 	if (dde->dde_loaded)
 		return (dde);
 
 	dde->dde_loading = B_TRUE;
 
-	ddt_exit(ddt);
+	mutex_exit(&dsh->dsh_lock);
+
+	/*
+	 * Most new blocks aren't in any of the objects, so start reading
+	 * all of them now rather than one after the other.
+	 */
+	for (type = 0; type < DDT_TYPES; type++)
+		for (class = 0; class < DDT_CLASSES; class++)
+			ddt_object_prefetch(ddt, type, class, dde);
 
 	error = ENOENT;
 
@@ -695,7 +1267,7 @@ ddt_lookup(ddt_t *ddt, const blkptr_t *bp, boolean_t add)
 
 	ASSERT(error == 0 || error == ENOENT);
 
-	ddt_enter(ddt);
+	mutex_enter(&dsh->dsh_lock);
 
 	ASSERT(dde->dde_loaded == B_FALSE);
 	ASSERT(dde->dde_loading == B_TRUE);
@@ -705,8 +1277,11 @@ ddt_lookup(ddt_t *ddt, const blkptr_t *bp, boolean_t add)
 	dde->dde_loaded = B_TRUE;
 	dde->dde_loading = B_FALSE;
 
-	if (error == 0)
+	if (error == 0) {
+		mutex_enter(&ddt->ddt_lock);
 		ddt_stat_update(ddt, dde, -1ULL);
+		mutex_exit(&ddt->ddt_lock);
+	}
 
 	cv_broadcast(&dde->dde_cv);
 
@@ -731,6 +1306,24 @@ ddt_entry_compare(const void *x1, const void *x2)
 	return (0);
 }
 
+static int
+ddt_cached_compare(const void *x1, const void *x2)
+{
+	const ddt_cached_t *ddc1 = x1;
+	const ddt_cached_t *ddc2 = x2;
+	const uint64_t *u1 = (const uint64_t *)&ddc1->ddc_key;
+	const uint64_t *u2 = (const uint64_t *)&ddc2->ddc_key;
+
+	for (int i = 0; i < DDT_KEY_WORDS; i++) {
+		if (u1[i] < u2[i])
+			return (-1);
+		if (u1[i] > u2[i])
+			return (1);
+	}
+
+	return (0);
+}
+
 static ddt_t *
 ddt_table_alloc(spa_t *spa, enum zio_checksum c)
 {
@@ -739,8 +1332,19 @@ ddt_table_alloc(spa_t *spa, enum zio_checksum c)
 	ddt = kmem_zalloc(sizeof (*ddt), KM_SLEEP);
 
 	mutex_init(&ddt->ddt_lock, NULL, MUTEX_DEFAULT, NULL);
-	avl_create(&ddt->ddt_tree, ddt_entry_compare,
-	    sizeof (ddt_entry_t), offsetof(ddt_entry_t, dde_node));
+	for (int s = 0; s < DDT_SHARDS; s++) {
+		ddt_shard_t *dsh = &ddt->ddt_shard[s];
+
+		mutex_init(&dsh->dsh_lock, NULL, MUTEX_DEFAULT, NULL);
+		avl_create(&dsh->dsh_tree, ddt_entry_compare,
+		    sizeof (ddt_entry_t), offsetof(ddt_entry_t, dde_node));
+		avl_create(&dsh->dsh_cache, ddt_cached_compare,
+		    sizeof (ddt_cached_t), offsetof(ddt_cached_t, ddc_node));
+		list_create(&dsh->dsh_cache_lru, sizeof (ddt_cached_t),
+		    offsetof(ddt_cached_t, ddc_lru_node));
+		avl_create(&dsh->dsh_log, ddt_log_compare,
+		    sizeof (ddt_log_entry_t), offsetof(ddt_log_entry_t, dle_node));
+	}
 	avl_create(&ddt->ddt_repair_tree, ddt_entry_compare,
 	    sizeof (ddt_entry_t), offsetof(ddt_entry_t, dde_node));
 	ddt->ddt_checksum = c;
@@ -753,14 +1357,52 @@ ddt_table_alloc(spa_t *spa, enum zio_checksum c)
 static void
 ddt_table_free(ddt_t *ddt)
 {
-	ASSERT(avl_numnodes(&ddt->ddt_tree) == 0);
+	for (int s = 0; s < DDT_SHARDS; s++) {
+		ddt_shard_t *dsh = &ddt->ddt_shard[s];
+		ddt_cached_t *ddc;
+		ddt_log_entry_t *dle;
+
+		while ((ddc = list_head(&dsh->dsh_cache_lru)) != NULL)
+			ddt_cache_remove(dsh, ddc);
+		mutex_enter(&dsh->dsh_lock);
+		while ((dle = avl_first(&dsh->dsh_log)) != NULL)
+			ddt_log_remove(ddt, dsh, dle);
+		mutex_exit(&dsh->dsh_lock);
+		ASSERT(avl_numnodes(&dsh->dsh_tree) == 0);
+		ASSERT(dsh->dsh_cache_size == 0);
+		avl_destroy(&dsh->dsh_tree);
+		avl_destroy(&dsh->dsh_cache);
+		list_destroy(&dsh->dsh_cache_lru);
+		avl_destroy(&dsh->dsh_log);
+		mutex_destroy(&dsh->dsh_lock);
+	}
 	ASSERT(avl_numnodes(&ddt->ddt_repair_tree) == 0);
-	avl_destroy(&ddt->ddt_tree);
 	avl_destroy(&ddt->ddt_repair_tree);
 	mutex_destroy(&ddt->ddt_lock);
 	kmem_free(ddt, sizeof (*ddt));
 }
 
+void
+ddt_io_stat_init(void)
+{
+	ddt_ksp = kstat_create("zfs", 0, "ddt_stats", "misc",
+	    KSTAT_TYPE_NAMED, sizeof (ddt_stats) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_VIRTUAL);
+	if (ddt_ksp != NULL) {
+		ddt_ksp->ks_data = &ddt_stats;
+		kstat_install(ddt_ksp);
+	}
+}
+
+void
+ddt_io_stat_fini(void)
+{
+	if (ddt_ksp != NULL) {
+		kstat_delete(ddt_ksp);
+		ddt_ksp = NULL;
+	}
+}
+
 void
 ddt_create(spa_t *spa)
 {
@@ -795,6 +1437,14 @@ ddt_load(spa_t *spa)
 			}
 		}
 
+		/*
+		 * Replay whatever the log holds that hasn't been applied to
+		 * the ZAP objects yet.
+		 */
+		error = ddt_log_load(ddt);
+		if (error != 0 && error != ENOENT)
+			return (error);
+
 		/*
 		 * Seed the cached histograms.
 		 */
@@ -832,6 +1482,9 @@ ddt_class_contains(spa_t *spa, enum ddt_class max_class, const blkptr_t *bp)
 
 	ddt_key_fill(&dde.dde_key, bp);
 
+	if (ddt_log_lookup(ddt, &dde) == 0)
+		return (dde.dde_type != DDT_TYPES && dde.dde_class <= max_class);
+
 	for (enum ddt_type type = 0; type < DDT_TYPES; type++)
 		for (enum ddt_class class = 0; class <= max_class; class++)
 			if (ddt_object_lookup(ddt, type, class, &dde) == 0)
@@ -850,6 +1503,14 @@ ddt_repair_start(ddt_t *ddt, const blkptr_t *bp)
 
 	dde = ddt_alloc(&ddk);
 
+	if (ddt_log_lookup(ddt, dde) == 0) {
+		if (dde->dde_type != DDT_TYPES &&
+		    dde->dde_class != DDT_CLASS_UNIQUE)
+			return (dde);
+		bzero(dde->dde_phys, sizeof (dde->dde_phys));
+		return (dde);
+	}
+
 	for (enum ddt_type type = 0; type < DDT_TYPES; type++) {
 		for (enum ddt_class class = 0; class < DDT_CLASSES; class++) {
 			/*
@@ -873,7 +1534,7 @@ ddt_repair_done(ddt_t *ddt, ddt_entry_t *dde)
 {
 	avl_index_t where;
 
-	ddt_enter(ddt);
+	mutex_enter(&ddt->ddt_lock);
 
 	if (dde->dde_repair_data != NULL && spa_writeable(ddt->ddt_spa) &&
 	    avl_find(&ddt->ddt_repair_tree, dde, &where) == NULL)
@@ -881,7 +1542,7 @@ ddt_repair_done(ddt_t *ddt, ddt_entry_t *dde)
 	else
 		ddt_free(dde);
 
-	ddt_exit(ddt);
+	mutex_exit(&ddt->ddt_lock);
 }
 
 static void
@@ -930,22 +1591,27 @@ ddt_repair_table(ddt_t *ddt, zio_t *rio)
 	if (spa_sync_pass(spa) > 1)
 		return;
 
-	ddt_enter(ddt);
+	mutex_enter(&ddt->ddt_lock);
 	for (rdde = avl_first(t); rdde != NULL; rdde = rdde_next) {
 		rdde_next = AVL_NEXT(t, rdde);
 		avl_remove(&ddt->ddt_repair_tree, rdde);
-		ddt_exit(ddt);
+		mutex_exit(&ddt->ddt_lock);
 		ddt_bp_create(ddt->ddt_checksum, &rdde->dde_key, NULL, &blk);
 		dde = ddt_repair_start(ddt, &blk);
 		ddt_repair_entry(ddt, dde, rdde, rio);
 		ddt_repair_done(ddt, dde);
-		ddt_enter(ddt);
+		mutex_enter(&ddt->ddt_lock);
 	}
-	ddt_exit(ddt);
+	mutex_exit(&ddt->ddt_lock);
 }
 
+/*
+ * Write back one dirty entry: straight to the ZAP objects, or, if dlr is
+ * given, as a dedup log record.
+ */
 static void
-ddt_sync_entry(ddt_t *ddt, ddt_entry_t *dde, dmu_tx_t *tx, uint64_t txg)
+ddt_sync_entry(ddt_t *ddt, ddt_entry_t *dde, dmu_tx_t *tx, uint64_t txg,
+    ddt_log_record_t *dlr)
 {
 	dsl_pool_t *dp = ddt->ddt_spa->spa_dsl_pool;
 	ddt_phys_t *ddp = dde->dde_phys;
@@ -983,19 +1649,47 @@ ddt_sync_entry(ddt_t *ddt, ddt_entry_t *dde, dmu_tx_t *tx, uint64_t txg)
 	else
 		nclass = DDT_CLASS_UNIQUE;
 
-	if (otype != DDT_TYPES &&
-	    (otype != ntype || oclass != nclass || total_refcnt == 0)) {
+	if (total_refcnt == 0) {
+		ntype = DDT_TYPES;
+		nclass = DDT_CLASSES;
+	}
+
+	if (dlr != NULL) {
+		ddt_shard_t *dsh = ddt_shard(ddt, &dde->dde_key);
+		ddt_log_entry_t *dle, dle_search;
+
+		/*
+		 * If the entry is already in the log, the ZAP objects still
+		 * have it where the log says, not where it was loaded from.
+		 */
+		dle_search.dle_key = dde->dde_key;
+		dle = avl_find(&dsh->dsh_log, &dle_search, NULL);
+
+		dlr->dlr_key = dde->dde_key;
+		bcopy(dde->dde_phys, dlr->dlr_phys, sizeof (dlr->dlr_phys));
+		dlr->dlr_loc = 0;
+		DLR_SET_ZTYPE(dlr, dle != NULL ? dle->dle_ztype : otype);
+		DLR_SET_ZCLASS(dlr, dle != NULL ? dle->dle_zclass : oclass);
+		DLR_SET_TYPE(dlr, ntype);
+		DLR_SET_CLASS(dlr, nclass);
+		ddt_log_apply(ddt, dlr);
+	} else if (otype != DDT_TYPES &&
+	    (otype != ntype || oclass != nclass)) {
 		VERIFY(ddt_object_remove(ddt, otype, oclass, dde, tx) == 0);
 		ASSERT(ddt_object_lookup(ddt, otype, oclass, dde) == ENOENT);
 	}
 
+	dde->dde_type = ntype;
+	dde->dde_class = nclass;
+
 	if (total_refcnt != 0) {
-		dde->dde_type = ntype;
-		dde->dde_class = nclass;
 		ddt_stat_update(ddt, dde, 0);
 		if (!ddt_object_exists(ddt, ntype, nclass))
 			ddt_object_create(ddt, ntype, nclass, tx);
-		VERIFY(ddt_object_update(ddt, ntype, nclass, dde, tx) == 0);
+		if (dlr == NULL) {
+			VERIFY(ddt_object_update(ddt, ntype, nclass,
+			    dde, tx) == 0);
+		}
 
 		/*
 		 * If the class changes, the order that we scan this bp
@@ -1011,18 +1705,66 @@ ddt_sync_entry(ddt_t *ddt, ddt_entry_t *dde, dmu_tx_t *tx, uint64_t txg)
 	}
 }
 
+uint64_t
+ddt_dirty_count(ddt_t *ddt)
+{
+	uint64_t count = 0;
+
+	for (int s = 0; s < DDT_SHARDS; s++)
+		count += avl_numnodes(&ddt->ddt_shard[s].dsh_tree);
+
+	return (count);
+}
+
+/*
+ * Write out the statistics of the table's ZAP objects, destroying those
+ * that have become empty.
+ */
+static void
+ddt_sync_objects(ddt_t *ddt, dmu_tx_t *tx)
+{
+	for (enum ddt_type type = 0; type < DDT_TYPES; type++) {
+		for (enum ddt_class class = 0; class < DDT_CLASSES; class++) {
+			if (!ddt_object_exists(ddt, type, class))
+				continue;
+			ddt_object_sync(ddt, type, class, tx);
+			/*
+			 * The histograms count logged entries where they
+			 * belong, so an object the log still has entries
+			 * for is never empty by both measures.
+			 */
+			if (ddt_object_count(ddt, type, class) == 0 &&
+			    ddt_histogram_empty(&ddt->ddt_histogram[type][class]))
+				ddt_object_destroy(ddt, type, class, tx);
+		}
+	}
+
+	bcopy(ddt->ddt_histogram, &ddt->ddt_histogram_cache,
+	    sizeof (ddt->ddt_histogram));
+}
+
 static void
 ddt_sync_table(ddt_t *ddt, dmu_tx_t *tx, uint64_t txg)
 {
 	spa_t *spa = ddt->ddt_spa;
 	ddt_entry_t *dde;
-	void *cookie = NULL;
-
-	if (avl_numnodes(&ddt->ddt_tree) == 0)
+	ddt_log_record_t *dlr = NULL;
+	uint64_t dirty = ddt_dirty_count(ddt);
+	uint64_t chunk = 0;
+	uint64_t n = 0;
+	boolean_t logging = ddt_log_enabled(ddt);
+	boolean_t flush = (ddt->ddt_log_records != 0 && (!logging ||
+	    ddt->ddt_log_entries >= zfs_ddt_log_max ||
+	    ddt->ddt_log_records >= zfs_ddt_log_max *
+	    zfs_ddt_log_records_ratio));
+
+	if (dirty == 0 && !flush)
 		return;
 
 	ASSERT(spa->spa_uberblock.ub_version >= SPA_VERSION_DEDUP);
 
+	DDTSTAT_BUMP(ddt_stat_syncs);
+
 	if (spa->spa_ddt_stat_object == 0) {
 		spa->spa_ddt_stat_object = zap_create(ddt->ddt_os,
 		    DMU_OT_DDT_STATS, DMU_OT_NONE, 0, tx);
@@ -1031,23 +1773,65 @@ ddt_sync_table(ddt_t *ddt, dmu_tx_t *tx, uint64_t txg)
 		    &spa->spa_ddt_stat_object, tx) == 0);
 	}
 
-	while ((dde = avl_destroy_nodes(&ddt->ddt_tree, &cookie)) != NULL) {
-		ddt_sync_entry(ddt, dde, tx, txg);
-		ddt_free(dde);
+	if (flush)
+		ddt_log_flush(ddt, tx);
+
+	/*
+	 * Log records go out a chunk at a time, so that a large sync
+	 * doesn't need a buffer for all of its dirty entries at once.
+	 */
+	if (logging && dirty != 0) {
+		chunk = MIN(dirty, SPA_MAXBLOCKSIZE / sizeof (*dlr));
+		dlr = kmem_alloc(chunk * sizeof (*dlr), KM_SLEEP);
 	}
 
-	for (enum ddt_type type = 0; type < DDT_TYPES; type++) {
-		for (enum ddt_class class = 0; class < DDT_CLASSES; class++) {
-			if (!ddt_object_exists(ddt, type, class))
-				continue;
-			ddt_object_sync(ddt, type, class, tx);
-			if (ddt_object_count(ddt, type, class) == 0)
-				ddt_object_destroy(ddt, type, class, tx);
+	/*
+	 * Entries still on disk after the sync stay in core, in compact
+	 * form, for the next txg that references them.
+	 */
+	for (int s = 0; s < DDT_SHARDS; s++) {
+		ddt_shard_t *dsh = &ddt->ddt_shard[s];
+		void *cookie = NULL;
+
+		while ((dde = avl_destroy_nodes(&dsh->dsh_tree,
+		    &cookie)) != NULL) {
+			ddt_sync_entry(ddt, dde, tx, txg,
+			    dlr != NULL ? &dlr[n++] : NULL);
+			if (dlr != NULL && n == chunk) {
+				ddt_log_write(ddt, dlr, n, tx);
+				n = 0;
+			}
+			if (dde->dde_type != DDT_TYPES &&
+			    zfs_ddt_cache_max != 0)
+				ddt_cache_insert(dsh, dde);
+			ddt_free(dde);
 		}
 	}
+	ddt_cache_trim(ddt);
 
-	bcopy(ddt->ddt_histogram, &ddt->ddt_histogram_cache,
-	    sizeof (ddt->ddt_histogram));
+	if (dlr != NULL) {
+		if (n != 0)
+			ddt_log_write(ddt, dlr, n, tx);
+		kmem_free(dlr, chunk * sizeof (*dlr));
+	}
+
+	ddt_sync_objects(ddt, tx);
+}
+
+/*
+ * Apply every table's log to its ZAP objects, for callers about to walk
+ * the ZAP objects directly.
+ */
+void
+ddt_log_flush_all(spa_t *spa, dmu_tx_t *tx)
+{
+	for (enum zio_checksum c = 0; c < ZIO_CHECKSUM_FUNCTIONS; c++) {
+		ddt_t *ddt = spa->spa_ddt[c];
+		if (ddt == NULL || ddt->ddt_log_records == 0)
+			continue;
+		ddt_log_flush(ddt, tx);
+		ddt_sync_objects(ddt, tx);
+	}
 }
 
 void
@@ -1214,6 +1214,7 @@ dmu_write_policy(objset_t *os, dnode_t *dn, int level, int wp, zio_prop_t *zp)
 	zp->zp_copies = MIN(copies + ismd, spa_max_replication(os->os_spa));
 	zp->zp_dedup = dedup;
 	zp->zp_dedup_verify = dedup && dedup_verify;
+	zp->zp_special_smallblk = ismd ? 0 : os->os_special_smallblk;
 }
 
 int
@@ -1372,6 +1373,7 @@ dmu_init(void)
 	dbuf_init();
 	dnode_init();
 	zfetch_init();
+	dmu_tx_init();
 	arc_init();
 	l2arc_init();
 }
@@ -1380,6 +1382,7 @@ void
 dmu_fini(void)
 {
 	arc_fini();
+	dmu_tx_fini();
 	zfetch_fini();
 	dnode_fini();
 	dbuf_fini();
@@ -28,36 +28,87 @@
 #include <sys/dmu_tx.h>
 #include <sys/dnode.h>
 
+/*
+ * Each CPU slot (each thread hashes to one, see CPU_SEQID) hands out object
+ * numbers from its own chunk of 2^dmu_object_alloc_chunk_shift dnodes, so
+ * that concurrent creates neither serialize on os_obj_lock nor dirty the
+ * same dnode block.  Threads sharing a slot claim from its chunk with
+ * atomic_cas_64(), and os_obj_lock is only taken to grab a new chunk or
+ * to skip ahead over allocated objects.
+ */
+int dmu_object_alloc_chunk_shift = 7;	/* 128 dnodes */
+
 uint64_t
 dmu_object_alloc(objset_t *os, dmu_object_type_t ot, int blocksize,
     dmu_object_type_t bonustype, int bonuslen, dmu_tx_t *tx)
 {
-	uint64_t object;
+	uint64_t object, next;
 	uint64_t L2_dnode_count = DNODES_PER_BLOCK <<
 	    (os->os_meta_dnode->dn_indblkshift - SPA_BLKPTRSHIFT);
+	uint64_t dnodes_per_chunk = 1ULL << dmu_object_alloc_chunk_shift;
+	uint64_t *cpuobj;
 	dnode_t *dn = NULL;
 	int restarted = B_FALSE;
 
-	mutex_enter(&os->os_obj_lock);
+	cpuobj = &os->os_obj_next_percpu[CPU_SEQID];
+
+	/*
+	 * A chunk must cover at least a whole dnode block, or the CPUs would
+	 * still share dnode blocks.  It must not be bigger than an L2 bp
+	 * worth of dnodes, or the sparse L2 search below would never run.
+	 */
+	dnodes_per_chunk = MAX(dnodes_per_chunk, DNODES_PER_BLOCK);
+	dnodes_per_chunk = MIN(dnodes_per_chunk, L2_dnode_count);
+
 	for (;;) {
-		object = os->os_obj_next;
-		/*
-		 * Each time we polish off an L2 bp worth of dnodes
-		 * (2^13 objects), move to another L2 bp that's still
-		 * reasonably sparse (at most 1/4 full).  Look from the
-		 * beginning once, but after that keep looking from here.
-		 * If we can't find one, just keep going from here.
-		 */
-		if (P2PHASE(object, L2_dnode_count) == 0) {
-			uint64_t offset = restarted ? object << DNODE_SHIFT : 0;
-			int error = dnode_next_offset(os->os_meta_dnode,
-			    DNODE_FIND_HOLE,
-			    &offset, 2, DNODES_PER_BLOCK >> 2, 0);
-			restarted = B_TRUE;
-			if (error == 0)
-				object = offset >> DNODE_SHIFT;
+		object = *cpuobj;
+		if (P2PHASE(object, dnodes_per_chunk) == 0) {
+			mutex_enter(&os->os_obj_lock);
+			/*
+			 * Another thread sharing this CPU slot may have
+			 * grabbed the new chunk while we waited.
+			 */
+			if (*cpuobj != object) {
+				mutex_exit(&os->os_obj_lock);
+				continue;
+			}
+			object = os->os_obj_next_chunk;
+			/*
+			 * Each time we polish off an L2 bp worth of dnodes
+			 * (2^12 objects), move to another L2 bp that's still
+			 * reasonably sparse (at most 1/4 full).  Look from
+			 * the beginning once, but after that keep looking
+			 * from here.  If we can't find one, just keep going
+			 * from here.
+			 */
+			if (P2PHASE(object, L2_dnode_count) == 0) {
+				uint64_t offset =
+				    restarted ? object << DNODE_SHIFT : 0;
+				int error = dnode_next_offset(os->os_meta_dnode,
+				    DNODE_FIND_HOLE,
+				    &offset, 2, DNODES_PER_BLOCK >> 2, 0);
+				restarted = B_TRUE;
+				if (error == 0)
+					object = offset >> DNODE_SHIFT;
+			}
+			/*
+			 * The search may not land on a chunk boundary; the
+			 * rest of that chunk is ours, the next one is not.
+			 * Take its first object right away, so that a start
+			 * on a boundary doesn't look used up.
+			 */
+			os->os_obj_next_chunk =
+			    P2ROUNDUP(object + 1, dnodes_per_chunk);
+			(void) atomic_swap_64(cpuobj, object + 1);
+			mutex_exit(&os->os_obj_lock);
+		} else if (atomic_cas_64(cpuobj, object, object + 1) != object) {
+			/*
+			 * Other threads may share this CPU slot; never move
+			 * it past the end of its chunk, which is where the
+			 * next thread takes a new chunk instead.
+			 */
+			continue;
 		}
-		os->os_obj_next = ++object;
 
 		/*
 		 * XXX We should check for an i/o error here and return
@@ -67,18 +118,49 @@ dmu_object_alloc(objset_t *os, dmu_object_type_t ot, int blocksize,
 		 */
 		(void) dnode_hold_impl(os, object, DNODE_MUST_BE_FREE,
 		    FTAG, &dn);
-		if (dn)
-			break;
+		if (dn) {
+			/*
+			 * The sparse L2 search can hand out a chunk that
+			 * starts below os_obj_next_chunk, so check again
+			 * under the struct lock that nobody allocated it.
+			 */
+			rw_enter(&dn->dn_struct_rwlock, RW_WRITER);
+			if (dn->dn_type == DMU_OT_NONE) {
+				dnode_allocate(dn, ot, blocksize, 0,
+				    bonustype, bonuslen, tx);
+				rw_exit(&dn->dn_struct_rwlock);
+				dnode_rele(dn, FTAG);
+				break;
+			}
+			rw_exit(&dn->dn_struct_rwlock);
+			dnode_rele(dn, FTAG);
+			dn = NULL;
+		}
 
-		if (dmu_object_next(os, &object, B_TRUE, 0) == 0)
-			os->os_obj_next = object - 1;
+		/*
+		 * Skip to the next hole.  Within this slot's chunk we carry
+		 * on from there.  Past it, the hole becomes the start of
+		 * the next chunk handed out, unless some slot already has
+		 * that chunk; either way this slot takes a new chunk.
+		 */
+		if (dmu_object_next(os, &object, B_TRUE, 0) != 0)
+			continue;
+		mutex_enter(&os->os_obj_lock);
+		next = *cpuobj;
+		if (P2PHASE(next, dnodes_per_chunk) != 0 &&
+		    P2ALIGN(object, dnodes_per_chunk) ==
+		    P2ALIGN(next, dnodes_per_chunk)) {
+			if (object > next)
+				(void) atomic_cas_64(cpuobj, next, object);
+		} else {
+			if (object > os->os_obj_next_chunk)
+				os->os_obj_next_chunk = object;
+			(void) atomic_cas_64(cpuobj, next,
+			    P2ROUNDUP(next, dnodes_per_chunk));
+		}
+		mutex_exit(&os->os_obj_lock);
 	}
 
-	dnode_allocate(dn, ot, blocksize, 0, bonustype, bonuslen, tx);
-	dnode_rele(dn, FTAG);
-
-	mutex_exit(&os->os_obj_lock);
-
 	dmu_tx_add_new_object(tx, os, object);
 	return (object);
 }
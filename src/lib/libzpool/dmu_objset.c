@@ -137,6 +137,20 @@ copies_changed_cb(void *arg, uint64_t newval)
 	os->os_copies = newval;
 }
 
+static void
+special_smallblk_changed_cb(void *arg, uint64_t newval)
+{
+	objset_t *os = arg;
+
+	/*
+	 * Inheritance and range checking should have been done by now.
+	 */
+	ASSERT(newval <= SPA_MAXBLOCKSIZE);
+	ASSERT(ISP2(newval));
+
+	os->os_special_smallblk = newval;
+}
+
 static void
 dedup_changed_cb(void *arg, uint64_t newval)
 {
@@ -303,6 +317,10 @@ dmu_objset_open_impl(spa_t *spa, dsl_dataset_t *ds, blkptr_t *bp,
 			if (err == 0)
 				err = dsl_prop_register(ds, "logbias",
 				    logbias_changed_cb, os);
+			if (err == 0)
+				err = dsl_prop_register(ds,
+				    "special_small_blocks",
+				    special_smallblk_changed_cb, os);
 		}
 		if (err) {
 			VERIFY(arc_buf_remove_ref(os->os_phys_buf,
@@ -320,6 +338,7 @@ dmu_objset_open_impl(spa_t *spa, dsl_dataset_t *ds, blkptr_t *bp,
 		os->os_logbias = 0;
 		os->os_primary_cache = ZFS_CACHE_ALL;
 		os->os_secondary_cache = ZFS_CACHE_ALL;
+		os->os_special_smallblk = 0;
 	}
 
 	os->os_zil_header = os->os_phys->os_zil_header;
@@ -339,6 +358,8 @@ dmu_objset_open_impl(spa_t *spa, dsl_dataset_t *ds, blkptr_t *bp,
 	mutex_init(&os->os_lock, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&os->os_obj_lock, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&os->os_user_ptr_lock, NULL, MUTEX_DEFAULT, NULL);
+	os->os_obj_next_percpu = kmem_zalloc(max_ncpus * sizeof (uint64_t),
+	    KM_SLEEP);
 
 	os->os_meta_dnode = dnode_special_open(os,
 	    &os->os_phys->os_meta_dnode, DMU_META_DNODE_OBJECT);
@@ -493,6 +514,9 @@ dmu_objset_evict(objset_t *os)
 			    dedup_changed_cb, os));
 			VERIFY(0 == dsl_prop_unregister(ds, "logbias",
 			    logbias_changed_cb, os));
+			VERIFY(0 == dsl_prop_unregister(ds,
+			    "special_small_blocks",
+			    special_smallblk_changed_cb, os));
 		}
 		VERIFY(0 == dsl_prop_unregister(ds, "primarycache",
 		    primary_cache_changed_cb, os));
@@ -519,6 +543,7 @@ dmu_objset_evict(objset_t *os)
 	mutex_destroy(&os->os_lock);
 	mutex_destroy(&os->os_obj_lock);
 	mutex_destroy(&os->os_user_ptr_lock);
+	kmem_free(os->os_obj_next_percpu, max_ncpus * sizeof (uint64_t));
 	kmem_free(os, sizeof (objset_t));
 }
 
@@ -916,6 +941,49 @@ dmu_objset_sync_dnodes(list_t *list, list_t *newlist, dmu_tx_t *tx)
 	}
 }
 
+/*
+ * Dirty dnodes are synced in parallel on the pool's dp_sync_taskq.  They
+ * are split into DMU_OBJSET_SYNC_LISTS lists by dnode block, so dnodes
+ * that share a block, and with it the block's zio and db_mtx, are synced
+ * by the same task.  With fewer than zfs_sync_dnodes_min dirty dnodes
+ * the dispatch isn't worth it and the sync thread does them itself.
+ */
+int zfs_sync_dnodes_min = 64;
+
+#define	DMU_OBJSET_SYNC_LISTS	16
+
+typedef struct sync_dnodes_arg {
+	list_t		sda_list;	/* dnodes to sync */
+	list_t		sda_synced;	/* synced dnodes, for userquota */
+	boolean_t	sda_userused;	/* keep sda_synced */
+	dmu_tx_t	*sda_tx;
+} sync_dnodes_arg_t;
+
+static int
+dmu_objset_split_dnodes(list_t *list, sync_dnodes_arg_t *sda)
+{
+	dnode_t *dn;
+	uint64_t blk;
+	int n = 0;
+
+	while (dn = list_head(list)) {
+		blk = dn->dn_object >> DNODES_PER_BLOCK_SHIFT;
+		list_remove(list, dn);
+		list_insert_tail(&sda[blk % DMU_OBJSET_SYNC_LISTS].sda_list, dn);
+		n++;
+	}
+	return (n);
+}
+
+static void
+dmu_objset_sync_dnodes_task(void *arg)
+{
+	sync_dnodes_arg_t *sda = arg;
+
+	dmu_objset_sync_dnodes(&sda->sda_list,
+	    sda->sda_userused ? &sda->sda_synced : NULL, sda->sda_tx);
+}
+
 /* ARGSUSED */
 static void
 dmu_objset_write_ready(zio_t *zio, arc_buf_t *abuf, void *arg)
@@ -969,6 +1037,8 @@ dmu_objset_sync(objset_t *os, zio_t *pio, dmu_tx_t *tx)
 	list_t *list;
 	list_t *newlist = NULL;
 	dbuf_dirty_record_t *dr;
+	sync_dnodes_arg_t *sda;
+	int i, ndnodes, ntasks = 0;
 
 	dprintf_ds(os->os_dsl_dataset, "txg=%"PRIu64"\n", tx->tx_txg);
 
@@ -1029,8 +1099,46 @@ dmu_objset_sync(objset_t *os, zio_t *pio, dmu_tx_t *tx)
 		    offsetof(dnode_t, dn_dirty_link[txgoff]));
 	}
 
-	dmu_objset_sync_dnodes(&os->os_free_dnodes[txgoff], newlist, tx);
-	dmu_objset_sync_dnodes(&os->os_dirty_dnodes[txgoff], newlist, tx);
+	/*
+	 * Free dnodes go first in each list, as they did when this was
+	 * done serially.  The dnode blocks' zios can only be issued once
+	 * every dnode in them has been synced.
+	 */
+	sda = kmem_alloc(DMU_OBJSET_SYNC_LISTS * sizeof (sync_dnodes_arg_t),
+	    KM_SLEEP);
+	for (i = 0; i < DMU_OBJSET_SYNC_LISTS; i++) {
+		list_create(&sda[i].sda_list, sizeof (dnode_t),
+		    offsetof(dnode_t, dn_dirty_link[txgoff]));
+		list_create(&sda[i].sda_synced, sizeof (dnode_t),
+		    offsetof(dnode_t, dn_dirty_link[txgoff]));
+		sda[i].sda_userused = (newlist != NULL);
+		sda[i].sda_tx = tx;
+	}
+	ndnodes = dmu_objset_split_dnodes(&os->os_free_dnodes[txgoff], sda);
+	ndnodes += dmu_objset_split_dnodes(&os->os_dirty_dnodes[txgoff], sda);
+
+	for (i = 0; i < DMU_OBJSET_SYNC_LISTS; i++) {
+		if (list_is_empty(&sda[i].sda_list))
+			continue;
+		if (ndnodes < zfs_sync_dnodes_min) {
+			dmu_objset_sync_dnodes_task(&sda[i]);
+		} else {
+			(void) taskq_dispatch(tx->tx_pool->dp_sync_taskq,
+			    dmu_objset_sync_dnodes_task, &sda[i], TQ_SLEEP);
+			ntasks++;
+		}
+	}
+	if (ntasks != 0)
+		taskq_wait(tx->tx_pool->dp_sync_taskq);
+	dsl_pool_sync_stat_dnodes(ndnodes, ntasks);
+
+	for (i = 0; i < DMU_OBJSET_SYNC_LISTS; i++) {
+		if (newlist != NULL)
+			list_move_tail(newlist, &sda[i].sda_synced);
+		list_destroy(&sda[i].sda_synced);
+		list_destroy(&sda[i].sda_list);
+	}
+	kmem_free(sda, DMU_OBJSET_SYNC_LISTS * sizeof (sync_dnodes_arg_t));
 
 	list = &os->os_meta_dnode->dn_dirty_records[txgoff];
 	while (dr = list_head(list)) {
@@ -43,6 +43,66 @@ typedef void (*dmu_tx_hold_func_t)(dmu_tx_t *tx, struct dnode *dn,
 
 static int slash2_txg_semantics_on = 0;
 
+/*
+ * Write throttle statistics.  dirty_delay counts the transactions sent to
+ * dmu_tx_wait() because of dirty data and dirty_over_max those that then
+ * had to wait for dsl_pool_sync() to write some of it out.  The delay_*
+ * counters are a histogram of the delays dmu_tx_delay() actually applied.
+ */
+typedef struct dmu_tx_stats {
+	kstat_named_t dmu_tx_assigned;
+	kstat_named_t dmu_tx_dirty_delay;
+	kstat_named_t dmu_tx_dirty_over_max;
+	kstat_named_t dmu_tx_delay_total_us;
+	kstat_named_t dmu_tx_delay_lt_10us;
+	kstat_named_t dmu_tx_delay_lt_100us;
+	kstat_named_t dmu_tx_delay_lt_1ms;
+	kstat_named_t dmu_tx_delay_lt_10ms;
+	kstat_named_t dmu_tx_delay_lt_100ms;
+	kstat_named_t dmu_tx_delay_ge_100ms;
+} dmu_tx_stats_t;
+
+static dmu_tx_stats_t dmu_tx_stats = {
+	{ "assigned",		KSTAT_DATA_UINT64 },
+	{ "dirty_delay",	KSTAT_DATA_UINT64 },
+	{ "dirty_over_max",	KSTAT_DATA_UINT64 },
+	{ "delay_total_us",	KSTAT_DATA_UINT64 },
+	{ "delay_lt_10us",	KSTAT_DATA_UINT64 },
+	{ "delay_lt_100us",	KSTAT_DATA_UINT64 },
+	{ "delay_lt_1ms",	KSTAT_DATA_UINT64 },
+	{ "delay_lt_10ms",	KSTAT_DATA_UINT64 },
+	{ "delay_lt_100ms",	KSTAT_DATA_UINT64 },
+	{ "delay_ge_100ms",	KSTAT_DATA_UINT64 },
+};
+
+#define	DMU_TX_STAT_INCR(stat, val) \
+	atomic_add_64(&dmu_tx_stats.stat.value.ui64, (val))
+#define	DMU_TX_STAT_BUMP(stat)	DMU_TX_STAT_INCR(stat, 1)
+
+static kstat_t *dmu_tx_ksp;
+
+void
+dmu_tx_init(void)
+{
+	dmu_tx_ksp = kstat_create("zfs", 0, "dmu_tx", "misc",
+	    KSTAT_TYPE_NAMED, sizeof (dmu_tx_stats) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_VIRTUAL);
+
+	if (dmu_tx_ksp != NULL) {
+		dmu_tx_ksp->ks_data = &dmu_tx_stats;
+		kstat_install(dmu_tx_ksp);
+	}
+}
+
+void
+dmu_tx_fini(void)
+{
+	if (dmu_tx_ksp != NULL) {
+		kstat_delete(dmu_tx_ksp);
+		dmu_tx_ksp = NULL;
+	}
+}
+
 dmu_tx_t *
 dmu_tx_create_dd(dsl_dir_t *dd)
 {
@@ -50,6 +110,7 @@ dmu_tx_create_dd(dsl_dir_t *dd)
 	tx->tx_dir = dd;
 	if (dd)
 		tx->tx_pool = dd->dd_pool;
+	tx->tx_start = gethrtime();
 	list_create(&tx->tx_holds, sizeof (dmu_tx_hold_t),
 	    offsetof(dmu_tx_hold_t, txh_node));
 	list_create(&tx->tx_callbacks, sizeof (dmu_tx_callback_t),
@@ -929,6 +990,16 @@ dmu_tx_try_assign(dmu_tx_t *tx, uint64_t txg_how)
 		return (ERESTART);
 	}
 
+	if (txg_how == TXG_WAITED)
+		tx->tx_dirty_delayed = B_TRUE;
+
+	if (!tx->tx_dirty_delayed && !(tx->tx_flags & TX_NOTHROTTLE) &&
+	    dsl_pool_need_dirty_delay(tx->tx_pool)) {
+		tx->tx_wait_dirty = B_TRUE;
+		DMU_TX_STAT_BUMP(dmu_tx_dirty_delay);
+		return (ERESTART);
+	}
+
 #ifdef ZFS_SLASHLIB
 	/*
  	 * The same zfs_vnops.c code is used with and without our slash2
@@ -1091,7 +1162,11 @@ dmu_tx_unassign(dmu_tx_t *tx)
  *	whenever you're holding locks.  On an ERESTART error, the caller
  *	should drop locks, do a dmu_tx_wait(tx), and try again.
  *
- * (3)	A specific txg.  Use this if you need to ensure that multiple
+ * (3)	TXG_WAITED.  Like TXG_NOWAIT, but use this when retrying after a
+ *	dmu_tx_wait() of an earlier tx, so that the new tx is not
+ *	delayed by the write throttle a second time.
+ *
+ * (4)	A specific txg.  Use this if you need to ensure that multiple
  *	transactions all sync in the same txg.  Like TXG_NOWAIT, it
  *	returns ERESTART if it can't assign you into the requested txg.
  */
@@ -1117,23 +1192,112 @@ dmu_tx_assign(dmu_tx_t *tx, uint64_t txg_how)
 	}
 
 	txg_rele_to_quiesce(&tx->tx_txgh);
+	DMU_TX_STAT_BUMP(dmu_tx_assigned);
 
 	return (0);
 }
 
+static void
+dmu_tx_stat_delay(hrtime_t delay)
+{
+	DMU_TX_STAT_INCR(dmu_tx_delay_total_us, delay / 1000);
+	if (delay < 10 * 1000)
+		DMU_TX_STAT_BUMP(dmu_tx_delay_lt_10us);
+	else if (delay < 100 * 1000)
+		DMU_TX_STAT_BUMP(dmu_tx_delay_lt_100us);
+	else if (delay < 1000 * 1000)
+		DMU_TX_STAT_BUMP(dmu_tx_delay_lt_1ms);
+	else if (delay < 10 * 1000 * 1000)
+		DMU_TX_STAT_BUMP(dmu_tx_delay_lt_10ms);
+	else if (delay < 100 * 1000 * 1000)
+		DMU_TX_STAT_BUMP(dmu_tx_delay_lt_100ms);
+	else
+		DMU_TX_STAT_BUMP(dmu_tx_delay_ge_100ms);
+}
+
+/*
+ * Delay a transaction according to the amount of dirty data in the pool,
+ * see the write throttle comment in dsl_pool.c.  The time the caller
+ * spent since dmu_tx_create() counts towards the delay.
+ */
+static void
+dmu_tx_delay(dmu_tx_t *tx, uint64_t dirty)
+{
+	dsl_pool_t *dp = tx->tx_pool;
+	uint64_t delay_min_bytes =
+	    zfs_dirty_data_max * zfs_delay_min_dirty_percent / 100;
+	hrtime_t wakeup, min_tx_time, now;
+
+	if (dirty <= delay_min_bytes)
+		return;
+
+	/*
+	 * dmu_tx_wait() has waited for dirty to drop below the maximum,
+	 * so the divisor is not zero.
+	 */
+	ASSERT3U(dirty, <, zfs_dirty_data_max);
+
+	now = gethrtime();
+	min_tx_time = zfs_delay_scale *
+	    (dirty - delay_min_bytes) / (zfs_dirty_data_max - dirty);
+	min_tx_time = MIN(min_tx_time, zfs_delay_max_ns);
+	if (now > tx->tx_start + min_tx_time)
+		return;
+
+	/*
+	 * Space out the wakeups of concurrent writers, so that together
+	 * they go at one transaction per min_tx_time instead of all sleeping
+	 * min_tx_time and then all going at once.
+	 */
+	mutex_enter(&dp->dp_lock);
+	wakeup = MAX(tx->tx_start + min_tx_time,
+	    dp->dp_last_wakeup + min_tx_time);
+	dp->dp_last_wakeup = wakeup;
+	mutex_exit(&dp->dp_lock);
+
+	dmu_tx_stat_delay(wakeup - now);
+	zfs_sleep_until(wakeup);
+}
+
 void
 dmu_tx_wait(dmu_tx_t *tx)
 {
-	spa_t *spa = tx->tx_pool->dp_spa;
+	dsl_pool_t *dp = tx->tx_pool;
+	spa_t *spa = dp->dp_spa;
 
 	ASSERT(tx->tx_txg == 0);
 
-	/*
-	 * It's possible that the pool has become active after this thread
-	 * has tried to obtain a tx. If that's the case then his
-	 * tx_lasttried_txg would not have been assigned.
-	 */
-	if (spa_suspended(spa) || tx->tx_lasttried_txg == 0) {
+	if (tx->tx_wait_dirty) {
+		uint64_t dirty;
+
+		/*
+		 * dmu_tx_try_assign() found too much dirty data.  At the
+		 * maximum we must wait for dsl_pool_sync() to write some of
+		 * it out; below it we are delayed according to how much
+		 * there is.
+		 */
+		mutex_enter(&dp->dp_lock);
+		if (dp->dp_dirty_total >= zfs_dirty_data_max)
+			DMU_TX_STAT_BUMP(dmu_tx_dirty_over_max);
+		while (dp->dp_dirty_total >= zfs_dirty_data_max)
+			cv_wait(&dp->dp_spaceavail_cv, &dp->dp_lock);
+		dirty = dp->dp_dirty_total;
+		mutex_exit(&dp->dp_lock);
+
+		dmu_tx_delay(tx, dirty);
+
+		/*
+		 * Throttle a transaction only once; if it has to be retried
+		 * for another reason it has already paid for its dirty data.
+		 */
+		tx->tx_wait_dirty = B_FALSE;
+		tx->tx_dirty_delayed = B_TRUE;
+	} else if (spa_suspended(spa) || tx->tx_lasttried_txg == 0) {
+		/*
+		 * It's possible that the pool has become active after this
+		 * thread has tried to obtain a tx. If that's the case then
+		 * his tx_lasttried_txg would not have been assigned.
+		 */
 		txg_wait_synced(tx->tx_pool, spa_last_synced_txg(spa) + 1);
 	} else if (tx->tx_needassign_txh) {
 		dnode_t *dn = tx->tx_needassign_txh->txh_dnode;
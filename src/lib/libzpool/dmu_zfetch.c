@@ -29,6 +29,7 @@
 #include <sys/dmu_zfetch.h>
 #include <sys/dmu.h>
 #include <sys/dbuf.h>
+#include <sys/spa_impl.h>
 #include <sys/kstat.h>
 
 /*
@@ -39,51 +40,60 @@
 int zfs_prefetch_disable = 0;
 
 /* max # of streams per zfetch */
-uint32_t	zfetch_max_streams = 8;
+uint32_t	zfetch_max_streams = 16;
 /* min time before stream reclaim */
 uint32_t	zfetch_min_sec_reap = 2;
-/* max number of blocks to fetch at a time */
-uint32_t	zfetch_block_cap = 256;
+/* number of reads a new stream prefetches ahead */
+uint32_t	zfetch_min_distance = 2;
+/* max number of bytes a stream prefetches ahead (8Mb) */
+uint64_t	zfetch_max_distance = 8 * 1024 * 1024;
+/* stay this many times the pool's read latency ahead of the reader */
+uint32_t	zfetch_latency_mult = 2;
 /* number of bytes in a array_read at which we stop prefetching (1Mb) */
 uint64_t	zfetch_array_rd_sz = 1024 * 1024;
 
 /* forward decls for static routines */
-static int		dmu_zfetch_colinear(zfetch_t *, zstream_t *);
-static void		dmu_zfetch_dofetch(zfetch_t *, zstream_t *);
-static uint64_t		dmu_zfetch_fetch(dnode_t *, uint64_t, uint64_t);
-static uint64_t		dmu_zfetch_fetchsz(dnode_t *, uint64_t, uint64_t);
-static int		dmu_zfetch_find(zfetch_t *, zstream_t *, int);
-static int		dmu_zfetch_stream_insert(zfetch_t *, zstream_t *);
-static zstream_t	*dmu_zfetch_stream_reclaim(zfetch_t *);
+static int64_t		dmu_zfetch_detect(zfetch_t *, uint64_t, uint64_t,
+    boolean_t *);
+static void		dmu_zfetch_dofetch(dnode_t *, int64_t, int64_t,
+    uint64_t, uint64_t);
+static uint64_t		dmu_zfetch_stream_advance(zfetch_t *, zstream_t *,
+    uint64_t, uint64_t, int, int64_t *);
+static uint64_t		dmu_zfetch_stream_ahead(zstream_t *);
+static int		dmu_zfetch_stream_compare(const void *, const void *);
+static zstream_t	*dmu_zfetch_stream_create(zfetch_t *, uint64_t,
+    uint64_t, int64_t, boolean_t);
+static zstream_t	*dmu_zfetch_stream_find(zfetch_t *, uint64_t, uint64_t);
 static void		dmu_zfetch_stream_remove(zfetch_t *, zstream_t *);
-static int		dmu_zfetch_streams_equal(zstream_t *, zstream_t *);
 
 typedef struct zfetch_stats {
 	kstat_named_t zfetchstat_hits;
 	kstat_named_t zfetchstat_misses;
-	kstat_named_t zfetchstat_colinear_hits;
-	kstat_named_t zfetchstat_colinear_misses;
 	kstat_named_t zfetchstat_stride_hits;
-	kstat_named_t zfetchstat_stride_misses;
+	kstat_named_t zfetchstat_reverse_hits;
+	kstat_named_t zfetchstat_late_hits;
+	kstat_named_t zfetchstat_streams_created;
+	kstat_named_t zfetchstat_streams_merged;
 	kstat_named_t zfetchstat_reclaim_successes;
 	kstat_named_t zfetchstat_reclaim_failures;
-	kstat_named_t zfetchstat_stream_resets;
-	kstat_named_t zfetchstat_stream_noresets;
-	kstat_named_t zfetchstat_bogus_streams;
+	kstat_named_t zfetchstat_prefetch_bytes;
+	kstat_named_t zfetchstat_useful_bytes;
+	kstat_named_t zfetchstat_wasted_bytes;
 } zfetch_stats_t;
 
 static zfetch_stats_t zfetch_stats = {
 	{ "hits",			KSTAT_DATA_UINT64 },
 	{ "misses",			KSTAT_DATA_UINT64 },
-	{ "colinear_hits",		KSTAT_DATA_UINT64 },
-	{ "colinear_misses",		KSTAT_DATA_UINT64 },
 	{ "stride_hits",		KSTAT_DATA_UINT64 },
-	{ "stride_misses",		KSTAT_DATA_UINT64 },
+	{ "reverse_hits",		KSTAT_DATA_UINT64 },
+	{ "late_hits",			KSTAT_DATA_UINT64 },
+	{ "streams_created",		KSTAT_DATA_UINT64 },
+	{ "streams_merged",		KSTAT_DATA_UINT64 },
 	{ "reclaim_successes",		KSTAT_DATA_UINT64 },
 	{ "reclaim_failures",		KSTAT_DATA_UINT64 },
-	{ "streams_resets",		KSTAT_DATA_UINT64 },
-	{ "streams_noresets",		KSTAT_DATA_UINT64 },
-	{ "bogus_streams",		KSTAT_DATA_UINT64 },
+	{ "prefetch_bytes",		KSTAT_DATA_UINT64 },
+	{ "useful_bytes",		KSTAT_DATA_UINT64 },
+	{ "wasted_bytes",		KSTAT_DATA_UINT64 },
 };
 
 #define	ZFETCHSTAT_INCR(stat, val) \
@@ -94,631 +104,459 @@ static zfetch_stats_t zfetch_stats = {
 kstat_t		*zfetch_ksp;
 
 /*
- * Given a zfetch structure and a zstream structure, determine whether the
- * blocks to be read are part of a co-linear pair of existing prefetch
- * streams.  If a set is found, coalesce the streams, removing one, and
- * configure the prefetch so it looks for a strided access pattern.
- *
- * In other words: if we find two sequential access streams that are
- * the same length and distance N appart, and this read is N from the
- * last stream, then we are probably in a strided access pattern.  So
- * combine the two sequential streams into a single strided stream.
- *
- * If no co-linear streams are found, return NULL.
+ * Backward contiguous streams are keyed by the block the next read ends at,
+ * since the size of that read, and so where it starts, isn't known yet.
  */
+#define	ZSTREAM_KEYS_END(zs) \
+	((zs)->zs_contig && (zs)->zs_dir == ZFETCH_BACKWARD)
+
 static int
-dmu_zfetch_colinear(zfetch_t *zf, zstream_t *zh)
+dmu_zfetch_stream_compare(const void *arg1, const void *arg2)
 {
-	zstream_t	*z_walk;
-	zstream_t	*z_comp;
-
-	if (! rw_tryenter(&zf->zf_rwlock, RW_WRITER))
-		return (0);
-
-	if (zh == NULL) {
-		rw_exit(&zf->zf_rwlock);
-		return (0);
-	}
-
-	for (z_walk = list_head(&zf->zf_stream); z_walk;
-	    z_walk = list_next(&zf->zf_stream, z_walk)) {
-		for (z_comp = list_next(&zf->zf_stream, z_walk); z_comp;
-		    z_comp = list_next(&zf->zf_stream, z_comp)) {
-			int64_t		diff;
-
-			if (z_walk->zst_len != z_walk->zst_stride ||
-			    z_comp->zst_len != z_comp->zst_stride) {
-				continue;
-			}
-
-			diff = z_comp->zst_offset - z_walk->zst_offset;
-			if (z_comp->zst_offset + diff == zh->zst_offset) {
-				z_walk->zst_offset = zh->zst_offset;
-				z_walk->zst_direction = diff < 0 ? -1 : 1;
-				z_walk->zst_stride =
-				    diff * z_walk->zst_direction;
-				z_walk->zst_ph_offset =
-				    zh->zst_offset + z_walk->zst_stride;
-				dmu_zfetch_stream_remove(zf, z_comp);
-				mutex_destroy(&z_comp->zst_lock);
-				kmem_free(z_comp, sizeof (zstream_t));
-
-				dmu_zfetch_dofetch(zf, z_walk);
-
-				rw_exit(&zf->zf_rwlock);
-				return (1);
-			}
-
-			diff = z_walk->zst_offset - z_comp->zst_offset;
-			if (z_walk->zst_offset + diff == zh->zst_offset) {
-				z_walk->zst_offset = zh->zst_offset;
-				z_walk->zst_direction = diff < 0 ? -1 : 1;
-				z_walk->zst_stride =
-				    diff * z_walk->zst_direction;
-				z_walk->zst_ph_offset =
-				    zh->zst_offset + z_walk->zst_stride;
-				dmu_zfetch_stream_remove(zf, z_comp);
-				mutex_destroy(&z_comp->zst_lock);
-				kmem_free(z_comp, sizeof (zstream_t));
-
-				dmu_zfetch_dofetch(zf, z_walk);
-
-				rw_exit(&zf->zf_rwlock);
-				return (1);
-			}
-		}
-	}
-
-	rw_exit(&zf->zf_rwlock);
+	const zstream_t	*zs1 = arg1;
+	const zstream_t	*zs2 = arg2;
+	int		end1 = ZSTREAM_KEYS_END(zs1);
+	int		end2 = ZSTREAM_KEYS_END(zs2);
+
+	if (end1 != end2)
+		return (end1 < end2 ? -1 : 1);
+	if (zs1->zs_key < zs2->zs_key)
+		return (-1);
+	if (zs1->zs_key > zs2->zs_key)
+		return (1);
 	return (0);
 }
 
 /*
- * Given a zstream_t, determine the bounds of the prefetch.  Then call the
- * routine that actually prefetches the individual blocks.
+ * Given the blocks [blkid, blkid + nblks) that missed every stream, look
+ * through the recent unmatched reads for one that it continues: a read that
+ * ends where this one starts (forward), or starts where this one ends
+ * (backward), or two reads of the same size the same distance apart as the
+ * newer of them is from this one (strided, in either direction).  Returns
+ * the stride in blocks, or zero if no pattern was found.
  */
-static void
-dmu_zfetch_dofetch(zfetch_t *zf, zstream_t *zs)
+static int64_t
+dmu_zfetch_detect(zfetch_t *zf, uint64_t blkid, uint64_t nblks,
+    boolean_t *contigp)
 {
-	uint64_t	prefetch_tail;
-	uint64_t	prefetch_limit;
-	uint64_t	prefetch_ofst;
-	uint64_t	prefetch_len;
-	uint64_t	blocks_fetched;
-
-	zs->zst_stride = MAX((int64_t)zs->zst_stride, zs->zst_len);
-	zs->zst_cap = MIN(zfetch_block_cap, 2 * zs->zst_cap);
-
-	prefetch_tail = MAX((int64_t)zs->zst_ph_offset,
-	    (int64_t)(zs->zst_offset + zs->zst_stride));
-	/*
-	 * XXX: use a faster division method?
-	 */
-	prefetch_limit = zs->zst_offset + zs->zst_len +
-	    (zs->zst_cap * zs->zst_stride) / zs->zst_len;
-
-	while (prefetch_tail < prefetch_limit) {
-		prefetch_ofst = zs->zst_offset + zs->zst_direction *
-		    (prefetch_tail - zs->zst_offset);
-
-		prefetch_len = zs->zst_len;
-
-		/*
-		 * Don't prefetch beyond the end of the file, if working
-		 * backwards.
-		 */
-		if ((zs->zst_direction == ZFETCH_BACKWARD) &&
-		    (prefetch_ofst > prefetch_tail)) {
-			prefetch_len += prefetch_ofst;
-			prefetch_ofst = 0;
-		}
-
-		/* don't prefetch more than we're supposed to */
-		if (prefetch_len > zs->zst_len)
-			break;
+	zfetch_hist_t	*zh;
+	zfetch_hist_t	*zo;
+	int64_t		diff;
+	int		i, j;
 
-		blocks_fetched = dmu_zfetch_fetch(zf->zf_dnode,
-		    prefetch_ofst, zs->zst_len);
+	ASSERT(MUTEX_HELD(&zf->zf_lock));
 
-		prefetch_tail += zs->zst_stride;
-		/* stop if we've run out of stuff to prefetch */
-		if (blocks_fetched < zs->zst_len)
+	for (i = 1; i <= ZFETCH_HISTORY; i++) {
+		zh = &zf->zf_hist[(zf->zf_hist_next - i) % ZFETCH_HISTORY];
+		if (zh->zh_nblks == 0)
 			break;
-	}
-	zs->zst_ph_offset = prefetch_tail;
-	zs->zst_last = lbolt;
-}
-
-void
-zfetch_init(void)
-{
 
-	zfetch_ksp = kstat_create("zfs", 0, "zfetchstats", "misc",
-	    KSTAT_TYPE_NAMED, sizeof (zfetch_stats) / sizeof (kstat_named_t),
-	    KSTAT_FLAG_VIRTUAL);
+		if (zh->zh_blkid + zh->zh_nblks == blkid) {
+			*contigp = B_TRUE;
+			return (nblks);
+		}
+		if (blkid + nblks == zh->zh_blkid) {
+			*contigp = B_TRUE;
+			return (-(int64_t)nblks);
+		}
 
-	if (zfetch_ksp != NULL) {
-		zfetch_ksp->ks_data = &zfetch_stats;
-		kstat_install(zfetch_ksp);
-	}
-}
+		diff = (int64_t)(blkid - zh->zh_blkid);
+		if (diff == 0 || zh->zh_nblks != nblks)
+			continue;
 
-void
-zfetch_fini(void)
-{
-	if (zfetch_ksp != NULL) {
-		kstat_delete(zfetch_ksp);
-		zfetch_ksp = NULL;
+		for (j = i + 1; j <= ZFETCH_HISTORY; j++) {
+			zo = &zf->zf_hist[(zf->zf_hist_next - j) %
+			    ZFETCH_HISTORY];
+			if (zo->zh_nblks == 0)
+				break;
+			if (zo->zh_blkid + diff == zh->zh_blkid &&
+			    zo->zh_nblks == nblks) {
+				*contigp = B_FALSE;
+				return (diff);
+			}
+		}
 	}
+	return (0);
 }
 
 /*
- * This takes a pointer to a zfetch structure and a dnode.  It performs the
- * necessary setup for the zfetch structure, grokking data from the
- * associated dnode.
+ * Prefetch count reads of nblks blocks, the first starting at block start
+ * and each following one stride blocks after the last.  Blocks outside the
+ * file are skipped.
  */
-void
-dmu_zfetch_init(zfetch_t *zf, dnode_t *dno)
+static void
+dmu_zfetch_dofetch(dnode_t *dn, int64_t start, int64_t stride, uint64_t count,
+    uint64_t nblks)
 {
-	if (zf == NULL) {
-		return;
-	}
-
-	zf->zf_dnode = dno;
-	zf->zf_stream_cnt = 0;
-	zf->zf_alloc_fail = 0;
-
-	list_create(&zf->zf_stream, sizeof (zstream_t),
-	    offsetof(zstream_t, zst_node));
+	int64_t		blkid;
+	int64_t		end;
+	uint64_t	fetched = 0;
+	uint64_t	i;
 
-	rw_init(&zf->zf_rwlock, NULL, RW_DEFAULT, NULL);
+	for (i = 0; i < count; i++, start += stride) {
+		end = MIN(start + (int64_t)nblks, (int64_t)dn->dn_maxblkid + 1);
+		for (blkid = MAX(start, 0); blkid < end; blkid++) {
+			dbuf_prefetch(dn, blkid);
+			fetched++;
+		}
+	}
+	ZFETCHSTAT_INCR(zfetchstat_prefetch_bytes,
+	    fetched << dn->dn_datablkshift);
 }
 
 /*
- * This function computes the actual size, in blocks, that can be prefetched,
- * and fetches it.
+ * Return the number of blocks the stream has prefetched that haven't been
+ * read yet.
  */
 static uint64_t
-dmu_zfetch_fetch(dnode_t *dn, uint64_t blkid, uint64_t nblks)
+dmu_zfetch_stream_ahead(zstream_t *zs)
 {
-	uint64_t	fetchsz;
-	uint64_t	i;
+	int64_t		ahead = (zs->zs_pf - zs->zs_next) / zs->zs_stride;
 
-	fetchsz = dmu_zfetch_fetchsz(dn, blkid, nblks);
-
-	for (i = 0; i < fetchsz; i++) {
-		dbuf_prefetch(dn, blkid + i);
-	}
-
-	return (fetchsz);
+	return (ahead > 0 ? ahead * zs->zs_nblks : 0);
 }
 
 /*
- * this function returns the number of blocks that would be prefetched, based
- * upon the supplied dnode, blockid, and nblks.  This is used so that we can
- * update streams in place, and then prefetch with their old value after the
- * fact.  This way, we can delay the prefetch, but subsequent accesses to the
- * stream won't result in the same data being prefetched multiple times.
+ * Account the read of [blkid, blkid + nblks), which continued stream zs, and
+ * move the stream past it.  The prefetch distance is adapted so the stream
+ * keeps zfetch_latency_mult times the pool's foreground read latency worth
+ * of reads in flight, and is doubled whenever a read had to wait for the
+ * disk.  Returns the number of reads to prefetch, the first of them starting
+ * at *startp; the caller must re-key the stream before dropping zf_lock.
  */
 static uint64_t
-dmu_zfetch_fetchsz(dnode_t *dn, uint64_t blkid, uint64_t nblks)
+dmu_zfetch_stream_advance(zfetch_t *zf, zstream_t *zs, uint64_t blkid,
+    uint64_t nblks, int prefetched, int64_t *startp)
 {
-	uint64_t	fetchsz;
-
-	if (blkid > dn->dn_maxblkid) {
-		return (0);
+	dnode_t		*dn = zf->zf_dnode;
+	uint64_t	latency = dn->dn_objset->os_spa->spa_fg_io_latency;
+	hrtime_t	now = gethrtime();
+	uint64_t	maxdist;
+	uint64_t	want;
+	uint64_t	n;
+	int64_t		end;
+
+	ASSERT(MUTEX_HELD(&zf->zf_lock));
+
+	/* did we issue this read ahead of time? */
+	if (((int64_t)blkid - zs->zs_pf) * zs->zs_dir < 0) {
+		ZFETCHSTAT_INCR(zfetchstat_useful_bytes,
+		    nblks << dn->dn_datablkshift);
+		if (!prefetched)
+			ZFETCHSTAT_BUMP(zfetchstat_late_hits);
 	}
 
-	/* compute fetch size */
-	if (blkid + nblks + 1 > dn->dn_maxblkid) {
-		fetchsz = (dn->dn_maxblkid - blkid) + 1;
-		ASSERT(blkid + fetchsz - 1 <= dn->dn_maxblkid);
+	if (zs->zs_contig) {
+		zs->zs_stride = zs->zs_dir * (int64_t)nblks;
+		zs->zs_key = zs->zs_dir == ZFETCH_FORWARD ?
+		    blkid + nblks : blkid;
 	} else {
-		fetchsz = nblks;
+		zs->zs_key = blkid + zs->zs_stride;
+	}
+	zs->zs_nblks = nblks;
+	zs->zs_next = (int64_t)blkid + zs->zs_stride;
+
+	if (zs->zs_atime != 0 && zs->zs_gap == 0)
+		zs->zs_gap = now - zs->zs_atime;
+	else if (zs->zs_atime != 0)
+		zs->zs_gap += (now - zs->zs_atime - zs->zs_gap) / 4;
+	zs->zs_atime = now;
+
+	want = MAX(zfetch_min_distance, 1);
+	if (latency != 0) {
+		want = MAX(want, latency * zfetch_latency_mult /
+		    MAX(zs->zs_gap, 1) + 1);
 	}
+	if (!prefetched)
+		want = MAX(want, 2 * zs->zs_dist);
+	if (want > zs->zs_dist)
+		zs->zs_dist = MIN(want, 2 * zs->zs_dist);
+	else
+		zs->zs_dist -= (zs->zs_dist - want) / 8;
+	maxdist = (zfetch_max_distance >> dn->dn_datablkshift) / nblks;
+	zs->zs_dist = MAX(MIN(zs->zs_dist, maxdist), 1);
+
+	/* don't prefetch what the reader has already gone past */
+	if ((zs->zs_pf - zs->zs_next) * zs->zs_dir < 0)
+		zs->zs_pf = zs->zs_next;
+
+	end = zs->zs_next + (int64_t)zs->zs_dist * zs->zs_stride;
+	if ((end - zs->zs_pf) * zs->zs_dir <= 0)
+		return (0);
+	n = (end - zs->zs_pf) / zs->zs_stride;
 
+	/* nor past either end of the file */
+	if (zs->zs_dir == ZFETCH_FORWARD) {
+		if (zs->zs_pf > (int64_t)dn->dn_maxblkid)
+			return (0);
+		n = MIN(n, (dn->dn_maxblkid - zs->zs_pf) / zs->zs_stride + 1);
+	} else {
+		if (zs->zs_pf + (int64_t)nblks <= 0)
+			return (0);
+		n = MIN(n, (zs->zs_pf + nblks - 1) / -zs->zs_stride + 1);
+	}
 
-	return (fetchsz);
+	*startp = zs->zs_pf;
+	zs->zs_pf += (int64_t)n * zs->zs_stride;
+	return (n);
 }
 
 /*
- * given a zfetch and a zstream structure, see if there is an associated zstream
- * for this block read.  If so, it starts a prefetch for the stream it
- * located and returns true, otherwise it returns false
+ * Start a stream at the read of [blkid, blkid + nblks) with the given stride,
+ * for dmu_zfetch_stream_advance() to move past.  The least recently used
+ * stream is reclaimed if the zfetch is full.  Returns NULL if an equivalent
+ * stream already exists or no stream could be had.
  */
-static int
-dmu_zfetch_find(zfetch_t *zf, zstream_t *zh, int prefetched)
+static zstream_t *
+dmu_zfetch_stream_create(zfetch_t *zf, uint64_t blkid, uint64_t nblks,
+    int64_t stride, boolean_t contig)
 {
 	zstream_t	*zs;
-	int64_t		diff;
-	int		reset = !prefetched;
-	int		rc = 0;
-
-	if (zh == NULL)
-		return (0);
-
-	/*
-	 * XXX: This locking strategy is a bit coarse; however, it's impact has
-	 * yet to be tested.  If this turns out to be an issue, it can be
-	 * modified in a number of different ways.
-	 */
-
-	rw_enter(&zf->zf_rwlock, RW_READER);
-top:
-
-	for (zs = list_head(&zf->zf_stream); zs;
-	    zs = list_next(&zf->zf_stream, zs)) {
-
-		/*
-		 * XXX - should this be an assert?
-		 */
-		if (zs->zst_len == 0) {
-			/* bogus stream */
-			ZFETCHSTAT_BUMP(zfetchstat_bogus_streams);
-			continue;
-		}
-
-		/*
-		 * We hit this case when we are in a strided prefetch stream:
-		 * we will read "len" blocks before "striding".
-		 */
-		if (zh->zst_offset >= zs->zst_offset &&
-		    zh->zst_offset < zs->zst_offset + zs->zst_len) {
-			if (prefetched) {
-				/* already fetched */
-				ZFETCHSTAT_BUMP(zfetchstat_stride_hits);
-				rc = 1;
-				goto out;
-			} else {
-				ZFETCHSTAT_BUMP(zfetchstat_stride_misses);
-			}
-		}
-
-		/*
-		 * This is the forward sequential read case: we increment
-		 * len by one each time we hit here, so we will enter this
-		 * case on every read.
-		 */
-		if (zh->zst_offset == zs->zst_offset + zs->zst_len) {
-
-			reset = !prefetched && zs->zst_len > 1;
-
-			mutex_enter(&zs->zst_lock);
-
-			if (zh->zst_offset != zs->zst_offset + zs->zst_len) {
-				mutex_exit(&zs->zst_lock);
-				goto top;
-			}
-			zs->zst_len += zh->zst_len;
-			diff = zs->zst_len - zfetch_block_cap;
-			if (diff > 0) {
-				zs->zst_offset += diff;
-				zs->zst_len = zs->zst_len > diff ?
-				    zs->zst_len - diff : 0;
-			}
-			zs->zst_direction = ZFETCH_FORWARD;
-
-			break;
-
-		/*
-		 * Same as above, but reading backwards through the file.
-		 */
-		} else if (zh->zst_offset == zs->zst_offset - zh->zst_len) {
-			/* backwards sequential access */
-
-			reset = !prefetched && zs->zst_len > 1;
-
-			mutex_enter(&zs->zst_lock);
-
-			if (zh->zst_offset != zs->zst_offset - zh->zst_len) {
-				mutex_exit(&zs->zst_lock);
-				goto top;
-			}
-
-			zs->zst_offset = zs->zst_offset > zh->zst_len ?
-			    zs->zst_offset - zh->zst_len : 0;
-			zs->zst_ph_offset = zs->zst_ph_offset > zh->zst_len ?
-			    zs->zst_ph_offset - zh->zst_len : 0;
-			zs->zst_len += zh->zst_len;
-
-			diff = zs->zst_len - zfetch_block_cap;
-			if (diff > 0) {
-				zs->zst_ph_offset = zs->zst_ph_offset > diff ?
-				    zs->zst_ph_offset - diff : 0;
-				zs->zst_len = zs->zst_len > diff ?
-				    zs->zst_len - diff : zs->zst_len;
-			}
-			zs->zst_direction = ZFETCH_BACKWARD;
-
-			break;
+	zstream_t	search;
 
-		} else if ((zh->zst_offset - zs->zst_offset - zs->zst_stride <
-		    zs->zst_len) && (zs->zst_len != zs->zst_stride)) {
-			/* strided forward access */
+	ASSERT(MUTEX_HELD(&zf->zf_lock));
 
-			mutex_enter(&zs->zst_lock);
+	search.zs_contig = contig;
+	search.zs_dir = stride > 0 ? ZFETCH_FORWARD : ZFETCH_BACKWARD;
+	search.zs_key = ZSTREAM_KEYS_END(&search) ? blkid : blkid + stride;
+	if (avl_find(&zf->zf_streams, &search, NULL) != NULL)
+		return (NULL);
 
-			if ((zh->zst_offset - zs->zst_offset - zs->zst_stride >=
-			    zs->zst_len) || (zs->zst_len == zs->zst_stride)) {
-				mutex_exit(&zs->zst_lock);
-				goto top;
-			}
-
-			zs->zst_offset += zs->zst_stride;
-			zs->zst_direction = ZFETCH_FORWARD;
-
-			break;
-
-		} else if ((zh->zst_offset - zs->zst_offset + zs->zst_stride <
-		    zs->zst_len) && (zs->zst_len != zs->zst_stride)) {
-			/* strided reverse access */
-
-			mutex_enter(&zs->zst_lock);
-
-			if ((zh->zst_offset - zs->zst_offset + zs->zst_stride >=
-			    zs->zst_len) || (zs->zst_len == zs->zst_stride)) {
-				mutex_exit(&zs->zst_lock);
-				goto top;
-			}
-
-			zs->zst_offset = zs->zst_offset > zs->zst_stride ?
-			    zs->zst_offset - zs->zst_stride : 0;
-			zs->zst_ph_offset = (zs->zst_ph_offset >
-			    (2 * zs->zst_stride)) ?
-			    (zs->zst_ph_offset - (2 * zs->zst_stride)) : 0;
-			zs->zst_direction = ZFETCH_BACKWARD;
-
-			break;
+	if (zf->zf_stream_cnt >= MAX(zfetch_max_streams, 1)) {
+		zs = list_head(&zf->zf_lru);
+		if (gethrtime() - zs->zs_atime <
+		    (hrtime_t)zfetch_min_sec_reap * NANOSEC) {
+			ZFETCHSTAT_BUMP(zfetchstat_reclaim_failures);
+			zf->zf_alloc_fail++;
+			return (NULL);
 		}
+		ZFETCHSTAT_BUMP(zfetchstat_reclaim_successes);
+		dmu_zfetch_stream_remove(zf, zs);
+		bzero(zs, sizeof (zstream_t));
+	} else if ((zs = kmem_zalloc(sizeof (zstream_t), KM_NOSLEEP)) == NULL) {
+		zf->zf_alloc_fail++;
+		return (NULL);
 	}
 
-	if (zs) {
-		if (reset) {
-			zstream_t *remove = zs;
-
-			ZFETCHSTAT_BUMP(zfetchstat_stream_resets);
-			rc = 0;
-			mutex_exit(&zs->zst_lock);
-			rw_exit(&zf->zf_rwlock);
-			rw_enter(&zf->zf_rwlock, RW_WRITER);
-			/*
-			 * Relocate the stream, in case someone removes
-			 * it while we were acquiring the WRITER lock.
-			 */
-			for (zs = list_head(&zf->zf_stream); zs;
-			    zs = list_next(&zf->zf_stream, zs)) {
-				if (zs == remove) {
-					dmu_zfetch_stream_remove(zf, zs);
-					mutex_destroy(&zs->zst_lock);
-					kmem_free(zs, sizeof (zstream_t));
-					break;
-				}
-			}
-		} else {
-			ZFETCHSTAT_BUMP(zfetchstat_stream_noresets);
-			rc = 1;
-			dmu_zfetch_dofetch(zf, zs);
-			mutex_exit(&zs->zst_lock);
-		}
-	}
-out:
-	rw_exit(&zf->zf_rwlock);
-	return (rc);
+	zs->zs_contig = contig;
+	zs->zs_dir = search.zs_dir;
+	zs->zs_key = search.zs_key;
+	zs->zs_stride = stride;
+	zs->zs_nblks = nblks;
+	zs->zs_next = blkid;
+	zs->zs_pf = blkid;
+	zs->zs_dist = MAX(zfetch_min_distance, 1);
+	zs->zs_atime = 0;
+	zs->zs_gap = 0;
+
+	avl_add(&zf->zf_streams, zs);
+	list_insert_tail(&zf->zf_lru, zs);
+	zf->zf_stream_cnt++;
+	ZFETCHSTAT_BUMP(zfetchstat_streams_created);
+
+	return (zs);
 }
 
 /*
- * Clean-up state associated with a zfetch structure.  This frees allocated
- * structure members, empties the zf_stream tree, and generally makes things
- * nice.  This doesn't free the zfetch_t itself, that's left to the caller.
+ * Find the stream that expects a read of [blkid, blkid + nblks) next.
  */
-void
-dmu_zfetch_rele(zfetch_t *zf)
+static zstream_t *
+dmu_zfetch_stream_find(zfetch_t *zf, uint64_t blkid, uint64_t nblks)
 {
+	zstream_t	search;
 	zstream_t	*zs;
-	zstream_t	*zs_next;
 
-	ASSERT(!RW_LOCK_HELD(&zf->zf_rwlock));
+	ASSERT(MUTEX_HELD(&zf->zf_lock));
 
-	for (zs = list_head(&zf->zf_stream); zs; zs = zs_next) {
-		zs_next = list_next(&zf->zf_stream, zs);
+	search.zs_contig = B_FALSE;
+	search.zs_dir = ZFETCH_FORWARD;
+	search.zs_key = blkid;
+	if ((zs = avl_find(&zf->zf_streams, &search, NULL)) != NULL)
+		return (zs);
 
-		list_remove(&zf->zf_stream, zs);
-		mutex_destroy(&zs->zst_lock);
-		kmem_free(zs, sizeof (zstream_t));
-	}
-	list_destroy(&zf->zf_stream);
-	rw_destroy(&zf->zf_rwlock);
-
-	zf->zf_dnode = NULL;
+	search.zs_contig = B_TRUE;
+	search.zs_dir = ZFETCH_BACKWARD;
+	search.zs_key = blkid + nblks;
+	return (avl_find(&zf->zf_streams, &search, NULL));
 }
 
 /*
- * Given a zfetch and zstream structure, insert the zstream structure into the
- * AVL tree contained within the zfetch structure.  Peform the appropriate
- * book-keeping.  It is possible that another thread has inserted a stream which
- * matches one that we are about to insert, so we must be sure to check for this
- * case.  If one is found, return failure, and let the caller cleanup the
- * duplicates.
+ * Given a zfetch and zstream structure, remove the zstream structure from its
+ * container in the zfetch structure.  Whatever it prefetched that was never
+ * read is counted as wasted.
  */
-static int
-dmu_zfetch_stream_insert(zfetch_t *zf, zstream_t *zs)
+static void
+dmu_zfetch_stream_remove(zfetch_t *zf, zstream_t *zs)
 {
-	zstream_t	*zs_walk;
-	zstream_t	*zs_next;
-
-	ASSERT(RW_WRITE_HELD(&zf->zf_rwlock));
-
-	for (zs_walk = list_head(&zf->zf_stream); zs_walk; zs_walk = zs_next) {
-		zs_next = list_next(&zf->zf_stream, zs_walk);
-
-		if (dmu_zfetch_streams_equal(zs_walk, zs)) {
-			return (0);
-		}
-	}
+	ASSERT(MUTEX_HELD(&zf->zf_lock));
 
-	list_insert_head(&zf->zf_stream, zs);
-	zf->zf_stream_cnt++;
-	return (1);
+	ZFETCHSTAT_INCR(zfetchstat_wasted_bytes,
+	    dmu_zfetch_stream_ahead(zs) << zf->zf_dnode->dn_datablkshift);
+	avl_remove(&zf->zf_streams, zs);
+	list_remove(&zf->zf_lru, zs);
+	zf->zf_stream_cnt--;
 }
 
-
-/*
- * Walk the list of zstreams in the given zfetch, find an old one (by time), and
- * reclaim it for use by the caller.
- */
-static zstream_t *
-dmu_zfetch_stream_reclaim(zfetch_t *zf)
+void
+zfetch_init(void)
 {
-	zstream_t	*zs;
-
-	if (! rw_tryenter(&zf->zf_rwlock, RW_WRITER))
-		return (0);
 
-	for (zs = list_head(&zf->zf_stream); zs;
-	    zs = list_next(&zf->zf_stream, zs)) {
+	zfetch_ksp = kstat_create("zfs", 0, "zfetchstats", "misc",
+	    KSTAT_TYPE_NAMED, sizeof (zfetch_stats) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_VIRTUAL);
 
-		if (((lbolt - zs->zst_last) / hz) > zfetch_min_sec_reap)
-			break;
+	if (zfetch_ksp != NULL) {
+		zfetch_ksp->ks_data = &zfetch_stats;
+		kstat_install(zfetch_ksp);
 	}
+}
 
-	if (zs) {
-		dmu_zfetch_stream_remove(zf, zs);
-		mutex_destroy(&zs->zst_lock);
-		bzero(zs, sizeof (zstream_t));
-	} else {
-		zf->zf_alloc_fail++;
+void
+zfetch_fini(void)
+{
+	if (zfetch_ksp != NULL) {
+		kstat_delete(zfetch_ksp);
+		zfetch_ksp = NULL;
 	}
-	rw_exit(&zf->zf_rwlock);
-
-	return (zs);
 }
 
 /*
- * Given a zfetch and zstream structure, remove the zstream structure from its
- * container in the zfetch structure.  Perform the appropriate book-keeping.
+ * This takes a pointer to a zfetch structure and a dnode.  It performs the
+ * necessary setup for the zfetch structure, grokking data from the
+ * associated dnode.
  */
-static void
-dmu_zfetch_stream_remove(zfetch_t *zf, zstream_t *zs)
+void
+dmu_zfetch_init(zfetch_t *zf, dnode_t *dno)
 {
-	ASSERT(RW_WRITE_HELD(&zf->zf_rwlock));
-
-	list_remove(&zf->zf_stream, zs);
-	zf->zf_stream_cnt--;
-}
+	if (zf == NULL) {
+		return;
+	}
 
-static int
-dmu_zfetch_streams_equal(zstream_t *zs1, zstream_t *zs2)
-{
-	if (zs1->zst_offset != zs2->zst_offset)
-		return (0);
+	zf->zf_dnode = dno;
+	zf->zf_stream_cnt = 0;
+	zf->zf_alloc_fail = 0;
+	zf->zf_hist_next = 0;
+	bzero(zf->zf_hist, sizeof (zf->zf_hist));
 
-	if (zs1->zst_len != zs2->zst_len)
-		return (0);
+	avl_create(&zf->zf_streams, dmu_zfetch_stream_compare,
+	    sizeof (zstream_t), offsetof(zstream_t, zs_node));
+	list_create(&zf->zf_lru, sizeof (zstream_t),
+	    offsetof(zstream_t, zs_lru));
 
-	if (zs1->zst_stride != zs2->zst_stride)
-		return (0);
+	mutex_init(&zf->zf_lock, NULL, MUTEX_DEFAULT, NULL);
+}
 
-	if (zs1->zst_ph_offset != zs2->zst_ph_offset)
-		return (0);
+/*
+ * Clean-up state associated with a zfetch structure.  This frees allocated
+ * structure members, empties the zf_streams tree, and generally makes things
+ * nice.  This doesn't free the zfetch_t itself, that's left to the caller.
+ */
+void
+dmu_zfetch_rele(zfetch_t *zf)
+{
+	zstream_t	*zs;
 
-	if (zs1->zst_cap != zs2->zst_cap)
-		return (0);
+	mutex_enter(&zf->zf_lock);
+	while ((zs = list_head(&zf->zf_lru)) != NULL) {
+		dmu_zfetch_stream_remove(zf, zs);
+		kmem_free(zs, sizeof (zstream_t));
+	}
+	mutex_exit(&zf->zf_lock);
 
-	if (zs1->zst_direction != zs2->zst_direction)
-		return (0);
+	avl_destroy(&zf->zf_streams);
+	list_destroy(&zf->zf_lru);
+	mutex_destroy(&zf->zf_lock);
 
-	return (1);
+	zf->zf_dnode = NULL;
 }
 
 /*
- * This is the prefetch entry point.  It calls all of the other dmu_zfetch
- * routines to create, delete, find, or operate upon prefetch streams.
+ * This is the prefetch entry point.  A read that continues a stream moves
+ * it along and tops up its prefetch; any other read is remembered so that
+ * the next reads following it, forwards, backwards or at a stride, start a
+ * new stream.  The blocks are prefetched after zf_lock is dropped.
  */
 void
 dmu_zfetch(zfetch_t *zf, uint64_t offset, uint64_t size, int prefetched)
 {
-	zstream_t	zst;
-	zstream_t	*newstream;
-	int		fetched;
-	int		inserted;
+	dnode_t		*dn = zf->zf_dnode;
+	zstream_t	*zs;
+	zstream_t	*dup;
+	zfetch_hist_t	*zh;
 	unsigned int	blkshft;
 	uint64_t	blksz;
+	uint64_t	blkid;
+	uint64_t	nblks;
+	uint64_t	count = 0;
+	int64_t		start = 0;
+	int64_t		stride;
+	boolean_t	contig;
 
 	if (zfs_prefetch_disable)
 		return;
 
 	/* files that aren't ln2 blocksz are only one block -- nothing to do */
-	if (!zf->zf_dnode->dn_datablkshift)
+	if (!dn->dn_datablkshift)
 		return;
 
 	/* convert offset and size, into blockid and nblocks */
-	blkshft = zf->zf_dnode->dn_datablkshift;
+	blkshft = dn->dn_datablkshift;
 	blksz = (1 << blkshft);
 
-	bzero(&zst, sizeof (zstream_t));
-	zst.zst_offset = offset >> blkshft;
-	zst.zst_len = (P2ROUNDUP(offset + size, blksz) -
+	blkid = offset >> blkshft;
+	nblks = (P2ROUNDUP(offset + size, blksz) -
 	    P2ALIGN(offset, blksz)) >> blkshft;
 
-	fetched = dmu_zfetch_find(zf, &zst, prefetched);
-	if (fetched) {
+	mutex_enter(&zf->zf_lock);
+
+	if ((zs = dmu_zfetch_stream_find(zf, blkid, nblks)) != NULL) {
 		ZFETCHSTAT_BUMP(zfetchstat_hits);
+		if (!zs->zs_contig)
+			ZFETCHSTAT_BUMP(zfetchstat_stride_hits);
+		if (zs->zs_dir == ZFETCH_BACKWARD)
+			ZFETCHSTAT_BUMP(zfetchstat_reverse_hits);
 	} else {
 		ZFETCHSTAT_BUMP(zfetchstat_misses);
-		if (fetched = dmu_zfetch_colinear(zf, &zst)) {
-			ZFETCHSTAT_BUMP(zfetchstat_colinear_hits);
-		} else {
-			ZFETCHSTAT_BUMP(zfetchstat_colinear_misses);
+
+		stride = dmu_zfetch_detect(zf, blkid, nblks, &contig);
+		if (stride == 0 || (zs = dmu_zfetch_stream_create(zf,
+		    blkid, nblks, stride, contig)) == NULL) {
+			zh = &zf->zf_hist[zf->zf_hist_next++ % ZFETCH_HISTORY];
+			zh->zh_blkid = blkid;
+			zh->zh_nblks = nblks;
+			mutex_exit(&zf->zf_lock);
+			return;
 		}
+		/* the read that started the stream wasn't late for it */
+		prefetched = TRUE;
 	}
 
-	if (!fetched) {
-		newstream = dmu_zfetch_stream_reclaim(zf);
+	avl_remove(&zf->zf_streams, zs);
+	count = dmu_zfetch_stream_advance(zf, zs, blkid, nblks, prefetched,
+	    &start);
+	stride = zs->zs_stride;
 
+	if ((dup = avl_find(&zf->zf_streams, zs, NULL)) != NULL) {
 		/*
-		 * we still couldn't find a stream, drop the lock, and allocate
-		 * one if possible.  Otherwise, give up and go home.
+		 * Another stream is already at the same place; two readers
+		 * have converged on one pattern.  Fold it into this one,
+		 * taking over whatever it had prefetched further ahead.
 		 */
-		if (newstream) {
-			ZFETCHSTAT_BUMP(zfetchstat_reclaim_successes);
-		} else {
-			uint64_t	maxblocks;
-			uint32_t	max_streams;
-			uint32_t	cur_streams;
-
-			ZFETCHSTAT_BUMP(zfetchstat_reclaim_failures);
-			cur_streams = zf->zf_stream_cnt;
-			maxblocks = zf->zf_dnode->dn_maxblkid;
-
-			max_streams = MIN(zfetch_max_streams,
-			    (maxblocks / zfetch_block_cap));
-			if (max_streams == 0) {
-				max_streams++;
-			}
-
-			if (cur_streams >= max_streams) {
-				return;
-			}
-			newstream = kmem_zalloc(sizeof (zstream_t), KM_SLEEP);
+		ZFETCHSTAT_BUMP(zfetchstat_streams_merged);
+		if (dup->zs_stride == zs->zs_stride &&
+		    (dup->zs_pf - zs->zs_pf) * zs->zs_dir > 0) {
+			zs->zs_pf = dup->zs_pf;
+			dup->zs_pf = dup->zs_next;
 		}
+		dmu_zfetch_stream_remove(zf, dup);
+		kmem_free(dup, sizeof (zstream_t));
+	}
+	avl_add(&zf->zf_streams, zs);
+	list_remove(&zf->zf_lru, zs);
+	list_insert_tail(&zf->zf_lru, zs);
 
-		newstream->zst_offset = zst.zst_offset;
-		newstream->zst_len = zst.zst_len;
-		newstream->zst_stride = zst.zst_len;
-		newstream->zst_ph_offset = zst.zst_len + zst.zst_offset;
-		newstream->zst_cap = zst.zst_len;
-		newstream->zst_direction = ZFETCH_FORWARD;
-		newstream->zst_last = lbolt;
-
-		mutex_init(&newstream->zst_lock, NULL, MUTEX_DEFAULT, NULL);
-
-		rw_enter(&zf->zf_rwlock, RW_WRITER);
-		inserted = dmu_zfetch_stream_insert(zf, newstream);
-		rw_exit(&zf->zf_rwlock);
+	mutex_exit(&zf->zf_lock);
 
-		if (!inserted) {
-			mutex_destroy(&newstream->zst_lock);
-			kmem_free(newstream, sizeof (zstream_t));
-		}
-	}
+	if (count != 0)
+		dmu_zfetch_dofetch(dn, start, stride, count, nblks);
 }
@@ -40,18 +40,112 @@
 #include <sys/spa_impl.h>
 #include "kmem_asprintf.h"
 
+/*
+ * Writers are throttled on the amount of dirty data in the pool, that is
+ * data dirtied in open context that has not been written out by
+ * dsl_pool_sync() yet.  Once it exceeds zfs_delay_min_dirty_percent of
+ * zfs_dirty_data_max, every transaction is delayed in dmu_tx_assign() by
+ *
+ *	zfs_delay_scale * (dirty - min) / (zfs_dirty_data_max - dirty)
+ *
+ * nanoseconds, capped at zfs_delay_max_ns.  The delay is small right
+ * above the minimum and grows smoothly without bound towards the maximum,
+ * so that writers settle at the rate the pool can sync instead of
+ * filling a txg and stalling until it is on disk.  At zfs_dirty_data_max
+ * writers block until dsl_pool_sync() has written some data out.
+ *
+ * zfs_delay_scale is roughly the inverse of the highest write rate we
+ * expect to sustain: at the midpoint between the minimum and the maximum
+ * each transaction waits zfs_delay_scale ns, i.e. 2000 tx/s by default.
+ *
+ * zfs_dirty_data_max defaults to zfs_dirty_data_max_percent of physical
+ * memory, capped at zfs_dirty_data_max_max and at a quarter of the ARC
+ * (see arc_init()).  zfs_no_write_throttle turns the delay off.
+ *
+ * Independently of the delay, the open txg is closed early once it holds
+ * enough dirty data to keep the disks busy for about zfs_txg_synctime_ms,
+ * going by the sync rate of recent txgs (see dsl_pool_sync_rate_update()),
+ * and at most zfs_dirty_data_sync_percent of zfs_dirty_data_max.  So txgs
+ * stay small enough to sync in a bounded time instead of piling up until
+ * zfs_txg_timeout, and txg_wait_synced() callers don't wait for bursts.
+ */
 int zfs_no_write_throttle = 0;
-int zfs_write_limit_shift = 3;			/* 1/8th of physical memory */
-int zfs_txg_synctime_ms = 5000;		/* target millisecs to sync a txg */
+uint64_t zfs_dirty_data_max = 0;
+uint64_t zfs_dirty_data_max_max = 4ULL << 30;
+int zfs_dirty_data_max_percent = 10;
+int zfs_delay_min_dirty_percent = 60;
+uint64_t zfs_delay_scale = 1000 * 1000 * 1000 / 2000;
+uint64_t zfs_delay_max_ns = 100 * 1000 * 1000;	/* 100ms */
+int zfs_dirty_data_sync_percent = 20;
+int zfs_txg_synctime_ms = 1000;
+
+/* % of CPUs used to sync dirty dnodes, see dmu_objset_sync() */
+int zfs_sync_taskq_batch_pct = 75;
+
+/*
+ * Time spent in each phase of the most recent dsl_pool_sync() pass of
+ * any pool, in microseconds, plus running totals of the dirty dnodes
+ * synced and the tasks used to sync them.
+ */
+typedef struct dsl_pool_sync_stats {
+	kstat_named_t dps_txg;
+	kstat_named_t dps_pass;
+	kstat_named_t dps_datasets_us;
+	kstat_named_t dps_userquota_us;
+	kstat_named_t dps_synctasks_us;
+	kstat_named_t dps_dirs_us;
+	kstat_named_t dps_mos_us;
+	kstat_named_t dps_total_us;
+	kstat_named_t dps_dnodes;
+	kstat_named_t dps_dnode_tasks;
+} dsl_pool_sync_stats_t;
+
+static dsl_pool_sync_stats_t dsl_pool_sync_stats = {
+	{ "txg",		KSTAT_DATA_UINT64 },
+	{ "pass",		KSTAT_DATA_UINT64 },
+	{ "datasets_us",	KSTAT_DATA_UINT64 },
+	{ "userquota_us",	KSTAT_DATA_UINT64 },
+	{ "synctasks_us",	KSTAT_DATA_UINT64 },
+	{ "dirs_us",		KSTAT_DATA_UINT64 },
+	{ "mos_us",		KSTAT_DATA_UINT64 },
+	{ "total_us",		KSTAT_DATA_UINT64 },
+	{ "dnodes",		KSTAT_DATA_UINT64 },
+	{ "dnode_tasks",	KSTAT_DATA_UINT64 },
+};
+
+#define	DPSSTAT(stat)		(dsl_pool_sync_stats.stat.value.ui64)
+#define	DPSSTAT_US(stat, ns)	DPSSTAT(stat) = (ns) / 1000
+
+static kstat_t *dsl_pool_sync_ksp;
 
-uint64_t zfs_write_limit_min = 32 << 20;	/* min write limit is 32MB */
-uint64_t zfs_write_limit_max = 0;		/* max data payload per txg */
-uint64_t zfs_write_limit_inflated = 0;
-uint64_t zfs_write_limit_override = 0;
+void
+dsl_pool_stat_init(void)
+{
+	dsl_pool_sync_ksp = kstat_create("zfs", 0, "dsl_pool_sync", "misc",
+	    KSTAT_TYPE_NAMED, sizeof (dsl_pool_sync_stats) /
+	    sizeof (kstat_named_t), KSTAT_FLAG_VIRTUAL);
 
-kmutex_t zfs_write_limit_lock;
+	if (dsl_pool_sync_ksp != NULL) {
+		dsl_pool_sync_ksp->ks_data = &dsl_pool_sync_stats;
+		kstat_install(dsl_pool_sync_ksp);
+	}
+}
 
-static uint64_t old_physmem = 0;
+void
+dsl_pool_stat_fini(void)
+{
+	if (dsl_pool_sync_ksp != NULL) {
+		kstat_delete(dsl_pool_sync_ksp);
+		dsl_pool_sync_ksp = NULL;
+	}
+}
+
+void
+dsl_pool_sync_stat_dnodes(uint64_t ndnodes, uint64_t ntasks)
+{
+	atomic_add_64(&DPSSTAT(dps_dnodes), ndnodes);
+	atomic_add_64(&DPSSTAT(dps_dnode_tasks), ntasks);
+}
 
 int
 dsl_pool_open_special_dir(dsl_pool_t *dp, const char *name, dsl_dir_t **ddp)
@@ -78,7 +172,6 @@ dsl_pool_open_impl(spa_t *spa, uint64_t txg)
 	dp->dp_spa = spa;
 	dp->dp_meta_rootbp = *bp;
 	rw_init(&dp->dp_config_rwlock, NULL, RW_DEFAULT, NULL);
-	dp->dp_write_limit = zfs_write_limit_min;
 	txg_init(dp, txg);
 
 	txg_list_create(&dp->dp_dirty_datasets,
@@ -91,9 +184,13 @@ dsl_pool_open_impl(spa_t *spa, uint64_t txg)
 	    offsetof(dsl_dataset_t, ds_synced_link));
 
 	mutex_init(&dp->dp_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&dp->dp_spaceavail_cv, NULL, CV_DEFAULT, NULL);
 
 	dp->dp_vnrele_taskq = taskq_create("zfs_vn_rele_taskq", 1, minclsyspri,
 	    1, 4, 0);
+	dp->dp_sync_taskq = taskq_create("dp_sync_taskq",
+	    zfs_sync_taskq_batch_pct, minclsyspri, 1, INT_MAX,
+	    TASKQ_THREADS_CPU_PCT);
 
 	return (dp);
 }
@@ -195,7 +292,9 @@ dsl_pool_close(dsl_pool_t *dp)
 	dsl_scan_fini(dp);
 	rw_destroy(&dp->dp_config_rwlock);
 	mutex_destroy(&dp->dp_lock);
+	cv_destroy(&dp->dp_spaceavail_cv);
 	taskq_destroy(dp->dp_vnrele_taskq);
+	taskq_destroy(dp->dp_sync_taskq);
 	if (dp->dp_blkstats)
 		kmem_free(dp->dp_blkstats, sizeof (zfs_all_blkstats_t));
 	kmem_free(dp, sizeof (dsl_pool_t));
@@ -253,6 +352,22 @@ dsl_pool_create(spa_t *spa, nvlist_t *zplprops, uint64_t txg)
 	return (dp);
 }
 
+/*
+ * The dirty data of txg has been written out (or will be rewritten by a
+ * later pass of the same txg, which will undirty it again): stop counting
+ * it against zfs_dirty_data_max and let throttled writers back in.
+ */
+static void
+dsl_pool_undirty_space(dsl_pool_t *dp, uint64_t txg)
+{
+	mutex_enter(&dp->dp_lock);
+	ASSERT3U(dp->dp_dirty_total, >=, dp->dp_space_towrite[txg & TXG_MASK]);
+	dp->dp_dirty_total -= dp->dp_space_towrite[txg & TXG_MASK];
+	dp->dp_space_towrite[txg & TXG_MASK] = 0;
+	cv_broadcast(&dp->dp_spaceavail_cv);
+	mutex_exit(&dp->dp_lock);
+}
+
 void
 dsl_pool_sync(dsl_pool_t *dp, uint64_t txg)
 {
@@ -262,22 +377,13 @@ dsl_pool_sync(dsl_pool_t *dp, uint64_t txg)
 	dsl_dataset_t *ds;
 	dsl_sync_task_group_t *dstg;
 	objset_t *mos = dp->dp_meta_objset;
-	hrtime_t start, write_time;
-	uint64_t data_written;
+	hrtime_t start, write_time, sync_start, phase;
 	int err;
 
-	/*
-	 * We need to copy dp_space_towrite() before doing
-	 * dsl_sync_task_group_sync(), because
-	 * dsl_dataset_snapshot_reserve_space() will increase
-	 * dp_space_towrite but not actually write anything.
-	 */
-	data_written = dp->dp_space_towrite[txg & TXG_MASK];
-
 	tx = dmu_tx_create_assigned(dp, txg);
 
 	dp->dp_read_overhead = 0;
-	start = gethrtime();
+	sync_start = start = gethrtime();
 
 	zio = zio_root(dp->dp_spa, NULL, NULL, ZIO_FLAG_MUSTSUCCEED);
 	while (ds = txg_list_remove(&dp->dp_dirty_datasets, txg)) {
@@ -295,7 +401,17 @@ dsl_pool_sync(dsl_pool_t *dp, uint64_t txg)
 
 	write_time = gethrtime() - start;
 	ASSERT(err == 0);
+	/*
+	 * The bulk of the dirty data has been written; whatever the rest of
+	 * this sync dirties is counted again and undirtied at the end.
+	 */
+	dsl_pool_undirty_space(dp, txg);
 	DTRACE_PROBE(pool_sync__2rootzio);
+	DPSSTAT(dps_txg) = txg;
+	DPSSTAT(dps_pass) = spa_sync_pass(dp->dp_spa);
+	DPSSTAT_US(dps_datasets_us, write_time);
+
+	phase = gethrtime();
 
 	for (ds = list_head(&dp->dp_synced_datasets); ds;
 	    ds = list_next(&dp->dp_synced_datasets, ds))
@@ -314,6 +430,7 @@ dsl_pool_sync(dsl_pool_t *dp, uint64_t txg)
 		dsl_dataset_sync(ds, zio, tx);
 	}
 	err = zio_wait(zio);
+	DPSSTAT_US(dps_userquota_us, gethrtime() - phase);
 
 	/*
 	 * If anything was added to a deadlist during a zio done callback,
@@ -324,6 +441,7 @@ dsl_pool_sync(dsl_pool_t *dp, uint64_t txg)
 		bplist_sync(&ds->ds_deadlist,
 		    bplist_enqueue_cb, &ds->ds_deadlist, tx);
 
+	phase = gethrtime();
 	while (dstg = txg_list_remove(&dp->dp_sync_tasks, txg)) {
 		/*
 		 * No more sync tasks should have been added while we
@@ -335,8 +453,10 @@ dsl_pool_sync(dsl_pool_t *dp, uint64_t txg)
 	DTRACE_PROBE(pool_sync__3task);
 
 	start = gethrtime();
+	DPSSTAT_US(dps_synctasks_us, start - phase);
 	while (dd = txg_list_remove(&dp->dp_dirty_dirs, txg))
 		dsl_dir_sync(dd, tx);
+	DPSSTAT_US(dps_dirs_us, gethrtime() - start);
 	write_time += gethrtime() - start;
 
 	start = gethrtime();
@@ -349,54 +469,15 @@ dsl_pool_sync(dsl_pool_t *dp, uint64_t txg)
 		dprintf_bp(&dp->dp_meta_rootbp, "meta objset rootbp is %s", "");
 		spa_set_rootblkptr(dp->dp_spa, &dp->dp_meta_rootbp);
 	}
+	DPSSTAT_US(dps_mos_us, gethrtime() - start);
 	write_time += gethrtime() - start;
 	DTRACE_PROBE2(pool_sync__4io, hrtime_t, write_time,
 	    hrtime_t, dp->dp_read_overhead);
-	write_time -= dp->dp_read_overhead;
 
 	dmu_tx_commit(tx);
+	DPSSTAT_US(dps_total_us, gethrtime() - sync_start);
 
-	dp->dp_space_towrite[txg & TXG_MASK] = 0;
-	ASSERT(dp->dp_tempreserved[txg & TXG_MASK] == 0);
-
-	/*
-	 * If the write limit max has not been explicitly set, set it
-	 * to a fraction of available physical memory (default 1/8th).
-	 * Note that we must inflate the limit because the spa
-	 * inflates write sizes to account for data replication.
-	 * Check this each sync phase to catch changing memory size.
-	 */
-	if (physmem != old_physmem && zfs_write_limit_shift) {
-		mutex_enter(&zfs_write_limit_lock);
-		old_physmem = physmem;
-		zfs_write_limit_max = ptob(physmem) >> zfs_write_limit_shift;
-		zfs_write_limit_inflated = MAX(zfs_write_limit_min,
-		    spa_get_asize(dp->dp_spa, zfs_write_limit_max));
-		mutex_exit(&zfs_write_limit_lock);
-	}
-
-	/*
-	 * Attempt to keep the sync time consistent by adjusting the
-	 * amount of write traffic allowed into each transaction group.
-	 * Weight the throughput calculation towards the current value:
-	 *	thru = 3/4 old_thru + 1/4 new_thru
-	 *
-	 * Note: write_time is in nanosecs, so write_time/MICROSEC
-	 * yields millisecs
-	 */
-	ASSERT(zfs_write_limit_min > 0);
-	if (data_written > zfs_write_limit_min / 8 && write_time > MICROSEC) {
-		uint64_t throughput = data_written / (write_time / MICROSEC);
-
-		if (dp->dp_throughput)
-			dp->dp_throughput = throughput / 4 +
-			    3 * dp->dp_throughput / 4;
-		else
-			dp->dp_throughput = throughput;
-		dp->dp_write_limit = MIN(zfs_write_limit_inflated,
-		    MAX(zfs_write_limit_min,
-		    dp->dp_throughput * zfs_txg_synctime_ms));
-	}
+	dsl_pool_undirty_space(dp, txg);
 }
 
 void
@@ -416,14 +497,16 @@ dsl_pool_sync_done(dsl_pool_t *dp, uint64_t txg)
 }
 
 /*
- * TRUE if the current thread is the tx_sync_thread or if we
- * are being called from SPA context during pool initialization.
+ * TRUE if the current thread is the tx_sync_thread, one of the threads
+ * it hands dirty dnodes to, or if we are being called from SPA context
+ * during pool initialization.
  */
 int
 dsl_pool_sync_context(dsl_pool_t *dp)
 {
 	return (curthread == dp->dp_tx.tx_sync_thread ||
-	    spa_get_dsl(dp->dp_spa) == NULL);
+	    spa_get_dsl(dp->dp_spa) == NULL ||
+	    taskq_member(dp->dp_sync_taskq, curthread));
 }
 
 uint64_t
@@ -449,80 +532,108 @@ dsl_pool_adjustedsize(dsl_pool_t *dp, boolean_t netfree)
 	return (space - resv);
 }
 
-int
-dsl_pool_tempreserve_space(dsl_pool_t *dp, uint64_t space, dmu_tx_t *tx)
+/*
+ * How much dirty data the open txg may hold before we close it, see the
+ * comment at the top of this file.  Until a sync rate has been measured
+ * this is just the zfs_dirty_data_sync_percent cap.
+ */
+static uint64_t
+dsl_pool_dirty_sync_target_impl(dsl_pool_t *dp)
 {
-	uint64_t reserved = 0;
-	uint64_t write_limit = (zfs_write_limit_override ?
-	    zfs_write_limit_override : dp->dp_write_limit);
-
-	if (zfs_no_write_throttle) {
-		atomic_add_64(&dp->dp_tempreserved[tx->tx_txg & TXG_MASK],
-		    space);
-		return (0);
-	}
-
-	/*
-	 * Check to see if we have exceeded the maximum allowed IO for
-	 * this transaction group.  We can do this without locks since
-	 * a little slop here is ok.  Note that we do the reserved check
-	 * with only half the requested reserve: this is because the
-	 * reserve requests are worst-case, and we really don't want to
-	 * throttle based off of worst-case estimates.
-	 */
-	if (write_limit > 0) {
-		reserved = dp->dp_space_towrite[tx->tx_txg & TXG_MASK]
-		    + dp->dp_tempreserved[tx->tx_txg & TXG_MASK] / 2;
+	uint64_t cap = zfs_dirty_data_max * zfs_dirty_data_sync_percent / 100;
+	uint64_t target;
 
-		if (reserved && reserved > write_limit)
-			return (ERESTART);
-	}
-
-	atomic_add_64(&dp->dp_tempreserved[tx->tx_txg & TXG_MASK], space);
-
-	/*
-	 * If this transaction group is over 7/8ths capacity, delay
-	 * the caller 1 clock tick.  This will slow down the "fill"
-	 * rate until the sync process can catch up with us.
-	 */
-	if (reserved && reserved > (write_limit - (write_limit >> 3)))
-		txg_delay(dp, tx->tx_txg, 1);
+	ASSERT(MUTEX_HELD(&dp->dp_lock));
 
-	return (0);
+	if (dp->dp_sync_bw == 0)
+		return (cap);
+	target = dp->dp_sync_bw * zfs_txg_synctime_ms / 1000;
+	return (MAX(MIN(target, cap), cap / 8));
 }
 
-void
-dsl_pool_tempreserve_clear(dsl_pool_t *dp, int64_t space, dmu_tx_t *tx)
+uint64_t
+dsl_pool_dirty_sync_target(dsl_pool_t *dp)
 {
-	ASSERT(dp->dp_tempreserved[tx->tx_txg & TXG_MASK] >= space);
-	atomic_add_64(&dp->dp_tempreserved[tx->tx_txg & TXG_MASK], -space);
+	uint64_t target;
+
+	mutex_enter(&dp->dp_lock);
+	target = dsl_pool_dirty_sync_target_impl(dp);
+	mutex_exit(&dp->dp_lock);
+	return (target);
 }
 
+/*
+ * Fold the sync time of a txg into the pool's sync rate, which is a moving
+ * average over the last few txgs.  Txgs well below the target are mostly
+ * fixed costs (MOS, uberblocks) and would make the disks look slower than
+ * they are, so they don't count.
+ */
 void
-dsl_pool_memory_pressure(dsl_pool_t *dp)
+dsl_pool_sync_rate_update(dsl_pool_t *dp, uint64_t dirty, hrtime_t sync_time)
 {
-	uint64_t space_inuse = 0;
-	int i;
+	uint64_t bw;
 
-	if (dp->dp_write_limit == zfs_write_limit_min)
+	if (sync_time <= 0)
 		return;
+	bw = dirty * NANOSEC / sync_time;
 
-	for (i = 0; i < TXG_SIZE; i++) {
-		space_inuse += dp->dp_space_towrite[i];
-		space_inuse += dp->dp_tempreserved[i];
+	mutex_enter(&dp->dp_lock);
+	if (dirty >= dsl_pool_dirty_sync_target_impl(dp) / 4) {
+		if (dp->dp_sync_bw == 0)
+			dp->dp_sync_bw = bw;
+		else
+			dp->dp_sync_bw = (dp->dp_sync_bw * 3 + bw) / 4;
 	}
-	dp->dp_write_limit = MAX(zfs_write_limit_min,
-	    MIN(dp->dp_write_limit, space_inuse / 4));
+	mutex_exit(&dp->dp_lock);
 }
 
 void
 dsl_pool_willuse_space(dsl_pool_t *dp, int64_t space, dmu_tx_t *tx)
 {
+	uint64_t *towrite = &dp->dp_space_towrite[tx->tx_txg & TXG_MASK];
+	uint64_t target;
+	boolean_t kick = B_FALSE;
+
 	if (space > 0) {
 		mutex_enter(&dp->dp_lock);
-		dp->dp_space_towrite[tx->tx_txg & TXG_MASK] += space;
+		/*
+		 * Close the open txg the moment it crosses the target, once.
+		 */
+		target = dsl_pool_dirty_sync_target_impl(dp);
+		if (!dmu_tx_is_syncing(tx) && *towrite < target &&
+		    *towrite + space >= target)
+			kick = B_TRUE;
+		*towrite += space;
+		dp->dp_dirty_total += space;
 		mutex_exit(&dp->dp_lock);
 	}
+
+	if (kick)
+		txg_kick(dp);
+}
+
+/*
+ * TRUE if there is enough dirty data that new transactions must be
+ * delayed, see dmu_tx_delay().  Also closes the open txg so that the
+ * dirty data starts going to disk instead of waiting for the txg timeout.
+ */
+boolean_t
+dsl_pool_need_dirty_delay(dsl_pool_t *dp)
+{
+	uint64_t delay_min_bytes =
+	    zfs_dirty_data_max * zfs_delay_min_dirty_percent / 100;
+	boolean_t rv;
+
+	if (zfs_no_write_throttle)
+		return (B_FALSE);
+
+	mutex_enter(&dp->dp_lock);
+	rv = (dp->dp_dirty_total > delay_min_bytes);
+	mutex_exit(&dp->dp_lock);
+
+	if (rv)
+		txg_kick(dp);
+	return (rv);
 }
 
 /* ARGSUSED */
@@ -53,6 +53,7 @@ static scan_cb_t dsl_scan_scrub_cb;
 static scan_cb_t dsl_scan_remove_cb;
 static dsl_syncfunc_t dsl_scan_cancel_sync;
 static void dsl_scan_sync_state(dsl_scan_t *, dmu_tx_t *tx);
+static void dsl_scan_issue_queued(dsl_scan_t *);
 
 int zfs_scan_min_time_ms = 1000; /* min millisecs to scrub per txg */
 int zfs_resilver_min_time_ms = 3000; /* min millisecs to resilver per txg */
@@ -60,6 +61,55 @@ boolean_t zfs_no_scrub_io = B_FALSE; /* set to disable scrub i/o */
 boolean_t zfs_no_scrub_prefetch = B_FALSE; /* set to disable srub prefetching */
 enum ddt_class zfs_scrub_ddt_class_max = DDT_CLASS_DUPLICATE;
 int dsl_scan_delay_completion = B_FALSE; /* set to delay scan completion */
+boolean_t zfs_no_scrub_sort = B_FALSE; /* set to issue scrub i/o unsorted */
+uint64_t zfs_scan_mem_lim = 16ULL << 20; /* max memory for queued scan i/o */
+uint64_t zfs_scan_queue_max = 256ULL << 20; /* max bytes queued before issue */
+uint64_t zfs_scan_max_ext_gap = 2ULL << 20; /* max gap within an extent */
+uint64_t zfs_scan_max_ext_size = 16ULL << 20; /* max extent per vdev turn */
+int zfs_scan_idle_ms = 50; /* no foreground i/o for this long is idle */
+int zfs_scan_pace_interval_ms = 100; /* how often the scan pace adapts */
+int zfs_scan_pace_delay = 1; /* ticks to delay scan i/o at slowest pace */
+
+/*
+ * The scan_pace.<pool> kstat: the foreground latency target set by the
+ * scanlatency pool property, what the vdev queues measured, and how the
+ * scan reacted (see dsl_scan_pace()).
+ */
+typedef struct dsl_scan_kstats {
+	kstat_named_t	sk_latency_target_us;
+	kstat_named_t	sk_fg_latency_us;
+	kstat_named_t	sk_fg_idle_ms;
+	kstat_named_t	sk_inflight;
+	kstat_named_t	sk_inflight_limit;
+	kstat_named_t	sk_idles;
+	kstat_named_t	sk_backoffs;
+	kstat_named_t	sk_increases;
+	kstat_named_t	sk_delays;
+} dsl_scan_kstats_t;
+
+static const dsl_scan_kstats_t dsl_scan_kstats_template = {
+	{ "latency_target_us",	KSTAT_DATA_UINT64 },
+	{ "fg_latency_us",	KSTAT_DATA_UINT64 },
+	{ "fg_idle_ms",		KSTAT_DATA_UINT64 },
+	{ "inflight",		KSTAT_DATA_UINT64 },
+	{ "inflight_limit",	KSTAT_DATA_UINT64 },
+	{ "idles",		KSTAT_DATA_UINT64 },
+	{ "backoffs",		KSTAT_DATA_UINT64 },
+	{ "increases",		KSTAT_DATA_UINT64 },
+	{ "delays",		KSTAT_DATA_UINT64 },
+};
+
+/*
+ * A scrub/resilver read waiting in its top-level vdev's queue.
+ */
+typedef struct scan_io {
+	avl_node_t	sio_node;
+	uint64_t	sio_offset;	/* offset of sio_bp's first DVA */
+	blkptr_t	sio_bp;
+	zbookmark_t	sio_zb;
+	int		sio_flags;
+	int		sio_priority;
+} scan_io_t;
 
 #define	DSL_SCAN_IS_SCRUB_RESILVER(scn) \
 	((scn)->scn_phys.scn_func == POOL_SCAN_SCRUB || \
@@ -74,6 +124,66 @@ static scan_cb_t *scan_funcs[POOL_SCAN_FUNCS] = {
 	dsl_scan_scrub_cb,	/* POOL_SCAN_RESILVER */
 };
 
+static int
+dsl_scan_kstat_update(kstat_t *ksp, int rw)
+{
+	dsl_scan_t *scn = ksp->ks_private;
+	dsl_scan_kstats_t *sk = ksp->ks_data;
+	spa_t *spa = scn->scn_dp->dp_spa;
+
+	if (rw == KSTAT_WRITE)
+		return (EACCES);
+
+	sk->sk_latency_target_us.value.ui64 = spa->spa_scan_latency * MILLISEC;
+	sk->sk_fg_latency_us.value.ui64 = spa->spa_fg_io_latency / MILLISEC;
+	sk->sk_fg_idle_ms.value.ui64 =
+	    (gethrtime() - spa->spa_fg_io_last) / MICROSEC;
+	sk->sk_inflight.value.ui64 = spa->spa_scrub_inflight;
+	sk->sk_inflight_limit.value.ui64 = scn->scn_pace_inflight;
+	sk->sk_idles.value.ui64 = scn->scn_pace_idles;
+	sk->sk_backoffs.value.ui64 = scn->scn_pace_backoffs;
+	sk->sk_increases.value.ui64 = scn->scn_pace_increases;
+	sk->sk_delays.value.ui64 = scn->scn_pace_delays;
+	return (0);
+}
+
+static void
+dsl_scan_kstat_init(dsl_scan_t *scn)
+{
+	char name[MAXNAMELEN];
+	dsl_scan_kstats_t *sk;
+
+	(void) snprintf(name, sizeof (name), "scan_pace.%s",
+	    spa_name(scn->scn_dp->dp_spa));
+	scn->scn_ksp = kstat_create("zfs", 0, name, "misc", KSTAT_TYPE_NAMED,
+	    sizeof (dsl_scan_kstats_t) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_VIRTUAL);
+	if (scn->scn_ksp == NULL)
+		return;
+
+	sk = kmem_alloc(sizeof (dsl_scan_kstats_t), KM_SLEEP);
+	bcopy(&dsl_scan_kstats_template, sk, sizeof (dsl_scan_kstats_t));
+
+	scn->scn_ksp->ks_data = sk;
+	scn->scn_ksp->ks_private = scn;
+	scn->scn_ksp->ks_update = dsl_scan_kstat_update;
+	kstat_install(scn->scn_ksp);
+}
+
+static void
+dsl_scan_kstat_fini(dsl_scan_t *scn)
+{
+	dsl_scan_kstats_t *sk;
+
+	if (scn->scn_ksp == NULL)
+		return;
+
+	sk = scn->scn_ksp->ks_data;
+	kstat_delete(scn->scn_ksp);
+	scn->scn_ksp = NULL;
+	kmem_free(sk, sizeof (dsl_scan_kstats_t));
+}
+
 int
 dsl_scan_init(dsl_pool_t *dp, uint64_t txg)
 {
@@ -84,6 +194,7 @@ dsl_scan_init(dsl_pool_t *dp, uint64_t txg)
 
 	scn = dp->dp_scan = kmem_zalloc(sizeof (dsl_scan_t), KM_SLEEP);
 	scn->scn_dp = dp;
+	dsl_scan_kstat_init(scn);
 
 	err = zap_lookup(dp->dp_meta_objset, DMU_POOL_DIRECTORY_OBJECT,
 	    "scrub_func", sizeof (uint64_t), 1, &f);
@@ -137,6 +248,7 @@ void
 dsl_scan_fini(dsl_pool_t *dp)
 {
 	if (dp->dp_scan) {
+		dsl_scan_kstat_fini(dp->dp_scan);
 		kmem_free(dp->dp_scan, sizeof (dsl_scan_t));
 		dp->dp_scan = NULL;
 	}
@@ -166,6 +278,15 @@ dsl_scan_setup_sync(void *arg1, void *arg2, dmu_tx_t *tx)
 
 	ASSERT(scn->scn_phys.scn_state != DSS_SCANNING);
 	ASSERT(*funcp > POOL_SCAN_NONE && *funcp < POOL_SCAN_FUNCS);
+
+	/*
+	 * dsl_scan_ddt() walks the DDT ZAP objects, and dsl_scan_visitbp()
+	 * skips what ddt_class_contains() says that walk covers, logged
+	 * entries included.  This may run after ddt_sync() in a txg (when
+	 * dsl_scan_sync() restarts a scan), so apply the DDT logs here.
+	 */
+	ddt_log_flush_all(spa, tx);
+
 	bzero(&scn->scn_phys, sizeof (scn->scn_phys));
 	scn->scn_phys.scn_func = *funcp;
 	scn->scn_phys.scn_state = DSS_SCANNING;
@@ -446,6 +567,7 @@ dsl_scan_sync_state(dsl_scan_t *scn, dmu_tx_t *tx)
 static boolean_t
 dsl_scan_check_pause(dsl_scan_t *scn, const zbookmark_t *zb)
 {
+	spa_t *spa = scn->scn_dp->dp_spa;
 	uint64_t elapsed_nanosecs;
 	int mintime;
 
@@ -465,6 +587,11 @@ dsl_scan_check_pause(dsl_scan_t *scn, const zbookmark_t *zb)
 
 	mintime = (scn->scn_phys.scn_func == POOL_SCAN_RESILVER) ?
 	    zfs_resilver_min_time_ms : zfs_scan_min_time_ms;
+	if (spa->spa_scan_latency != 0 && !scn->scn_pace_idle &&
+	    scn->scn_pace_inflight != 0) {
+		mintime = mintime * scn->scn_pace_inflight /
+		    MAX(spa->spa_scrub_maxinflight, 1);
+	}
 	elapsed_nanosecs = gethrtime() - scn->scn_sync_start_time;
 	if (elapsed_nanosecs / NANOSEC > zfs_txg_timeout ||
 	    (elapsed_nanosecs / MICROSEC > mintime &&
@@ -1251,7 +1378,7 @@ dsl_scan_ddt(dsl_scan_t *scn, dmu_tx_t *tx)
 
 		/* There should be no pending changes to the dedup table */
 		ddt = scn->scn_dp->dp_spa->spa_ddt[ddb->ddb_checksum];
-		ASSERT(avl_first(&ddt->ddt_tree) == NULL);
+		ASSERT(ddt_dirty_count(ddt) == 0);
 
 		dsl_scan_ddt_entry(scn, ddb->ddb_checksum, &dde, tx);
 		n++;
@@ -1437,10 +1564,19 @@ dsl_scan_sync(dsl_pool_t *dp, dmu_tx_t *tx)
 
 	scn->scn_prefetch_zio_root = zio_root(dp->dp_spa, NULL,
 	    NULL, ZIO_FLAG_CANFAIL);
+	scn->scn_sorting = !zfs_no_scrub_sort &&
+	    DSL_SCAN_IS_SCRUB_RESILVER(scn);
 	dsl_scan_visit(scn, tx);
 	(void) zio_wait(scn->scn_prefetch_zio_root);
 	scn->scn_prefetch_zio_root = NULL;
 
+	/*
+	 * The bookmark synced below is past every queued block, so the
+	 * queues must be drained before this txg's scan state is written.
+	 */
+	dsl_scan_issue_queued(scn);
+	scn->scn_sorting = B_FALSE;
+
 	zfs_dbgmsg("visited %"PRIu64" blocks in %"PRIu64"ms",
 	    (longlong_t)scn->scn_visited_this_txg,
 	    (longlong_t)(gethrtime() - scn->scn_sync_start_time) / MICROSEC);
@@ -1558,12 +1694,226 @@ dsl_scan_scrub_done(zio_t *zio)
 	mutex_exit(&spa->spa_scrub_lock);
 }
 
+/*
+ * With the scanlatency pool property set, scan I/O is paced on what the
+ * vdev queues observe of foreground I/O (see vdev_queue_fg_io_done()).
+ * Every zfs_scan_pace_interval_ms the number of scan I/Os allowed in
+ * flight is adjusted: back to spa_scrub_maxinflight when there has been
+ * no foreground I/O for zfs_scan_idle_ms, halved when the foreground
+ * latency exceeds the target, and otherwise raised by one.  Once down to
+ * a single I/O in flight, each scan I/O is also delayed by
+ * zfs_scan_pace_delay ticks for as long as the target is exceeded.  The
+ * per-txg time slice shrinks in proportion (see dsl_scan_check_pause()).
+ *
+ * Returns the number of scan I/Os allowed in flight.
+ */
+static uint64_t
+dsl_scan_pace(dsl_scan_t *scn)
+{
+	spa_t *spa = scn->scn_dp->dp_spa;
+	uint64_t max = MAX(spa->spa_scrub_maxinflight, 1);
+	uint64_t target = spa->spa_scan_latency * MICROSEC;
+	hrtime_t now;
+
+	if (target == 0) {
+		scn->scn_pace_inflight = max;
+		scn->scn_pace_idle = B_FALSE;
+		scn->scn_pace_over = B_FALSE;
+		return (max);
+	}
+
+	now = gethrtime();
+	if (scn->scn_pace_inflight != 0 &&
+	    now - scn->scn_pace_time < zfs_scan_pace_interval_ms * MICROSEC)
+		return (MIN(scn->scn_pace_inflight, max));
+	scn->scn_pace_time = now;
+
+	if (now - spa->spa_fg_io_last > zfs_scan_idle_ms * MICROSEC) {
+		scn->scn_pace_idle = B_TRUE;
+		scn->scn_pace_over = B_FALSE;
+		scn->scn_pace_inflight = max;
+		scn->scn_pace_idles++;
+	} else if (spa->spa_fg_io_latency > target) {
+		scn->scn_pace_idle = B_FALSE;
+		scn->scn_pace_over = B_TRUE;
+		scn->scn_pace_inflight = MAX(scn->scn_pace_inflight / 2, 1);
+		scn->scn_pace_backoffs++;
+	} else {
+		scn->scn_pace_idle = B_FALSE;
+		scn->scn_pace_over = B_FALSE;
+		scn->scn_pace_inflight = MIN(scn->scn_pace_inflight + 1, max);
+		scn->scn_pace_increases++;
+	}
+	return (scn->scn_pace_inflight);
+}
+
+static void
+dsl_scan_scrub_issue(dsl_scan_t *scn, const blkptr_t *bp,
+    const zbookmark_t *zb, int zio_flags, int zio_priority)
+{
+	spa_t *spa = scn->scn_dp->dp_spa;
+	size_t size = BP_GET_PSIZE(bp);
+	uint64_t maxinflight = dsl_scan_pace(scn);
+	void *data;
+
+	if (scn->scn_pace_over && maxinflight == 1) {
+		scn->scn_pace_delays++;
+		delay(zfs_scan_pace_delay);
+	}
+
+	data = zio_data_buf_alloc(size);
+
+	mutex_enter(&spa->spa_scrub_lock);
+	while (spa->spa_scrub_inflight >= maxinflight)
+		cv_wait(&spa->spa_scrub_io_cv, &spa->spa_scrub_lock);
+	spa->spa_scrub_inflight++;
+	mutex_exit(&spa->spa_scrub_lock);
+
+	spa->spa_scan_pass_issued += BP_GET_ASIZE(bp);
+
+	zio_nowait(zio_read(NULL, spa, bp, data, size,
+	    dsl_scan_scrub_done, NULL, zio_priority, zio_flags, zb));
+}
+
+static int
+scan_io_compare(const void *x1, const void *x2)
+{
+	const scan_io_t *s1 = x1;
+	const scan_io_t *s2 = x2;
+
+	if (s1->sio_offset < s2->sio_offset)
+		return (-1);
+	if (s1->sio_offset > s2->sio_offset)
+		return (1);
+	return (0);
+}
+
+/*
+ * Issue one extent from a top-level vdev's queue: a run of queued blocks
+ * in ascending offset order, with no gap larger than zfs_scan_max_ext_gap,
+ * of at most zfs_scan_max_ext_size bytes.  Adjacent reads in the run are
+ * aggregated by the vdev queue into large sequential I/Os.
+ */
+static void
+dsl_scan_issue_extent(dsl_scan_t *scn, avl_tree_t *t)
+{
+	scan_io_t *sio, *next;
+	uint64_t start, end;
+
+	sio = avl_first(t);
+	start = end = sio->sio_offset;
+
+	while (sio != NULL && sio->sio_offset <= end + zfs_scan_max_ext_gap &&
+	    end - start < zfs_scan_max_ext_size) {
+		next = AVL_NEXT(t, sio);
+		avl_remove(t, sio);
+
+		end = MAX(end, sio->sio_offset +
+		    DVA_GET_ASIZE(&sio->sio_bp.blk_dva[0]));
+		scn->scn_queued_mem -= sizeof (scan_io_t);
+		scn->scn_queued_bytes -= BP_GET_ASIZE(&sio->sio_bp);
+
+		dsl_scan_scrub_issue(scn, &sio->sio_bp, &sio->sio_zb,
+		    sio->sio_flags, sio->sio_priority);
+		kmem_free(sio, sizeof (scan_io_t));
+		sio = next;
+	}
+}
+
+/*
+ * Drain every top-level vdev's queue.  The vdevs take turns issuing one
+ * extent each, so that all of them stay busy under the in-flight limit.
+ */
+static void
+dsl_scan_issue_queued(dsl_scan_t *scn)
+{
+	vdev_t *rvd = scn->scn_dp->dp_spa->spa_root_vdev;
+	boolean_t more;
+
+	if (scn->scn_queued_mem == 0)
+		return;
+
+	do {
+		more = B_FALSE;
+		for (uint64_t c = 0; c < rvd->vdev_children; c++) {
+			vdev_t *vd = rvd->vdev_child[c];
+			avl_tree_t *t = vd->vdev_scan_queue;
+
+			if (t == NULL)
+				continue;
+
+			dsl_scan_issue_extent(scn, t);
+
+			if (avl_numnodes(t) == 0) {
+				avl_destroy(t);
+				kmem_free(t, sizeof (avl_tree_t));
+				vd->vdev_scan_queue = NULL;
+			} else {
+				more = B_TRUE;
+			}
+		}
+	} while (more);
+
+	ASSERT3U(scn->scn_queued_mem, ==, 0);
+	ASSERT3U(scn->scn_queued_bytes, ==, 0);
+}
+
+/*
+ * Queue a scrub/resilver read on the top-level vdev holding the block's
+ * first DVA, sorted by offset, so that the reads can later be issued in
+ * disk order rather than in logical traversal order.  When the queues
+ * outgrow zfs_scan_mem_lim or zfs_scan_queue_max they are drained right
+ * away.
+ */
+static void
+dsl_scan_enqueue(dsl_scan_t *scn, const blkptr_t *bp, const zbookmark_t *zb,
+    int zio_flags, int zio_priority)
+{
+	spa_t *spa = scn->scn_dp->dp_spa;
+	vdev_t *vd = vdev_lookup_top(spa, DVA_GET_VDEV(&bp->blk_dva[0]));
+	avl_tree_t *t;
+	scan_io_t *sio;
+	avl_index_t where;
+
+	if (vd == NULL) {
+		dsl_scan_scrub_issue(scn, bp, zb, zio_flags, zio_priority);
+		return;
+	}
+
+	if ((t = vd->vdev_scan_queue) == NULL) {
+		t = vd->vdev_scan_queue = kmem_alloc(sizeof (avl_tree_t),
+		    KM_SLEEP);
+		avl_create(t, scan_io_compare, sizeof (scan_io_t),
+		    offsetof(scan_io_t, sio_node));
+	}
+
+	sio = kmem_alloc(sizeof (scan_io_t), KM_SLEEP);
+	sio->sio_offset = DVA_GET_OFFSET(&bp->blk_dva[0]);
+	sio->sio_bp = *bp;
+	sio->sio_zb = *zb;
+	sio->sio_flags = zio_flags;
+	sio->sio_priority = zio_priority;
+
+	if (avl_find(t, sio, &where) != NULL) {
+		/* reached the same block twice; one read covers both */
+		kmem_free(sio, sizeof (scan_io_t));
+		return;
+	}
+	avl_insert(t, sio, where);
+
+	scn->scn_queued_mem += sizeof (scan_io_t);
+	scn->scn_queued_bytes += BP_GET_ASIZE(bp);
+
+	if (scn->scn_queued_mem >= zfs_scan_mem_lim ||
+	    scn->scn_queued_bytes >= zfs_scan_queue_max)
+		dsl_scan_issue_queued(scn);
+}
+
 static int
 dsl_scan_scrub_cb(dsl_pool_t *dp,
     const blkptr_t *bp, const zbookmark_t *zb)
 {
 	dsl_scan_t *scn = dp->dp_scan;
-	size_t size = BP_GET_PSIZE(bp);
 	spa_t *spa = dp->dp_spa;
 	uint64_t phys_birth = BP_PHYSICAL_BIRTH(bp);
 	boolean_t needs_io;
@@ -1622,17 +1972,11 @@ dsl_scan_scrub_cb(dsl_pool_t *dp,
 	}
 
 	if (needs_io && !zfs_no_scrub_io) {
-		void *data = zio_data_buf_alloc(size);
-
-		mutex_enter(&spa->spa_scrub_lock);
-		while (spa->spa_scrub_inflight >= spa->spa_scrub_maxinflight)
-			cv_wait(&spa->spa_scrub_io_cv, &spa->spa_scrub_lock);
-		spa->spa_scrub_inflight++;
-		mutex_exit(&spa->spa_scrub_lock);
-
-		zio_nowait(zio_read(NULL, spa, bp, data, size,
-		    dsl_scan_scrub_done, NULL, zio_priority,
-		    zio_flags, zb));
+		if (scn->scn_sorting)
+			dsl_scan_enqueue(scn, bp, zb, zio_flags, zio_priority);
+		else
+			dsl_scan_scrub_issue(scn, bp, zb, zio_flags,
+			    zio_priority);
 	}
 
 	/* do not relocate this block */
@@ -157,10 +157,11 @@ dsl_sync_task_group_sync(dsl_sync_task_group_t *dstg, dmu_tx_t *tx)
 	 * Check for sufficient space.  We just check against what's
 	 * on-disk; we don't want any in-flight accounting to get in our
 	 * way, because open context may have already used up various
-	 * in-core limits (arc_tempreserve, dsl_pool_tempreserve).
+	 * in-core limits (arc_tempreserve, dd_tempreserved).
 	 */
 	quota = dsl_pool_adjustedsize(dp, B_FALSE) -
-	    metaslab_class_get_deferred(spa_normal_class(dp->dp_spa));
+	    metaslab_class_get_deferred(spa_normal_class(dp->dp_spa)) -
+	    metaslab_class_get_deferred(spa_special_class(dp->dp_spa));
 	used = dp->dp_root_dir->dd_phys->dd_used_bytes;
 	/* MOS space is triple-dittoed, so we multiply by 3. */
 	if (dstg->dstg_space > 0 && used + dstg->dstg_space * 3 > quota) {
@@ -455,6 +455,7 @@ extern vnode_t *rootdir;
 #define	hz	119	/* frequency when using gethrtime() >> 23 for lbolt */
 
 extern void delay(clock_t ticks);
+extern void zfs_sleep_until(hrtime_t wakeup);
 
 #define	gethrestime_sec() time(NULL)
 #define	gethrestime(t) \
@@ -468,7 +469,12 @@ extern void delay(clock_t ticks);
 #define	minclsyspri	60
 #define	maxclsyspri	99
 
-#define	CPU_SEQID	(thr_self() & (max_ncpus - 1))
+/*
+ * pthread_t values are aligned addresses whose low bits are the same for
+ * every thread, so hash the id to spread threads over the CPU slots.
+ */
+#define	CPU_SEQID	((uint_t)(((((uint64_t)thr_self() >> 12) * \
+	0x9e3779b97f4a7c15ULL) >> 32) & (max_ncpus - 1)))
 
 #define	kcred		NULL
 #define	CRED()		NULL
@@ -476,6 +482,7 @@ extern void delay(clock_t ticks);
 #define	ptob(x)		((x) * PAGESIZE)
 
 extern uint64_t physmem;
+extern int ncpus;
 
 extern int highbit(ulong_t i);
 extern int random_get_bytes(uint8_t *ptr, size_t len);
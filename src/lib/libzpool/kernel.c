@@ -43,6 +43,7 @@
  */
 
 uint64_t physmem;
+int ncpus;
 vnode_t *rootdir = (vnode_t *)0xabcd1234;
 char hw_serial[HW_HOSTID_LEN];
 
@@ -739,6 +740,23 @@ delay(clock_t ticks)
 	poll(0, 0, ticks * (1000 / hz));
 }
 
+/*
+ * Sleep until gethrtime() reaches wakeup.  Unlike delay() this is not
+ * rounded up to whole clock ticks.
+ */
+void
+zfs_sleep_until(hrtime_t wakeup)
+{
+	struct timespec ts;
+	hrtime_t now;
+
+	while ((now = gethrtime()) < wakeup) {
+		ts.tv_sec = (wakeup - now) / NANOSEC;
+		ts.tv_nsec = (wakeup - now) % NANOSEC;
+		(void) nanosleep(&ts, NULL);
+	}
+}
+
 static int random_fd = -1, urandom_fd = -1;
 
 static int
@@ -803,6 +821,7 @@ kernel_init(int mode)
 	umem_nofail_callback(umem_out_of_memory);
 
 	physmem = sysconf(_SC_PHYS_PAGES);
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
 
 	dprintf("physmem = %"PRIu64" pages (%.2f GB)\n", physmem,
 	    (double)physmem * sysconf(_SC_PAGE_SIZE) / (1ULL << 30));
@@ -31,6 +31,10 @@
 #include <sys/vdev_impl.h>
 #include <sys/zio.h>
 
+#if defined(_KERNEL)
+#include <util/qsort.h>
+#endif
+
 uint64_t metaslab_aliquot = 512ULL << 10;
 uint64_t metaslab_gang_bang = SPA_MAXBLOCKSIZE + 1;	/* force gang blocks */
 
@@ -62,15 +66,39 @@ int metaslab_df_free_pct = 4;
 uint64_t metaslab_min_alloc_size = DMU_MAX_ACCESS;
 
 /*
- * Max number of space_maps to prefetch.
+ * Max number of metaslabs per group to load in the background, ahead of
+ * their activation.
+ */
+int metaslab_preload_limit = SPA_DVAS_PER_BP;
+boolean_t metaslab_preload_enabled = B_TRUE;
+
+/*
+ * In-core bytes of space maps each metaslab class keeps loaded.  Beyond
+ * this, the least recently used maps of inactive metaslabs are unloaded.
  */
-int metaslab_prefetch_limit = SPA_DVAS_PER_BP;
+uint64_t metaslab_loaded_max = 64ULL << 20;
+
+/*
+ * Condense a loaded metaslab's space map object once it is this many
+ * percent of the size of a freshly written one, and over a block long.
+ */
+int metaslab_condense_pct = 200;
 
 /*
  * Percentage bonus multiplier for metaslabs that are in the bonus area.
  */
 int metaslab_smo_bonus_pct = 150;
 
+/*
+ * Allocation throttle.  Each metaslab group counts the blocks allocated
+ * from it whose writes are still in flight.  A group with more than
+ * metaslab_alloc_queue_depth_max of them per leaf vdev is skipped while
+ * another group in its class is below that limit, and the rotor gives
+ * groups that drain faster than the class average a larger share.
+ */
+boolean_t metaslab_alloc_throttle_enabled = B_TRUE;
+int metaslab_alloc_queue_depth_max = 32;
+
 /*
  * ==========================================================================
  * Metaslab classes
@@ -86,6 +114,9 @@ metaslab_class_create(spa_t *spa, space_map_ops_t *ops)
 	mc->mc_spa = spa;
 	mc->mc_rotor = NULL;
 	mc->mc_ops = ops;
+	mutex_init(&mc->mc_lock, NULL, MUTEX_DEFAULT, NULL);
+	list_create(&mc->mc_loaded_list, sizeof (metaslab_t),
+	    offsetof(metaslab_t, ms_loaded_node));
 
 	return (mc);
 }
@@ -98,7 +129,11 @@ metaslab_class_destroy(metaslab_class_t *mc)
 	ASSERT(mc->mc_deferred == 0);
 	ASSERT(mc->mc_space == 0);
 	ASSERT(mc->mc_dspace == 0);
+	ASSERT(mc->mc_loaded_size == 0);
+	ASSERT(mc->mc_groups == 0);
 
+	list_destroy(&mc->mc_loaded_list);
+	mutex_destroy(&mc->mc_lock);
 	kmem_free(mc, sizeof (metaslab_class_t));
 }
 
@@ -191,6 +226,86 @@ metaslab_compare(const void *x1, const void *x2)
 	return (0);
 }
 
+typedef struct metaslab_group_kstats {
+	kstat_named_t	mgk_queue_depth;
+	kstat_named_t	mgk_queue_depth_max;
+	kstat_named_t	mgk_queued_bytes;
+	kstat_named_t	mgk_allocs;
+	kstat_named_t	mgk_throttled;
+} metaslab_group_kstats_t;
+
+static const metaslab_group_kstats_t metaslab_group_kstats_template = {
+	{ "queue_depth",	KSTAT_DATA_UINT64 },
+	{ "queue_depth_max",	KSTAT_DATA_UINT64 },
+	{ "queued_bytes",	KSTAT_DATA_UINT64 },
+	{ "allocs",		KSTAT_DATA_UINT64 },
+	{ "throttled",		KSTAT_DATA_UINT64 },
+};
+
+static uint64_t
+metaslab_group_queue_depth_max(metaslab_group_t *mg)
+{
+	return (metaslab_alloc_queue_depth_max *
+	    MAX(1, mg->mg_vd->vdev_children));
+}
+
+static int
+metaslab_group_kstat_update(kstat_t *ksp, int rw)
+{
+	metaslab_group_t *mg = ksp->ks_private;
+	metaslab_group_kstats_t *mgk = ksp->ks_data;
+
+	if (rw == KSTAT_WRITE)
+		return (EACCES);
+
+	mgk->mgk_queue_depth.value.ui64 = mg->mg_alloc_queue_depth;
+	mgk->mgk_queue_depth_max.value.ui64 =
+	    metaslab_group_queue_depth_max(mg);
+	mgk->mgk_queued_bytes.value.ui64 = mg->mg_alloc_queued;
+	mgk->mgk_allocs.value.ui64 = mg->mg_allocs;
+	mgk->mgk_throttled.value.ui64 = mg->mg_throttled;
+	return (0);
+}
+
+static void
+metaslab_group_kstat_init(metaslab_group_t *mg)
+{
+	vdev_t *vd = mg->mg_vd;
+	char name[MAXNAMELEN];
+	metaslab_group_kstats_t *mgk;
+
+	(void) snprintf(name, sizeof (name), "alloc_queue.%s.%llu",
+	    spa_name(vd->vdev_spa), (u_longlong_t)vd->vdev_id);
+	mg->mg_ksp = kstat_create("zfs", 0, name, "misc", KSTAT_TYPE_NAMED,
+	    sizeof (metaslab_group_kstats_t) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_VIRTUAL);
+	if (mg->mg_ksp == NULL)
+		return;
+
+	mgk = kmem_alloc(sizeof (metaslab_group_kstats_t), KM_SLEEP);
+	bcopy(&metaslab_group_kstats_template, mgk,
+	    sizeof (metaslab_group_kstats_t));
+
+	mg->mg_ksp->ks_data = mgk;
+	mg->mg_ksp->ks_private = mg;
+	mg->mg_ksp->ks_update = metaslab_group_kstat_update;
+	kstat_install(mg->mg_ksp);
+}
+
+static void
+metaslab_group_kstat_fini(metaslab_group_t *mg)
+{
+	metaslab_group_kstats_t *mgk;
+
+	if (mg->mg_ksp == NULL)
+		return;
+
+	mgk = mg->mg_ksp->ks_data;
+	kstat_delete(mg->mg_ksp);
+	mg->mg_ksp = NULL;
+	kmem_free(mgk, sizeof (metaslab_group_kstats_t));
+}
+
 metaslab_group_t *
 metaslab_group_create(metaslab_class_t *mc, vdev_t *vd)
 {
@@ -203,6 +318,9 @@ metaslab_group_create(metaslab_class_t *mc, vdev_t *vd)
 	mg->mg_vd = vd;
 	mg->mg_class = mc;
 	mg->mg_activation_count = 0;
+	mg->mg_taskq = taskq_create("metaslab_preload", 1, minclsyspri,
+	    metaslab_preload_limit, metaslab_preload_limit, TASKQ_PREPOPULATE);
+	metaslab_group_kstat_init(mg);
 
 	return (mg);
 }
@@ -219,6 +337,8 @@ metaslab_group_destroy(metaslab_group_t *mg)
 	 */
 	ASSERT(mg->mg_activation_count <= 0);
 
+	metaslab_group_kstat_fini(mg);
+	taskq_destroy(mg->mg_taskq);
 	avl_destroy(&mg->mg_metaslab_tree);
 	mutex_destroy(&mg->mg_lock);
 	kmem_free(mg, sizeof (metaslab_group_t));
@@ -253,6 +373,7 @@ metaslab_group_activate(metaslab_group_t *mg)
 		mgnext->mg_prev = mg;
 	}
 	mc->mc_rotor = mg;
+	mc->mc_groups++;
 }
 
 void
@@ -263,6 +384,12 @@ metaslab_group_passivate(metaslab_group_t *mg)
 
 	ASSERT(spa_config_held(mc->mc_spa, SCL_ALLOC, RW_WRITER));
 
+	/*
+	 * Let queued preloads finish before the caller tears the metaslabs
+	 * down.  They can't be holding SCL_ALLOC, so they give up quickly.
+	 */
+	taskq_wait(mg->mg_taskq);
+
 	if (--mg->mg_activation_count != 0) {
 		ASSERT(mc->mc_rotor != mg);
 		ASSERT(mg->mg_prev == NULL);
@@ -284,6 +411,7 @@ metaslab_group_passivate(metaslab_group_t *mg)
 
 	mg->mg_prev = NULL;
 	mg->mg_next = NULL;
+	mc->mc_groups--;
 }
 
 static void
@@ -352,23 +480,47 @@ metaslab_segsize_compare(const void *x1, const void *x2)
 }
 
 /*
- * This is a helper function that can be used by the allocator to find
- * a suitable block to allocate. This will search the specified AVL
- * tree looking for a block that matches the specified criteria.
+ * Find the first segment of "t", either the map's offset-sorted tree or
+ * its picker-private size-sorted one, that could hold [start, start + size).
+ * The offset tree is keyed on ss_start alone, so the segment before the
+ * search key may still overlap it.
  */
-static uint64_t
-metaslab_block_picker(avl_tree_t *t, uint64_t *cursor, uint64_t size,
-    uint64_t align)
+static space_seg_t *
+metaslab_block_find(space_map_t *sm, btree_t *t, uint64_t start,
+    uint64_t size, btree_index_t *where)
 {
 	space_seg_t *ss, ssearch;
-	avl_index_t where;
+	btree_index_t idx;
+
+	ssearch.ss_start = start;
+	ssearch.ss_end = start + size;
 
-	ssearch.ss_start = *cursor;
-	ssearch.ss_end = *cursor + size;
+	ss = btree_find(t, &ssearch, where);
+	if (ss != NULL)
+		return (ss);
 
-	ss = avl_find(t, &ssearch, &where);
-	if (ss == NULL)
-		ss = avl_nearest(t, where, AVL_AFTER);
+	if (t == &sm->sm_root &&
+	    (ss = btree_prev(t, where, &idx)) != NULL && ss->ss_end > start) {
+		*where = idx;
+		return (ss);
+	}
+
+	return (btree_next(t, where, where));
+}
+
+/*
+ * This is a helper function that can be used by the allocator to find
+ * a suitable block to allocate. This will search the specified B-tree
+ * looking for a block that matches the specified criteria.
+ */
+static uint64_t
+metaslab_block_picker(space_map_t *sm, btree_t *t, uint64_t *cursor,
+    uint64_t size, uint64_t align)
+{
+	space_seg_t *ss;
+	btree_index_t where;
+
+	ss = metaslab_block_find(sm, t, *cursor, size, &where);
 
 	while (ss != NULL) {
 		uint64_t offset = P2ROUNDUP(ss->ss_start, align);
@@ -377,7 +529,7 @@ metaslab_block_picker(avl_tree_t *t, uint64_t *cursor, uint64_t size,
 			*cursor = offset + size;
 			return (offset);
 		}
-		ss = AVL_NEXT(t, ss);
+		ss = btree_next(t, &where, &where);
 	}
 
 	/*
@@ -388,39 +540,49 @@ metaslab_block_picker(avl_tree_t *t, uint64_t *cursor, uint64_t size,
 		return (-1ULL);
 
 	*cursor = 0;
-	return (metaslab_block_picker(t, cursor, size, align));
+	return (metaslab_block_picker(sm, t, cursor, size, align));
 }
 
+/*
+ * Build the size-sorted tree from a sorted copy of the segments: added in
+ * ascending order, its nodes come out full.
+ */
 static void
 metaslab_pp_load(space_map_t *sm)
 {
-	space_seg_t *ss;
+	btree_index_t where;
+	space_seg_t *ss, *segs;
+	ulong_t i, n = btree_numnodes(&sm->sm_root);
 
 	ASSERT(sm->sm_ppd == NULL);
 	sm->sm_ppd = kmem_zalloc(64 * sizeof (uint64_t), KM_SLEEP);
 
-	sm->sm_pp_root = kmem_alloc(sizeof (avl_tree_t), KM_SLEEP);
-	avl_create(sm->sm_pp_root, metaslab_segsize_compare,
-	    sizeof (space_seg_t), offsetof(struct space_seg, ss_pp_node));
+	sm->sm_pp_root = kmem_alloc(sizeof (btree_t), KM_SLEEP);
+	btree_create(sm->sm_pp_root, metaslab_segsize_compare,
+	    sizeof (space_seg_t));
 
-	for (ss = avl_first(&sm->sm_root); ss; ss = AVL_NEXT(&sm->sm_root, ss))
-		avl_add(sm->sm_pp_root, ss);
+	if (n == 0)
+		return;
+
+	segs = kmem_alloc(n * sizeof (space_seg_t), KM_SLEEP);
+	for (ss = btree_first(&sm->sm_root, &where), i = 0; ss != NULL;
+	    ss = btree_next(&sm->sm_root, &where, &where), i++)
+		segs[i] = *ss;
+	qsort(segs, n, sizeof (space_seg_t), metaslab_segsize_compare);
+	for (i = 0; i < n; i++)
+		btree_add(sm->sm_pp_root, &segs[i]);
+	kmem_free(segs, n * sizeof (space_seg_t));
 }
 
 static void
 metaslab_pp_unload(space_map_t *sm)
 {
-	void *cookie = NULL;
-
 	kmem_free(sm->sm_ppd, 64 * sizeof (uint64_t));
 	sm->sm_ppd = NULL;
 
-	while (avl_destroy_nodes(sm->sm_pp_root, &cookie) != NULL) {
-		/* tear down the tree */
-	}
-
-	avl_destroy(sm->sm_pp_root);
-	kmem_free(sm->sm_pp_root, sizeof (avl_tree_t));
+	btree_clear(sm->sm_pp_root);
+	btree_destroy(sm->sm_pp_root);
+	kmem_free(sm->sm_pp_root, sizeof (btree_t));
 	sm->sm_pp_root = NULL;
 }
 
@@ -444,10 +606,10 @@ metaslab_pp_free(space_map_t *sm, uint64_t start, uint64_t size)
 uint64_t
 metaslab_pp_maxsize(space_map_t *sm)
 {
-	avl_tree_t *t = sm->sm_pp_root;
+	btree_t *t = sm->sm_pp_root;
 	space_seg_t *ss;
 
-	if (t == NULL || (ss = avl_last(t)) == NULL)
+	if (t == NULL || (ss = btree_last(t, NULL)) == NULL)
 		return (0ULL);
 
 	return (ss->ss_end - ss->ss_start);
@@ -461,11 +623,11 @@ metaslab_pp_maxsize(space_map_t *sm)
 static uint64_t
 metaslab_ff_alloc(space_map_t *sm, uint64_t size)
 {
-	avl_tree_t *t = &sm->sm_root;
+	btree_t *t = &sm->sm_root;
 	uint64_t align = size & -size;
 	uint64_t *cursor = (uint64_t *)sm->sm_ppd + highbit(align) - 1;
 
-	return (metaslab_block_picker(t, cursor, size, align));
+	return (metaslab_block_picker(sm, t, cursor, size, align));
 }
 
 /* ARGSUSED */
@@ -496,21 +658,22 @@ static space_map_ops_t metaslab_ff_ops = {
 static uint64_t
 metaslab_df_alloc(space_map_t *sm, uint64_t size)
 {
-	avl_tree_t *t = &sm->sm_root;
+	btree_t *t = &sm->sm_root;
 	uint64_t align = size & -size;
 	uint64_t *cursor = (uint64_t *)sm->sm_ppd + highbit(align) - 1;
 	uint64_t max_size = metaslab_pp_maxsize(sm);
 	int free_pct = sm->sm_space * 100 / sm->sm_size;
 
 	ASSERT(MUTEX_HELD(sm->sm_lock));
-	ASSERT3U(avl_numnodes(&sm->sm_root), ==, avl_numnodes(sm->sm_pp_root));
+	ASSERT3U(btree_numnodes(&sm->sm_root), ==,
+	    btree_numnodes(sm->sm_pp_root));
 
 	if (max_size < size)
 		return (-1ULL);
 
 	/*
 	 * If we're running low on space switch to using the size
-	 * sorted AVL tree (best-fit).
+	 * sorted B-tree (best-fit).
 	 */
 	if (max_size < metaslab_df_alloc_threshold ||
 	    free_pct < metaslab_df_free_pct) {
@@ -518,7 +681,7 @@ metaslab_df_alloc(space_map_t *sm, uint64_t size)
 		*cursor = 0;
 	}
 
-	return (metaslab_block_picker(t, cursor, size, 1ULL));
+	return (metaslab_block_picker(sm, t, cursor, size, 1ULL));
 }
 
 static boolean_t
@@ -552,7 +715,7 @@ static space_map_ops_t metaslab_df_ops = {
 static uint64_t
 metaslab_cdf_alloc(space_map_t *sm, uint64_t size)
 {
-	avl_tree_t *t = &sm->sm_root;
+	btree_t *t = &sm->sm_root;
 	uint64_t *cursor = (uint64_t *)sm->sm_ppd;
 	uint64_t *extent_end = (uint64_t *)sm->sm_ppd + 1;
 	uint64_t max_size = metaslab_pp_maxsize(sm);
@@ -560,7 +723,8 @@ metaslab_cdf_alloc(space_map_t *sm, uint64_t size)
 	uint64_t offset = 0;
 
 	ASSERT(MUTEX_HELD(sm->sm_lock));
-	ASSERT3U(avl_numnodes(&sm->sm_root), ==, avl_numnodes(sm->sm_pp_root));
+	ASSERT3U(btree_numnodes(&sm->sm_root), ==,
+	    btree_numnodes(sm->sm_pp_root));
 
 	if (max_size < size)
 		return (-1ULL);
@@ -569,7 +733,7 @@ metaslab_cdf_alloc(space_map_t *sm, uint64_t size)
 
 	/*
 	 * If we're running low on space switch to using the size
-	 * sorted AVL tree (best-fit).
+	 * sorted B-tree (best-fit).
 	 */
 	if ((*cursor + size) > *extent_end) {
 
@@ -578,11 +742,12 @@ metaslab_cdf_alloc(space_map_t *sm, uint64_t size)
 
 		if (max_size > 2 * SPA_MAXBLOCKSIZE)
 			rsize = MIN(metaslab_min_alloc_size, max_size);
-		offset = metaslab_block_picker(t, extent_end, rsize, 1ULL);
+		offset = metaslab_block_picker(sm, t, extent_end, rsize,
+		    1ULL);
 		if (offset != -1)
 			*cursor = offset + size;
 	} else {
-		offset = metaslab_block_picker(t, cursor, rsize, 1ULL);
+		offset = metaslab_block_picker(sm, t, cursor, rsize, 1ULL);
 	}
 	ASSERT3U(*cursor, <=, *extent_end);
 	return (offset);
@@ -611,33 +776,28 @@ static space_map_ops_t metaslab_cdf_ops = {
 static uint64_t
 metaslab_ndf_alloc(space_map_t *sm, uint64_t size)
 {
-	avl_tree_t *t = &sm->sm_root;
-	avl_index_t where;
-	space_seg_t *ss, ssearch;
+	btree_t *t = &sm->sm_root;
+	btree_index_t where;
+	space_seg_t *ss;
 	uint64_t *cursor = (uint64_t *)sm->sm_ppd;
 	uint64_t max_size = metaslab_pp_maxsize(sm);
 
 	ASSERT(MUTEX_HELD(sm->sm_lock));
-	ASSERT3U(avl_numnodes(&sm->sm_root), ==, avl_numnodes(sm->sm_pp_root));
+	ASSERT3U(btree_numnodes(&sm->sm_root), ==,
+	    btree_numnodes(sm->sm_pp_root));
 
 	if (max_size < size)
 		return (-1ULL);
 
-	ssearch.ss_start = *cursor;
-	ssearch.ss_end = *cursor + size;
-
-	ss = avl_find(t, &ssearch, &where);
-	if (ss == NULL || (ss->ss_start + size > ss->ss_end)) {
+	ss = metaslab_block_find(sm, t, *cursor, size, &where);
+	if (ss == NULL || ss->ss_start >= *cursor + size ||
+	    (ss->ss_start + size > ss->ss_end)) {
 		t = sm->sm_pp_root;
 
 		if (max_size > 2 * SPA_MAXBLOCKSIZE)
 			size = MIN(metaslab_min_alloc_size, max_size);
 
-		ssearch.ss_start = 0;
-		ssearch.ss_end = size;
-		ss = avl_find(t, &ssearch, &where);
-		if (ss == NULL)
-			ss = avl_nearest(t, where, AVL_AFTER);
+		ss = metaslab_block_find(sm, t, 0, size, &where);
 		ASSERT(ss != NULL);
 	}
 
@@ -678,6 +838,137 @@ space_map_ops_t *zfs_metaslab_ops = &metaslab_df_ops;
  * Metaslabs
  * ==========================================================================
  */
+#define	METASLAB_WEIGHT_PRIMARY		(1ULL << 63)
+#define	METASLAB_WEIGHT_SECONDARY	(1ULL << 62)
+#define	METASLAB_ACTIVE_MASK		\
+	(METASLAB_WEIGHT_PRIMARY | METASLAB_WEIGHT_SECONDARY)
+
+/*
+ * In-core bytes of a metaslab's space map, including the allocator's tree.
+ */
+static uint64_t
+metaslab_map_memory(metaslab_t *msp)
+{
+	space_map_t *sm = &msp->ms_map;
+	uint64_t size = btree_memory(&sm->sm_root);
+
+	if (sm->sm_pp_root != NULL)
+		size += btree_memory(sm->sm_pp_root);
+	return (size);
+}
+
+/*
+ * Account for a loaded map on its class's loaded list.  If "used", also
+ * move it to the head of the list, away from eviction.
+ */
+static void
+metaslab_loaded_update(metaslab_t *msp, boolean_t used)
+{
+	metaslab_class_t *mc = msp->ms_group->mg_class;
+	uint64_t size = metaslab_map_memory(msp);
+
+	ASSERT(MUTEX_HELD(&msp->ms_lock));
+	ASSERT(msp->ms_map.sm_loaded);
+
+	mutex_enter(&mc->mc_lock);
+	if (!list_link_active(&msp->ms_loaded_node)) {
+		ASSERT(msp->ms_loaded_size == 0);
+		list_insert_head(&mc->mc_loaded_list, msp);
+	} else if (used && list_head(&mc->mc_loaded_list) != msp) {
+		list_remove(&mc->mc_loaded_list, msp);
+		list_insert_head(&mc->mc_loaded_list, msp);
+	}
+	mc->mc_loaded_size += size - msp->ms_loaded_size;
+	msp->ms_loaded_size = size;
+	mutex_exit(&mc->mc_lock);
+}
+
+static void
+metaslab_loaded_remove(metaslab_class_t *mc, metaslab_t *msp)
+{
+	ASSERT(MUTEX_HELD(&mc->mc_lock));
+
+	if (list_link_active(&msp->ms_loaded_node)) {
+		list_remove(&mc->mc_loaded_list, msp);
+		mc->mc_loaded_size -= msp->ms_loaded_size;
+		msp->ms_loaded_size = 0;
+	}
+}
+
+/*
+ * A loaded map can be dropped once its metaslab is inactive and all of
+ * its allocations have made it into ms_smo, which is what a later load
+ * reads: none may be left to sync, and a sync must not be waiting for
+ * metaslab_sync_done() to update ms_smo.
+ */
+static boolean_t
+metaslab_evictable(metaslab_t *msp)
+{
+	ASSERT(MUTEX_HELD(&msp->ms_lock));
+
+	if (metaslab_debug || msp->ms_map.sm_loading ||
+	    (msp->ms_weight & METASLAB_ACTIVE_MASK))
+		return (B_FALSE);
+
+	for (int t = 0; t < TXG_SIZE; t++)
+		if (msp->ms_allocmap[t].sm_space != 0)
+			return (B_FALSE);
+
+	return (bcmp(&msp->ms_smo, &msp->ms_smo_syncing,
+	    sizeof (space_map_obj_t)) == 0);
+}
+
+/*
+ * Unload the least recently used maps until the class's loaded maps fit
+ * in metaslab_loaded_max.  Lock order is ms_lock before mc_lock, so we
+ * skip metaslabs whose lock we can't get right away.
+ */
+static void
+metaslab_class_evict(metaslab_class_t *mc)
+{
+	metaslab_t *msp, *prev;
+
+	mutex_enter(&mc->mc_lock);
+	for (msp = list_tail(&mc->mc_loaded_list);
+	    msp != NULL && mc->mc_loaded_size > metaslab_loaded_max;
+	    msp = prev) {
+		prev = list_prev(&mc->mc_loaded_list, msp);
+		if (!mutex_tryenter(&msp->ms_lock))
+			continue;
+		if (!msp->ms_map.sm_loaded && !msp->ms_map.sm_loading) {
+			/* somebody else, e.g. zdb(1M), unloaded it */
+			metaslab_loaded_remove(mc, msp);
+		} else if (metaslab_evictable(msp)) {
+			metaslab_loaded_remove(mc, msp);
+			space_map_unload(&msp->ms_map);
+		}
+		mutex_exit(&msp->ms_lock);
+	}
+	mutex_exit(&mc->mc_lock);
+}
+
+/*
+ * Space map objects are only ever appended to, so they grow with every
+ * txg that touches the metaslab.  Rewrite one from its in-core map once
+ * it is metaslab_condense_pct percent of what it would take to describe
+ * that map from scratch.  This takes the map to be loaded, which, now
+ * that maps stay in core after passivation, also covers the metaslabs
+ * that only see frees.
+ */
+static boolean_t
+metaslab_should_condense(metaslab_t *msp)
+{
+	space_map_t *sm = &msp->ms_map;
+	space_map_obj_t *smo = &msp->ms_smo_syncing;
+
+	ASSERT(MUTEX_HELD(&msp->ms_lock));
+
+	return (sm->sm_loaded &&
+	    smo->smo_objsize >= (1ULL << SPACE_MAP_BLOCKSHIFT) &&
+	    smo->smo_objsize >= metaslab_condense_pct * sizeof (uint64_t) *
+	    btree_numnodes(&sm->sm_root) / 100);
+}
+
 metaslab_t *
 metaslab_init(metaslab_group_t *mg, space_map_obj_t *smo,
 	uint64_t start, uint64_t size, uint64_t txg)
@@ -730,6 +1021,7 @@ void
 metaslab_fini(metaslab_t *msp)
 {
 	metaslab_group_t *mg = msp->ms_group;
+	metaslab_class_t *mc = mg->mg_class;
 
 	vdev_space_update(mg->mg_vd,
 	    -msp->ms_smo.smo_alloc, 0, -msp->ms_map.sm_size);
@@ -738,6 +1030,10 @@ metaslab_fini(metaslab_t *msp)
 
 	mutex_enter(&msp->ms_lock);
 
+	mutex_enter(&mc->mc_lock);
+	metaslab_loaded_remove(mc, msp);
+	mutex_exit(&mc->mc_lock);
+
 	space_map_unload(&msp->ms_map);
 	space_map_destroy(&msp->ms_map);
 
@@ -757,11 +1053,6 @@ metaslab_fini(metaslab_t *msp)
 	kmem_free(msp, sizeof (metaslab_t));
 }
 
-#define	METASLAB_WEIGHT_PRIMARY		(1ULL << 63)
-#define	METASLAB_WEIGHT_SECONDARY	(1ULL << 62)
-#define	METASLAB_ACTIVE_MASK		\
-	(METASLAB_WEIGHT_PRIMARY | METASLAB_WEIGHT_SECONDARY)
-
 static uint64_t
 metaslab_weight(metaslab_t *msp)
 {
@@ -812,33 +1103,80 @@ metaslab_weight(metaslab_t *msp)
 	return (weight);
 }
 
+/*
+ * Load msp's space map, unless it is already, and mark it most recently
+ * used on its class's loaded list.
+ */
+static int
+metaslab_load(metaslab_t *msp)
+{
+	space_map_t *sm = &msp->ms_map;
+	space_map_ops_t *sm_ops = msp->ms_group->mg_class->mc_ops;
+
+	ASSERT(MUTEX_HELD(&msp->ms_lock));
+
+	space_map_load_wait(sm);
+	if (!sm->sm_loaded) {
+		int error = space_map_load(sm, sm_ops, SM_FREE, &msp->ms_smo,
+		    spa_meta_objset(msp->ms_group->mg_vd->vdev_spa));
+		if (error)
+			return (error);
+		for (int t = 0; t < TXG_DEFER_SIZE; t++)
+			space_map_walk(&msp->ms_defermap[t],
+			    space_map_claim, sm);
+	}
+	metaslab_loaded_update(msp, B_TRUE);
+
+	return (0);
+}
+
+/*
+ * Load a metaslab ahead of its activation.  Whoever holds SCL_ALLOC as
+ * writer may be waiting for us in metaslab_group_passivate(), so give
+ * up rather than wait for it.
+ */
 static void
-metaslab_prefetch(metaslab_group_t *mg)
+metaslab_preload(void *arg)
 {
-	spa_t *spa = mg->mg_vd->vdev_spa;
-	metaslab_t *msp;
-	avl_tree_t *t = &mg->mg_metaslab_tree;
-	int m;
+	metaslab_t *msp = arg;
+	metaslab_class_t *mc = msp->ms_group->mg_class;
+	spa_t *spa = mc->mc_spa;
 
-	mutex_enter(&mg->mg_lock);
+	if (!spa_config_tryenter(spa, SCL_ALLOC, FTAG, RW_READER))
+		return;
 
-	/*
-	 * Prefetch the next potential metaslabs
-	 */
-	for (msp = avl_first(t), m = 0; msp; msp = AVL_NEXT(t, msp), m++) {
-		space_map_t *sm = &msp->ms_map;
-		space_map_obj_t *smo = &msp->ms_smo;
+	mutex_enter(&msp->ms_lock);
+	if (mc->mc_loaded_size < metaslab_loaded_max)
+		(void) metaslab_load(msp);
+	mutex_exit(&msp->ms_lock);
 
-		/* If we have reached our prefetch limit then we're done */
-		if (m >= metaslab_prefetch_limit)
-			break;
+	spa_config_exit(spa, SCL_ALLOC, FTAG);
+}
 
-		if (!sm->sm_loaded && smo->smo_object != 0) {
-			mutex_exit(&mg->mg_lock);
-			dmu_prefetch(spa_meta_objset(spa), smo->smo_object,
-			    0ULL, smo->smo_objsize);
-			mutex_enter(&mg->mg_lock);
-		}
+/*
+ * Start loading the best metaslabs of the group that aren't in use yet,
+ * so that their activation doesn't have to wait for the reads.
+ */
+static void
+metaslab_group_preload(metaslab_group_t *mg)
+{
+	avl_tree_t *t = &mg->mg_metaslab_tree;
+	metaslab_t *msp;
+	int m = 0;
+
+	if (!metaslab_preload_enabled)
+		return;
+
+	mutex_enter(&mg->mg_lock);
+	for (msp = avl_first(t); msp != NULL && m < metaslab_preload_limit;
+	    msp = AVL_NEXT(t, msp)) {
+		if (msp->ms_weight & METASLAB_ACTIVE_MASK)
+			continue;
+		m++;
+		if (msp->ms_map.sm_loaded || msp->ms_smo.smo_object == 0)
+			continue;
+		(void) taskq_dispatch(mg->mg_taskq, metaslab_preload,
+		    msp, TQ_NOSLEEP);
 	}
 	mutex_exit(&mg->mg_lock);
 }
@@ -848,24 +1186,14 @@ metaslab_activate(metaslab_t *msp, uint64_t activation_weight, uint64_t size)
 {
 	metaslab_group_t *mg = msp->ms_group;
 	space_map_t *sm = &msp->ms_map;
-	space_map_ops_t *sm_ops = msp->ms_group->mg_class->mc_ops;
 
 	ASSERT(MUTEX_HELD(&msp->ms_lock));
 
 	if ((msp->ms_weight & METASLAB_ACTIVE_MASK) == 0) {
-		space_map_load_wait(sm);
-		if (!sm->sm_loaded) {
-			int error = space_map_load(sm, sm_ops, SM_FREE,
-			    &msp->ms_smo,
-			    spa_meta_objset(msp->ms_group->mg_vd->vdev_spa));
-			if (error)  {
-				metaslab_group_sort(msp->ms_group, msp, 0);
-				return (error);
-			}
-			for (int t = 0; t < TXG_DEFER_SIZE; t++)
-				space_map_walk(&msp->ms_defermap[t],
-				    space_map_claim, sm);
-
+		int error = metaslab_load(msp);
+		if (error) {
+			metaslab_group_sort(msp->ms_group, msp, 0);
+			return (error);
 		}
 
 		/*
@@ -955,11 +1283,10 @@ metaslab_sync(metaslab_t *msp, uint64_t txg)
 
 	space_map_walk(freemap, space_map_add, freed_map);
 
-	if (sm->sm_loaded && spa_sync_pass(spa) == 1 && smo->smo_objsize >=
-	    2 * sizeof (uint64_t) * avl_numnodes(&sm->sm_root)) {
+	if (spa_sync_pass(spa) == 1 && metaslab_should_condense(msp)) {
 		/*
-		 * The in-core space map representation is twice as compact
-		 * as the on-disk one, so it's time to condense the latter
+		 * The in-core space map representation is much more compact
+		 * than the on-disk one, so it's time to condense the latter
 		 * by generating a pure allocmap from first principles.
 		 *
 		 * This metaslab is 100% allocated,
@@ -1075,20 +1402,13 @@ metaslab_sync_done(metaslab_t *msp, uint64_t txg)
 	}
 
 	/*
-	 * If the map is loaded but no longer active, evict it as soon as all
-	 * future allocations have synced.  (If we unloaded it now and then
-	 * loaded a moment later, the map wouldn't reflect those allocations.)
+	 * A loaded map stays loaded once its metaslab is passivated, in
+	 * case we come back to it; metaslab_class_evict() unloads the least
+	 * recently used ones.  Keep its size on the loaded list current.
 	 */
-	if (sm->sm_loaded && (msp->ms_weight & METASLAB_ACTIVE_MASK) == 0) {
-		int evictable = 1;
-
-		for (int t = 1; t < TXG_CONCURRENT_STATES; t++)
-			if (msp->ms_allocmap[(txg + t) & TXG_MASK].sm_space)
-				evictable = 0;
-
-		if (evictable && !metaslab_debug)
-			space_map_unload(sm);
-	}
+	if (sm->sm_loaded)
+		metaslab_loaded_update(msp,
+		    (msp->ms_weight & METASLAB_ACTIVE_MASK) != 0);
 
 	metaslab_group_sort(mg, msp, metaslab_weight(msp));
 
@@ -1116,9 +1436,10 @@ metaslab_sync_reassess(metaslab_group_t *mg)
 	}
 
 	/*
-	 * Prefetch the next potential metaslabs
+	 * Make room for, and start loading, the next potential metaslabs.
 	 */
-	metaslab_prefetch(mg);
+	metaslab_class_evict(mg->mg_class);
+	metaslab_group_preload(mg);
 }
 
 static uint64_t
@@ -1234,6 +1555,27 @@ metaslab_group_alloc(metaslab_group_t *mg, uint64_t size, uint64_t txg,
 /*
  * Allocate a block for the specified i/o.
  */
+/*
+ * Is 'mg' over its allocation queue limit while some other group in its
+ * class is under its own?  No locking: the answer only steers allocations.
+ */
+static boolean_t
+metaslab_group_throttled(metaslab_group_t *mg)
+{
+	metaslab_group_t *mgp;
+
+	if (!metaslab_alloc_throttle_enabled ||
+	    mg->mg_alloc_queue_depth < metaslab_group_queue_depth_max(mg))
+		return (B_FALSE);
+
+	for (mgp = mg->mg_next; mgp != mg; mgp = mgp->mg_next) {
+		if (mgp->mg_alloc_queue_depth <
+		    metaslab_group_queue_depth_max(mgp))
+			return (B_TRUE);
+	}
+	return (B_FALSE);
+}
+
 static int
 metaslab_alloc_dva(spa_t *spa, metaslab_class_t *mc, uint64_t psize,
     dva_t *dva, int d, dva_t *hintdva, uint64_t txg, int flags)
@@ -1340,6 +1682,17 @@ top:
 			goto next;
 		}
 
+		/*
+		 * Skip a group whose allocation queue is full while
+		 * another one could take the block.  Only the first
+		 * pass is throttled; after that, space comes first.
+		 */
+		if (dshift == 3 && metaslab_group_throttled(mg)) {
+			atomic_add_64(&mg->mg_throttled, 1);
+			all_zero = B_FALSE;
+			goto next;
+		}
+
 		ASSERT(mg->mg_class == mc);
 
 		distance = vd->vdev_asize >> dshift;
@@ -1361,7 +1714,7 @@ top:
 			 */
 			if (mc->mc_aliquot == 0) {
 				vdev_stat_t *vs = &vd->vdev_stat;
-				int64_t vu, cu;
+				int64_t vu, cu, gq, cq;
 
 				/*
 				 * Determine percent used in units of 0..1024.
@@ -1375,6 +1728,21 @@ top:
 				 */
 				mg->mg_bias = ((cu - vu) *
 				    (int64_t)mg->mg_aliquot) / (1024 * 4);
+
+				/*
+				 * A group with less in flight than the
+				 * class average is draining faster; bias
+				 * by up to another +/- 25% towards it.
+				 */
+				if (metaslab_alloc_throttle_enabled &&
+				    mc->mc_groups > 1) {
+					gq = mg->mg_alloc_queued;
+					cq = mc->mc_alloc_queued /
+					    mc->mc_groups;
+					mg->mg_bias += ((cq - gq) *
+					    (int64_t)mg->mg_aliquot) /
+					    (MAX(cq, gq) * 4 + 1);
+				}
 			}
 
 			if (atomic_add_64_nv(&mc->mc_aliquot, asize) >=
@@ -1412,6 +1780,56 @@ next:
 	return (ENOSPC);
 }
 
+/*
+ * Account for the DVAs of a block allocated with METASLAB_ALLOC_QUEUE in
+ * the allocation queues of their metaslab groups, until
+ * metaslab_alloc_queue_remove() is called when its write is done.
+ */
+void
+metaslab_alloc_queue_add(spa_t *spa, const blkptr_t *bp)
+{
+	const dva_t *dva = bp->blk_dva;
+	int ndvas = BP_GET_NDVAS(bp);
+
+	for (int d = 0; d < ndvas; d++) {
+		vdev_t *vd = vdev_lookup_top(spa, DVA_GET_VDEV(&dva[d]));
+		metaslab_group_t *mg;
+		uint64_t asize = DVA_GET_ASIZE(&dva[d]);
+
+		if (vd == NULL || (mg = vd->vdev_mg) == NULL)
+			continue;
+		atomic_add_64(&mg->mg_alloc_queue_depth, 1);
+		atomic_add_64(&mg->mg_alloc_queued, asize);
+		atomic_add_64(&mg->mg_class->mc_alloc_queued, asize);
+		atomic_add_64(&mg->mg_allocs, 1);
+	}
+}
+
+/*
+ * The caller holds SCL_ZIO, so the DVAs' top-level vdevs can't go away.
+ */
+void
+metaslab_alloc_queue_remove(spa_t *spa, const blkptr_t *bp)
+{
+	const dva_t *dva = bp->blk_dva;
+	int ndvas = BP_GET_NDVAS(bp);
+
+	ASSERT(spa_config_held(spa, SCL_ZIO, RW_READER));
+
+	for (int d = 0; d < ndvas; d++) {
+		vdev_t *vd = vdev_lookup_top(spa, DVA_GET_VDEV(&dva[d]));
+		metaslab_group_t *mg;
+		uint64_t asize = DVA_GET_ASIZE(&dva[d]);
+
+		if (vd == NULL || (mg = vd->vdev_mg) == NULL)
+			continue;
+		ASSERT(mg->mg_alloc_queue_depth > 0);
+		atomic_add_64(&mg->mg_alloc_queue_depth, -1);
+		atomic_add_64(&mg->mg_alloc_queued, -asize);
+		atomic_add_64(&mg->mg_class->mc_alloc_queued, -asize);
+	}
+}
+
 /*
  * Free the block represented by DVA in the context of the specified
  * transaction group.
@@ -1548,6 +1966,9 @@ metaslab_alloc(spa_t *spa, metaslab_class_t *mc, uint64_t psize, blkptr_t *bp,
 	ASSERT(error == 0);
 	ASSERT(BP_GET_NDVAS(bp) == ndvas);
 
+	if (flags & METASLAB_ALLOC_QUEUE)
+		metaslab_alloc_queue_add(spa, bp);
+
 	spa_config_exit(spa, SCL_ALLOC, FTAG);
 
 	BP_SET_BIRTH(bp, txg, txg);
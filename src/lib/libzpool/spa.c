@@ -161,8 +161,10 @@ spa_prop_get_config(spa_t *spa, nvlist_t **nvp)
 	ASSERT(MUTEX_HELD(&spa->spa_props_lock));
 
 	if (spa->spa_root_vdev != NULL) {
-		alloc = metaslab_class_get_alloc(spa_normal_class(spa));
-		size = metaslab_class_get_space(spa_normal_class(spa));
+		alloc = metaslab_class_get_alloc(spa_normal_class(spa)) +
+		    metaslab_class_get_alloc(spa_special_class(spa));
+		size = metaslab_class_get_space(spa_normal_class(spa)) +
+		    metaslab_class_get_space(spa_special_class(spa));
 		spa_prop_add_list(*nvp, ZPOOL_PROP_NAME, spa_name(spa), 0, src);
 		spa_prop_add_list(*nvp, ZPOOL_PROP_SIZE, NULL, size, src);
 		spa_prop_add_list(*nvp, ZPOOL_PROP_ALLOCATED, NULL, alloc, src);
@@ -456,6 +458,12 @@ spa_prop_validate(spa_t *spa, nvlist_t *props)
 			    intval != 0 && intval < ZIO_DEDUPDITTO_MIN)
 				error = EINVAL;
 			break;
+
+		case ZPOOL_PROP_SCANLATENCY:
+			error = nvpair_value_uint64(elem, &intval);
+			if (error == 0 && intval > MILLISEC)
+				error = EINVAL;
+			break;
 		}
 
 		if (error)
@@ -603,6 +611,7 @@ spa_activate(spa_t *spa, int mode)
 
 	spa->spa_normal_class = metaslab_class_create(spa, zfs_metaslab_ops);
 	spa->spa_log_class = metaslab_class_create(spa, zfs_metaslab_ops);
+	spa->spa_special_class = metaslab_class_create(spa, zfs_metaslab_ops);
 
 	/* Initialize async I/O context and thread */
 #ifdef LINUX_AIO
@@ -722,6 +731,9 @@ spa_deactivate(spa_t *spa)
 	metaslab_class_destroy(spa->spa_log_class);
 	spa->spa_log_class = NULL;
 
+	metaslab_class_destroy(spa->spa_special_class);
+	spa->spa_special_class = NULL;
+
 	/*
 	 * If this was part of an import or the open otherwise failed, we may
 	 * still have errors left in the queues.  Empty them just in case.
@@ -796,6 +808,11 @@ spa_unload(spa_t *spa)
 	 */
 	trim_thread_destroy(spa);
 
+	/*
+	 * Stop ARC warm start.
+	 */
+	arc_warmstart_destroy(spa);
+
 	/*
 	 * Stop async tasks.
 	 */
@@ -1821,6 +1838,8 @@ spa_load_impl(spa_t *spa, uint64_t pool_guid, nvlist_t *config,
 		spa_prop_find(spa, ZPOOL_PROP_AUTOEXPAND, &spa->spa_autoexpand);
 		spa_prop_find(spa, ZPOOL_PROP_DEDUPDITTO,
 		    &spa->spa_dedup_ditto);
+		spa_prop_find(spa, ZPOOL_PROP_SCANLATENCY,
+		    &spa->spa_scan_latency);
 
 		spa->spa_autoreplace = (autoreplace != 0);
 	}
@@ -1901,6 +1920,13 @@ spa_load_impl(spa_t *spa, uint64_t pool_guid, nvlist_t *config,
 		}
 	}
 
+	/*
+	 * Start ARC warm start before anything new can sync, see
+	 * arc_warmstart_create().
+	 */
+	if (state != SPA_LOAD_TRYIMPORT)
+		arc_warmstart_create(spa);
+
 	if (spa_writeable(spa) && (state == SPA_LOAD_RECOVER ||
 	    spa->spa_load_max_txg == UINT64_MAX)) {
 		dmu_tx_t *tx;
@@ -2779,6 +2805,8 @@ spa_create(const char *pool, nvlist_t *nvroot, nvlist_t *props,
 	 */
 	txg_wait_synced(spa->spa_dsl_pool, txg);
 
+	arc_warmstart_create(spa);
+
 	spa_config_sync(spa, B_FALSE, B_TRUE);
 
 	if (version >= SPA_VERSION_ZPOOL_HISTORY && history_str != NULL)
@@ -5080,6 +5108,9 @@ spa_sync_props(void *arg1, void *arg2, dmu_tx_t *tx)
 			case ZPOOL_PROP_DEDUPDITTO:
 				spa->spa_dedup_ditto = intval;
 				break;
+			case ZPOOL_PROP_SCANLATENCY:
+				spa->spa_scan_latency = intval;
+				break;
 			default:
 				break;
 			}
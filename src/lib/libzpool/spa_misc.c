@@ -251,6 +251,11 @@ int zfs_flags = 0;
  */
 int zfs_recover = 0;
 
+/*
+ * Level 0 data blocks stop going to the special class once it is this
+ * percent full; the rest is left for metadata.  See spa_preferred_class().
+ */
+int zfs_special_class_small_pct = 75;
 
 /*
  * ==========================================================================
@@ -442,10 +447,12 @@ spa_add(const char *name, nvlist_t *config, const char *altroot)
 	mutex_init(&spa->spa_props_lock, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&spa->spa_suspend_lock, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&spa->spa_vdev_top_lock, NULL, MUTEX_DEFAULT, NULL);
+	mutex_init(&spa->spa_warmstart_lock, NULL, MUTEX_DEFAULT, NULL);
 
 	cv_init(&spa->spa_async_cv, NULL, CV_DEFAULT, NULL);
 	cv_init(&spa->spa_scrub_io_cv, NULL, CV_DEFAULT, NULL);
 	cv_init(&spa->spa_suspend_cv, NULL, CV_DEFAULT, NULL);
+	cv_init(&spa->spa_warmstart_cv, NULL, CV_DEFAULT, NULL);
 
 	for (int t = 0; t < TXG_SIZE; t++)
 		bplist_init(&spa->spa_free_bplist[t]);
@@ -531,6 +538,7 @@ spa_remove(spa_t *spa)
 	cv_destroy(&spa->spa_async_cv);
 	cv_destroy(&spa->spa_scrub_io_cv);
 	cv_destroy(&spa->spa_suspend_cv);
+	cv_destroy(&spa->spa_warmstart_cv);
 
 	mutex_destroy(&spa->spa_async_lock);
 	mutex_destroy(&spa->spa_scrub_lock);
@@ -540,6 +548,7 @@ spa_remove(spa_t *spa)
 	mutex_destroy(&spa->spa_props_lock);
 	mutex_destroy(&spa->spa_suspend_lock);
 	mutex_destroy(&spa->spa_vdev_top_lock);
+	mutex_destroy(&spa->spa_warmstart_lock);
 
 	kmem_free(spa, sizeof (spa_t));
 }
@@ -901,6 +910,7 @@ spa_vdev_config_exit(spa_t *spa, vdev_t *vd, uint64_t txg, int error, char *tag)
 	 */
 	ASSERT(metaslab_class_validate(spa_normal_class(spa)) == 0);
 	ASSERT(metaslab_class_validate(spa_log_class(spa)) == 0);
+	ASSERT(metaslab_class_validate(spa_special_class(spa)) == 0);
 
 	spa_config_exit(spa, SCL_ALL, spa);
 
@@ -1343,6 +1353,7 @@ void
 spa_update_dspace(spa_t *spa)
 {
 	spa->spa_dspace = metaslab_class_get_dspace(spa_normal_class(spa)) +
+	    metaslab_class_get_dspace(spa_special_class(spa)) +
 	    ddt_get_dedup_dspace(spa);
 }
 
@@ -1386,6 +1397,45 @@ spa_log_class(spa_t *spa)
 	return (spa->spa_log_class);
 }
 
+metaslab_class_t *
+spa_special_class(spa_t *spa)
+{
+	return (spa->spa_special_class);
+}
+
+/*
+ * Pick the metaslab class a block should be allocated from.  Metadata
+ * (indirect blocks and blocks of metadata object types) goes to the
+ * special class whenever the pool has one.  Level 0 data blocks no larger
+ * than the dataset's special_small_blocks go there too, but only while
+ * the special class is less than zfs_special_class_small_pct percent
+ * full, so that small file blocks can't crowd out metadata.  Callers
+ * fall back to the normal class if the special class is out of space.
+ */
+metaslab_class_t *
+spa_preferred_class(spa_t *spa, uint64_t size, boolean_t ismd,
+    uint64_t special_smallblk)
+{
+	metaslab_class_t *special = spa_special_class(spa);
+	uint64_t space;
+
+	if (!spa_has_special(spa))
+		return (spa_normal_class(spa));
+
+	if (ismd)
+		return (special);
+
+	if (size > special_smallblk)
+		return (spa_normal_class(spa));
+
+	space = metaslab_class_get_dspace(special);
+	if (metaslab_class_get_alloc(special) * 100 >=
+	    space * zfs_special_class_small_pct)
+		return (spa_normal_class(spa));
+
+	return (special);
+}
+
 int
 spa_max_replication(spa_t *spa)
 {
@@ -1505,6 +1555,9 @@ spa_init(int mode)
 	dmu_init();
 	zil_init();
 	vdev_cache_stat_init();
+	dsl_pool_stat_init();
+	ddt_io_stat_init();
+	vdev_raidz_math_init();
 	zfs_prop_init();
 	zpool_prop_init();
 	spa_config_load();
@@ -1518,6 +1571,8 @@ spa_fini(void)
 
 	spa_evict_all();
 
+	ddt_io_stat_fini();
+	dsl_pool_stat_fini();
 	vdev_cache_stat_fini();
 	zil_fini();
 	dmu_fini();
@@ -1546,6 +1601,16 @@ spa_has_slogs(spa_t *spa)
 	return (spa->spa_log_class->mc_rotor != NULL);
 }
 
+/*
+ * Return whether this pool has a special allocation class.  Like
+ * spa_has_slogs(), this is only used to steer allocations.
+ */
+boolean_t
+spa_has_special(spa_t *spa)
+{
+	return (spa->spa_special_class->mc_rotor != NULL);
+}
+
 spa_log_state_t
 spa_get_log_state(spa_t *spa)
 {
@@ -1609,6 +1674,7 @@ spa_scan_stat_init(spa_t *spa)
 	/* data not stored on disk */
 	spa->spa_scan_pass_start = gethrestime_sec();
 	spa->spa_scan_pass_exam = 0;
+	spa->spa_scan_pass_issued = 0;
 	vdev_scan_stat_init(spa->spa_root_vdev);
 }
 
@@ -1638,6 +1704,8 @@ spa_scan_get_stats(spa_t *spa, pool_scan_stat_t *ps)
 	/* data not stored on disk */
 	ps->pss_pass_start = spa->spa_scan_pass_start;
 	ps->pss_pass_exam = spa->spa_scan_pass_exam;
+	ps->pss_pass_issued = spa->spa_scan_pass_issued;
+	ps->pss_queued = scn->scn_queued_bytes;
 
 	return (0);
 }
@@ -39,16 +39,10 @@ space_map_seg_compare(const void *x1, const void *x2)
 	const space_seg_t *s1 = x1;
 	const space_seg_t *s2 = x2;
 
-	if (s1->ss_start < s2->ss_start) {
-		if (s1->ss_end > s2->ss_start)
-			return (0);
+	if (s1->ss_start < s2->ss_start)
 		return (-1);
-	}
-	if (s1->ss_start > s2->ss_start) {
-		if (s1->ss_start < s2->ss_end)
-			return (0);
+	if (s1->ss_start > s2->ss_start)
 		return (1);
-	}
 	return (0);
 }
 
@@ -60,8 +54,7 @@ space_map_create(space_map_t *sm, uint64_t start, uint64_t size, uint8_t shift,
 
 	cv_init(&sm->sm_load_cv, NULL, CV_DEFAULT, NULL);
 
-	avl_create(&sm->sm_root, space_map_seg_compare,
-	    sizeof (space_seg_t), offsetof(struct space_seg, ss_node));
+	btree_create(&sm->sm_root, space_map_seg_compare, sizeof (space_seg_t));
 
 	sm->sm_start = start;
 	sm->sm_size = size;
@@ -74,15 +67,43 @@ space_map_destroy(space_map_t *sm)
 {
 	ASSERT(!sm->sm_loaded && !sm->sm_loading);
 	VERIFY3U(sm->sm_space, ==, 0);
-	avl_destroy(&sm->sm_root);
+	btree_destroy(&sm->sm_root);
 	cv_destroy(&sm->sm_load_cv);
 }
 
+/*
+ * Segments never overlap, so the tree is sorted by start offset alone.
+ * Return the segment overlapping [start, end) and set "where" to it, or
+ * return NULL and set "where" to the insertion point for "start".
+ */
+static space_seg_t *
+space_map_find(space_map_t *sm, uint64_t start, uint64_t end,
+    btree_index_t *where)
+{
+	btree_index_t idx;
+	space_seg_t ssearch, *ss;
+
+	ssearch.ss_start = start;
+	ssearch.ss_end = end;
+	ss = btree_find(&sm->sm_root, &ssearch, where);
+	if (ss != NULL)
+		return (ss);
+
+	ss = btree_prev(&sm->sm_root, where, &idx);
+	if (ss == NULL || ss->ss_end <= start)
+		ss = btree_next(&sm->sm_root, where, &idx);
+	if (ss == NULL || ss->ss_end <= start || ss->ss_start >= end)
+		return (NULL);
+
+	*where = idx;
+	return (ss);
+}
+
 void
 space_map_add(space_map_t *sm, uint64_t start, uint64_t size)
 {
-	avl_index_t where;
-	space_seg_t ssearch, *ss_before, *ss_after, *ss;
+	btree_index_t where;
+	space_seg_t *ss_before, *ss_after, *ss, seg;
 	uint64_t end = start + size;
 	int merge_before, merge_after;
 
@@ -94,9 +115,7 @@ space_map_add(space_map_t *sm, uint64_t start, uint64_t size)
 	VERIFY(P2PHASE(start, 1ULL << sm->sm_shift) == 0);
 	VERIFY(P2PHASE(size, 1ULL << sm->sm_shift) == 0);
 
-	ssearch.ss_start = start;
-	ssearch.ss_end = end;
-	ss = avl_find(&sm->sm_root, &ssearch, &where);
+	ss = space_map_find(sm, start, end, &where);
 
 	if (ss != NULL && ss->ss_start <= start && ss->ss_end >= end) {
 		zfs_panic_recover("zfs: allocating allocated segment"
@@ -108,40 +127,48 @@ space_map_add(space_map_t *sm, uint64_t start, uint64_t size)
 	/* Make sure we don't overlap with either of our neighbors */
 	VERIFY(ss == NULL);
 
-	ss_before = avl_nearest(&sm->sm_root, where, AVL_BEFORE);
-	ss_after = avl_nearest(&sm->sm_root, where, AVL_AFTER);
+	ss_before = btree_prev(&sm->sm_root, &where, NULL);
+	ss_after = btree_next(&sm->sm_root, &where, NULL);
 
 	merge_before = (ss_before != NULL && ss_before->ss_end == start);
 	merge_after = (ss_after != NULL && ss_after->ss_start == end);
 
+	/*
+	 * Segments are updated in place where that keeps them sorted;
+	 * the picker-private tree is keyed on size, so there they have
+	 * to be removed and re-added.
+	 */
 	if (merge_before && merge_after) {
-		avl_remove(&sm->sm_root, ss_before);
 		if (sm->sm_pp_root) {
-			avl_remove(sm->sm_pp_root, ss_before);
-			avl_remove(sm->sm_pp_root, ss_after);
+			btree_remove(sm->sm_pp_root, ss_before);
+			btree_remove(sm->sm_pp_root, ss_after);
 		}
-		ss_after->ss_start = ss_before->ss_start;
-		kmem_free(ss_before, sizeof (*ss_before));
-		ss = ss_after;
+		seg = *ss_after;
+		ss_before->ss_end = seg.ss_end;
+		ss = ss_before;
 	} else if (merge_before) {
-		ss_before->ss_end = end;
 		if (sm->sm_pp_root)
-			avl_remove(sm->sm_pp_root, ss_before);
+			btree_remove(sm->sm_pp_root, ss_before);
+		ss_before->ss_end = end;
 		ss = ss_before;
 	} else if (merge_after) {
-		ss_after->ss_start = start;
 		if (sm->sm_pp_root)
-			avl_remove(sm->sm_pp_root, ss_after);
+			btree_remove(sm->sm_pp_root, ss_after);
+		ss_after->ss_start = start;
 		ss = ss_after;
 	} else {
-		ss = kmem_alloc(sizeof (*ss), KM_SLEEP);
-		ss->ss_start = start;
-		ss->ss_end = end;
-		avl_insert(&sm->sm_root, ss, where);
+		seg.ss_start = start;
+		seg.ss_end = end;
+		btree_insert(&sm->sm_root, &seg, &where);
+		ss = &seg;
 	}
 
 	if (sm->sm_pp_root)
-		avl_add(sm->sm_pp_root, ss);
+		btree_add(sm->sm_pp_root, ss);
+
+	/* This invalidates ss_before, so it comes last. */
+	if (merge_before && merge_after)
+		btree_remove(&sm->sm_root, &seg);
 
 	sm->sm_space += size;
 }
@@ -149,8 +176,8 @@ space_map_add(space_map_t *sm, uint64_t start, uint64_t size)
 void
 space_map_remove(space_map_t *sm, uint64_t start, uint64_t size)
 {
-	avl_index_t where;
-	space_seg_t ssearch, *ss, *newseg;
+	btree_index_t where;
+	space_seg_t *ss, seg, newseg;
 	uint64_t end = start + size;
 	int left_over, right_over;
 
@@ -159,9 +186,7 @@ space_map_remove(space_map_t *sm, uint64_t start, uint64_t size)
 	VERIFY(P2PHASE(start, 1ULL << sm->sm_shift) == 0);
 	VERIFY(P2PHASE(size, 1ULL << sm->sm_shift) == 0);
 
-	ssearch.ss_start = start;
-	ssearch.ss_end = end;
-	ss = avl_find(&sm->sm_root, &ssearch, &where);
+	ss = space_map_find(sm, start, end, &where);
 
 	/* Make sure we completely overlap with someone */
 	if (ss == NULL) {
@@ -178,37 +203,39 @@ space_map_remove(space_map_t *sm, uint64_t start, uint64_t size)
 	right_over = (ss->ss_end != end);
 
 	if (sm->sm_pp_root)
-		avl_remove(sm->sm_pp_root, ss);
+		btree_remove(sm->sm_pp_root, ss);
+
+	newseg.ss_start = end;
+	newseg.ss_end = ss->ss_end;
 
 	if (left_over && right_over) {
-		newseg = kmem_alloc(sizeof (*newseg), KM_SLEEP);
-		newseg->ss_start = end;
-		newseg->ss_end = ss->ss_end;
 		ss->ss_end = start;
-		avl_insert_here(&sm->sm_root, newseg, ss, AVL_AFTER);
-		if (sm->sm_pp_root)
-			avl_add(sm->sm_pp_root, newseg);
+		seg = *ss;
+		btree_add(&sm->sm_root, &newseg);
+		if (sm->sm_pp_root) {
+			btree_add(sm->sm_pp_root, &seg);
+			btree_add(sm->sm_pp_root, &newseg);
+		}
 	} else if (left_over) {
 		ss->ss_end = start;
+		if (sm->sm_pp_root)
+			btree_add(sm->sm_pp_root, ss);
 	} else if (right_over) {
 		ss->ss_start = end;
+		if (sm->sm_pp_root)
+			btree_add(sm->sm_pp_root, ss);
 	} else {
-		avl_remove(&sm->sm_root, ss);
-		kmem_free(ss, sizeof (*ss));
-		ss = NULL;
+		btree_remove_idx(&sm->sm_root, &where);
 	}
 
-	if (sm->sm_pp_root && ss != NULL)
-		avl_add(sm->sm_pp_root, ss);
-
 	sm->sm_space -= size;
 }
 
 boolean_t
 space_map_contains(space_map_t *sm, uint64_t start, uint64_t size)
 {
-	avl_index_t where;
-	space_seg_t ssearch, *ss;
+	btree_index_t where;
+	space_seg_t *ss;
 	uint64_t end = start + size;
 
 	ASSERT(MUTEX_HELD(sm->sm_lock));
@@ -216,9 +243,7 @@ space_map_contains(space_map_t *sm, uint64_t start, uint64_t size)
 	VERIFY(P2PHASE(start, 1ULL << sm->sm_shift) == 0);
 	VERIFY(P2PHASE(size, 1ULL << sm->sm_shift) == 0);
 
-	ssearch.ss_start = start;
-	ssearch.ss_end = end;
-	ss = avl_find(&sm->sm_root, &ssearch, &where);
+	ss = space_map_find(sm, start, end, &where);
 
 	return (ss != NULL && ss->ss_start <= start && ss->ss_end >= end);
 }
@@ -226,27 +251,24 @@ space_map_contains(space_map_t *sm, uint64_t start, uint64_t size)
 void
 space_map_vacate(space_map_t *sm, space_map_func_t *func, space_map_t *mdest)
 {
-	space_seg_t *ss;
-	void *cookie = NULL;
-
 	ASSERT(MUTEX_HELD(sm->sm_lock));
 
-	while ((ss = avl_destroy_nodes(&sm->sm_root, &cookie)) != NULL) {
-		if (func != NULL)
-			func(mdest, ss->ss_start, ss->ss_end - ss->ss_start);
-		kmem_free(ss, sizeof (*ss));
-	}
+	if (func != NULL)
+		space_map_walk(sm, func, mdest);
+	btree_clear(&sm->sm_root);
 	sm->sm_space = 0;
 }
 
 void
 space_map_walk(space_map_t *sm, space_map_func_t *func, space_map_t *mdest)
 {
+	btree_index_t where;
 	space_seg_t *ss;
 
 	ASSERT(MUTEX_HELD(sm->sm_lock));
 
-	for (ss = avl_first(&sm->sm_root); ss; ss = AVL_NEXT(&sm->sm_root, ss))
+	for (ss = btree_first(&sm->sm_root, &where); ss != NULL;
+	    ss = btree_next(&sm->sm_root, &where, &where))
 		func(mdest, ss->ss_start, ss->ss_end - ss->ss_start);
 }
 
@@ -404,7 +426,7 @@ space_map_sync(space_map_t *sm, uint8_t maptype,
 	space_map_obj_t *smo, objset_t *os, dmu_tx_t *tx)
 {
 	spa_t *spa = dmu_objset_spa(os);
-	void *cookie = NULL;
+	btree_index_t where;
 	space_seg_t *ss;
 	uint64_t bufsize, start, size, run_len;
 	uint64_t *entry, *entry_map, *entry_map_end;
@@ -416,7 +438,7 @@ space_map_sync(space_map_t *sm, uint8_t maptype,
 
 	dprintf("object %4"PRIu64", txg %"PRIu64", pass %d, %c, count %lu, space %"PRIx64"\n",
 	    smo->smo_object, dmu_tx_get_txg(tx), spa_sync_pass(spa),
-	    maptype == SM_ALLOC ? 'A' : 'F', avl_numnodes(&sm->sm_root),
+	    maptype == SM_ALLOC ? 'A' : 'F', btree_numnodes(&sm->sm_root),
 	    sm->sm_space);
 
 	if (maptype == SM_ALLOC)
@@ -424,7 +446,7 @@ space_map_sync(space_map_t *sm, uint8_t maptype,
 	else
 		smo->smo_alloc -= sm->sm_space;
 
-	bufsize = (8 + avl_numnodes(&sm->sm_root)) * sizeof (uint64_t);
+	bufsize = (8 + btree_numnodes(&sm->sm_root)) * sizeof (uint64_t);
 	bufsize = MIN(bufsize, 1ULL << SPACE_MAP_BLOCKSHIFT);
 	entry_map = zio_buf_alloc(bufsize);
 	entry_map_end = entry_map + (bufsize / sizeof (uint64_t));
@@ -435,7 +457,12 @@ space_map_sync(space_map_t *sm, uint8_t maptype,
 	    SM_DEBUG_SYNCPASS_ENCODE(spa_sync_pass(spa)) |
 	    SM_DEBUG_TXG_ENCODE(dmu_tx_get_txg(tx));
 
-	while ((ss = avl_destroy_nodes(&sm->sm_root, &cookie)) != NULL) {
+	/*
+	 * Nothing else modifies the map while it is being synced, so the
+	 * position survives dropping sm_lock around dmu_write().
+	 */
+	for (ss = btree_first(&sm->sm_root, &where); ss != NULL;
+	    ss = btree_next(&sm->sm_root, &where, &where)) {
 		size = ss->ss_end - ss->ss_start;
 		start = (ss->ss_start - sm->sm_start) >> sm->sm_shift;
 
@@ -461,8 +488,8 @@ space_map_sync(space_map_t *sm, uint8_t maptype,
 			start += run_len;
 			size -= run_len;
 		}
-		kmem_free(ss, sizeof (*ss));
 	}
+	btree_clear(&sm->sm_root);
 
 	if (entry != entry_map) {
 		size = (entry - entry_map) * sizeof (uint64_t);
@@ -572,11 +599,13 @@ space_map_ref_add_seg(avl_tree_t *t, uint64_t start, uint64_t end,
 void
 space_map_ref_add_map(avl_tree_t *t, space_map_t *sm, int64_t refcnt)
 {
+	btree_index_t where;
 	space_seg_t *ss;
 
 	ASSERT(MUTEX_HELD(sm->sm_lock));
 
-	for (ss = avl_first(&sm->sm_root); ss; ss = AVL_NEXT(&sm->sm_root, ss))
+	for (ss = btree_first(&sm->sm_root, &where); ss != NULL;
+	    ss = btree_next(&sm->sm_root, &where, &where))
 		space_map_ref_add_seg(t, ss->ss_start, ss->ss_end, refcnt);
 }
 
@@ -36,9 +36,31 @@
 
 static void txg_sync_thread(dsl_pool_t *dp);
 static void txg_quiesce_thread(dsl_pool_t *dp);
+static txg_synced_func_t txg_synced_fd_cb;
 
 int zfs_txg_timeout = 10;	/* max seconds worth of delta per txg */
 
+/*
+ * The txgs.<pool> kstat: the dirty data at which the open txg gets closed
+ * and the sync rate it is derived from (see the comment at the top of
+ * dsl_pool.c), and what happened to the last TXG_HISTORY_SIZE txgs, as
+ * text, one txg per line.
+ */
+typedef struct txg_kstats {
+	kstat_named_t	txk_dirty_sync_target;
+	kstat_named_t	txk_sync_bytes_per_sec;
+	kstat_named_t	txk_history;
+} txg_kstats_t;
+
+static const txg_kstats_t txg_kstats_template = {
+	{ "dirty_sync_target",	KSTAT_DATA_UINT64 },
+	{ "sync_bytes_per_sec",	KSTAT_DATA_UINT64 },
+	{ "history",		KSTAT_DATA_STRING },
+};
+
+#define	TXG_HISTORY_LINELEN	80
+#define	TXG_HISTORY_BUFLEN	((TXG_HISTORY_SIZE + 1) * TXG_HISTORY_LINELEN)
+
 /*
  * Prepare the txg subsystem.
  */
@@ -64,6 +86,10 @@ txg_init(dsl_pool_t *dp, uint64_t txg)
 		}
 	}
 
+	for (c = 0; c < TXG_SIZE; c++)
+		list_create(&tx->tx_synced_cbs[c], sizeof (dmu_tx_callback_t),
+		    offsetof(dmu_tx_callback_t, dcb_node));
+
 	mutex_init(&tx->tx_sync_lock, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&tx->tx_slash2_lock, NULL, MUTEX_DEFAULT, NULL);
 
@@ -125,12 +151,100 @@ txg_fini(dsl_pool_t *dp)
 
 	if (tx->tx_commit_cb_taskq != NULL)
 		taskq_destroy(tx->tx_commit_cb_taskq);
+	if (tx->tx_synced_cb_taskq != NULL)
+		taskq_destroy(tx->tx_synced_cb_taskq);
+
+	for (c = 0; c < TXG_SIZE; c++) {
+		dmu_tx_do_callbacks(&tx->tx_synced_cbs[c], ECANCELED);
+		list_destroy(&tx->tx_synced_cbs[c]);
+	}
 
 	kmem_free(tx->tx_cpu, max_ncpus * sizeof (tx_cpu_t));
 
 	bzero(tx, sizeof (tx_state_t));
 }
 
+/*
+ * Called with tx_sync_lock held, it is the kstat's ks_lock.
+ */
+static int
+txg_kstat_update(kstat_t *ksp, int rw)
+{
+	dsl_pool_t *dp = ksp->ks_private;
+	tx_state_t *tx = &dp->dp_tx;
+	txg_kstats_t *txk = ksp->ks_data;
+	char *buf = KSTAT_NAMED_STR_PTR(&txk->txk_history);
+	uint64_t txg, t;
+	size_t off;
+
+	if (rw == KSTAT_WRITE)
+		return (EACCES);
+
+	txk->txk_dirty_sync_target.value.ui64 = dsl_pool_dirty_sync_target(dp);
+	txk->txk_sync_bytes_per_sec.value.ui64 = dp->dp_sync_bw;
+
+	off = snprintf(buf, TXG_HISTORY_BUFLEN, "%-12s %12s %12s %12s %12s\n",
+	    "txg", "dirty", "open_us", "quiesce_us", "sync_us");
+
+	txg = tx->tx_synced_txg;
+	t = (txg >= TXG_HISTORY_SIZE ? txg - TXG_HISTORY_SIZE + 1 : 1);
+	for (; t <= txg && off < TXG_HISTORY_BUFLEN; t++) {
+		txg_history_t *txh = &tx->tx_history[t % TXG_HISTORY_SIZE];
+
+		if (txh->txh_txg != t)
+			continue;
+		off += snprintf(buf + off, TXG_HISTORY_BUFLEN - off,
+		    "%-12"PRIu64" %12"PRIu64" %12"PRIu64" %12"PRIu64
+		    " %12"PRIu64"\n", t, txh->txh_dirty,
+		    (uint64_t)txh->txh_open_time / 1000,
+		    (uint64_t)txh->txh_quiesce_time / 1000,
+		    (uint64_t)txh->txh_sync_time / 1000);
+	}
+	return (0);
+}
+
+static void
+txg_kstat_init(dsl_pool_t *dp)
+{
+	tx_state_t *tx = &dp->dp_tx;
+	char name[MAXNAMELEN];
+	txg_kstats_t *txk;
+
+	(void) snprintf(name, sizeof (name), "txgs.%s", spa_name(dp->dp_spa));
+	tx->tx_ksp = kstat_create("zfs", 0, name, "misc", KSTAT_TYPE_NAMED,
+	    sizeof (txg_kstats_t) / sizeof (kstat_named_t), KSTAT_FLAG_VIRTUAL);
+	if (tx->tx_ksp == NULL)
+		return;
+
+	txk = kmem_alloc(sizeof (txg_kstats_t), KM_SLEEP);
+	bcopy(&txg_kstats_template, txk, sizeof (txg_kstats_t));
+	KSTAT_NAMED_STR_PTR(&txk->txk_history) =
+	    kmem_zalloc(TXG_HISTORY_BUFLEN, KM_SLEEP);
+	KSTAT_NAMED_STR_BUFLEN(&txk->txk_history) = TXG_HISTORY_BUFLEN;
+
+	tx->tx_ksp->ks_data = txk;
+	tx->tx_ksp->ks_private = dp;
+	tx->tx_ksp->ks_lock = &tx->tx_sync_lock;
+	tx->tx_ksp->ks_update = txg_kstat_update;
+	kstat_install(tx->tx_ksp);
+}
+
+static void
+txg_kstat_fini(dsl_pool_t *dp)
+{
+	tx_state_t *tx = &dp->dp_tx;
+	txg_kstats_t *txk;
+
+	if (tx->tx_ksp == NULL)
+		return;
+
+	txk = tx->tx_ksp->ks_data;
+	kstat_delete(tx->tx_ksp);
+	tx->tx_ksp = NULL;
+	kmem_free(KSTAT_NAMED_STR_PTR(&txk->txk_history), TXG_HISTORY_BUFLEN);
+	kmem_free(txk, sizeof (txg_kstats_t));
+}
+
 /*
  * Start syncing transaction groups.
  */
@@ -146,6 +260,13 @@ txg_sync_start(dsl_pool_t *dp)
 	ASSERT(tx->tx_threads == 0);
 
 	tx->tx_threads = 2;
+	tx->tx_open_time = gethrtime();
+
+	if (tx->tx_synced_cb_taskq == NULL) {
+		/* One thread, so that batches run in txg order */
+		tx->tx_synced_cb_taskq = taskq_create("txg_synced_cb", 1,
+		    minclsyspri, 1, INT_MAX, TASKQ_PREPOPULATE);
+	}
 
 	tx->tx_quiesce_thread = thread_create(NULL, 0, txg_quiesce_thread,
 	    dp, 0, &p0, TS_RUN, minclsyspri);
@@ -159,6 +280,7 @@ txg_sync_start(dsl_pool_t *dp)
 	    dp, 0, &p0, TS_RUN, minclsyspri);
 
 	mutex_exit(&tx->tx_sync_lock);
+	txg_kstat_init(dp);
 }
 
 static void
@@ -230,6 +352,13 @@ txg_sync_stop(dsl_pool_t *dp)
 	tx->tx_exiting = 0;
 
 	mutex_exit(&tx->tx_sync_lock);
+	txg_kstat_fini(dp);
+
+	/*
+	 * Everything registered up to the open txg has been dispatched by
+	 * now, let it run before the pool goes away.
+	 */
+	taskq_wait(tx->tx_synced_cb_taskq);
 }
 
 uint64_t
@@ -394,6 +523,66 @@ txg_dispatch_callbacks(dsl_pool_t *dp, uint64_t txg)
 	}
 }
 
+/*
+ * txg_notify_synced(): arg is the fd.  EAGAIN means the eventfd counter is
+ * about to overflow, so it has plenty to report already.
+ */
+/* ARGSUSED */
+static void
+txg_synced_fd_cb(void *arg, int error)
+{
+	uint64_t one = 1;
+
+	(void) write((int)(uintptr_t)arg, &one, sizeof (one));
+}
+
+/*
+ * Run a batch of txg_register_synced() callbacks.  Consecutive
+ * txg_notify_synced() entries for the same fd only write it once.
+ */
+static void
+txg_do_synced_callbacks(list_t *cb_list)
+{
+	dmu_tx_callback_t *dcb;
+	void *last_fd = NULL;
+
+	while ((dcb = list_head(cb_list)) != NULL) {
+		list_remove(cb_list, dcb);
+		if (dcb->dcb_func != txg_synced_fd_cb ||
+		    dcb->dcb_data != last_fd)
+			dcb->dcb_func(dcb->dcb_data, 0);
+		last_fd = (dcb->dcb_func == txg_synced_fd_cb ?
+		    dcb->dcb_data : NULL);
+		kmem_free(dcb, sizeof (dmu_tx_callback_t));
+	}
+	list_destroy(cb_list);
+	kmem_free(cb_list, sizeof (list_t));
+}
+
+/*
+ * Hand the callbacks waiting for txg, which is now synced, to the
+ * txg_synced_cb taskq in one go.
+ */
+static void
+txg_dispatch_synced(tx_state_t *tx, uint64_t txg)
+{
+	list_t *synced = &tx->tx_synced_cbs[txg & TXG_MASK];
+	list_t *cb_list;
+
+	ASSERT(MUTEX_HELD(&tx->tx_sync_lock));
+
+	if (list_is_empty(synced))
+		return;
+
+	cb_list = kmem_alloc(sizeof (list_t), KM_SLEEP);
+	list_create(cb_list, sizeof (dmu_tx_callback_t),
+	    offsetof(dmu_tx_callback_t, dcb_node));
+	list_move_tail(cb_list, synced);
+
+	(void) taskq_dispatch(tx->tx_synced_cb_taskq,
+	    (task_func_t *)txg_do_synced_callbacks, cb_list, TQ_SLEEP);
+}
+
 static void
 txg_sync_thread(dsl_pool_t *dp)
 {
@@ -407,12 +596,16 @@ txg_sync_thread(dsl_pool_t *dp)
 	start = delta = 0;
 	for (;;) {
 		uint64_t timer, timeout = zfs_txg_timeout * hz;
-		uint64_t txg;
+		uint64_t txg, dirty;
+		hrtime_t sync_start, sync_time;
+		txg_history_t *txh;
 
 		/*
 		 * We sync when we're scanning, there's someone waiting
 		 * on us, or the quiesce thread has handed off a txg to
-		 * us, or we have reached our timeout.
+		 * us, or we have reached our timeout.  The quiesce thread
+		 * is kicked early once the open txg holds enough dirty
+		 * data, see dsl_pool_willuse_space().
 		 */
 		timer = (delta >= timeout ? 0 : timeout - delta);
 		while ((dp->dp_scan->scn_phys.scn_state != DSS_SCANNING ||
@@ -456,11 +649,22 @@ txg_sync_thread(dsl_pool_t *dp)
 		    txg, tx->tx_quiesce_txg_waiting, tx->tx_sync_txg_waiting);
 		mutex_exit(&tx->tx_sync_lock);
 
+		mutex_enter(&dp->dp_lock);
+		dirty = dp->dp_space_towrite[txg & TXG_MASK];
+		mutex_exit(&dp->dp_lock);
+
 		start = lbolt;
+		sync_start = gethrtime();
 		spa_sync(spa, txg);
+		sync_time = gethrtime() - sync_start;
 		delta = lbolt - start;
 
+		dsl_pool_sync_rate_update(dp, dirty, sync_time);
+
 		mutex_enter(&tx->tx_sync_lock);
+		txh = &tx->tx_history[txg % TXG_HISTORY_SIZE];
+		txh->txh_dirty = dirty;
+		txh->txh_sync_time = sync_time;
 		tx->tx_synced_txg = txg;
 		tx->tx_syncing_txg = 0;
 		cv_broadcast(&tx->tx_sync_done_cv);
@@ -469,6 +673,7 @@ txg_sync_thread(dsl_pool_t *dp)
 		 * Dispatch commit callbacks to worker threads.
 		 */
 		txg_dispatch_callbacks(dp, txg);
+		txg_dispatch_synced(tx, txg);
 	}
 }
 
@@ -481,6 +686,8 @@ txg_quiesce_thread(dsl_pool_t *dp)
 	txg_thread_enter(tx, &cpr);
 
 	for (;;) {
+		txg_history_t *txh;
+		hrtime_t start;
 		uint64_t txg;
 
 		/*
@@ -502,9 +709,16 @@ txg_quiesce_thread(dsl_pool_t *dp)
 		dprintf("txg=%"PRIu64" quiesce_txg=%"PRIu64" sync_txg=%"PRIu64"\n",
 		    txg, tx->tx_quiesce_txg_waiting,
 		    tx->tx_sync_txg_waiting);
+		start = gethrtime();
+		txh = &tx->tx_history[txg % TXG_HISTORY_SIZE];
+		bzero(txh, sizeof (txg_history_t));
+		txh->txh_txg = txg;
+		txh->txh_open_time = start - tx->tx_open_time;
+		tx->tx_open_time = start;
 		mutex_exit(&tx->tx_sync_lock);
 		txg_quiesce(dp, txg);
 		mutex_enter(&tx->tx_sync_lock);
+		txh->txh_quiesce_time = gethrtime() - start;
 
 		/*
 		 * Hand this txg off to the sync thread.
@@ -517,32 +731,20 @@ txg_quiesce_thread(dsl_pool_t *dp)
 }
 
 /*
- * Delay this thread by 'ticks' if we are still in the open transaction
- * group and there is already a waiting txg quiesing or quiesced.  Abort
- * the delay if this txg stalls or enters the quiesing state.
+ * Close the open txg as soon as the txg before it is out of the way,
+ * rather than at the next txg timeout.  Unlike txg_wait_open() this does
+ * not wait.  Called by the write throttle when dirty data builds up.
  */
 void
-txg_delay(dsl_pool_t *dp, uint64_t txg, int ticks)
+txg_kick(dsl_pool_t *dp)
 {
 	tx_state_t *tx = &dp->dp_tx;
-	int timeout = lbolt + ticks;
-
-	/* don't delay if this txg could transition to quiesing immediately */
-	if (tx->tx_open_txg > txg ||
-	    tx->tx_syncing_txg == txg-1 || tx->tx_synced_txg == txg-1)
-		return;
 
 	mutex_enter(&tx->tx_sync_lock);
-	if (tx->tx_open_txg > txg || tx->tx_synced_txg == txg-1) {
-		mutex_exit(&tx->tx_sync_lock);
-		return;
+	if (tx->tx_quiesce_txg_waiting <= tx->tx_open_txg) {
+		tx->tx_quiesce_txg_waiting = tx->tx_open_txg + 1;
+		cv_broadcast(&tx->tx_quiesce_more_cv);
 	}
-
-	while (lbolt < timeout &&
-	    tx->tx_syncing_txg < txg-1 && !txg_stalled(dp))
-		(void) cv_timedwait(&tx->tx_quiesce_more_cv, &tx->tx_sync_lock,
-		    timeout);
-
 	mutex_exit(&tx->tx_sync_lock);
 }
 
@@ -558,6 +760,58 @@ txg_return_synced(dsl_pool_t *dp)
 	return (txg);
 }
 
+int
+txg_register_synced(dsl_pool_t *dp, uint64_t txg, txg_synced_func_t *func,
+    void *arg)
+{
+	tx_state_t *tx = &dp->dp_tx;
+	dmu_tx_callback_t *dcb;
+	list_t *synced;
+
+	mutex_enter(&tx->tx_sync_lock);
+	if (txg == 0)
+		txg = tx->tx_open_txg;
+	if (txg > tx->tx_open_txg) {
+		mutex_exit(&tx->tx_sync_lock);
+		return (EINVAL);
+	}
+
+	/*
+	 * Anything between the last synced and the open txg has its own
+	 * slot; an already synced txg goes to the one just drained.
+	 */
+	synced = &tx->tx_synced_cbs[MAX(txg, tx->tx_synced_txg) & TXG_MASK];
+	if (func == txg_synced_fd_cb && txg > tx->tx_synced_txg) {
+		dcb = list_tail(synced);
+		if (dcb != NULL && dcb->dcb_func == func &&
+		    dcb->dcb_data == arg) {
+			mutex_exit(&tx->tx_sync_lock);
+			return (0);
+		}
+	}
+
+	dcb = kmem_alloc(sizeof (dmu_tx_callback_t), KM_SLEEP);
+	dcb->dcb_func = func;
+	dcb->dcb_data = arg;
+	list_insert_tail(synced, dcb);
+
+	if (txg <= tx->tx_synced_txg) {
+		txg_dispatch_synced(tx, tx->tx_synced_txg);
+	} else if (tx->tx_sync_txg_waiting < txg) {
+		tx->tx_sync_txg_waiting = txg;
+		cv_broadcast(&tx->tx_sync_more_cv);
+	}
+	mutex_exit(&tx->tx_sync_lock);
+	return (0);
+}
+
+int
+txg_notify_synced(dsl_pool_t *dp, uint64_t txg, int fd)
+{
+	return (txg_register_synced(dp, txg, txg_synced_fd_cb,
+	    (void *)(uintptr_t)fd));
+}
+
 void
 txg_wait_synced(dsl_pool_t *dp, uint64_t txg)
 {
@@ -27,6 +27,8 @@
 #include <sys/vdev_impl.h>
 #include <sys/zio.h>
 #include <sys/avl.h>
+#include <sys/spa_impl.h>
+#include <sys/dsl_pool.h>
 
 /*
  * These tunables are for performance analysis.
@@ -40,6 +42,20 @@
 int zfs_vdev_max_pending = 10;
 int zfs_vdev_min_pending = 4;
 
+/*
+ * Async writes, i.e. those of the txg sync, may only occupy part of the
+ * pending slots, so that reads and the ZIL do not queue up behind them
+ * while there is little dirty data.  Their share is
+ * zfs_vdev_async_write_min_pending up to
+ * zfs_vdev_async_write_active_min_dirty_percent of zfs_dirty_data_max and
+ * grows linearly to all of the slots at
+ * zfs_vdev_async_write_active_max_dirty_percent, so that the sync catches
+ * up before the write throttle (see dsl_pool.c) has to delay writers much.
+ */
+int zfs_vdev_async_write_min_pending = 1;
+int zfs_vdev_async_write_active_min_dirty_percent = 30;
+int zfs_vdev_async_write_active_max_dirty_percent = 60;
+
 /* deadline = pri + (lbolt >> time_shift) */
 int zfs_vdev_time_shift = 6;
 
@@ -56,6 +72,16 @@ int zfs_vdev_aggregation_limit = SPA_MAXBLOCKSIZE;
 int zfs_vdev_read_gap_limit = 32 << 10;
 int zfs_vdev_write_gap_limit = 4 << 10;
 
+/*
+ * Completions of foreground (non-scan) I/Os record when the pool was last
+ * busy and, for reads and ZIL writes, a moving average of their latency
+ * from queueing to completion, weighted 1/2^zfs_vdev_latency_shift per
+ * sample.  The scan paces itself on these (see dsl_scan_pace()).  They
+ * are updated under each leaf's own queue lock, so concurrent updates
+ * from different leaves may occasionally lose a sample.
+ */
+int zfs_vdev_latency_shift = 3;
+
 /*
  * Virtual device vector for disk I/O scheduling.
  */
@@ -112,6 +138,9 @@ vdev_queue_init(vdev_t *vd)
 	avl_create(&vq->vq_deadline_tree, vdev_queue_deadline_compare,
 	    sizeof (zio_t), offsetof(struct zio, io_deadline_node));
 
+	avl_create(&vq->vq_async_deadline_tree, vdev_queue_deadline_compare,
+	    sizeof (zio_t), offsetof(struct zio, io_deadline_node));
+
 	avl_create(&vq->vq_read_tree, vdev_queue_offset_compare,
 	    sizeof (zio_t), offsetof(struct zio, io_offset_node));
 
@@ -128,6 +157,7 @@ vdev_queue_fini(vdev_t *vd)
 	vdev_queue_t *vq = &vd->vdev_queue;
 
 	avl_destroy(&vq->vq_deadline_tree);
+	avl_destroy(&vq->vq_async_deadline_tree);
 	avl_destroy(&vq->vq_read_tree);
 	avl_destroy(&vq->vq_write_tree);
 	avl_destroy(&vq->vq_pending_tree);
@@ -135,20 +165,80 @@ vdev_queue_fini(vdev_t *vd)
 	mutex_destroy(&vq->vq_lock);
 }
 
+static avl_tree_t *
+vdev_queue_deadline_tree(vdev_queue_t *vq, zio_t *zio)
+{
+	if (zio->io_type == ZIO_TYPE_WRITE &&
+	    zio->io_priority == ZIO_PRIORITY_ASYNC_WRITE)
+		return (&vq->vq_async_deadline_tree);
+	return (&vq->vq_deadline_tree);
+}
+
 static void
 vdev_queue_io_add(vdev_queue_t *vq, zio_t *zio)
 {
-	avl_add(&vq->vq_deadline_tree, zio);
+	avl_add(vdev_queue_deadline_tree(vq, zio), zio);
 	avl_add(zio->io_vdev_tree, zio);
 }
 
 static void
 vdev_queue_io_remove(vdev_queue_t *vq, zio_t *zio)
 {
-	avl_remove(&vq->vq_deadline_tree, zio);
+	avl_remove(vdev_queue_deadline_tree(vq, zio), zio);
 	avl_remove(zio->io_vdev_tree, zio);
 }
 
+static void
+vdev_queue_pending_add(vdev_queue_t *vq, zio_t *zio)
+{
+	avl_add(&vq->vq_pending_tree, zio);
+	if (zio->io_type == ZIO_TYPE_WRITE)
+		vq->vq_pending_writes++;
+}
+
+static void
+vdev_queue_pending_remove(vdev_queue_t *vq, zio_t *zio)
+{
+	avl_remove(&vq->vq_pending_tree, zio);
+	if (zio->io_type == ZIO_TYPE_WRITE)
+		vq->vq_pending_writes--;
+}
+
+/*
+ * How many writes may be pending before we stop issuing async writes.
+ * All pending writes count, so that a burst of ZIL writes also holds
+ * back the sync.
+ */
+static uint64_t
+vdev_queue_max_async_writes(spa_t *spa)
+{
+	dsl_pool_t *dp = spa_get_dsl(spa);
+	uint64_t min_bytes = zfs_dirty_data_max *
+	    zfs_vdev_async_write_active_min_dirty_percent / 100;
+	uint64_t max_bytes = zfs_dirty_data_max *
+	    zfs_vdev_async_write_active_max_dirty_percent / 100;
+	uint64_t dirty;
+
+	/*
+	 * Writes issued while the pool is being loaded or created are
+	 * not throttled.
+	 */
+	if (dp == NULL)
+		return (zfs_vdev_max_pending);
+
+	dirty = dp->dp_dirty_total;
+	if (dirty < min_bytes)
+		return (zfs_vdev_async_write_min_pending);
+	if (dirty >= max_bytes)
+		return (zfs_vdev_max_pending);
+
+	ASSERT3U(max_bytes, >, min_bytes);
+	return (zfs_vdev_async_write_min_pending +
+	    (dirty - min_bytes) *
+	    (zfs_vdev_max_pending - zfs_vdev_async_write_min_pending) /
+	    (max_bytes - min_bytes));
+}
+
 static void
 vdev_queue_agg_io_done(zio_t *aio)
 {
@@ -184,11 +274,22 @@ vdev_queue_io_to_issue(vdev_queue_t *vq, uint64_t pending_limit)
 again:
 	ASSERT(MUTEX_HELD(&vq->vq_lock));
 
-	if (avl_numnodes(&vq->vq_pending_tree) >= pending_limit ||
-	    avl_numnodes(&vq->vq_deadline_tree) == 0)
+	if (avl_numnodes(&vq->vq_pending_tree) >= pending_limit)
 		return (NULL);
 
-	fio = lio = avl_first(&vq->vq_deadline_tree);
+	/*
+	 * Issue whichever of the oldest async write and the oldest other
+	 * I/O is due first, unless async writes have used up their share.
+	 */
+	fio = avl_first(&vq->vq_deadline_tree);
+	aio = avl_first(&vq->vq_async_deadline_tree);
+	if (aio != NULL && (fio == NULL ||
+	    vdev_queue_deadline_compare(aio, fio) < 0) &&
+	    vq->vq_pending_writes < vdev_queue_max_async_writes(aio->io_spa))
+		fio = aio;
+	if (fio == NULL)
+		return (NULL);
+	lio = fio;
 
 	t = fio->io_vdev_tree;
 	flags = fio->io_flags & ZIO_FLAG_AGG_INHERIT;
@@ -288,6 +389,7 @@ again:
 		    zio_buf_alloc(size), size, fio->io_type, ZIO_PRIORITY_AGG,
 		    flags | ZIO_FLAG_DONT_CACHE | ZIO_FLAG_DONT_QUEUE,
 		    vdev_queue_agg_io_done, NULL);
+		aio->io_timestamp = fio->io_timestamp;
 
 		nio = fio;
 		do {
@@ -312,7 +414,7 @@ again:
 			zio_execute(dio);
 		} while (dio != lio);
 
-		avl_add(&vq->vq_pending_tree, aio);
+		vdev_queue_pending_add(vq, aio);
 
 		return (aio);
 	}
@@ -334,7 +436,7 @@ again:
 		goto again;
 	}
 
-	avl_add(&vq->vq_pending_tree, fio);
+	vdev_queue_pending_add(vq, fio);
 
 	return (fio);
 }
@@ -360,6 +462,7 @@ vdev_queue_io(zio_t *zio)
 	mutex_enter(&vq->vq_lock);
 
 	zio->io_deadline = (lbolt64 >> zfs_vdev_time_shift) + zio->io_priority;
+	zio->io_timestamp = gethrtime();
 
 	vdev_queue_io_add(vq, zio);
 
@@ -378,6 +481,28 @@ vdev_queue_io(zio_t *zio)
 	return (nio);
 }
 
+static void
+vdev_queue_fg_io_done(zio_t *zio)
+{
+	spa_t *spa = zio->io_spa;
+	hrtime_t now, latency;
+
+	if (zio->io_timestamp == 0 || (zio->io_flags &
+	    (ZIO_FLAG_SCRUB | ZIO_FLAG_RESILVER | ZIO_FLAG_IO_REPAIR)))
+		return;
+
+	now = gethrtime();
+	spa->spa_fg_io_last = now;
+
+	if (zio->io_type == ZIO_TYPE_READ ||
+	    zio->io_priority == ZIO_PRIORITY_LOG_WRITE) {
+		latency = now - zio->io_timestamp;
+		spa->spa_fg_io_latency = spa->spa_fg_io_latency -
+		    (spa->spa_fg_io_latency >> zfs_vdev_latency_shift) +
+		    (latency >> zfs_vdev_latency_shift);
+	}
+}
+
 void
 vdev_queue_io_done(zio_t *zio)
 {
@@ -385,7 +510,8 @@ vdev_queue_io_done(zio_t *zio)
 
 	mutex_enter(&vq->vq_lock);
 
-	avl_remove(&vq->vq_pending_tree, zio);
+	vdev_queue_pending_remove(vq, zio);
+	vdev_queue_fg_io_done(zio);
 
 	for (int i = 0; i < zfs_vdev_ramp_rate; i++) {
 		zio_t *nio = vdev_queue_io_to_issue(vq, zfs_vdev_max_pending);
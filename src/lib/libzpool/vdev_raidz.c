@@ -26,6 +26,7 @@
 #include <sys/zfs_context.h>
 #include <sys/spa.h>
 #include <sys/vdev_impl.h>
+#include <sys/vdev_raidz.h>
 #include <sys/zio.h>
 #include <sys/zio_checksum.h>
 #include <sys/fs/zfs.h>
@@ -95,63 +96,12 @@
  *
  * See the reconstruction code below for how P, Q and R can used individually
  * or in concert to recover missing data columns.
+ *
+ * The field arithmetic itself is done a whole column at a time by the
+ * kernels in vdev_raidz_math.c, which have vector implementations for the
+ * instruction sets the CPU supports.
  */
 
-typedef struct raidz_col {
-	uint64_t rc_devidx;		/* child device index for I/O */
-	uint64_t rc_offset;		/* device offset */
-	uint64_t rc_size;		/* I/O size */
-	void *rc_data;			/* I/O data */
-	void *rc_gdata;			/* used to store the "good" version */
-	int rc_error;			/* I/O error for this device */
-	uint8_t rc_tried;		/* Did we attempt this I/O column? */
-	uint8_t rc_skipped;		/* Did we skip this I/O column? */
-} raidz_col_t;
-
-typedef struct raidz_map {
-	uint64_t rm_cols;		/* Regular column count */
-	uint64_t rm_scols;		/* Count including skipped columns */
-	uint64_t rm_bigcols;		/* Number of oversized columns */
-	uint64_t rm_asize;		/* Actual total I/O size */
-	uint64_t rm_missingdata;	/* Count of missing data devices */
-	uint64_t rm_missingparity;	/* Count of missing parity devices */
-	uint64_t rm_firstdatacol;	/* First data column/parity count */
-	uint64_t rm_nskip;		/* Skipped sectors for padding */
-	uint64_t rm_skipstart;	/* Column index of padding start */
-	void *rm_datacopy;		/* rm_asize-buffer of copied data */
-	uintptr_t rm_reports;		/* # of referencing checksum reports */
-	uint8_t	rm_freed;		/* map no longer has referencing ZIO */
-	uint8_t	rm_ecksuminjected;	/* checksum error was injected */
-	raidz_col_t rm_col[1];		/* Flexible array of I/O columns */
-} raidz_map_t;
-
-#define	VDEV_RAIDZ_P		0
-#define	VDEV_RAIDZ_Q		1
-#define	VDEV_RAIDZ_R		2
-
-#define	VDEV_RAIDZ_MUL_2(x)	(((x) << 1) ^ (((x) & 0x80) ? 0x1d : 0))
-#define	VDEV_RAIDZ_MUL_4(x)	(VDEV_RAIDZ_MUL_2(VDEV_RAIDZ_MUL_2(x)))
-
-/*
- * We provide a mechanism to perform the field multiplication operation on a
- * 64-bit value all at once rather than a byte at a time. This works by
- * creating a mask from the top bit in each byte and using that to
- * conditionally apply the XOR of 0x1d.
- */
-#define	VDEV_RAIDZ_64MUL_2(x, mask) \
-{ \
-	(mask) = (x) & 0x8080808080808080ULL; \
-	(mask) = ((mask) << 1) - ((mask) >> 7); \
-	(x) = (((x) << 1) & 0xfefefefefefefefeULL) ^ \
-	    ((mask) & 0x1d1d1d1d1d1d1d1d); \
-}
-
-#define	VDEV_RAIDZ_64MUL_4(x, mask) \
-{ \
-	VDEV_RAIDZ_64MUL_2((x), mask); \
-	VDEV_RAIDZ_64MUL_2((x), mask); \
-}
-
 /*
  * Force reconstruction to use the general purpose method.
  */
@@ -230,8 +180,6 @@ static const uint8_t vdev_raidz_log2[256] = {
 	0x74, 0xd6, 0xf4, 0xea, 0xa8, 0x50, 0x58, 0xaf,
 };
 
-static void vdev_raidz_generate_parity(raidz_map_t *rm);
-
 /*
  * Multiply a given number by 2 raised to the given power.
  */
@@ -251,7 +199,7 @@ vdev_raidz_exp2(uint_t a, int exp)
 	return (vdev_raidz_pow2[exp]);
 }
 
-static void
+void
 vdev_raidz_map_free(raidz_map_t *rm)
 {
 	int c;
@@ -432,7 +380,7 @@ static const zio_vsd_ops_t vdev_raidz_vsd_ops = {
 	vdev_raidz_cksum_report
 };
 
-static raidz_map_t *
+raidz_map_t *
 vdev_raidz_map_alloc(zio_t *zio, uint64_t unit_shift, uint64_t dcols,
     uint64_t nparity)
 {
@@ -563,26 +511,23 @@ vdev_raidz_map_alloc(zio_t *zio, uint64_t unit_shift, uint64_t dcols,
 static void
 vdev_raidz_generate_parity_p(raidz_map_t *rm)
 {
-	uint64_t *p, *src, pcount, ccount, i;
+	void *p, *src;
+	uint64_t psize, csize;
 	int c;
 
-	pcount = rm->rm_col[VDEV_RAIDZ_P].rc_size / sizeof (src[0]);
+	psize = rm->rm_col[VDEV_RAIDZ_P].rc_size;
 
 	for (c = rm->rm_firstdatacol; c < rm->rm_cols; c++) {
 		src = rm->rm_col[c].rc_data;
 		p = rm->rm_col[VDEV_RAIDZ_P].rc_data;
-		ccount = rm->rm_col[c].rc_size / sizeof (src[0]);
+		csize = rm->rm_col[c].rc_size;
 
 		if (c == rm->rm_firstdatacol) {
-			ASSERT(ccount == pcount);
-			for (i = 0; i < ccount; i++, src++, p++) {
-				*p = *src;
-			}
+			ASSERT(csize == psize);
+			bcopy(src, p, csize);
 		} else {
-			ASSERT(ccount <= pcount);
-			for (i = 0; i < ccount; i++, src++, p++) {
-				*p ^= *src;
-			}
+			ASSERT(csize <= psize);
+			vdev_raidz_math->rm_add(p, src, csize);
 		}
 	}
 }
@@ -590,10 +535,11 @@ vdev_raidz_generate_parity_p(raidz_map_t *rm)
 static void
 vdev_raidz_generate_parity_pq(raidz_map_t *rm)
 {
-	uint64_t *p, *q, *src, pcnt, ccnt, mask, i;
+	char *p, *q, *src;
+	uint64_t psize, csize;
 	int c;
 
-	pcnt = rm->rm_col[VDEV_RAIDZ_P].rc_size / sizeof (src[0]);
+	psize = rm->rm_col[VDEV_RAIDZ_P].rc_size;
 	ASSERT(rm->rm_col[VDEV_RAIDZ_P].rc_size ==
 	    rm->rm_col[VDEV_RAIDZ_Q].rc_size);
 
@@ -602,38 +548,30 @@ vdev_raidz_generate_parity_pq(raidz_map_t *rm)
 		p = rm->rm_col[VDEV_RAIDZ_P].rc_data;
 		q = rm->rm_col[VDEV_RAIDZ_Q].rc_data;
 
-		ccnt = rm->rm_col[c].rc_size / sizeof (src[0]);
+		csize = rm->rm_col[c].rc_size;
 
 		if (c == rm->rm_firstdatacol) {
-			ASSERT(ccnt == pcnt || ccnt == 0);
-			for (i = 0; i < ccnt; i++, src++, p++, q++) {
-				*p = *src;
-				*q = *src;
-			}
-			for (; i < pcnt; i++, src++, p++, q++) {
-				*p = 0;
-				*q = 0;
-			}
+			ASSERT(csize == psize || csize == 0);
+			bcopy(src, p, csize);
+			bcopy(src, q, csize);
+			bzero(p + csize, psize - csize);
+			bzero(q + csize, psize - csize);
 		} else {
-			ASSERT(ccnt <= pcnt);
+			ASSERT(csize <= psize);
 
 			/*
 			 * Apply the algorithm described above by multiplying
 			 * the previous result and adding in the new value.
 			 */
-			for (i = 0; i < ccnt; i++, src++, p++, q++) {
-				*p ^= *src;
-
-				VDEV_RAIDZ_64MUL_2(*q, mask);
-				*q ^= *src;
-			}
+			vdev_raidz_math->rm_pq_add(p, q, src, csize);
 
 			/*
 			 * Treat short columns as though they are full of 0s.
 			 * Note that there's therefore nothing needed for P.
 			 */
-			for (; i < pcnt; i++, q++) {
-				VDEV_RAIDZ_64MUL_2(*q, mask);
+			if (csize < psize) {
+				vdev_raidz_math->rm_mul(q + csize, q + csize,
+				    2, psize - csize);
 			}
 		}
 	}
@@ -642,10 +580,11 @@ vdev_raidz_generate_parity_pq(raidz_map_t *rm)
 static void
 vdev_raidz_generate_parity_pqr(raidz_map_t *rm)
 {
-	uint64_t *p, *q, *r, *src, pcnt, ccnt, mask, i;
+	char *p, *q, *r, *src;
+	uint64_t psize, csize;
 	int c;
 
-	pcnt = rm->rm_col[VDEV_RAIDZ_P].rc_size / sizeof (src[0]);
+	psize = rm->rm_col[VDEV_RAIDZ_P].rc_size;
 	ASSERT(rm->rm_col[VDEV_RAIDZ_P].rc_size ==
 	    rm->rm_col[VDEV_RAIDZ_Q].rc_size);
 	ASSERT(rm->rm_col[VDEV_RAIDZ_P].rc_size ==
@@ -657,44 +596,34 @@ vdev_raidz_generate_parity_pqr(raidz_map_t *rm)
 		q = rm->rm_col[VDEV_RAIDZ_Q].rc_data;
 		r = rm->rm_col[VDEV_RAIDZ_R].rc_data;
 
-		ccnt = rm->rm_col[c].rc_size / sizeof (src[0]);
+		csize = rm->rm_col[c].rc_size;
 
 		if (c == rm->rm_firstdatacol) {
-			ASSERT(ccnt == pcnt || ccnt == 0);
-			for (i = 0; i < ccnt; i++, src++, p++, q++, r++) {
-				*p = *src;
-				*q = *src;
-				*r = *src;
-			}
-			for (; i < pcnt; i++, src++, p++, q++, r++) {
-				*p = 0;
-				*q = 0;
-				*r = 0;
-			}
+			ASSERT(csize == psize || csize == 0);
+			bcopy(src, p, csize);
+			bcopy(src, q, csize);
+			bcopy(src, r, csize);
+			bzero(p + csize, psize - csize);
+			bzero(q + csize, psize - csize);
+			bzero(r + csize, psize - csize);
 		} else {
-			ASSERT(ccnt <= pcnt);
+			ASSERT(csize <= psize);
 
 			/*
 			 * Apply the algorithm described above by multiplying
 			 * the previous result and adding in the new value.
 			 */
-			for (i = 0; i < ccnt; i++, src++, p++, q++, r++) {
-				*p ^= *src;
-
-				VDEV_RAIDZ_64MUL_2(*q, mask);
-				*q ^= *src;
-
-				VDEV_RAIDZ_64MUL_4(*r, mask);
-				*r ^= *src;
-			}
+			vdev_raidz_math->rm_pqr_add(p, q, r, src, csize);
 
 			/*
 			 * Treat short columns as though they are full of 0s.
 			 * Note that there's therefore nothing needed for P.
 			 */
-			for (; i < pcnt; i++, q++, r++) {
-				VDEV_RAIDZ_64MUL_2(*q, mask);
-				VDEV_RAIDZ_64MUL_4(*r, mask);
+			if (csize < psize) {
+				vdev_raidz_math->rm_mul(q + csize, q + csize,
+				    2, psize - csize);
+				vdev_raidz_math->rm_mul(r + csize, r + csize,
+				    4, psize - csize);
 			}
 		}
 	}
@@ -704,7 +633,7 @@ vdev_raidz_generate_parity_pqr(raidz_map_t *rm)
  * Generate RAID parity in the first virtual columns according to the number of
  * parity columns available.
  */
-static void
+void
 vdev_raidz_generate_parity(raidz_map_t *rm)
 {
 	switch (rm->rm_firstdatacol) {
@@ -725,7 +654,8 @@ vdev_raidz_generate_parity(raidz_map_t *rm)
 static int
 vdev_raidz_reconstruct_p(raidz_map_t *rm, int *tgts, int ntgts)
 {
-	uint64_t *dst, *src, xcount, ccount, count, i;
+	void *dst, *src;
+	uint64_t xsize, csize;
 	int x = tgts[0];
 	int c;
 
@@ -733,15 +663,13 @@ vdev_raidz_reconstruct_p(raidz_map_t *rm, int *tgts, int ntgts)
 	ASSERT(x >= rm->rm_firstdatacol);
 	ASSERT(x < rm->rm_cols);
 
-	xcount = rm->rm_col[x].rc_size / sizeof (src[0]);
-	ASSERT(xcount <= rm->rm_col[VDEV_RAIDZ_P].rc_size / sizeof (src[0]));
-	ASSERT(xcount > 0);
+	xsize = rm->rm_col[x].rc_size;
+	ASSERT(xsize <= rm->rm_col[VDEV_RAIDZ_P].rc_size);
+	ASSERT(xsize > 0);
 
 	src = rm->rm_col[VDEV_RAIDZ_P].rc_data;
 	dst = rm->rm_col[x].rc_data;
-	for (i = 0; i < xcount; i++, dst++, src++) {
-		*dst = *src;
-	}
+	bcopy(src, dst, xsize);
 
 	for (c = rm->rm_firstdatacol; c < rm->rm_cols; c++) {
 		src = rm->rm_col[c].rc_data;
@@ -750,12 +678,8 @@ vdev_raidz_reconstruct_p(raidz_map_t *rm, int *tgts, int ntgts)
 		if (c == x)
 			continue;
 
-		ccount = rm->rm_col[c].rc_size / sizeof (src[0]);
-		count = MIN(ccount, xcount);
-
-		for (i = 0; i < count; i++, dst++, src++) {
-			*dst ^= *src;
-		}
+		csize = MIN(rm->rm_col[c].rc_size, xsize);
+		vdev_raidz_math->rm_add(dst, src, csize);
 	}
 
 	return (1 << VDEV_RAIDZ_P);
@@ -764,43 +688,33 @@ vdev_raidz_reconstruct_p(raidz_map_t *rm, int *tgts, int ntgts)
 static int
 vdev_raidz_reconstruct_q(raidz_map_t *rm, int *tgts, int ntgts)
 {
-	uint64_t *dst, *src, xcount, ccount, count, mask, i;
-	uint8_t *b;
+	char *dst, *src;
+	uint64_t xsize, size;
 	int x = tgts[0];
-	int c, j, exp;
+	int c, exp;
 
 	ASSERT(ntgts == 1);
 
-	xcount = rm->rm_col[x].rc_size / sizeof (src[0]);
-	ASSERT(xcount <= rm->rm_col[VDEV_RAIDZ_Q].rc_size / sizeof (src[0]));
+	xsize = rm->rm_col[x].rc_size;
+	ASSERT(xsize <= rm->rm_col[VDEV_RAIDZ_Q].rc_size);
 
 	for (c = rm->rm_firstdatacol; c < rm->rm_cols; c++) {
 		src = rm->rm_col[c].rc_data;
 		dst = rm->rm_col[x].rc_data;
 
 		if (c == x)
-			ccount = 0;
+			size = 0;
 		else
-			ccount = rm->rm_col[c].rc_size / sizeof (src[0]);
-
-		count = MIN(ccount, xcount);
+			size = MIN(rm->rm_col[c].rc_size, xsize);
 
 		if (c == rm->rm_firstdatacol) {
-			for (i = 0; i < count; i++, dst++, src++) {
-				*dst = *src;
-			}
-			for (; i < xcount; i++, dst++) {
-				*dst = 0;
-			}
-
+			bcopy(src, dst, size);
+			bzero(dst + size, xsize - size);
 		} else {
-			for (i = 0; i < count; i++, dst++, src++) {
-				VDEV_RAIDZ_64MUL_2(*dst, mask);
-				*dst ^= *src;
-			}
-
-			for (; i < xcount; i++, dst++) {
-				VDEV_RAIDZ_64MUL_2(*dst, mask);
+			vdev_raidz_math->rm_q_add(dst, src, size);
+			if (size < xsize) {
+				vdev_raidz_math->rm_mul(dst + size, dst + size,
+				    2, xsize - size);
 			}
 		}
 	}
@@ -809,12 +723,8 @@ vdev_raidz_reconstruct_q(raidz_map_t *rm, int *tgts, int ntgts)
 	dst = rm->rm_col[x].rc_data;
 	exp = 255 - (rm->rm_cols - 1 - x);
 
-	for (i = 0; i < xcount; i++, dst++, src++) {
-		*dst ^= *src;
-		for (j = 0, b = (uint8_t *)dst; j < 8; j++, b++) {
-			*b = vdev_raidz_exp2(*b, exp);
-		}
-	}
+	vdev_raidz_math->rm_add(dst, src, xsize);
+	vdev_raidz_math->rm_mul(dst, dst, vdev_raidz_pow2[exp], xsize);
 
 	return (1 << VDEV_RAIDZ_Q);
 }
@@ -822,9 +732,9 @@ vdev_raidz_reconstruct_q(raidz_map_t *rm, int *tgts, int ntgts)
 static int
 vdev_raidz_reconstruct_pq(raidz_map_t *rm, int *tgts, int ntgts)
 {
-	uint8_t *p, *q, *pxy, *qxy, *xd, *yd, tmp, a, b, aexp, bexp;
+	uint8_t *p, *q, *pxy, *qxy, *xd, *yd, tmp, a, b, acoef, bcoef;
 	void *pdata, *qdata;
-	uint64_t xsize, ysize, i;
+	uint64_t xsize, ysize;
 	int x = tgts[0];
 	int y = tgts[1];
 
@@ -879,22 +789,26 @@ vdev_raidz_reconstruct_pq(raidz_map_t *rm, int *tgts, int ntgts)
 	 *
 	 * With D_x in hand, we can easily solve for D_y:
 	 *	D_y = P + Pxy + D_x
+	 *
+	 * The sums P + Pxy and Q + Qxy are formed in place in the scratch
+	 * parity buffers, which are discarded afterwards.
 	 */
 
 	a = vdev_raidz_pow2[255 + x - y];
 	b = vdev_raidz_pow2[255 - (rm->rm_cols - 1 - x)];
 	tmp = 255 - vdev_raidz_log2[a ^ 1];
 
-	aexp = vdev_raidz_log2[vdev_raidz_exp2(a, tmp)];
-	bexp = vdev_raidz_log2[vdev_raidz_exp2(b, tmp)];
+	acoef = vdev_raidz_exp2(a, tmp);
+	bcoef = vdev_raidz_exp2(b, tmp);
 
-	for (i = 0; i < xsize; i++, p++, q++, pxy++, qxy++, xd++, yd++) {
-		*xd = vdev_raidz_exp2(*p ^ *pxy, aexp) ^
-		    vdev_raidz_exp2(*q ^ *qxy, bexp);
+	vdev_raidz_math->rm_add(pxy, p, xsize);
+	vdev_raidz_math->rm_add(qxy, q, xsize);
 
-		if (i < ysize)
-			*yd = *p ^ *pxy ^ *xd;
-	}
+	vdev_raidz_math->rm_mul(xd, pxy, acoef, xsize);
+	vdev_raidz_math->rm_mul_add(xd, qxy, bcoef, xsize);
+
+	bcopy(pxy, yd, ysize);
+	vdev_raidz_math->rm_add(yd, xd, ysize);
 
 	zio_buf_free(rm->rm_col[VDEV_RAIDZ_P].rc_data,
 	    rm->rm_col[VDEV_RAIDZ_P].rc_size);
@@ -1192,75 +1106,42 @@ static void
 vdev_raidz_matrix_reconstruct(raidz_map_t *rm, int n, int nmissing,
     int *missing, uint8_t **invrows, const uint8_t *used)
 {
-	int i, j, x, cc, c;
-	uint8_t *src;
-	uint64_t ccount;
-	uint8_t *dst[VDEV_RAIDZ_MAXPARITY];
-	uint64_t dcount[VDEV_RAIDZ_MAXPARITY];
-	uint8_t log, val;
-	int ll;
-	uint8_t *invlog[VDEV_RAIDZ_MAXPARITY];
-	uint8_t *p, *pp;
-	size_t psize;
-
-	psize = sizeof (invlog[0][0]) * n * nmissing;
-	p = kmem_alloc(psize, KM_SLEEP);
-
-	for (pp = p, i = 0; i < nmissing; i++) {
-		invlog[i] = pp;
-		pp += n;
-	}
-
-	for (i = 0; i < nmissing; i++) {
-		for (j = 0; j < n; j++) {
-			ASSERT3U(invrows[i][j], !=, 0);
-			invlog[i][j] = vdev_raidz_log2[invrows[i][j]];
-		}
-	}
+	int i, j, cc, c;
+	void *src, *dst;
+	uint64_t csize, size;
 
 	for (i = 0; i < n; i++) {
 		c = used[i];
 		ASSERT3U(c, <, rm->rm_cols);
 
 		src = rm->rm_col[c].rc_data;
-		ccount = rm->rm_col[c].rc_size;
+		csize = rm->rm_col[c].rc_size;
+
+		ASSERT(csize >= rm->rm_col[missing[0]].rc_size || i > 0);
+
+		/*
+		 * Accumulate this column, scaled by its coefficient in the
+		 * inverted matrix, into every missing column.
+		 */
 		for (j = 0; j < nmissing; j++) {
 			cc = missing[j] + rm->rm_firstdatacol;
 			ASSERT3U(cc, >=, rm->rm_firstdatacol);
 			ASSERT3U(cc, <, rm->rm_cols);
 			ASSERT3U(cc, !=, c);
+			ASSERT3U(invrows[j][i], !=, 0);
 
-			dst[j] = rm->rm_col[cc].rc_data;
-			dcount[j] = rm->rm_col[cc].rc_size;
-		}
-
-		ASSERT(ccount >= rm->rm_col[missing[0]].rc_size || i > 0);
-
-		for (x = 0; x < ccount; x++, src++) {
-			if (*src != 0)
-				log = vdev_raidz_log2[*src];
+			dst = rm->rm_col[cc].rc_data;
+			size = MIN(csize, rm->rm_col[cc].rc_size);
 
-			for (cc = 0; cc < nmissing; cc++) {
-				if (x >= dcount[cc])
-					continue;
-
-				if (*src == 0) {
-					val = 0;
-				} else {
-					if ((ll = log + invlog[cc][i]) >= 255)
-						ll -= 255;
-					val = vdev_raidz_pow2[ll];
-				}
-
-				if (i == 0)
-					dst[cc][x] = val;
-				else
-					dst[cc][x] ^= val;
+			if (i == 0) {
+				vdev_raidz_math->rm_mul(dst, src,
+				    invrows[j][i], size);
+			} else {
+				vdev_raidz_math->rm_mul_add(dst, src,
+				    invrows[j][i], size);
 			}
 		}
 	}
-
-	kmem_free(p, psize);
 }
 
 static int
@@ -1369,7 +1250,7 @@ vdev_raidz_reconstruct_general(raidz_map_t *rm, int *tgts, int ntgts)
 	return (code);
 }
 
-static int
+int
 vdev_raidz_reconstruct(raidz_map_t *rm, int *t, int nt)
 {
 	int tgts[VDEV_RAIDZ_MAXPARITY], *dt;
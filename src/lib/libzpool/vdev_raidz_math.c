@@ -0,0 +1,370 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/spa.h>
+#include <sys/vdev_raidz.h>
+
+/*
+ * Galois field kernels for RAID-Z parity generation and reconstruction.
+ *
+ * See the block comment at the top of vdev_raidz.c for the field itself.
+ * Every kernel in this file works on whole columns; vdev_raidz.c only
+ * decides which columns to combine and with what coefficients.
+ *
+ * Multiplication by 2 is done a word or vector at a time by doubling each
+ * byte and conditionally XORing in 0x1d where the top bit was set.
+ * Multiplication by an arbitrary constant c uses the split-nibble method:
+ * since multiplication distributes over addition (XOR),
+ *
+ *	c * x = c * (x & 0x0f) + c * (x & 0xf0)
+ *
+ * so two 16-entry tables indexed by the low and high nibble of x are
+ * enough. On x86 those tables fit in a register and PSHUFB does 16, 32
+ * or 64 lookups per instruction.
+ *
+ * zfs-fuse runs entirely in user space, so the vector units may be used
+ * from any thread without saving FPU state. The implementation is chosen
+ * once by vdev_raidz_math_init() from what the CPU supports.
+ */
+
+#define	VDEV_RAIDZ_MUL_2(x)	(((x) << 1) ^ (((x) & 0x80) ? 0x1d : 0))
+
+/*
+ * We provide a mechanism to perform the field multiplication operation on a
+ * 64-bit value all at once rather than a byte at a time. This works by
+ * creating a mask from the top bit in each byte and using that to
+ * conditionally apply the XOR of 0x1d.
+ */
+#define	VDEV_RAIDZ_64MUL_2(x, mask) \
+{ \
+	(mask) = (x) & 0x8080808080808080ULL; \
+	(mask) = ((mask) << 1) - ((mask) >> 7); \
+	(x) = (((x) << 1) & 0xfefefefefefefefeULL) ^ \
+	    ((mask) & 0x1d1d1d1d1d1d1d1d); \
+}
+
+#define	VDEV_RAIDZ_64MUL_4(x, mask) \
+{ \
+	VDEV_RAIDZ_64MUL_2((x), mask); \
+	VDEV_RAIDZ_64MUL_2((x), mask); \
+}
+
+char *zfs_vdev_raidz_impl = "fastest";
+
+/*
+ * Multiply two field elements the long way; only used to build tables.
+ */
+static uint8_t
+vdev_raidz_gf_mul(uint8_t a, uint8_t b)
+{
+	uint8_t r = 0;
+
+	for (; b != 0; b >>= 1) {
+		if (b & 1)
+			r ^= a;
+		a = VDEV_RAIDZ_MUL_2(a);
+	}
+
+	return (r);
+}
+
+/*
+ * Build the low and high nibble product tables for the constant c.
+ */
+static void
+vdev_raidz_mul_tables(uint8_t c, uint8_t *lo, uint8_t *hi)
+{
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		lo[i] = vdev_raidz_gf_mul(c, i);
+		hi[i] = vdev_raidz_gf_mul(c, i << 4);
+	}
+}
+
+/*
+ * Scalar (64 bits at a time) implementation. This is always available
+ * and also handles the tails the vector implementations leave behind.
+ */
+static boolean_t
+vdev_raidz_scalar_supported(void)
+{
+	return (B_TRUE);
+}
+
+static void
+vdev_raidz_scalar_add(void *dst, const void *src, size_t size)
+{
+	uint64_t *d = dst;
+	const uint64_t *s = src;
+	size_t i, cnt = size / sizeof (uint64_t);
+
+	for (i = 0; i < cnt; i++)
+		d[i] ^= s[i];
+}
+
+static void
+vdev_raidz_scalar_q_add(void *qp, const void *src, size_t size)
+{
+	uint64_t *q = qp, mask;
+	const uint64_t *s = src;
+	size_t i, cnt = size / sizeof (uint64_t);
+
+	for (i = 0; i < cnt; i++) {
+		VDEV_RAIDZ_64MUL_2(q[i], mask);
+		q[i] ^= s[i];
+	}
+}
+
+static void
+vdev_raidz_scalar_pq_add(void *pp, void *qp, const void *src, size_t size)
+{
+	uint64_t *p = pp, *q = qp, mask;
+	const uint64_t *s = src;
+	size_t i, cnt = size / sizeof (uint64_t);
+
+	for (i = 0; i < cnt; i++) {
+		p[i] ^= s[i];
+
+		VDEV_RAIDZ_64MUL_2(q[i], mask);
+		q[i] ^= s[i];
+	}
+}
+
+static void
+vdev_raidz_scalar_pqr_add(void *pp, void *qp, void *rp, const void *src,
+    size_t size)
+{
+	uint64_t *p = pp, *q = qp, *r = rp, mask;
+	const uint64_t *s = src;
+	size_t i, cnt = size / sizeof (uint64_t);
+
+	for (i = 0; i < cnt; i++) {
+		p[i] ^= s[i];
+
+		VDEV_RAIDZ_64MUL_2(q[i], mask);
+		q[i] ^= s[i];
+
+		VDEV_RAIDZ_64MUL_4(r[i], mask);
+		r[i] ^= s[i];
+	}
+}
+
+static void
+vdev_raidz_scalar_mul(void *dst, const void *src, uint8_t c, size_t size)
+{
+	uint8_t lo[16], hi[16];
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t i;
+
+	vdev_raidz_mul_tables(c, lo, hi);
+
+	for (i = 0; i < size; i++)
+		d[i] = lo[s[i] & 0x0f] ^ hi[s[i] >> 4];
+}
+
+static void
+vdev_raidz_scalar_mul_add(void *dst, const void *src, uint8_t c, size_t size)
+{
+	uint8_t lo[16], hi[16];
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t i;
+
+	vdev_raidz_mul_tables(c, lo, hi);
+
+	for (i = 0; i < size; i++)
+		d[i] ^= lo[s[i] & 0x0f] ^ hi[s[i] >> 4];
+}
+
+static const vdev_raidz_math_ops_t vdev_raidz_scalar_ops = {
+	"scalar",
+	vdev_raidz_scalar_supported,
+	vdev_raidz_scalar_add,
+	vdev_raidz_scalar_q_add,
+	vdev_raidz_scalar_pq_add,
+	vdev_raidz_scalar_pqr_add,
+	vdev_raidz_scalar_mul,
+	vdev_raidz_scalar_mul_add
+};
+
+/*
+ * x86 vector implementations. Each one is generated from
+ * vdev_raidz_math_impl.h with the intrinsics for its register width and
+ * compiled for the matching instruction set, so the rest of the library
+ * does not need to be built with -mavx2 or similar.
+ */
+#if defined(__x86_64__) && defined(__GNUC__) && __GNUC__ >= 5
+#define	HAVE_RAIDZ_X86
+
+#include <immintrin.h>
+
+#pragma GCC push_options
+#pragma GCC target("ssse3")
+
+#define	RAIDZ_NAME		"sse"
+#define	RAIDZ_IMPL(fn)		vdev_raidz_sse_##fn
+#define	RAIDZ_VEC		__m128i
+#define	RAIDZ_LOAD(p)		_mm_loadu_si128((const __m128i *)(p))
+#define	RAIDZ_STORE(p, v)	_mm_storeu_si128((__m128i *)(p), (v))
+#define	RAIDZ_XOR(a, b)		_mm_xor_si128((a), (b))
+#define	RAIDZ_AND(a, b)		_mm_and_si128((a), (b))
+#define	RAIDZ_ADD8(a, b)	_mm_add_epi8((a), (b))
+#define	RAIDZ_SUB8(a, b)	_mm_sub_epi8((a), (b))
+#define	RAIDZ_SRL16(a, n)	_mm_srli_epi16((a), (n))
+#define	RAIDZ_SET1(c)		_mm_set1_epi8((char)(c))
+#define	RAIDZ_ZERO()		_mm_setzero_si128()
+#define	RAIDZ_SHUF(t, i)	_mm_shuffle_epi8((t), (i))
+#define	RAIDZ_TABLE(p)		_mm_loadu_si128((const __m128i *)(p))
+
+static boolean_t
+vdev_raidz_sse_supported(void)
+{
+	return (__builtin_cpu_supports("ssse3") ? B_TRUE : B_FALSE);
+}
+
+#include "vdev_raidz_math_impl.h"
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+#define	RAIDZ_NAME		"avx2"
+#define	RAIDZ_IMPL(fn)		vdev_raidz_avx2_##fn
+#define	RAIDZ_VEC		__m256i
+#define	RAIDZ_LOAD(p)		_mm256_loadu_si256((const __m256i *)(p))
+#define	RAIDZ_STORE(p, v)	_mm256_storeu_si256((__m256i *)(p), (v))
+#define	RAIDZ_XOR(a, b)		_mm256_xor_si256((a), (b))
+#define	RAIDZ_AND(a, b)		_mm256_and_si256((a), (b))
+#define	RAIDZ_ADD8(a, b)	_mm256_add_epi8((a), (b))
+#define	RAIDZ_SUB8(a, b)	_mm256_sub_epi8((a), (b))
+#define	RAIDZ_SRL16(a, n)	_mm256_srli_epi16((a), (n))
+#define	RAIDZ_SET1(c)		_mm256_set1_epi8((char)(c))
+#define	RAIDZ_ZERO()		_mm256_setzero_si256()
+#define	RAIDZ_SHUF(t, i)	_mm256_shuffle_epi8((t), (i))
+#define	RAIDZ_TABLE(p)	\
+	_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(p)))
+
+static boolean_t
+vdev_raidz_avx2_supported(void)
+{
+	return (__builtin_cpu_supports("avx2") ? B_TRUE : B_FALSE);
+}
+
+#include "vdev_raidz_math_impl.h"
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bw")
+
+#define	RAIDZ_NAME		"avx512"
+#define	RAIDZ_IMPL(fn)		vdev_raidz_avx512_##fn
+#define	RAIDZ_VEC		__m512i
+#define	RAIDZ_LOAD(p)		_mm512_loadu_si512((const void *)(p))
+#define	RAIDZ_STORE(p, v)	_mm512_storeu_si512((void *)(p), (v))
+#define	RAIDZ_XOR(a, b)		_mm512_xor_si512((a), (b))
+#define	RAIDZ_AND(a, b)		_mm512_and_si512((a), (b))
+#define	RAIDZ_ADD8(a, b)	_mm512_add_epi8((a), (b))
+#define	RAIDZ_SUB8(a, b)	_mm512_sub_epi8((a), (b))
+#define	RAIDZ_SRL16(a, n)	_mm512_srli_epi16((a), (n))
+#define	RAIDZ_SET1(c)		_mm512_set1_epi8((char)(c))
+#define	RAIDZ_ZERO()		_mm512_setzero_si512()
+#define	RAIDZ_SHUF(t, i)	_mm512_shuffle_epi8((t), (i))
+#define	RAIDZ_TABLE(p)	\
+	_mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)(p)))
+
+static boolean_t
+vdev_raidz_avx512_supported(void)
+{
+	return (__builtin_cpu_supports("avx512f") &&
+	    __builtin_cpu_supports("avx512bw") ? B_TRUE : B_FALSE);
+}
+
+#include "vdev_raidz_math_impl.h"
+
+#pragma GCC pop_options
+
+#endif	/* __x86_64__ */
+
+/*
+ * Ordered from narrowest to widest; "fastest" picks the last supported one.
+ */
+const vdev_raidz_math_ops_t *vdev_raidz_math_impls[] = {
+	&vdev_raidz_scalar_ops,
+#ifdef HAVE_RAIDZ_X86
+	&vdev_raidz_sse_ops,
+	&vdev_raidz_avx2_ops,
+	&vdev_raidz_avx512_ops,
+#endif
+	NULL
+};
+
+const vdev_raidz_math_ops_t *vdev_raidz_math = &vdev_raidz_scalar_ops;
+
+/*
+ * Select the implementation by name; "fastest" selects the widest one
+ * supported by this CPU. Returns ENOTSUP if the named implementation is
+ * unknown or unsupported, in which case the current one is kept.
+ */
+int
+vdev_raidz_math_set(const char *name)
+{
+	const vdev_raidz_math_ops_t *ops, *sel = NULL;
+	int i;
+
+#ifdef HAVE_RAIDZ_X86
+	__builtin_cpu_init();
+#endif
+
+	for (i = 0; (ops = vdev_raidz_math_impls[i]) != NULL; i++) {
+		if (!ops->rm_is_supported())
+			continue;
+		if (strcmp(name, "fastest") == 0) {
+			sel = ops;
+		} else if (strcmp(name, ops->rm_name) == 0) {
+			sel = ops;
+			break;
+		}
+	}
+
+	if (sel == NULL)
+		return (ENOTSUP);
+
+	vdev_raidz_math = sel;
+	return (0);
+}
+
+void
+vdev_raidz_math_init(void)
+{
+	if (zfs_vdev_raidz_impl == NULL ||
+	    vdev_raidz_math_set(zfs_vdev_raidz_impl) != 0) {
+		if (zfs_vdev_raidz_impl != NULL)
+			cmn_err(CE_WARN, "raidz implementation '%s' is not "
+			    "supported, using the fastest available",
+			    zfs_vdev_raidz_impl);
+		VERIFY(vdev_raidz_math_set("fastest") == 0);
+	}
+}
@@ -0,0 +1,196 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Vector RAID-Z kernels, included once per instruction set by
+ * vdev_raidz_math.c. The includer defines RAIDZ_NAME, RAIDZ_IMPL() and
+ * the RAIDZ_* intrinsic wrappers for one register width; everything is
+ * undefined again at the bottom of this file.
+ */
+
+#define	RAIDZ_VSIZE	(sizeof (RAIDZ_VEC))
+
+/*
+ * Multiply each byte by 2: shift the top bit of every byte down to bit 0,
+ * negate it into a 0x00/0xff mask and use that to select 0x1d.
+ */
+static inline RAIDZ_VEC
+RAIDZ_IMPL(mul2)(RAIDZ_VEC x)
+{
+	RAIDZ_VEC m;
+
+	m = RAIDZ_AND(RAIDZ_SRL16(x, 7), RAIDZ_SET1(0x01));
+	m = RAIDZ_SUB8(RAIDZ_ZERO(), m);
+	return (RAIDZ_XOR(RAIDZ_ADD8(x, x), RAIDZ_AND(m, RAIDZ_SET1(0x1d))));
+}
+
+/*
+ * Multiply each byte by the constant whose nibble tables are lo and hi.
+ */
+static inline RAIDZ_VEC
+RAIDZ_IMPL(mulc)(RAIDZ_VEC x, RAIDZ_VEC lo, RAIDZ_VEC hi)
+{
+	RAIDZ_VEC mask = RAIDZ_SET1(0x0f);
+
+	return (RAIDZ_XOR(RAIDZ_SHUF(lo, RAIDZ_AND(x, mask)),
+	    RAIDZ_SHUF(hi, RAIDZ_AND(RAIDZ_SRL16(x, 4), mask))));
+}
+
+static void
+RAIDZ_IMPL(add)(void *dst, const void *src, size_t size)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t i, n = size - size % RAIDZ_VSIZE;
+
+	for (i = 0; i < n; i += RAIDZ_VSIZE)
+		RAIDZ_STORE(d + i, RAIDZ_XOR(RAIDZ_LOAD(d + i),
+		    RAIDZ_LOAD(s + i)));
+
+	if (i < size)
+		vdev_raidz_scalar_add(d + i, s + i, size - i);
+}
+
+static void
+RAIDZ_IMPL(q_add)(void *qp, const void *src, size_t size)
+{
+	uint8_t *q = qp;
+	const uint8_t *s = src;
+	size_t i, n = size - size % RAIDZ_VSIZE;
+
+	for (i = 0; i < n; i += RAIDZ_VSIZE) {
+		RAIDZ_STORE(q + i,
+		    RAIDZ_XOR(RAIDZ_IMPL(mul2)(RAIDZ_LOAD(q + i)),
+		    RAIDZ_LOAD(s + i)));
+	}
+
+	if (i < size)
+		vdev_raidz_scalar_q_add(q + i, s + i, size - i);
+}
+
+static void
+RAIDZ_IMPL(pq_add)(void *pp, void *qp, const void *src, size_t size)
+{
+	uint8_t *p = pp, *q = qp;
+	const uint8_t *s = src;
+	size_t i, n = size - size % RAIDZ_VSIZE;
+	RAIDZ_VEC d;
+
+	for (i = 0; i < n; i += RAIDZ_VSIZE) {
+		d = RAIDZ_LOAD(s + i);
+		RAIDZ_STORE(p + i, RAIDZ_XOR(RAIDZ_LOAD(p + i), d));
+		RAIDZ_STORE(q + i,
+		    RAIDZ_XOR(RAIDZ_IMPL(mul2)(RAIDZ_LOAD(q + i)), d));
+	}
+
+	if (i < size)
+		vdev_raidz_scalar_pq_add(p + i, q + i, s + i, size - i);
+}
+
+static void
+RAIDZ_IMPL(pqr_add)(void *pp, void *qp, void *rp, const void *src,
+    size_t size)
+{
+	uint8_t *p = pp, *q = qp, *r = rp;
+	const uint8_t *s = src;
+	size_t i, n = size - size % RAIDZ_VSIZE;
+	RAIDZ_VEC d;
+
+	for (i = 0; i < n; i += RAIDZ_VSIZE) {
+		d = RAIDZ_LOAD(s + i);
+		RAIDZ_STORE(p + i, RAIDZ_XOR(RAIDZ_LOAD(p + i), d));
+		RAIDZ_STORE(q + i,
+		    RAIDZ_XOR(RAIDZ_IMPL(mul2)(RAIDZ_LOAD(q + i)), d));
+		RAIDZ_STORE(r + i, RAIDZ_XOR(RAIDZ_IMPL(mul2)(
+		    RAIDZ_IMPL(mul2)(RAIDZ_LOAD(r + i))), d));
+	}
+
+	if (i < size)
+		vdev_raidz_scalar_pqr_add(p + i, q + i, r + i, s + i, size - i);
+}
+
+static void
+RAIDZ_IMPL(mul)(void *dst, const void *src, uint8_t c, size_t size)
+{
+	uint8_t tlo[16], thi[16];
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t i, n = size - size % RAIDZ_VSIZE;
+	RAIDZ_VEC lo, hi;
+
+	vdev_raidz_mul_tables(c, tlo, thi);
+	lo = RAIDZ_TABLE(tlo);
+	hi = RAIDZ_TABLE(thi);
+
+	for (i = 0; i < n; i += RAIDZ_VSIZE)
+		RAIDZ_STORE(d + i, RAIDZ_IMPL(mulc)(RAIDZ_LOAD(s + i), lo, hi));
+
+	if (i < size)
+		vdev_raidz_scalar_mul(d + i, s + i, c, size - i);
+}
+
+static void
+RAIDZ_IMPL(mul_add)(void *dst, const void *src, uint8_t c, size_t size)
+{
+	uint8_t tlo[16], thi[16];
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t i, n = size - size % RAIDZ_VSIZE;
+	RAIDZ_VEC lo, hi;
+
+	vdev_raidz_mul_tables(c, tlo, thi);
+	lo = RAIDZ_TABLE(tlo);
+	hi = RAIDZ_TABLE(thi);
+
+	for (i = 0; i < n; i += RAIDZ_VSIZE)
+		RAIDZ_STORE(d + i, RAIDZ_XOR(RAIDZ_LOAD(d + i),
+		    RAIDZ_IMPL(mulc)(RAIDZ_LOAD(s + i), lo, hi)));
+
+	if (i < size)
+		vdev_raidz_scalar_mul_add(d + i, s + i, c, size - i);
+}
+
+static const vdev_raidz_math_ops_t RAIDZ_IMPL(ops) = {
+	RAIDZ_NAME,
+	RAIDZ_IMPL(supported),
+	RAIDZ_IMPL(add),
+	RAIDZ_IMPL(q_add),
+	RAIDZ_IMPL(pq_add),
+	RAIDZ_IMPL(pqr_add),
+	RAIDZ_IMPL(mul),
+	RAIDZ_IMPL(mul_add)
+};
+
+#undef	RAIDZ_VSIZE
+#undef	RAIDZ_NAME
+#undef	RAIDZ_IMPL
+#undef	RAIDZ_VEC
+#undef	RAIDZ_LOAD
+#undef	RAIDZ_STORE
+#undef	RAIDZ_XOR
+#undef	RAIDZ_AND
+#undef	RAIDZ_ADD8
+#undef	RAIDZ_SUB8
+#undef	RAIDZ_SRL16
+#undef	RAIDZ_SET1
+#undef	RAIDZ_ZERO
+#undef	RAIDZ_SHUF
+#undef	RAIDZ_TABLE
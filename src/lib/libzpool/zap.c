@@ -50,6 +50,9 @@
 
 int fzap_default_block_shift = 14; /* 16k blocksize */
 
+/* leaf blocks a cursor keeps prefetched ahead of itself, in hash order */
+int zap_cursor_prefetch_leafs = 8;
+
 static void zap_leaf_pageout(dmu_buf_t *db, void *vl);
 static uint64_t zap_allocate_blocks(zap_t *zap, int nblocks);
 
@@ -397,6 +400,7 @@ zap_create_leaf(zap_t *zap, dmu_tx_t *tx)
 	l->l_blkid = zap_allocate_blocks(zap, 1);
 	l->l_dbuf = NULL;
 	l->l_phys = NULL;
+	l->l_ents = NULL;
 
 	VERIFY(0 == dmu_buf_hold(zap->zap_objset, zap->zap_object,
 	    l->l_blkid << FZAP_BLOCK_SHIFT(zap), NULL, &l->l_dbuf));
@@ -405,6 +409,7 @@ zap_create_leaf(zap_t *zap, dmu_tx_t *tx)
 	dmu_buf_will_dirty(l->l_dbuf, tx);
 
 	zap_leaf_init(l, zap->zap_normflags != 0);
+	zap_leaf_index_build(l);
 
 	zap->zap_f.zap_phys->zap_num_leafs++;
 
@@ -438,6 +443,7 @@ zap_leaf_pageout(dmu_buf_t *db, void *vl)
 {
 	zap_leaf_t *l = vl;
 
+	zap_leaf_index_free(l);
 	rw_destroy(&l->l_rwlock);
 	kmem_free(l, sizeof (zap_leaf_t));
 }
@@ -456,8 +462,11 @@ zap_open_leaf(uint64_t blkid, dmu_buf_t *db)
 	l->l_bs = highbit(db->db_size)-1;
 	l->l_dbuf = db;
 	l->l_phys = NULL;
+	l->l_ents = NULL;
 
 	winner = dmu_buf_set_user(db, l, &l->l_phys, zap_leaf_pageout);
+	if (winner == NULL)
+		zap_leaf_index_build(l);
 
 	rw_exit(&l->l_rwlock);
 	if (winner != NULL) {
@@ -781,6 +790,25 @@ fzap_lookup(zap_name_t *zn,
 	return (err);
 }
 
+/*
+ * Start reading the leaf that zn hashes to, so that a later lookup
+ * doesn't have to wait for it.
+ */
+void
+fzap_prefetch(zap_name_t *zn)
+{
+	zap_t *zap = zn->zn_zap;
+	uint64_t idx, blk;
+	int bs;
+
+	idx = ZAP_HASH_IDX(zn->zn_hash,
+	    zap->zap_f.zap_phys->zap_ptrtbl.zt_shift);
+	if (zap_idx_to_blk(zap, idx, &blk) != 0)
+		return;
+	bs = FZAP_BLOCK_SHIFT(zap);
+	dmu_prefetch(zap->zap_objset, zap->zap_object, blk << bs, 1 << bs);
+}
+
 int
 fzap_add_cd(zap_name_t *zn,
     uint64_t integer_size, uint64_t num_integers,
@@ -1105,6 +1133,49 @@ zap_increment_int(objset_t *os, uint64_t obj, uint64_t key, int64_t delta,
  * Routines for iterating over the attributes.
  */
 
+/*
+ * Prefetch the zap_cursor_prefetch_leafs leaf blocks that follow the
+ * cursor's leaf in pointer table order.  Every leaf owns an aligned,
+ * power-of-2 run of the table, so the length of a run is found by
+ * probing at doubling distances from its start.  Leafs the cursor
+ * already prefetched are skipped, so each new leaf usually issues a
+ * single read.
+ */
+static void
+zap_cursor_prefetch(zap_t *zap, zap_cursor_t *zc)
+{
+	zap_leaf_t *l = zc->zc_leaf;
+	int shift = zap->zap_f.zap_phys->zap_ptrtbl.zt_shift;
+	int prefix_len = l->l_phys->l_hdr.lh_prefix_len;
+	int bs = FZAP_BLOCK_SHIFT(zap);
+	uint64_t idx, len, blk, nextblk;
+	uint64_t end = 1ULL << shift;
+	int n;
+
+	ASSERT(RW_LOCK_HELD(&zap->zap_rwlock));
+	ASSERT3U(prefix_len, <=, shift);
+
+	if (prefix_len == 0)
+		return;
+
+	idx = (l->l_phys->l_hdr.lh_prefix + 1) << (shift - prefix_len);
+	for (n = 0; idx < end && n < zap_cursor_prefetch_leafs; n++) {
+		if (zap_idx_to_blk(zap, idx, &blk) != 0)
+			break;
+		for (len = 1; idx + len < end; len <<= 1) {
+			if (zap_idx_to_blk(zap, idx + len, &nextblk) != 0 ||
+			    nextblk != blk)
+				break;
+		}
+		if (idx >= zc->zc_prefetch) {
+			dmu_prefetch(zap->zap_objset, zap->zap_object,
+			    blk << bs, 1ULL << bs);
+		}
+		idx += len;
+	}
+	zc->zc_prefetch = MAX(zc->zc_prefetch, idx);
+}
+
 int
 fzap_cursor_retrieve(zap_t *zap, zap_cursor_t *zc, zap_attribute_t *za)
 {
@@ -1130,6 +1201,8 @@ again:
 		    &zc->zc_leaf);
 		if (err != 0)
 			return (err);
+		if (zap_cursor_prefetch_leafs != 0)
+			zap_cursor_prefetch(zap, zc);
 	} else {
 		rw_enter(&zc->zc_leaf->l_rwlock, RW_READER);
 	}
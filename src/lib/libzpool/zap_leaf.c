@@ -38,6 +38,10 @@
 #include <sys/zap_leaf.h>
 #include <sys/arc.h>
 
+#ifdef _KERNEL
+#include <util/qsort.h>
+#endif
+
 static uint16_t *zap_leaf_rehash_entry(zap_leaf_t *l, uint16_t entry);
 
 #define	CHAIN_END 0xffff /* end of the chunk chain */
@@ -169,6 +173,141 @@ zap_leaf_init(zap_leaf_t *l, boolean_t sort)
 	l->l_phys->l_hdr.lh_nfree = ZAP_LEAF_NUMCHUNKS(l);
 	if (sort)
 		l->l_phys->l_hdr.lh_flags |= ZLF_ENTRIES_CDSORTED;
+	l->l_nents = 0;
+}
+
+/*
+ * Routines which manipulate the in-core index (l_ents[]).
+ */
+
+#define	ZAP_LEAF_MIN_ENTS 16
+
+static int
+zap_leaf_ent_compare(const void *arg1, const void *arg2)
+{
+	const zap_leaf_ent_t *zle1 = arg1;
+	const zap_leaf_ent_t *zle2 = arg2;
+
+	if (zle1->zle_hash > zle2->zle_hash)
+		return (+1);
+	if (zle1->zle_hash < zle2->zle_hash)
+		return (-1);
+	if (zle1->zle_cd > zle2->zle_cd)
+		return (+1);
+	if (zle1->zle_cd < zle2->zle_cd)
+		return (-1);
+	return (0);
+}
+
+static void
+zap_leaf_index_resize(zap_leaf_t *l, int max)
+{
+	zap_leaf_ent_t *ents = kmem_alloc(max * sizeof (zap_leaf_ent_t),
+	    KM_SLEEP);
+
+	ASSERT3S(max, >=, l->l_nents);
+
+	if (l->l_ents != NULL) {
+		bcopy(l->l_ents, ents, l->l_nents * sizeof (zap_leaf_ent_t));
+		kmem_free(l->l_ents, l->l_ents_max * sizeof (zap_leaf_ent_t));
+	}
+	l->l_ents = ents;
+	l->l_ents_max = max;
+}
+
+/*
+ * (Re)build the index from the entry chunks of the leaf.
+ */
+void
+zap_leaf_index_build(zap_leaf_t *l)
+{
+	int nents = l->l_phys->l_hdr.lh_nentries;
+	int i, n = 0;
+
+	l->l_nents = 0;
+	if (l->l_ents == NULL || l->l_ents_max < nents)
+		zap_leaf_index_resize(l, MAX(nents, ZAP_LEAF_MIN_ENTS));
+
+	for (i = 0; i < ZAP_LEAF_NUMCHUNKS(l) && n < nents; i++) {
+		struct zap_leaf_entry *le = ZAP_LEAF_ENTRY(l, i);
+
+		if (le->le_type != ZAP_CHUNK_ENTRY)
+			continue;
+		l->l_ents[n].zle_hash = le->le_hash;
+		l->l_ents[n].zle_cd = le->le_cd;
+		l->l_ents[n].zle_chunk = i;
+		l->l_ents[n].zle_pad = 0;
+		n++;
+	}
+	ASSERT3S(n, ==, nents);
+
+	qsort(l->l_ents, n, sizeof (zap_leaf_ent_t), zap_leaf_ent_compare);
+	l->l_nents = n;
+}
+
+void
+zap_leaf_index_free(zap_leaf_t *l)
+{
+	if (l->l_ents != NULL) {
+		kmem_free(l->l_ents, l->l_ents_max * sizeof (zap_leaf_ent_t));
+		l->l_ents = NULL;
+		l->l_nents = 0;
+		l->l_ents_max = 0;
+	}
+}
+
+/*
+ * Return the index of the first entry at or after (h, cd).
+ */
+static int
+zap_leaf_index_lower_bound(zap_leaf_t *l, uint64_t h, uint32_t cd)
+{
+	const zap_leaf_ent_t *ents = l->l_ents;
+	int lo = 0, hi = l->l_nents;
+
+	ASSERT(ents != NULL);
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (ents[mid].zle_hash < h ||
+		    (ents[mid].zle_hash == h && ents[mid].zle_cd < cd))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+static void
+zap_leaf_index_insert(zap_leaf_t *l, uint64_t h, uint32_t cd, uint16_t chunk)
+{
+	zap_leaf_ent_t *zle;
+	int i;
+
+	if (l->l_nents == l->l_ents_max)
+		zap_leaf_index_resize(l, 2 * l->l_ents_max);
+
+	i = zap_leaf_index_lower_bound(l, h, cd);
+	zle = &l->l_ents[i];
+	ASSERT(i == l->l_nents || zle->zle_hash != h || zle->zle_cd != cd);
+	ovbcopy(zle, zle + 1, (l->l_nents - i) * sizeof (zap_leaf_ent_t));
+	zle->zle_hash = h;
+	zle->zle_cd = cd;
+	zle->zle_chunk = chunk;
+	zle->zle_pad = 0;
+	l->l_nents++;
+}
+
+static void
+zap_leaf_index_remove(zap_leaf_t *l, uint64_t h, uint32_t cd)
+{
+	int i = zap_leaf_index_lower_bound(l, h, cd);
+	zap_leaf_ent_t *zle = &l->l_ents[i];
+
+	ASSERT(i < l->l_nents && zle->zle_hash == h && zle->zle_cd == cd);
+	ovbcopy(zle + 1, zle, (l->l_nents - i - 1) * sizeof (zap_leaf_ent_t));
+	l->l_nents--;
 }
 
 /*
@@ -336,19 +475,35 @@ zap_leaf_array_match(zap_leaf_t *l, zap_name_t *zn,
 	int bseen = 0;
 
 	if (zap_getflags(zn->zn_zap) & ZAP_FLAG_UINT64_KEY) {
-		uint64_t *thiskey;
-		boolean_t match;
+		const uint64_t *key = zn->zn_key_orig;
+		uint64_t value = 0;
+		int i;
 
-		ASSERT(zn->zn_key_intlen == sizeof (*thiskey));
-		thiskey = kmem_alloc(array_numints * sizeof (*thiskey),
-		    KM_SLEEP);
+		ASSERT(zn->zn_key_intlen == sizeof (*key));
+		if (array_numints != zn->zn_key_orig_numints)
+			return (B_FALSE);
 
-		zap_leaf_array_read(l, chunk, sizeof (*thiskey), array_numints,
-		    sizeof (*thiskey), array_numints, thiskey);
-		match = bcmp(thiskey, zn->zn_key_orig,
-		    array_numints * sizeof (*thiskey)) == 0;
-		kmem_free(thiskey, array_numints * sizeof (*thiskey));
-		return (match);
+		/*
+		 * Decode the big-endian key in place, stopping at the
+		 * first integer that differs.
+		 */
+		while (bseen < array_numints * sizeof (*key)) {
+			struct zap_leaf_array *la =
+			    &ZAP_LEAF_CHUNK(l, chunk).l_array;
+
+			ASSERT3U(chunk, <, ZAP_LEAF_NUMCHUNKS(l));
+			for (i = 0; i < ZAP_LEAF_ARRAY_BYTES &&
+			    bseen < array_numints * sizeof (*key); i++) {
+				value = (value << 8) | la->la_array[i];
+				if (++bseen % sizeof (*key) == 0) {
+					if (value != *key++)
+						return (B_FALSE);
+					value = 0;
+				}
+			}
+			chunk = la->la_next;
+		}
+		return (B_TRUE);
 	}
 
 	ASSERT(zn->zn_key_intlen == 1);
@@ -386,41 +541,47 @@ zap_leaf_array_match(zap_leaf_t *l, zap_name_t *zn,
  * Routines which manipulate leaf entries.
  */
 
+static void
+zap_leaf_entry_handle(zap_leaf_t *l, uint16_t chunk, zap_entry_handle_t *zeh)
+{
+	struct zap_leaf_entry *le = ZAP_LEAF_ENTRY(l, chunk);
+
+	zeh->zeh_num_integers = le->le_value_numints;
+	zeh->zeh_integer_size = le->le_value_intlen;
+	zeh->zeh_cd = le->le_cd;
+	zeh->zeh_hash = le->le_hash;
+	zeh->zeh_fakechunk = chunk;
+	zeh->zeh_chunkp = &zeh->zeh_fakechunk;
+	zeh->zeh_leaf = l;
+}
+
 int
 zap_leaf_lookup(zap_leaf_t *l, zap_name_t *zn, zap_entry_handle_t *zeh)
 {
-	uint16_t *chunkp;
+	const zap_leaf_ent_t *zle, *end;
 	struct zap_leaf_entry *le;
 
 	ASSERT3U(l->l_phys->l_hdr.lh_magic, ==, ZAP_LEAF_MAGIC);
 
 again:
-	for (chunkp = LEAF_HASH_ENTPTR(l, zn->zn_hash);
-	    *chunkp != CHAIN_END; chunkp = &le->le_next) {
-		uint16_t chunk = *chunkp;
-		le = ZAP_LEAF_ENTRY(l, chunk);
+	/*
+	 * Only entries whose packed hash matches are looked at in the
+	 * chunks.  They are sorted by cd, so this will find the
+	 * lowest-cd match for MT_FIRST.
+	 */
+	end = &l->l_ents[l->l_nents];
+	for (zle = &l->l_ents[zap_leaf_index_lower_bound(l, zn->zn_hash, 0)];
+	    zle < end && zle->zle_hash == zn->zn_hash; zle++) {
+		le = ZAP_LEAF_ENTRY(l, zle->zle_chunk);
 
-		ASSERT3U(chunk, <, ZAP_LEAF_NUMCHUNKS(l));
+		ASSERT3U(zle->zle_chunk, <, ZAP_LEAF_NUMCHUNKS(l));
 		ASSERT3U(le->le_type, ==, ZAP_CHUNK_ENTRY);
+		ASSERT3U(le->le_hash, ==, zle->zle_hash);
+		ASSERT3U(le->le_cd, ==, zle->zle_cd);
 
-		if (le->le_hash != zn->zn_hash)
-			continue;
-
-		/*
-		 * NB: the entry chain is always sorted by cd on
-		 * normalized zap objects, so this will find the
-		 * lowest-cd match for MT_FIRST.
-		 */
-		ASSERT(zn->zn_matchtype == MT_EXACT ||
-		    (l->l_phys->l_hdr.lh_flags & ZLF_ENTRIES_CDSORTED));
 		if (zap_leaf_array_match(l, zn, le->le_name_chunk,
 		    le->le_name_numints)) {
-			zeh->zeh_num_integers = le->le_value_numints;
-			zeh->zeh_integer_size = le->le_value_intlen;
-			zeh->zeh_cd = le->le_cd;
-			zeh->zeh_hash = le->le_hash;
-			zeh->zeh_chunkp = chunkp;
-			zeh->zeh_leaf = l;
+			zap_leaf_entry_handle(l, zle->zle_chunk, zeh);
 			return (0);
 		}
 	}
@@ -437,50 +598,22 @@ again:
 	return (ENOENT);
 }
 
-/* Return (h1,cd1 >= h2,cd2) */
-#define	HCD_GTEQ(h1, cd1, h2, cd2) \
-	((h1 > h2) ? TRUE : ((h1 == h2 && cd1 >= cd2) ? TRUE : FALSE))
-
 int
 zap_leaf_lookup_closest(zap_leaf_t *l,
     uint64_t h, uint32_t cd, zap_entry_handle_t *zeh)
 {
-	uint16_t chunk;
-	uint64_t besth = -1ULL;
-	uint32_t bestcd = -1U;
-	uint16_t bestlh = ZAP_LEAF_HASH_NUMENTRIES(l)-1;
-	uint16_t lh;
-	struct zap_leaf_entry *le;
+	int i;
 
 	ASSERT3U(l->l_phys->l_hdr.lh_magic, ==, ZAP_LEAF_MAGIC);
 
-	for (lh = LEAF_HASH(l, h); lh <= bestlh; lh++) {
-		for (chunk = l->l_phys->l_hash[lh];
-		    chunk != CHAIN_END; chunk = le->le_next) {
-			le = ZAP_LEAF_ENTRY(l, chunk);
-
-			ASSERT3U(chunk, <, ZAP_LEAF_NUMCHUNKS(l));
-			ASSERT3U(le->le_type, ==, ZAP_CHUNK_ENTRY);
-
-			if (HCD_GTEQ(le->le_hash, le->le_cd, h, cd) &&
-			    HCD_GTEQ(besth, bestcd, le->le_hash, le->le_cd)) {
-				ASSERT3U(bestlh, >=, lh);
-				bestlh = lh;
-				besth = le->le_hash;
-				bestcd = le->le_cd;
-
-				zeh->zeh_num_integers = le->le_value_numints;
-				zeh->zeh_integer_size = le->le_value_intlen;
-				zeh->zeh_cd = le->le_cd;
-				zeh->zeh_hash = le->le_hash;
-				zeh->zeh_fakechunk = chunk;
-				zeh->zeh_chunkp = &zeh->zeh_fakechunk;
-				zeh->zeh_leaf = l;
-			}
-		}
-	}
+	i = zap_leaf_index_lower_bound(l, h, cd);
+	if (i == l->l_nents)
+		return (ENOENT);
 
-	return (bestcd == -1U ? ENOENT : 0);
+	ASSERT3U(ZAP_LEAF_ENTRY(l, l->l_ents[i].zle_chunk)->le_type, ==,
+	    ZAP_CHUNK_ENTRY);
+	zap_leaf_entry_handle(l, l->l_ents[i].zle_chunk, zeh);
+	return (0);
 }
 
 int
@@ -550,19 +683,25 @@ void
 zap_entry_remove(zap_entry_handle_t *zeh)
 {
 	uint16_t entry_chunk;
+	uint16_t *chunkp;
 	struct zap_leaf_entry *le;
 	zap_leaf_t *l = zeh->zeh_leaf;
 
-	ASSERT3P(zeh->zeh_chunkp, !=, &zeh->zeh_fakechunk);
-
 	entry_chunk = *zeh->zeh_chunkp;
 	le = ZAP_LEAF_ENTRY(l, entry_chunk);
 	ASSERT3U(le->le_type, ==, ZAP_CHUNK_ENTRY);
 
+	/* lookups hand out a copy of the chunk; find its hash chain link */
+	for (chunkp = LEAF_HASH_ENTPTR(l, le->le_hash);
+	    *chunkp != entry_chunk;
+	    chunkp = &ZAP_LEAF_ENTRY(l, *chunkp)->le_next)
+		ASSERT3U(*chunkp, !=, CHAIN_END);
+
+	zap_leaf_index_remove(l, le->le_hash, le->le_cd);
 	zap_leaf_array_free(l, &le->le_name_chunk);
 	zap_leaf_array_free(l, &le->le_value_chunk);
 
-	*zeh->zeh_chunkp = le->le_next;
+	*chunkp = le->le_next;
 	zap_leaf_chunk_free(l, entry_chunk);
 
 	l->l_phys->l_hdr.lh_nentries--;
@@ -645,6 +784,7 @@ zap_entry_create(zap_leaf_t *l, zap_name_t *zn, uint32_t cd,
 	/* link it into the hash chain */
 	/* XXX if we did the search above, we could just use that */
 	chunkp = zap_leaf_rehash_entry(l, chunk);
+	zap_leaf_index_insert(l, h, cd, chunk);
 
 	l->l_phys->l_hdr.lh_nentries++;
 
@@ -824,6 +964,9 @@ zap_leaf_split(zap_leaf_t *l, zap_leaf_t *nl, boolean_t sort)
 		else
 			(void) zap_leaf_rehash_entry(l, i);
 	}
+
+	zap_leaf_index_build(l);
+	zap_leaf_index_build(nl);
 }
 
 void
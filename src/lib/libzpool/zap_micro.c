@@ -36,6 +36,7 @@
 
 #ifdef _KERNEL
 #include <sys/sunddi.h>
+#include <util/qsort.h>
 #endif
 
 static int mzap_upgrade(zap_t **zapp, dmu_tx_t *tx, zap_flags_t flags);
@@ -169,33 +170,39 @@ zap_name_free(zap_name_t *zn)
 	kmem_free(zn, sizeof (zap_name_t));
 }
 
-zap_name_t *
-zap_name_alloc(zap_t *zap, const char *key, matchtype_t mt)
+static int
+zap_name_init_str(zap_name_t *zn, zap_t *zap, const char *key, matchtype_t mt)
 {
-	zap_name_t *zn = kmem_alloc(sizeof (zap_name_t), KM_SLEEP);
-
 	zn->zn_zap = zap;
 	zn->zn_key_intlen = sizeof (*key);
 	zn->zn_key_orig = key;
 	zn->zn_key_orig_numints = strlen(zn->zn_key_orig) + 1;
 	zn->zn_matchtype = mt;
 	if (zap->zap_normflags) {
-		if (zap_normalize(zap, key, zn->zn_normbuf) != 0) {
-			zap_name_free(zn);
-			return (NULL);
-		}
+		if (zap_normalize(zap, key, zn->zn_normbuf) != 0)
+			return (ENOTSUP);
 		zn->zn_key_norm = zn->zn_normbuf;
 		zn->zn_key_norm_numints = strlen(zn->zn_key_norm) + 1;
 	} else {
-		if (mt != MT_EXACT) {
-			zap_name_free(zn);
-			return (NULL);
-		}
+		if (mt != MT_EXACT)
+			return (ENOTSUP);
 		zn->zn_key_norm = zn->zn_key_orig;
 		zn->zn_key_norm_numints = zn->zn_key_orig_numints;
 	}
 
 	zn->zn_hash = zap_hash(zn);
+	return (0);
+}
+
+zap_name_t *
+zap_name_alloc(zap_t *zap, const char *key, matchtype_t mt)
+{
+	zap_name_t *zn = kmem_alloc(sizeof (zap_name_t), KM_SLEEP);
+
+	if (zap_name_init_str(zn, zap, key, mt) != 0) {
+		zap_name_free(zn);
+		return (NULL);
+	}
 	return (zn);
 }
 
@@ -263,44 +270,129 @@ mze_compare(const void *arg1, const void *arg2)
 	return (0);
 }
 
+#define	MZE_BUCKET(zap, hash) \
+	((hash) >> (64 - (zap)->zap_m.zap_bucket_bits))
+
+/*
+ * Return the index of the first entry at or after (hash, cd).  Entries of
+ * later buckets all sort after it, so only hash's own bucket is scanned.
+ */
+static int
+mze_lower_bound(zap_t *zap, uint64_t hash, uint32_t cd)
+{
+	const mzap_ent_t *ents = zap->zap_m.zap_ents;
+	uint64_t b = MZE_BUCKET(zap, hash);
+	int i = zap->zap_m.zap_buckets[b];
+	int end = zap->zap_m.zap_buckets[b + 1];
+
+	while (i < end && (ents[i].mze_hash < hash ||
+	    (ents[i].mze_hash == hash && ents[i].mze_cd < cd)))
+		i++;
+	return (i);
+}
+
+static void
+mze_rebuild_buckets(zap_t *zap)
+{
+	const mzap_ent_t *ents = zap->zap_m.zap_ents;
+	int nbuckets = 1 << zap->zap_m.zap_bucket_bits;
+	int n = zap->zap_m.zap_num_entries;
+	int i = 0;
+
+	for (int b = 0; b <= nbuckets; b++) {
+		while (i < n && MZE_BUCKET(zap, ents[i].mze_hash) < b)
+			i++;
+		zap->zap_m.zap_buckets[b] = i;
+	}
+}
+
+static void
+mze_destroy(zap_t *zap)
+{
+	if (zap->zap_m.zap_ents != NULL) {
+		kmem_free(zap->zap_m.zap_ents,
+		    zap->zap_m.zap_ents_max * sizeof (mzap_ent_t));
+		kmem_free(zap->zap_m.zap_buckets,
+		    ((1 << zap->zap_m.zap_bucket_bits) + 1) *
+		    sizeof (uint16_t));
+		zap->zap_m.zap_ents = NULL;
+		zap->zap_m.zap_buckets = NULL;
+	}
+}
+
+/*
+ * Size the index for max entries, keeping the current ones.  There is
+ * about one bucket per possible entry.
+ */
+static void
+mze_resize(zap_t *zap, int max)
+{
+	mzap_ent_t *ents = kmem_alloc(max * sizeof (mzap_ent_t), KM_SLEEP);
+	int bits = highbit(max);
+
+	ASSERT3S(max, >=, zap->zap_m.zap_num_entries);
+
+	if (zap->zap_m.zap_ents != NULL) {
+		bcopy(zap->zap_m.zap_ents, ents,
+		    zap->zap_m.zap_num_entries * sizeof (mzap_ent_t));
+		mze_destroy(zap);
+	}
+	zap->zap_m.zap_ents = ents;
+	zap->zap_m.zap_ents_max = max;
+	zap->zap_m.zap_bucket_bits = bits;
+	zap->zap_m.zap_buckets = kmem_alloc(((1 << bits) + 1) *
+	    sizeof (uint16_t), KM_SLEEP);
+	mze_rebuild_buckets(zap);
+}
+
 static void
 mze_insert(zap_t *zap, int chunkid, uint64_t hash)
 {
 	mzap_ent_t *mze;
+	uint32_t cd = zap->zap_m.zap_phys->mz_chunk[chunkid].mze_cd;
+	int n = zap->zap_m.zap_num_entries;
+	int nbuckets, i;
 
 	ASSERT(zap->zap_ismicro);
 	ASSERT(RW_WRITE_HELD(&zap->zap_rwlock));
+	ASSERT(zap->zap_m.zap_phys->mz_chunk[chunkid].mze_name[0] != 0);
 
-	mze = kmem_alloc(sizeof (mzap_ent_t), KM_SLEEP);
-	mze->mze_chunkid = chunkid;
+	/* the block has grown since the index was sized */
+	if (n == zap->zap_m.zap_ents_max)
+		mze_resize(zap, zap->zap_m.zap_num_chunks);
+
+	i = mze_lower_bound(zap, hash, cd);
+	mze = &zap->zap_m.zap_ents[i];
+	ASSERT(i == n || mze->mze_hash != hash || mze->mze_cd != cd);
+	ovbcopy(mze, mze + 1, (n - i) * sizeof (mzap_ent_t));
 	mze->mze_hash = hash;
-	mze->mze_cd = MZE_PHYS(zap, mze)->mze_cd;
-	ASSERT(MZE_PHYS(zap, mze)->mze_name[0] != 0);
-	avl_add(&zap->zap_m.zap_avl, mze);
+	mze->mze_cd = cd;
+	mze->mze_chunkid = chunkid;
+	mze->mze_pad = 0;
+
+	nbuckets = 1 << zap->zap_m.zap_bucket_bits;
+	for (int b = MZE_BUCKET(zap, hash) + 1; b <= nbuckets; b++)
+		zap->zap_m.zap_buckets[b]++;
+	zap->zap_m.zap_num_entries++;
 }
 
 static mzap_ent_t *
 mze_find(zap_name_t *zn)
 {
-	mzap_ent_t mze_tofind;
-	mzap_ent_t *mze;
-	avl_index_t idx;
-	avl_tree_t *avl = &zn->zn_zap->zap_m.zap_avl;
-
-	ASSERT(zn->zn_zap->zap_ismicro);
-	ASSERT(RW_LOCK_HELD(&zn->zn_zap->zap_rwlock));
+	zap_t *zap = zn->zn_zap;
+	mzap_ent_t *ents = zap->zap_m.zap_ents;
+	int n = zap->zap_m.zap_num_entries;
+	int i;
 
-	mze_tofind.mze_hash = zn->zn_hash;
-	mze_tofind.mze_cd = 0;
+	ASSERT(zap->zap_ismicro);
+	ASSERT(RW_LOCK_HELD(&zap->zap_rwlock));
 
 again:
-	mze = avl_find(avl, &mze_tofind, &idx);
-	if (mze == NULL)
-		mze = avl_nearest(avl, idx, AVL_AFTER);
-	for (; mze && mze->mze_hash == zn->zn_hash; mze = AVL_NEXT(avl, mze)) {
-		ASSERT3U(mze->mze_cd, ==, MZE_PHYS(zn->zn_zap, mze)->mze_cd);
-		if (zap_match(zn, MZE_PHYS(zn->zn_zap, mze)->mze_name))
-			return (mze);
+	for (i = mze_lower_bound(zap, zn->zn_hash, 0);
+	    i < n && ents[i].mze_hash == zn->zn_hash; i++) {
+		ASSERT3U(ents[i].mze_cd, ==, MZE_PHYS(zap, &ents[i])->mze_cd);
+		if (zap_match(zn, MZE_PHYS(zap, &ents[i])->mze_name))
+			return (&ents[i]);
 	}
 	if (zn->zn_matchtype == MT_BEST) {
 		zn->zn_matchtype = MT_FIRST;
@@ -312,22 +404,18 @@ again:
 static uint32_t
 mze_find_unused_cd(zap_t *zap, uint64_t hash)
 {
-	mzap_ent_t mze_tofind;
-	mzap_ent_t *mze;
-	avl_index_t idx;
-	avl_tree_t *avl = &zap->zap_m.zap_avl;
+	mzap_ent_t *ents = zap->zap_m.zap_ents;
+	int n = zap->zap_m.zap_num_entries;
 	uint32_t cd;
+	int i;
 
 	ASSERT(zap->zap_ismicro);
 	ASSERT(RW_LOCK_HELD(&zap->zap_rwlock));
 
-	mze_tofind.mze_hash = hash;
-	mze_tofind.mze_cd = 0;
-
 	cd = 0;
-	for (mze = avl_find(avl, &mze_tofind, &idx);
-	    mze && mze->mze_hash == hash; mze = AVL_NEXT(avl, mze)) {
-		if (mze->mze_cd != cd)
+	for (i = mze_lower_bound(zap, hash, 0);
+	    i < n && ents[i].mze_hash == hash; i++) {
+		if (ents[i].mze_cd != cd)
 			break;
 		cd++;
 	}
@@ -338,22 +426,53 @@ mze_find_unused_cd(zap_t *zap, uint64_t hash)
 static void
 mze_remove(zap_t *zap, mzap_ent_t *mze)
 {
+	int i = mze - zap->zap_m.zap_ents;
+	int n = zap->zap_m.zap_num_entries;
+	int nbuckets = 1 << zap->zap_m.zap_bucket_bits;
+
 	ASSERT(zap->zap_ismicro);
 	ASSERT(RW_WRITE_HELD(&zap->zap_rwlock));
+	ASSERT(i >= 0 && i < n);
 
-	avl_remove(&zap->zap_m.zap_avl, mze);
-	kmem_free(mze, sizeof (mzap_ent_t));
+	for (int b = MZE_BUCKET(zap, mze->mze_hash) + 1; b <= nbuckets; b++)
+		zap->zap_m.zap_buckets[b]--;
+	ovbcopy(mze + 1, mze, (n - i - 1) * sizeof (mzap_ent_t));
+	zap->zap_m.zap_num_entries--;
 }
 
+/*
+ * Build the index of a microzap being opened: one zap_name_t to hash all
+ * the names, then a single sort.
+ */
 static void
-mze_destroy(zap_t *zap)
+mze_load(zap_t *zap)
 {
-	mzap_ent_t *mze;
-	void *avlcookie = NULL;
+	mzap_ent_t *ents;
+	zap_name_t *zn;
+	int i, n = 0;
+
+	mze_resize(zap, zap->zap_m.zap_num_chunks);
+	ents = zap->zap_m.zap_ents;
+	zn = kmem_alloc(sizeof (zap_name_t), KM_SLEEP);
+
+	for (i = 0; i < zap->zap_m.zap_num_chunks; i++) {
+		mzap_ent_phys_t *mzep = &zap->zap_m.zap_phys->mz_chunk[i];
 
-	while (mze = avl_destroy_nodes(&zap->zap_m.zap_avl, &avlcookie))
-		kmem_free(mze, sizeof (mzap_ent_t));
-	avl_destroy(&zap->zap_m.zap_avl);
+		if (mzep->mze_name[0] == 0)
+			continue;
+		VERIFY(zap_name_init_str(zn, zap, mzep->mze_name,
+		    MT_EXACT) == 0);
+		ents[n].mze_hash = zn->zn_hash;
+		ents[n].mze_cd = mzep->mze_cd;
+		ents[n].mze_chunkid = i;
+		ents[n].mze_pad = 0;
+		n++;
+	}
+	zap_name_free(zn);
+
+	qsort(ents, n, sizeof (mzap_ent_t), mze_compare);
+	zap->zap_m.zap_num_entries = n;
+	mze_rebuild_buckets(zap);
 }
 
 static zap_t *
@@ -361,7 +480,6 @@ mzap_open(objset_t *os, uint64_t obj, dmu_buf_t *db)
 {
 	zap_t *winner;
 	zap_t *zap;
-	int i;
 
 	ASSERT3U(MZAP_ENT_LEN, ==, sizeof (mzap_ent_phys_t));
 
@@ -399,22 +517,7 @@ mzap_open(objset_t *os, uint64_t obj, dmu_buf_t *db)
 		zap->zap_salt = zap->zap_m.zap_phys->mz_salt;
 		zap->zap_normflags = zap->zap_m.zap_phys->mz_normflags;
 		zap->zap_m.zap_num_chunks = db->db_size / MZAP_ENT_LEN - 1;
-		avl_create(&zap->zap_m.zap_avl, mze_compare,
-		    sizeof (mzap_ent_t), offsetof(mzap_ent_t, mze_node));
-
-		for (i = 0; i < zap->zap_m.zap_num_chunks; i++) {
-			mzap_ent_phys_t *mze =
-			    &zap->zap_m.zap_phys->mz_chunk[i];
-			if (mze->mze_name[0]) {
-				zap_name_t *zn;
-
-				zap->zap_m.zap_num_entries++;
-				zn = zap_name_alloc(zap, mze->mze_name,
-				    MT_EXACT);
-				mze_insert(zap, i, zn->zn_hash);
-				zap_name_free(zn);
-			}
-		}
+		mze_load(zap);
 	} else {
 		zap->zap_salt = zap->zap_f.zap_phys->zap_salt;
 		zap->zap_normflags = zap->zap_f.zap_phys->zap_normflags;
@@ -548,7 +651,7 @@ mzap_upgrade(zap_t **zapp, dmu_tx_t *tx, zap_flags_t flags)
 
 	dprintf("upgrading obj=%"PRIu64" with %u chunks\n",
 	    zap->zap_object, nchunks);
-	/* XXX destroy the avl later, so we can use the stored hash value */
+	/* XXX destroy the index later, so we can use the stored hash value */
 	mze_destroy(zap);
 
 	fzap_upgrade(zap, tx, flags);
@@ -717,17 +820,19 @@ zap_count(objset_t *os, uint64_t zapobj, uint64_t *count)
 static boolean_t
 mzap_normalization_conflict(zap_t *zap, zap_name_t *zn, mzap_ent_t *mze)
 {
+	mzap_ent_t *first = zap->zap_m.zap_ents;
+	mzap_ent_t *end = first + zap->zap_m.zap_num_entries;
 	mzap_ent_t *other;
-	int direction = AVL_BEFORE;
+	int direction = -1;
 	boolean_t allocdzn = B_FALSE;
 
 	if (zap->zap_normflags == 0)
 		return (B_FALSE);
 
 again:
-	for (other = avl_walk(&zap->zap_m.zap_avl, mze, direction);
-	    other && other->mze_hash == mze->mze_hash;
-	    other = avl_walk(&zap->zap_m.zap_avl, other, direction)) {
+	for (other = mze + direction;
+	    other >= first && other < end && other->mze_hash == mze->mze_hash;
+	    other += direction) {
 
 		if (zn == NULL) {
 			zn = zap_name_alloc(zap, MZE_PHYS(zap, mze)->mze_name,
@@ -741,8 +846,8 @@ again:
 		}
 	}
 
-	if (direction == AVL_BEFORE) {
-		direction = AVL_AFTER;
+	if (direction == -1) {
+		direction = 1;
 		goto again;
 	}
 
@@ -836,6 +941,29 @@ zap_lookup_uint64(objset_t *os, uint64_t zapobj, const uint64_t *key,
 	return (err);
 }
 
+int
+zap_prefetch_uint64(objset_t *os, uint64_t zapobj, const uint64_t *key,
+    int key_numints)
+{
+	zap_t *zap;
+	int err;
+	zap_name_t *zn;
+
+	err = zap_lockdir(os, zapobj, NULL, RW_READER, TRUE, FALSE, &zap);
+	if (err)
+		return (err);
+	zn = zap_name_alloc_uint64(zap, key, key_numints);
+	if (zn == NULL) {
+		zap_unlockdir(zap);
+		return (ENOTSUP);
+	}
+
+	fzap_prefetch(zn);
+	zap_name_free(zn);
+	zap_unlockdir(zap);
+	return (err);
+}
+
 int
 zap_contains(objset_t *os, uint64_t zapobj, const char *name)
 {
@@ -931,7 +1059,6 @@ again:
 			mze->mze_value = value;
 			mze->mze_cd = cd;
 			(void) strcpy(mze->mze_name, zn->zn_key_orig);
-			zap->zap_m.zap_num_entries++;
 			zap->zap_m.zap_alloc_next = i+1;
 			if (zap->zap_m.zap_alloc_next ==
 			    zap->zap_m.zap_num_chunks)
@@ -1127,7 +1254,6 @@ zap_remove_norm(objset_t *os, uint64_t zapobj, const char *name,
 		if (mze == NULL) {
 			err = ENOENT;
 		} else {
-			zap->zap_m.zap_num_entries--;
 			bzero(&zap->zap_m.zap_phys->mz_chunk[mze->mze_chunkid],
 			    sizeof (mzap_ent_phys_t));
 			mze_remove(zap, mze);
@@ -1175,6 +1301,7 @@ zap_cursor_init_serialized(zap_cursor_t *zc, objset_t *os, uint64_t zapobj,
 	zc->zc_serialized = serialized;
 	zc->zc_hash = 0;
 	zc->zc_cd = 0;
+	zc->zc_prefetch = 0;
 }
 
 void
@@ -1225,9 +1352,8 @@ int
 zap_cursor_retrieve(zap_cursor_t *zc, zap_attribute_t *za)
 {
 	int err;
-	avl_index_t idx;
-	mzap_ent_t mze_tofind;
 	mzap_ent_t *mze;
+	int i;
 
 	if (zc->zc_hash == -1ULL)
 		return (ENOENT);
@@ -1258,16 +1384,12 @@ zap_cursor_retrieve(zap_cursor_t *zc, zap_attribute_t *za)
 	} else {
 		err = ENOENT;
 
-		mze_tofind.mze_hash = zc->zc_hash;
-		mze_tofind.mze_cd = zc->zc_cd;
+		i = mze_lower_bound(zc->zc_zap, zc->zc_hash, zc->zc_cd);
+		if (i < zc->zc_zap->zap_m.zap_num_entries) {
+			mzap_ent_phys_t *mzep;
 
-		mze = avl_find(&zc->zc_zap->zap_m.zap_avl, &mze_tofind, &idx);
-		if (mze == NULL) {
-			mze = avl_nearest(&zc->zc_zap->zap_m.zap_avl,
-			    idx, AVL_AFTER);
-		}
-		if (mze) {
-			mzap_ent_phys_t *mzep = MZE_PHYS(zc->zc_zap, mze);
+			mze = &zc->zc_zap->zap_m.zap_ents[i];
+			mzep = MZE_PHYS(zc->zc_zap, mze);
 			ASSERT3U(mze->mze_cd, ==, mzep->mze_cd);
 			za->za_normalization_conflict =
 			    mzap_normalization_conflict(zc->zc_zap, NULL, mze);
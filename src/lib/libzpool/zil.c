@@ -79,6 +79,42 @@ boolean_t zfs_trim_enabled = B_TRUE;
 
 static kmem_cache_t *zil_lwb_cache;
 
+/*
+ * zil_commit() statistics.  commit_writer counts the commits that wrote
+ * log blocks themselves instead of finding another writer had already
+ * pushed their records; itx_count and itx_bytes are the records written
+ * to log blocks.  The commit_* counters are a latency histogram.
+ */
+typedef struct zil_stats {
+	kstat_named_t zil_commit_count;
+	kstat_named_t zil_commit_writer_count;
+	kstat_named_t zil_itx_count;
+	kstat_named_t zil_itx_bytes;
+	kstat_named_t zil_commit_lt_100us;
+	kstat_named_t zil_commit_lt_1ms;
+	kstat_named_t zil_commit_lt_10ms;
+	kstat_named_t zil_commit_lt_100ms;
+	kstat_named_t zil_commit_ge_100ms;
+} zil_stats_t;
+
+static zil_stats_t zil_stats = {
+	{ "commit_count",	KSTAT_DATA_UINT64 },
+	{ "commit_writer_count", KSTAT_DATA_UINT64 },
+	{ "itx_count",		KSTAT_DATA_UINT64 },
+	{ "itx_bytes",		KSTAT_DATA_UINT64 },
+	{ "commit_lt_100us",	KSTAT_DATA_UINT64 },
+	{ "commit_lt_1ms",	KSTAT_DATA_UINT64 },
+	{ "commit_lt_10ms",	KSTAT_DATA_UINT64 },
+	{ "commit_lt_100ms",	KSTAT_DATA_UINT64 },
+	{ "commit_ge_100ms",	KSTAT_DATA_UINT64 },
+};
+
+#define	ZIL_STAT_INCR(stat, val) \
+	atomic_add_64(&zil_stats.stat.value.ui64, (val))
+#define	ZIL_STAT_BUMP(stat)	ZIL_STAT_INCR(stat, 1)
+
+static kstat_t *zil_ksp;
+
 static boolean_t zil_empty(zilog_t *zilog);
 
 #define	LWB_EMPTY(lwb) ((BP_GET_LSIZE(&lwb->lwb_blk) - \
@@ -232,6 +268,24 @@ zil_read_log_block(zilog_t *zilog, const blkptr_t *bp, blkptr_t *nbp, void *dst,
 	return (error);
 }
 
+/*
+ * Start reading the next log block of the chain into the ARC, so that it
+ * is there by the time the records of the current one have been parsed.
+ */
+static void
+zil_prefetch_log_block(zilog_t *zilog, const blkptr_t *bp)
+{
+	uint32_t aflags = ARC_NOWAIT | ARC_PREFETCH;
+	zbookmark_t zb;
+
+	SET_BOOKMARK(&zb, bp->blk_cksum.zc_word[ZIL_ZC_OBJSET],
+	    ZB_ZIL_OBJECT, ZB_ZIL_LEVEL, bp->blk_cksum.zc_word[ZIL_ZC_SEQ]);
+
+	(void) dsl_read_nolock(NULL, zilog->zl_spa, bp, NULL, NULL,
+	    ZIO_PRIORITY_ASYNC_READ, ZIO_FLAG_CANFAIL | ZIO_FLAG_SPECULATIVE,
+	    &aflags, &zb);
+}
+
 /*
  * Read a TX_WRITE log data block.
  */
@@ -326,6 +380,10 @@ zil_parse(zilog_t *zilog, zil_parse_blk_func_t *parse_blk_func,
 		if (error)
 			break;
 
+		if (!BP_IS_HOLE(&next_blk) &&
+		    next_blk.blk_cksum.zc_word[ZIL_ZC_SEQ] <= claim_blk_seq)
+			zil_prefetch_log_block(zilog, &next_blk);
+
 		for (lrp = lrbuf; lrp < end; lrp += reclen) {
 			lr_t *lr = (lr_t *)lrp;
 			reclen = lr->lrc_reclen;
@@ -430,6 +488,9 @@ zil_alloc_lwb(zilog_t *zilog, blkptr_t *bp, uint64_t txg)
 	lwb->lwb_max_txg = txg;
 	lwb->lwb_zio = NULL;
 	lwb->lwb_tx = NULL;
+	lwb->lwb_issue_seq = 0;
+	lwb->lwb_lr_seq = 0;
+	lwb->lwb_error = 0;
 	if (BP_GET_CHECKSUM(bp) == ZIO_CHECKSUM_ZILOG2) {
 		lwb->lwb_nused = sizeof (zil_chain_t);
 		lwb->lwb_sz = BP_GET_LSIZE(bp);
@@ -673,6 +734,20 @@ zil_vdev_compare(const void *x1, const void *x2)
 	return (0);
 }
 
+static int
+zil_itx_obj_compare(const void *x1, const void *x2)
+{
+	uint64_t o1 = ((itx_obj_t *)x1)->io_foid;
+	uint64_t o2 = ((itx_obj_t *)x2)->io_foid;
+
+	if (o1 < o2)
+		return (-1);
+	if (o1 > o2)
+		return (1);
+
+	return (0);
+}
+
 void
 zil_add_block(zilog_t *zilog, const blkptr_t *bp)
 {
@@ -685,12 +760,9 @@ zil_add_block(zilog_t *zilog, const blkptr_t *bp)
 	if (zfs_nocacheflush)
 		return;
 
-	ASSERT(zilog->zl_writer);
-
 	/*
-	 * Even though we're zl_writer, we still need a lock because the
-	 * zl_get_data() callbacks may have dmu_sync() done callbacks
-	 * that will run concurrently.
+	 * Log block and dmu_sync() write completions add blocks
+	 * concurrently, and zil_flush_vdevs() takes the tree away.
 	 */
 	mutex_enter(&zilog->zl_vdev_lock);
 	for (i = 0; i < ndvas; i++) {
@@ -708,25 +780,31 @@ void
 zil_flush_vdevs(zilog_t *zilog)
 {
 	spa_t *spa = zilog->zl_spa;
-	avl_tree_t *t = &zilog->zl_vdev_tree;
+	avl_tree_t t;
 	void *cookie = NULL;
 	zil_vdev_node_t *zv;
 	zio_t *zio;
 
-	ASSERT(zilog->zl_writer);
-
 	/*
-	 * We don't need zl_vdev_lock here because we're the zl_writer,
-	 * and all zl_get_data() callbacks are done.
+	 * Take the vdevs written so far and leave an empty tree for the
+	 * writes still in flight, so the flushes can be issued and waited
+	 * for without holding up their completion.
 	 */
-	if (avl_numnodes(t) == 0)
+	mutex_enter(&zilog->zl_vdev_lock);
+	if (avl_numnodes(&zilog->zl_vdev_tree) == 0) {
+		mutex_exit(&zilog->zl_vdev_lock);
 		return;
+	}
+	t = zilog->zl_vdev_tree;
+	avl_create(&zilog->zl_vdev_tree, zil_vdev_compare,
+	    sizeof (zil_vdev_node_t), offsetof(zil_vdev_node_t, zv_node));
+	mutex_exit(&zilog->zl_vdev_lock);
 
 	spa_config_enter(spa, SCL_STATE, FTAG, RW_READER);
 
 	zio = zio_root(spa, NULL, NULL, ZIO_FLAG_CANFAIL);
 
-	while ((zv = avl_destroy_nodes(t, &cookie)) != NULL) {
+	while ((zv = avl_destroy_nodes(&t, &cookie)) != NULL) {
 		vdev_t *vd = vdev_lookup_top(spa, zv->zv_vdev);
 		if (vd != NULL)
 			zio_flush(zio, vd);
@@ -738,6 +816,7 @@ zil_flush_vdevs(zilog_t *zilog)
 	 * support the DKIOCFLUSHWRITECACHE ioctl, so it's OK if it fails.
 	 */
 	(void) zio_wait(zio);
+	avl_destroy(&t);
 
 	spa_config_exit(spa, SCL_STATE, FTAG);
 }
@@ -751,6 +830,7 @@ zil_lwb_write_done(zio_t *zio)
 	lwb_t *lwb = zio->io_private;
 	zilog_t *zilog = lwb->lwb_zilog;
 	dmu_tx_t *tx = lwb->lwb_tx;
+	spa_t *spa = zilog->zl_spa;
 
 	ASSERT(BP_GET_COMPRESS(zio->io_bp) == ZIO_COMPRESS_OFF);
 	ASSERT(BP_GET_TYPE(zio->io_bp) == DMU_OT_INTENT_LOG);
@@ -772,6 +852,40 @@ zil_lwb_write_done(zio_t *zio)
 	mutex_enter(&zilog->zl_lock);
 	lwb->lwb_buf = NULL;
 	lwb->lwb_tx = NULL;
+	lwb->lwb_error = zio->io_error;
+
+	/* Record the block for later vdev flushing */
+	if (zio->io_error == 0)
+		zil_add_block(zilog, &lwb->lwb_blk);
+
+	/*
+	 * Log blocks may complete in any order, but a block is no use
+	 * until every block before it in the chain is written too.  So
+	 * advance zl_lwb_done_seq over the written blocks in issue order
+	 * and wake up the zil_commit()s waiting for them.
+	 */
+	if (lwb->lwb_issue_seq == zilog->zl_lwb_done_seq + 1) {
+		for (; lwb != NULL && lwb->lwb_issue_seq != 0 &&
+		    lwb->lwb_buf == NULL;
+		    lwb = list_next(&zilog->zl_lwb_list, lwb)) {
+			zilog->zl_lwb_done_seq = lwb->lwb_issue_seq;
+			if (lwb->lwb_error != 0) {
+				/*
+				 * Every block issued so far, up to and
+				 * past this one, has its records and its
+				 * lwb_tx in the open txg or earlier.
+				 */
+				zilog->zl_lwb_failed_txg = MAX(
+				    zilog->zl_lwb_failed_txg,
+				    zilog->zl_dmu_pool->dp_tx.tx_open_txg);
+			} else if (zilog->zl_lwb_failed_txg <=
+			    spa_last_synced_txg(spa)) {
+				/* ztest checks the chain reaches this */
+				zilog->zl_commit_lr_seq = lwb->lwb_lr_seq;
+			}
+		}
+		cv_broadcast(&zilog->zl_cv_lwb);
+	}
 	mutex_exit(&zilog->zl_lock);
 
 	/*
@@ -794,12 +908,8 @@ zil_lwb_write_init(zilog_t *zilog, lwb_t *lwb)
 	    ZB_ZIL_OBJECT, ZB_ZIL_LEVEL,
 	    lwb->lwb_blk.blk_cksum.zc_word[ZIL_ZC_SEQ]);
 
-	if (zilog->zl_root_zio == NULL) {
-		zilog->zl_root_zio = zio_root(zilog->zl_spa, NULL, NULL,
-		    ZIO_FLAG_CANFAIL);
-	}
 	if (lwb->lwb_zio == NULL) {
-		lwb->lwb_zio = zio_rewrite(zilog->zl_root_zio, zilog->zl_spa,
+		lwb->lwb_zio = zio_rewrite(NULL, zilog->zl_spa,
 		    0, &lwb->lwb_blk, lwb->lwb_buf, BP_GET_LSIZE(&lwb->lwb_blk),
 		    zil_lwb_write_done, lwb, ZIO_PRIORITY_LOG_WRITE,
 		    ZIO_FLAG_CANFAIL | ZIO_FLAG_DONT_PROPAGATE, &zb);
@@ -831,7 +941,8 @@ uint64_t zil_slog_limit = 1024 * 1024;
 
 /*
  * Start a log block write and advance to the next log block.
- * Calls are serialized.
+ * Calls are serialized by zl_writer, but the writes they start are not
+ * waited for here: zil_commit_wait() does that.
  */
 static lwb_t *
 zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
@@ -863,8 +974,11 @@ zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
 	 * Therefore, we don't do dmu_tx_commit() until zil_lwb_write_done().
 	 * We dirty the dataset to ensure that zil_sync() will be called
 	 * to clean up in the event of allocation failure or I/O failure.
+	 * The tx dirties next to nothing and a zil_commit() is waiting on
+	 * it, so don't make it pay for other writers' dirty data.
 	 */
 	tx = dmu_tx_create(zilog->zl_os);
+	tx->tx_flags |= TX_NOTHROTTLE;
 	VERIFY(dmu_tx_assign(tx, TXG_WAIT) == 0);
 	dsl_dataset_dirty(dmu_objset_ds(zilog->zl_os), tx);
 	txg = dmu_tx_get_txg(tx);
@@ -873,30 +987,30 @@ zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
 
 	/*
 	 * Log blocks are pre-allocated. Here we select the size of the next
-	 * block, based on size used in the last block.
-	 * - first find the smallest bucket that will fit the block from a
-	 *   limited set of block sizes. This is because it's faster to write
+	 * block, based on the size of recent commits.
+	 * - first find the maximum of what the current commit used so far
+	 *   and the sizes of the last ZIL_PREV_BLKS commits (see
+	 *   zil_commit_writer()). The next block will most likely be filled
+	 *   by the next commit, and looking back over several lessens a
+	 *   picket fence effect of wrongly guessing the size if we have a
+	 *   stream of say 2k, 64k, 2k, 64k commits.
+	 * - then find the smallest bucket that will fit it from a limited
+	 *   set of block sizes. This is because it's faster to write
 	 *   blocks allocated from the same metaslab as they are adjacent or
 	 *   close.
-	 * - next find the maximum from the new suggested size and an array of
-	 *   previous sizes. This lessens a picket fence effect of wrongly
-	 *   guesssing the size if we have a stream of say 2k, 64k, 2k, 64k
-	 *   requests.
 	 *
 	 * Note we only write what is used, but we can't just allocate
 	 * the maximum block size because we can exhaust the available
 	 * pool log space.
 	 */
 	zil_blksz = zilog->zl_cur_used + sizeof (zil_chain_t);
+	for (i = 0; i < ZIL_PREV_BLKS; i++)
+		zil_blksz = MAX(zil_blksz, zilog->zl_prev_blks[i]);
 	for (i = 0; zil_blksz > zil_block_buckets[i]; i++)
 		continue;
 	zil_blksz = zil_block_buckets[i];
 	if (zil_blksz == UINT64_MAX)
 		zil_blksz = SPA_MAXBLOCKSIZE;
-	zilog->zl_prev_blks[zilog->zl_prev_rotor] = zil_blksz;
-	for (i = 0; i < ZIL_PREV_BLKS; i++)
-		zil_blksz = MAX(zil_blksz, zilog->zl_prev_blks[i]);
-	zilog->zl_prev_rotor = (zilog->zl_prev_rotor + 1) & (ZIL_PREV_BLKS - 1);
 
 	BP_ZERO(bp);
 	/* pass the old blkptr in order to spread log blocks across devs */
@@ -911,9 +1025,6 @@ zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
 		 * Allocate a new log write buffer (lwb).
 		 */
 		nlwb = zil_alloc_lwb(zilog, bp, txg);
-
-		/* Record the block for later vdev flushing */
-		zil_add_block(zilog, &lwb->lwb_blk);
 	}
 
 	if (BP_GET_CHECKSUM(&lwb->lwb_blk) == ZIO_CHECKSUM_ZILOG2) {
@@ -935,6 +1046,11 @@ zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
 	 */
 	bzero(lwb->lwb_buf + lwb->lwb_nused, wsz - lwb->lwb_nused);
 
+	mutex_enter(&zilog->zl_lock);
+	lwb->lwb_issue_seq = ++zilog->zl_lwb_issued_seq;
+	lwb->lwb_lr_seq = zilog->zl_lr_seq;
+	mutex_exit(&zilog->zl_lock);
+
 	zio_nowait(lwb->lwb_zio); /* Kick off the write for the old log block */
 
 	/*
@@ -1056,6 +1172,123 @@ zil_itx_destroy(itx_t *itx)
 	kmem_free(itx, offsetof(itx_t, itx_lr) + itx->itx_lr.lrc_reclen);
 }
 
+/*
+ * Return the list an itx belongs on: its object's list if it can be
+ * logged out of order, zl_itx_list otherwise.
+ */
+static list_t *
+zil_itx_list(zilog_t *zilog, itx_t *itx)
+{
+	itx_obj_t search, *io;
+	avl_index_t where;
+
+	ASSERT(MUTEX_HELD(&zilog->zl_lock));
+
+	/* only the out-of-order record types set itx_sync */
+	if (!TX_OOO(itx->itx_lr.lrc_txtype) || itx->itx_sync)
+		return (&zilog->zl_itx_list);
+
+	search.io_foid = ((lr_ooo_t *)&itx->itx_lr)->lr_foid;
+	io = avl_find(&zilog->zl_itx_obj_tree, &search, &where);
+	if (io == NULL) {
+		io = kmem_alloc(sizeof (itx_obj_t), KM_SLEEP);
+		io->io_foid = search.io_foid;
+		list_create(&io->io_list, sizeof (itx_t),
+		    offsetof(itx_t, itx_node));
+		avl_insert(&zilog->zl_itx_obj_tree, io, where);
+	}
+	return (&io->io_list);
+}
+
+static void
+zil_itx_obj_free(zilog_t *zilog, itx_obj_t *io)
+{
+	ASSERT(MUTEX_HELD(&zilog->zl_lock));
+	ASSERT(list_is_empty(&io->io_list));
+
+	avl_remove(&zilog->zl_itx_obj_tree, io);
+	list_destroy(&io->io_list);
+	kmem_free(io, sizeof (itx_obj_t));
+}
+
+/*
+ * Merge every object's itxs into zl_itx_list, keeping lrc_seq order, for
+ * a zil_commit() of all files.  Caller must be the log writer.
+ */
+static void
+zil_itx_obj_merge_all(zilog_t *zilog)
+{
+	list_t *list = &zilog->zl_itx_list;
+	itx_obj_t *io;
+	itx_t *itx, *pos;
+
+	ASSERT(MUTEX_HELD(&zilog->zl_lock));
+	ASSERT(zilog->zl_writer);
+
+	while ((io = avl_first(&zilog->zl_itx_obj_tree)) != NULL) {
+		pos = list_tail(list);
+		while ((itx = list_remove_tail(&io->io_list)) != NULL) {
+			while (pos != NULL &&
+			    pos->itx_lr.lrc_seq > itx->itx_lr.lrc_seq)
+				pos = list_prev(list, pos);
+			if (pos == NULL)
+				list_insert_head(list, itx);
+			else
+				list_insert_after(list, pos, itx);
+		}
+		zil_itx_obj_free(zilog, io);
+	}
+
+	/*
+	 * zl_commit_seq says every record on zl_itx_list up to it is on
+	 * stable storage, which no longer holds for the records just moved
+	 * there.  Pull it back below them until the writer pushes them.
+	 */
+	itx = list_head(list);
+	if (itx != NULL && itx->itx_lr.lrc_seq <= zilog->zl_commit_seq)
+		zilog->zl_commit_seq = itx->itx_lr.lrc_seq - 1;
+}
+
+static itx_obj_t *
+zil_itx_obj_find(zilog_t *zilog, uint64_t foid)
+{
+	itx_obj_t search;
+
+	search.io_foid = foid;
+	return (avl_find(&zilog->zl_itx_obj_tree, &search, NULL));
+}
+
+/*
+ * Report whether all itxs up to seq that a zil_commit() of foid has to
+ * push are on stable storage.  zl_commit_seq only covers zl_itx_list;
+ * the per-object lists are checked separately.
+ */
+static boolean_t
+zil_itx_committed(zilog_t *zilog, uint64_t seq, uint64_t foid)
+{
+	itx_obj_t *io;
+	itx_t *itx;
+
+	ASSERT(MUTEX_HELD(&zilog->zl_lock));
+
+	if (seq > zilog->zl_commit_seq)
+		return (B_FALSE);
+
+	if (foid != 0) {
+		io = zil_itx_obj_find(zilog, foid);
+		return (io == NULL || (itx = list_head(&io->io_list)) == NULL ||
+		    itx->itx_lr.lrc_seq > seq);
+	}
+
+	for (io = avl_first(&zilog->zl_itx_obj_tree); io != NULL;
+	    io = AVL_NEXT(&zilog->zl_itx_obj_tree, io)) {
+		itx = list_head(&io->io_list);
+		if (itx != NULL && itx->itx_lr.lrc_seq <= seq)
+			return (B_FALSE);
+	}
+	return (B_TRUE);
+}
+
 uint64_t
 zil_itx_assign(zilog_t *zilog, itx_t *itx, dmu_tx_t *tx)
 {
@@ -1065,7 +1298,7 @@ zil_itx_assign(zilog_t *zilog, itx_t *itx, dmu_tx_t *tx)
 	ASSERT(!zilog->zl_replay);
 
 	mutex_enter(&zilog->zl_lock);
-	list_insert_tail(&zilog->zl_itx_list, itx);
+	list_insert_tail(zil_itx_list(zilog, itx), itx);
 	zilog->zl_itx_list_sz += itx->itx_sod;
 	itx->itx_lr.lrc_txg = dmu_tx_get_txg(tx);
 	itx->itx_lr.lrc_seq = seq = ++zilog->zl_itx_seq;
@@ -1083,6 +1316,7 @@ zil_itx_clean(zilog_t *zilog)
 	uint64_t synced_txg = spa_last_synced_txg(zilog->zl_spa);
 	uint64_t freeze_txg = spa_freeze_txg(zilog->zl_spa);
 	list_t clean_list;
+	itx_obj_t *io, *io_next;
 	itx_t *itx;
 
 	list_create(&clean_list, sizeof (itx_t), offsetof(itx_t, itx_node));
@@ -1105,6 +1339,18 @@ zil_itx_clean(zilog_t *zilog)
 		zilog->zl_itx_list_sz -= itx->itx_sod;
 		list_insert_tail(&clean_list, itx);
 	}
+	for (io = avl_first(&zilog->zl_itx_obj_tree); io != NULL;
+	    io = io_next) {
+		io_next = AVL_NEXT(&zilog->zl_itx_obj_tree, io);
+		while ((itx = list_head(&io->io_list)) != NULL &&
+		    itx->itx_lr.lrc_txg <= MIN(synced_txg, freeze_txg)) {
+			list_remove(&io->io_list, itx);
+			zilog->zl_itx_list_sz -= itx->itx_sod;
+			list_insert_tail(&clean_list, itx);
+		}
+		if (list_is_empty(&io->io_list))
+			zil_itx_obj_free(zilog, io);
+	}
 	cv_broadcast(&zilog->zl_cv_writer);
 	mutex_exit(&zilog->zl_lock);
 
@@ -1127,8 +1373,9 @@ zil_clean(zilog_t *zilog)
 
 	mutex_enter(&zilog->zl_lock);
 	itx = list_head(&zilog->zl_itx_list);
-	if ((itx != NULL) &&
-	    (itx->itx_lr.lrc_txg <= spa_last_synced_txg(zilog->zl_spa))) {
+	if (((itx != NULL) &&
+	    (itx->itx_lr.lrc_txg <= spa_last_synced_txg(zilog->zl_spa))) ||
+	    avl_numnodes(&zilog->zl_itx_obj_tree) != 0) {
 		(void) taskq_dispatch(zilog->zl_clean_taskq,
 		    (task_func_t *)zil_itx_clean, zilog, TQ_NOSLEEP);
 	}
@@ -1140,15 +1387,25 @@ zil_commit_writer(zilog_t *zilog, uint64_t seq, uint64_t foid)
 {
 	uint64_t txg;
 	uint64_t commit_seq = 0;
-	itx_t *itx, *itx_next;
+	itx_obj_t *io = NULL;
+	itx_t *itx, *oitx;
+	list_t *list;
 	lwb_t *lwb;
 	spa_t *spa;
-	int error = 0;
 
 	zilog->zl_writer = B_TRUE;
-	ASSERT(zilog->zl_root_zio == NULL);
 	spa = zilog->zl_spa;
 
+	/*
+	 * Besides zl_itx_list, push the out-of-order itxs of foid, or of
+	 * all objects if foid is 0.  io stays valid while we drop zl_lock
+	 * below, as only the log writer and zil_itx_clean() free it.
+	 */
+	if (foid == 0)
+		zil_itx_obj_merge_all(zilog);
+	else
+		io = zil_itx_obj_find(zilog, foid);
+
 	if (zilog->zl_suspend) {
 		lwb = NULL;
 	} else {
@@ -1158,7 +1415,8 @@ zil_commit_writer(zilog_t *zilog, uint64_t seq, uint64_t foid)
 			 * Return if there's nothing to flush before we
 			 * dirty the fs by calling zil_create()
 			 */
-			if (list_is_empty(&zilog->zl_itx_list)) {
+			if (list_is_empty(&zilog->zl_itx_list) &&
+			    (io == NULL || list_is_empty(&io->io_list))) {
 				zilog->zl_writer = B_FALSE;
 				return;
 			}
@@ -1172,35 +1430,31 @@ zil_commit_writer(zilog_t *zilog, uint64_t seq, uint64_t foid)
 	/* Loop through in-memory log transactions filling log blocks. */
 	DTRACE_PROBE1(zil__cw1, zilog_t *, zilog);
 
-	for (itx = list_head(&zilog->zl_itx_list); itx; itx = itx_next) {
+	for (;;) {
 		/*
-		 * Save the next pointer.  Even though we drop zl_lock below,
-		 * all threads that can remove itx list entries (other writers
-		 * and zil_itx_clean()) can't do so until they have zl_writer.
+		 * Take the lower sequenced head of zl_itx_list and foid's
+		 * own list, so records go out in the order they were
+		 * assigned.  Other objects' out-of-order records (TX_WRITE,
+		 * TX_TRUNCATE, TX_SETATTR, TX_ACL) are on their own lists
+		 * and don't have to be walked.
 		 */
-		itx_next = list_next(&zilog->zl_itx_list, itx);
-
-		/*
-		 * Determine whether to push this itx.
-		 * Push all transactions related to specified foid and
-		 * all other transactions except those that can be logged
-		 * out of order (TX_WRITE, TX_TRUNCATE, TX_SETATTR, TX_ACL)
-		 * for all other files.
-		 *
-		 * If foid == 0 (meaning "push all foids") or
-		 * itx->itx_sync is set (meaning O_[D]SYNC), push regardless.
-		 */
-		if (foid != 0 && !itx->itx_sync &&
-		    TX_OOO(itx->itx_lr.lrc_txtype) &&
-		    ((lr_ooo_t *)&itx->itx_lr)->lr_foid != foid)
-			continue; /* skip this record */
+		list = &zilog->zl_itx_list;
+		itx = list_head(list);
+		oitx = (io != NULL ? list_head(&io->io_list) : NULL);
+		if (oitx != NULL && (itx == NULL ||
+		    oitx->itx_lr.lrc_seq < itx->itx_lr.lrc_seq)) {
+			list = &io->io_list;
+			itx = oitx;
+		}
+		if (itx == NULL)
+			break;
 
 		if ((itx->itx_lr.lrc_seq > seq) &&
 		    ((lwb == NULL) || (LWB_EMPTY(lwb)) ||
 		    (lwb->lwb_nused + itx->itx_sod > lwb->lwb_sz)))
 			break;
 
-		list_remove(&zilog->zl_itx_list, itx);
+		list_remove(list, itx);
 		zilog->zl_itx_list_sz -= itx->itx_sod;
 
 		mutex_exit(&zilog->zl_lock);
@@ -1209,8 +1463,11 @@ zil_commit_writer(zilog_t *zilog, uint64_t seq, uint64_t foid)
 		ASSERT(txg);
 
 		if (txg > spa_last_synced_txg(spa) ||
-		    txg > spa_freeze_txg(spa))
+		    txg > spa_freeze_txg(spa)) {
 			lwb = zil_lwb_commit(zilog, itx, lwb);
+			ZIL_STAT_BUMP(zil_itx_count);
+			ZIL_STAT_INCR(zil_itx_bytes, itx->itx_sod);
+		}
 
 		zil_itx_destroy(itx);
 
@@ -1223,70 +1480,162 @@ zil_commit_writer(zilog_t *zilog, uint64_t seq, uint64_t foid)
 		commit_seq = itx->itx_lr.lrc_seq - 1;
 	else
 		commit_seq = zilog->zl_itx_seq;
+	if (io != NULL && list_is_empty(&io->io_list))
+		zil_itx_obj_free(zilog, io);
 	mutex_exit(&zilog->zl_lock);
 
 	/* write the last block out */
 	if (lwb != NULL && lwb->lwb_zio != NULL)
 		lwb = zil_lwb_write_start(zilog, lwb);
 
+	/* remember the commit's size for sizing log blocks */
+	if (zilog->zl_cur_used != 0) {
+		zilog->zl_prev_blks[zilog->zl_prev_rotor] =
+		    MIN(zilog->zl_cur_used + sizeof (zil_chain_t),
+		    SPA_MAXBLOCKSIZE);
+		zilog->zl_prev_rotor =
+		    (zilog->zl_prev_rotor + 1) & (ZIL_PREV_BLKS - 1);
+	}
 	zilog->zl_prev_used = zilog->zl_cur_used;
 	zilog->zl_cur_used = 0;
 
+	mutex_enter(&zilog->zl_lock);
+
 	/*
-	 * Wait if necessary for the log blocks to be on stable storage.
+	 * If we couldn't allocate a log block, or the log is suspended,
+	 * fall back to syncing the txg.  Let the blocks already issued
+	 * finish first so that zil_sync() can retire the whole chain.
 	 */
-	if (zilog->zl_root_zio) {
-		DTRACE_PROBE1(zil__cw3, zilog_t *, zilog);
-		error = zio_wait(zilog->zl_root_zio);
-		zilog->zl_root_zio = NULL;
-		DTRACE_PROBE1(zil__cw4, zilog_t *, zilog);
-		zil_flush_vdevs(zilog);
-	}
-
-	if (error || lwb == NULL)
+	if (lwb == NULL) {
+		while (zilog->zl_lwb_done_seq < zilog->zl_lwb_issued_seq)
+			cv_wait(&zilog->zl_cv_lwb, &zilog->zl_lock);
+		mutex_exit(&zilog->zl_lock);
 		txg_wait_synced(zilog->zl_dmu_pool, 0);
+		mutex_enter(&zilog->zl_lock);
+	}
 
-	mutex_enter(&zilog->zl_lock);
 	zilog->zl_writer = B_FALSE;
 
 	ASSERT3U(commit_seq, >=, zilog->zl_commit_seq);
 	zilog->zl_commit_seq = commit_seq;
+}
+
+/*
+ * Wait for the log blocks up to issue sequence target to be written and
+ * on stable storage.  Whoever first finds them written flushes the vdevs
+ * of all blocks written so far, for everybody.  Called and returns with
+ * zl_lock held.
+ */
+static void
+zil_commit_wait(zilog_t *zilog, uint64_t target)
+{
+	uint64_t done, txg;
+
+	ASSERT(MUTEX_HELD(&zilog->zl_lock));
+
+	while (zilog->zl_lwb_flushed_seq < target) {
+		if (zilog->zl_lwb_done_seq < target || zilog->zl_flushing) {
+			cv_wait(&zilog->zl_cv_lwb, &zilog->zl_lock);
+			continue;
+		}
+		zilog->zl_flushing = B_TRUE;
+		done = zilog->zl_lwb_done_seq;
+		mutex_exit(&zilog->zl_lock);
+
+		DTRACE_PROBE1(zil__cw3, zilog_t *, zilog);
+		zil_flush_vdevs(zilog);
+		DTRACE_PROBE1(zil__cw4, zilog_t *, zilog);
+
+		mutex_enter(&zilog->zl_lock);
+		zilog->zl_flushing = B_FALSE;
+		zilog->zl_lwb_flushed_seq = done;
+		cv_broadcast(&zilog->zl_cv_lwb);
+	}
 
 	/*
-	 * Remember the highest committed log sequence number for ztest.
-	 * We only update this value when all the log writes succeeded,
-	 * because ztest wants to ASSERT that it got the whole log chain.
+	 * A log block that failed to write breaks the chain for every
+	 * block after it, until the txg that was open when it failed
+	 * syncs: by then the records of all blocks issued before the
+	 * failure are in the pool, and zil_sync() has moved zh_log past
+	 * the failed block.
 	 */
-	if (error == 0 && lwb != NULL)
-		zilog->zl_commit_lr_seq = zilog->zl_lr_seq;
+	txg = zilog->zl_lwb_failed_txg;
+	if (txg > spa_last_synced_txg(zilog->zl_spa)) {
+		mutex_exit(&zilog->zl_lock);
+		txg_wait_synced(zilog->zl_dmu_pool, txg);
+		mutex_enter(&zilog->zl_lock);
+	}
+}
+
+/*
+ * Wait for the log writer and all the log block writes it issued.
+ */
+static void
+zil_commit_wait_all(zilog_t *zilog)
+{
+	ASSERT(MUTEX_HELD(&zilog->zl_lock));
+
+	for (;;) {
+		if (zilog->zl_writer)
+			cv_wait(&zilog->zl_cv_writer, &zilog->zl_lock);
+		else if (zilog->zl_lwb_done_seq < zilog->zl_lwb_issued_seq)
+			cv_wait(&zilog->zl_cv_lwb, &zilog->zl_lock);
+		else
+			break;
+	}
+}
+
+static void
+zil_stat_commit(hrtime_t latency)
+{
+	ZIL_STAT_BUMP(zil_commit_count);
+	if (latency < 100 * 1000)
+		ZIL_STAT_BUMP(zil_commit_lt_100us);
+	else if (latency < 1000 * 1000)
+		ZIL_STAT_BUMP(zil_commit_lt_1ms);
+	else if (latency < 10 * 1000 * 1000)
+		ZIL_STAT_BUMP(zil_commit_lt_10ms);
+	else if (latency < 100 * 1000 * 1000)
+		ZIL_STAT_BUMP(zil_commit_lt_100ms);
+	else
+		ZIL_STAT_BUMP(zil_commit_ge_100ms);
 }
 
 /*
  * Push zfs transactions to stable storage up to the supplied sequence number.
  * If foid is 0 push out all transactions, otherwise push only those
  * for that file or might have been used to create that file.
+ *
+ * Log writes are pipelined: only copying itxs into log blocks and issuing
+ * the block writes is serialized (zl_writer).  The writer doesn't wait
+ * for its blocks, so the next committer can fill the next block while
+ * they are in flight, and each committer then waits for just the blocks
+ * issued by the time its records were, see zil_commit_wait().
  */
 void
 zil_commit(zilog_t *zilog, uint64_t seq, uint64_t foid)
 {
+	hrtime_t start;
+
 	if (zilog == NULL || seq == 0)
 		return;
 
+	start = gethrtime();
 	mutex_enter(&zilog->zl_lock);
 
 	seq = MIN(seq, zilog->zl_itx_seq);	/* cap seq at largest itx seq */
 
-	while (zilog->zl_writer) {
+	while (zilog->zl_writer)
 		cv_wait(&zilog->zl_cv_writer, &zilog->zl_lock);
-		if (seq <= zilog->zl_commit_seq) {
-			mutex_exit(&zilog->zl_lock);
-			return;
-		}
+	if (!zil_itx_committed(zilog, seq, foid)) {
+		ZIL_STAT_BUMP(zil_commit_writer_count);
+		zil_commit_writer(zilog, seq, foid); /* drops zl_lock */
+		/* wake up others waiting on the commit */
+		cv_broadcast(&zilog->zl_cv_writer);
 	}
-	zil_commit_writer(zilog, seq, foid); /* drops zl_lock */
-	/* wake up others waiting on the commit */
-	cv_broadcast(&zilog->zl_cv_writer);
+	zil_commit_wait(zilog, zilog->zl_lwb_issued_seq);
 	mutex_exit(&zilog->zl_lock);
+	zil_stat_commit(gethrtime() - start);
 }
 
 /*
@@ -1300,10 +1649,10 @@ zil_is_committed(zilog_t *zilog)
 
 	mutex_enter(&zilog->zl_lock);
 
-	while (zilog->zl_writer)
-		cv_wait(&zilog->zl_cv_writer, &zilog->zl_lock);
+	zil_commit_wait_all(zilog);
 
-	if (!list_is_empty(&zilog->zl_itx_list))
+	if (!list_is_empty(&zilog->zl_itx_list) ||
+	    avl_numnodes(&zilog->zl_itx_obj_tree) != 0)
 		committed = B_FALSE;		/* unpushed transactions */
 	else if ((lwb = list_head(&zilog->zl_lwb_list)) == NULL)
 		committed = B_TRUE;		/* intent log never used */
@@ -1340,7 +1689,11 @@ zil_sync(zilog_t *zilog, dmu_tx_t *tx)
 	ASSERT(zilog->zl_stop_sync == 0);
 
 	if (*replayed_seq != 0) {
-		ASSERT(zh->zh_replay_seq < *replayed_seq);
+		/*
+		 * While records are replayed concurrently, successive txgs
+		 * record the same seq (see zil_replay_drain()).
+		 */
+		ASSERT(zh->zh_replay_seq <= *replayed_seq);
 		zh->zh_replay_seq = *replayed_seq;
 		*replayed_seq = 0;
 	}
@@ -1392,11 +1745,24 @@ zil_init(void)
 {
 	zil_lwb_cache = kmem_cache_create("zil_lwb_cache",
 	    sizeof (struct lwb), 0, NULL, NULL, NULL, NULL, NULL, 0);
+
+	zil_ksp = kstat_create("zfs", 0, "zil", "misc", KSTAT_TYPE_NAMED,
+	    sizeof (zil_stats) / sizeof (kstat_named_t), KSTAT_FLAG_VIRTUAL);
+
+	if (zil_ksp != NULL) {
+		zil_ksp->ks_data = &zil_stats;
+		kstat_install(zil_ksp);
+	}
 }
 
 void
 zil_fini(void)
 {
+	if (zil_ksp != NULL) {
+		kstat_delete(zil_ksp);
+		zil_ksp = NULL;
+	}
+
 	kmem_cache_destroy(zil_lwb_cache);
 }
 
@@ -1425,6 +1791,9 @@ zil_alloc(objset_t *os, zil_header_t *zh_phys)
 	list_create(&zilog->zl_itx_list, sizeof (itx_t),
 	    offsetof(itx_t, itx_node));
 
+	avl_create(&zilog->zl_itx_obj_tree, zil_itx_obj_compare,
+	    sizeof (itx_obj_t), offsetof(itx_obj_t, io_node));
+
 	list_create(&zilog->zl_lwb_list, sizeof (lwb_t),
 	    offsetof(lwb_t, lwb_node));
 
@@ -1434,6 +1803,7 @@ zil_alloc(objset_t *os, zil_header_t *zh_phys)
 	    sizeof (zil_vdev_node_t), offsetof(zil_vdev_node_t, zv_node));
 
 	cv_init(&zilog->zl_cv_writer, NULL, CV_DEFAULT, NULL);
+	cv_init(&zilog->zl_cv_lwb, NULL, CV_DEFAULT, NULL);
 	cv_init(&zilog->zl_cv_suspend, NULL, CV_DEFAULT, NULL);
 
 	return (zilog);
@@ -1459,9 +1829,12 @@ zil_free(zilog_t *zilog)
 
 	ASSERT(list_head(&zilog->zl_itx_list) == NULL);
 	list_destroy(&zilog->zl_itx_list);
+	ASSERT(avl_numnodes(&zilog->zl_itx_obj_tree) == 0);
+	avl_destroy(&zilog->zl_itx_obj_tree);
 	mutex_destroy(&zilog->zl_lock);
 
 	cv_destroy(&zilog->zl_cv_writer);
+	cv_destroy(&zilog->zl_cv_lwb);
 	cv_destroy(&zilog->zl_cv_suspend);
 
 	kmem_free(zilog, sizeof (zilog_t));
@@ -1508,6 +1881,7 @@ zil_close(zilog_t *zilog)
 
 	zil_itx_clean(zilog);
 	ASSERT(list_head(&zilog->zl_itx_list) == NULL);
+	ASSERT(avl_numnodes(&zilog->zl_itx_obj_tree) == 0);
 }
 
 /*
@@ -1545,8 +1919,7 @@ zil_suspend(zilog_t *zilog)
 	 * Wait for any in-flight log writes to complete.
 	 */
 	mutex_enter(&zilog->zl_lock);
-	while (zilog->zl_writer)
-		cv_wait(&zilog->zl_cv_writer, &zilog->zl_lock);
+	zil_commit_wait_all(zilog);
 	mutex_exit(&zilog->zl_lock);
 
 	zil_destroy(zilog, B_FALSE);
@@ -1568,11 +1941,51 @@ zil_resume(zilog_t *zilog)
 	mutex_exit(&zilog->zl_lock);
 }
 
+/*
+ * Records that only change the object they name are replayed concurrently:
+ * they are queued to one of zil_replay_streams streams by object number,
+ * and a taskq applies each stream in log order.  Any other record waits
+ * for all queued records to be applied, and is then applied by the thread
+ * parsing the log.  Setting zil_replay_streams to 1 or less replays every
+ * record in the parsing thread.  The parsing thread also waits once
+ * zil_replay_max_queued bytes of records are queued.
+ */
+int zil_replay_streams = 8;
+uint64_t zil_replay_max_queued = 8 << 20;
+
+#define	ZIL_REPLAY_STREAMED(txtype)	\
+	((txtype) == TX_WRITE ||	\
+	(txtype) == TX_TRUNCATE ||	\
+	(txtype) == TX_WRITE2)
+
+typedef struct zil_replay_rec {
+	list_node_t	zrr_node;
+	size_t		zrr_size;	/* of the allocation, record follows */
+} zil_replay_rec_t;
+
+typedef struct zil_replay_stream {
+	struct zil_replay_arg *zrs_zr;
+	list_t		zrs_list;	/* records queued, in log order */
+	boolean_t	zrs_active;	/* a task is applying zrs_list */
+	char		*zrs_lr;	/* copy of the record being applied */
+} zil_replay_stream_t;
+
 typedef struct zil_replay_arg {
 	zil_replay_func_t **zr_replay;
 	void		*zr_arg;
 	boolean_t	zr_byteswap;
 	char		*zr_lr;
+	zilog_t		*zr_zilog;
+	taskq_t		*zr_taskq;	/* NULL if replaying serially */
+	int		zr_nstreams;
+	zil_replay_stream_t *zr_streams;
+	boolean_t	zr_pending;	/* records queued since last drain */
+	uint64_t	zr_last_seq;	/* last record seen */
+	kmutex_t	zr_lock;	/* protects the fields below */
+	kcondvar_t	zr_cv;
+	uint64_t	zr_queued;	/* bytes of records queued */
+	int		zr_nactive;	/* streams being applied */
+	int		zr_error;	/* first queued record error */
 } zil_replay_arg_t;
 
 static int
@@ -1580,8 +1993,6 @@ zil_replay_error(zilog_t *zilog, lr_t *lr, int error)
 {
 	char name[MAXNAMELEN];
 
-	zilog->zl_replaying_seq--;	/* didn't actually replay this one */
-
 	dmu_objset_name(zilog->zl_os, name);
 
 	cmn_err(CE_WARN, "ZFS replay transaction error %d, "
@@ -1593,29 +2004,16 @@ zil_replay_error(zilog_t *zilog, lr_t *lr, int error)
 	return (error);
 }
 
+/*
+ * Apply a valid log record, using buf for a copy of it and its data.
+ */
 static int
-zil_replay_log_record(zilog_t *zilog, lr_t *lr, void *zra, uint64_t claim_txg)
+zil_replay_apply(zilog_t *zilog, zil_replay_arg_t *zr, lr_t *lr, char *buf)
 {
-	zil_replay_arg_t *zr = zra;
-	const zil_header_t *zh = zilog->zl_header;
 	uint64_t reclen = lr->lrc_reclen;
-	uint64_t txtype = lr->lrc_txtype;
+	uint64_t txtype = lr->lrc_txtype & ~TX_CI;
 	int error = 0;
 
-	zilog->zl_replaying_seq = lr->lrc_seq;
-
-	if (lr->lrc_seq <= zh->zh_replay_seq)	/* already replayed */
-		return (0);
-
-	if (lr->lrc_txg < claim_txg)		/* already committed */
-		return (0);
-
-	/* Strip case-insensitive bit, still present in log record */
-	txtype &= ~TX_CI;
-
-	if (txtype == 0 || txtype >= TX_MAX_TYPE)
-		return (zil_replay_error(zilog, lr, EINVAL));
-
 	/*
 	 * If this record type can be logged out of order, the object
 	 * (lr_foid) may no longer exist.  That's legitimate, not an error.
@@ -1630,16 +2028,16 @@ zil_replay_log_record(zilog_t *zilog, lr_t *lr, void *zra, uint64_t claim_txg)
 	/*
 	 * Make a copy of the data so we can revise and extend it.
 	 */
-	bcopy(lr, zr->zr_lr, reclen);
+	bcopy(lr, buf, reclen);
 
 	/*
 	 * If this is a TX_WRITE with a blkptr, suck in the data.
 	 */
 	if (txtype == TX_WRITE && reclen == sizeof (lr_write_t)) {
 		error = zil_read_log_data(zilog, (lr_write_t *)lr,
-		    zr->zr_lr + reclen);
+		    buf + reclen);
 		if (error)
-			return (zil_replay_error(zilog, lr, error));
+			return (error);
 	}
 
 	/*
@@ -1650,7 +2048,7 @@ zil_replay_log_record(zilog_t *zilog, lr_t *lr, void *zra, uint64_t claim_txg)
 	 * the lr was byteswapped, undo it before invoking the replay vector.
 	 */
 	if (zr->zr_byteswap)
-		byteswap_uint64_array(zr->zr_lr, reclen);
+		byteswap_uint64_array(buf, reclen);
 
 	/*
 	 * We must now do two things atomically: replay this log record,
@@ -1658,7 +2056,7 @@ zil_replay_log_record(zilog_t *zilog, lr_t *lr, void *zra, uint64_t claim_txg)
 	 * we did so. At the end of each replay function the sequence number
 	 * is updated if we are in replay mode.
 	 */
-	error = zr->zr_replay[txtype](zr->zr_arg, zr->zr_lr, zr->zr_byteswap);
+	error = zr->zr_replay[txtype](zr->zr_arg, buf, zr->zr_byteswap);
 	if (error) {
 		/*
 		 * The DMU's dnode layer doesn't see removes until the txg
@@ -1668,9 +2066,181 @@ zil_replay_log_record(zilog_t *zilog, lr_t *lr, void *zra, uint64_t claim_txg)
 		 * specify B_FALSE for byteswap now, so we don't do it twice.
 		 */
 		txg_wait_synced(spa_get_dsl(zilog->zl_spa), 0);
-		error = zr->zr_replay[txtype](zr->zr_arg, zr->zr_lr, B_FALSE);
-		if (error)
-			return (zil_replay_error(zilog, lr, error));
+		error = zr->zr_replay[txtype](zr->zr_arg, buf, B_FALSE);
+	}
+	return (error);
+}
+
+static void
+zil_replay_stream_task(void *arg)
+{
+	zil_replay_stream_t *zrs = arg;
+	zil_replay_arg_t *zr = zrs->zrs_zr;
+	zilog_t *zilog = zr->zr_zilog;
+	zil_replay_rec_t *zrr;
+	lr_t *lr;
+	size_t size;
+	int error;
+
+	mutex_enter(&zr->zr_lock);
+	while ((zrr = list_head(&zrs->zrs_list)) != NULL) {
+		list_remove(&zrs->zrs_list, zrr);
+		error = zr->zr_error;
+		mutex_exit(&zr->zr_lock);
+
+		/* once a record fails, the rest are only dropped */
+		lr = (lr_t *)(zrr + 1);
+		if (error == 0) {
+			error = zil_replay_apply(zilog, zr, lr, zrs->zrs_lr);
+			if (error)
+				(void) zil_replay_error(zilog, lr, error);
+		}
+		size = zrr->zrr_size;
+		kmem_free(zrr, size);
+
+		mutex_enter(&zr->zr_lock);
+		if (zr->zr_error == 0)
+			zr->zr_error = error;
+		zr->zr_queued -= size;
+		cv_broadcast(&zr->zr_cv);
+	}
+	zrs->zrs_active = B_FALSE;
+	zr->zr_nactive--;
+	cv_broadcast(&zr->zr_cv);
+	mutex_exit(&zr->zr_lock);
+}
+
+/*
+ * Start reading the data of a TX_WRITE record with a blkptr into the ARC,
+ * so that it is there when its stream gets to the record.
+ */
+static void
+zil_replay_prefetch_data(zilog_t *zilog, const lr_write_t *lr)
+{
+	const blkptr_t *bp = &lr->lr_blkptr;
+	uint32_t aflags = ARC_NOWAIT | ARC_PREFETCH;
+	zbookmark_t zb;
+
+	if (BP_IS_HOLE(bp))
+		return;
+
+	SET_BOOKMARK(&zb, dmu_objset_id(zilog->zl_os), lr->lr_foid,
+	    ZB_ZIL_LEVEL, lr->lr_offset / BP_GET_LSIZE(bp));
+
+	(void) arc_read_nolock(NULL, zilog->zl_spa, bp, NULL, NULL,
+	    ZIO_PRIORITY_ASYNC_READ, ZIO_FLAG_CANFAIL | ZIO_FLAG_SPECULATIVE,
+	    &aflags, &zb);
+}
+
+/*
+ * Queue a record to the stream of its object.
+ */
+static int
+zil_replay_queue(zilog_t *zilog, zil_replay_arg_t *zr, lr_t *lr)
+{
+	uint64_t foid = ((lr_ooo_t *)lr)->lr_foid;
+	zil_replay_stream_t *zrs = &zr->zr_streams[foid % zr->zr_nstreams];
+	size_t size = sizeof (zil_replay_rec_t) + lr->lrc_reclen;
+	zil_replay_rec_t *zrr;
+	int error;
+
+	mutex_enter(&zr->zr_lock);
+	while (zr->zr_queued != 0 &&
+	    zr->zr_queued + size > zil_replay_max_queued)
+		cv_wait(&zr->zr_cv, &zr->zr_lock);
+	error = zr->zr_error;
+	mutex_exit(&zr->zr_lock);
+	if (error)
+		return (error);
+
+	if ((lr->lrc_txtype & ~TX_CI) == TX_WRITE &&
+	    lr->lrc_reclen == sizeof (lr_write_t))
+		zil_replay_prefetch_data(zilog, (lr_write_t *)lr);
+
+	zrr = kmem_alloc(size, KM_SLEEP);
+	zrr->zrr_size = size;
+	bcopy(lr, zrr + 1, lr->lrc_reclen);
+
+	mutex_enter(&zr->zr_lock);
+	zr->zr_queued += size;
+	list_insert_tail(&zrs->zrs_list, zrr);
+	if (!zrs->zrs_active) {
+		zrs->zrs_active = B_TRUE;
+		zr->zr_nactive++;
+		(void) taskq_dispatch(zr->zr_taskq, zil_replay_stream_task,
+		    zrs, TQ_SLEEP);
+	}
+	mutex_exit(&zr->zr_lock);
+	zr->zr_pending = B_TRUE;
+
+	return (0);
+}
+
+/*
+ * Wait for the queued records to be applied.
+ *
+ * zil_replaying() stores zl_replaying_seq as the sequence number replayed
+ * by each replay tx, and zil_sync() moves it to zh_replay_seq.  Queued
+ * records are applied out of log order, so while any are outstanding
+ * zl_replaying_seq stays at the last record before them: if we crash,
+ * they are all replayed again, which is harmless as each object's
+ * records are applied again in order.  Only once they are all applied
+ * does it move on to the last record seen.
+ */
+static int
+zil_replay_drain(zilog_t *zilog, zil_replay_arg_t *zr)
+{
+	int error;
+
+	if (!zr->zr_pending)
+		return (0);
+
+	mutex_enter(&zr->zr_lock);
+	while (zr->zr_nactive != 0)
+		cv_wait(&zr->zr_cv, &zr->zr_lock);
+	error = zr->zr_error;
+	mutex_exit(&zr->zr_lock);
+
+	zr->zr_pending = B_FALSE;
+	if (error == 0)
+		zilog->zl_replaying_seq = zr->zr_last_seq;
+
+	return (error);
+}
+
+static int
+zil_replay_log_record(zilog_t *zilog, lr_t *lr, void *zra, uint64_t claim_txg)
+{
+	zil_replay_arg_t *zr = zra;
+	const zil_header_t *zh = zilog->zl_header;
+	uint64_t txtype = lr->lrc_txtype & ~TX_CI;
+	int error;
+
+	zr->zr_last_seq = lr->lrc_seq;
+
+	if (lr->lrc_seq <= zh->zh_replay_seq ||	/* already replayed */
+	    lr->lrc_txg < claim_txg) {		/* already committed */
+		if (!zr->zr_pending)
+			zilog->zl_replaying_seq = lr->lrc_seq;
+		return (0);
+	}
+
+	if (zr->zr_taskq != NULL && ZIL_REPLAY_STREAMED(txtype))
+		return (zil_replay_queue(zilog, zr, lr));
+
+	if ((error = zil_replay_drain(zilog, zr)) != 0)
+		return (error);
+
+	zilog->zl_replaying_seq = lr->lrc_seq;
+
+	if (txtype == 0 || txtype >= TX_MAX_TYPE)
+		error = EINVAL;
+	else
+		error = zil_replay_apply(zilog, zr, lr, zr->zr_lr);
+	if (error) {
+		/* didn't actually replay this one */
+		zilog->zl_replaying_seq--;
+		return (zil_replay_error(zilog, lr, error));
 	}
 	return (0);
 }
@@ -1684,6 +2254,58 @@ zil_incr_blks(zilog_t *zilog, blkptr_t *bp, void *arg, uint64_t claim_txg)
 	return (0);
 }
 
+static void
+zil_replay_streams_init(zil_replay_arg_t *zr)
+{
+	zil_replay_stream_t *zrs;
+	int s;
+
+	zr->zr_taskq = NULL;
+	zr->zr_nstreams = zil_replay_streams;
+	zr->zr_pending = B_FALSE;
+	zr->zr_queued = 0;
+	zr->zr_nactive = 0;
+	zr->zr_error = 0;
+	if (zr->zr_nstreams <= 1)
+		return;
+
+	mutex_init(&zr->zr_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&zr->zr_cv, NULL, CV_DEFAULT, NULL);
+	zr->zr_streams = kmem_zalloc(zr->zr_nstreams *
+	    sizeof (zil_replay_stream_t), KM_SLEEP);
+	for (s = 0; s < zr->zr_nstreams; s++) {
+		zrs = &zr->zr_streams[s];
+		zrs->zrs_zr = zr;
+		list_create(&zrs->zrs_list, sizeof (zil_replay_rec_t),
+		    offsetof(zil_replay_rec_t, zrr_node));
+		zrs->zrs_lr = kmem_alloc(2 * SPA_MAXBLOCKSIZE, KM_SLEEP);
+	}
+	zr->zr_taskq = taskq_create("zil_replay", zr->zr_nstreams,
+	    minclsyspri, zr->zr_nstreams, INT_MAX, 0);
+}
+
+static void
+zil_replay_streams_fini(zil_replay_arg_t *zr)
+{
+	zil_replay_stream_t *zrs;
+	int s;
+
+	if (zr->zr_taskq == NULL)
+		return;
+
+	taskq_destroy(zr->zr_taskq);
+	for (s = 0; s < zr->zr_nstreams; s++) {
+		zrs = &zr->zr_streams[s];
+		ASSERT(list_is_empty(&zrs->zrs_list));
+		list_destroy(&zrs->zrs_list);
+		kmem_free(zrs->zrs_lr, 2 * SPA_MAXBLOCKSIZE);
+	}
+	kmem_free(zr->zr_streams, zr->zr_nstreams *
+	    sizeof (zil_replay_stream_t));
+	cv_destroy(&zr->zr_cv);
+	mutex_destroy(&zr->zr_lock);
+}
+
 /*
  * If this dataset has a non-empty intent log, replay it and destroy it.
  */
@@ -1693,6 +2315,9 @@ zil_replay(objset_t *os, void *arg, zil_replay_func_t *replay_func[TX_MAX_TYPE])
 	zilog_t *zilog = dmu_objset_zil(os);
 	const zil_header_t *zh = zilog->zl_header;
 	zil_replay_arg_t zr;
+	char name[MAXNAMELEN];
+	hrtime_t start;
+	uint64_t msec;
 
 	if ((zh->zh_flags & ZIL_REPLAY_NEEDED) == 0) {
 		zil_destroy(zilog, B_TRUE);
@@ -1703,22 +2328,34 @@ zil_replay(objset_t *os, void *arg, zil_replay_func_t *replay_func[TX_MAX_TYPE])
 	zr.zr_arg = arg;
 	zr.zr_byteswap = BP_SHOULD_BYTESWAP(&zh->zh_log);
 	zr.zr_lr = kmem_alloc(2 * SPA_MAXBLOCKSIZE, KM_SLEEP);
+	zr.zr_zilog = zilog;
+	zil_replay_streams_init(&zr);
 
 	/*
 	 * Wait for in-progress removes to sync before starting replay.
 	 */
 	txg_wait_synced(zilog->zl_dmu_pool, 0);
 
+	start = gethrtime();
 	zilog->zl_replay = B_TRUE;
 	zilog->zl_replay_time = lbolt;
 	ASSERT(zilog->zl_replay_blks == 0);
 	(void) zil_parse(zilog, zil_incr_blks, zil_replay_log_record, &zr,
 	    zh->zh_claim_txg);
+	(void) zil_replay_drain(zilog, &zr);
+	zil_replay_streams_fini(&zr);
 	kmem_free(zr.zr_lr, 2 * SPA_MAXBLOCKSIZE);
 
 	zil_destroy(zilog, B_FALSE);
 	txg_wait_synced(zilog->zl_dmu_pool, zilog->zl_destroy_txg);
 	zilog->zl_replay = B_FALSE;
+
+	msec = MAX((gethrtime() - start) / (NANOSEC / MILLISEC), 1);
+	dmu_objset_name(os, name);
+	cmn_err(CE_NOTE, "ZFS replay of dataset %s: %"PRIu64" records in "
+	    "%"PRIu64" blocks, %"PRIu64" ms, %"PRIu64" records/s", name,
+	    zilog->zl_parse_lr_count, zilog->zl_parse_blk_count, msec,
+	    zilog->zl_parse_lr_count * MILLISEC / msec);
 }
 
 boolean_t
@@ -719,6 +719,13 @@ zio_free_sync(zio_t *pio, spa_t *spa, uint64_t txg, const blkptr_t *bp,
 
 	arc_free(spa, bp);
 
+	/*
+	 * Frees are issued in bulk, so start reading the dedup table
+	 * entries now; zio_ddt_free() will find them in the ARC.
+	 */
+	if (BP_GET_DEDUP(bp))
+		ddt_prefetch(spa, bp);
+
 	zio = zio_create(pio, spa, txg, bp, NULL, size,
 	    NULL, NULL, ZIO_TYPE_FREE, ZIO_PRIORITY_FREE, flags,
 	    NULL, 0, NULL, ZIO_STAGE_OPEN, ZIO_FREE_PIPELINE);
@@ -1771,6 +1778,7 @@ zio_write_gang_block(zio_t *pio)
 		zp.zp_copies = gio->io_prop.zp_copies;
 		zp.zp_dedup = 0;
 		zp.zp_dedup_verify = 0;
+		zp.zp_special_smallblk = 0;
 
 		zio_nowait(zio_write(zio, spa, txg, &gbh->zg_blkptr[g],
 		    (char *)pio->io_data + (pio->io_size - resid), lsize, &zp,
@@ -1925,7 +1933,7 @@ zio_ddt_collision(zio_t *zio, ddt_t *ddt, ddt_entry_t *dde)
 
 			ddt_bp_fill(ddp, &blk, ddp->ddp_phys_birth);
 
-			ddt_exit(ddt);
+			ddt_exit(ddt, &dde->dde_key);
 
 			error = arc_read_nolock(NULL, spa, &blk,
 			    arc_getbuf_func, &abuf, ZIO_PRIORITY_SYNC_READ,
@@ -1940,7 +1948,7 @@ zio_ddt_collision(zio_t *zio, ddt_t *ddt, ddt_entry_t *dde)
 				VERIFY(arc_buf_remove_ref(abuf, &abuf) == 1);
 			}
 
-			ddt_enter(ddt);
+			ddt_enter(ddt, &dde->dde_key);
 			return (error != 0);
 		}
 	}
@@ -1960,7 +1968,7 @@ zio_ddt_child_write_ready(zio_t *zio)
 	if (zio->io_error)
 		return;
 
-	ddt_enter(ddt);
+	ddt_enter(ddt, &dde->dde_key);
 
 	ASSERT(dde->dde_lead_zio[p] == zio);
 
@@ -1969,7 +1977,7 @@ zio_ddt_child_write_ready(zio_t *zio)
 	while ((pio = zio_walk_parents(zio)) != NULL)
 		ddt_bp_fill(ddp, pio->io_bp, zio->io_txg);
 
-	ddt_exit(ddt);
+	ddt_exit(ddt, &dde->dde_key);
 }
 
 static void
@@ -1980,7 +1988,7 @@ zio_ddt_child_write_done(zio_t *zio)
 	ddt_entry_t *dde = zio->io_private;
 	ddt_phys_t *ddp = &dde->dde_phys[p];
 
-	ddt_enter(ddt);
+	ddt_enter(ddt, &dde->dde_key);
 
 	ASSERT(ddp->ddp_refcnt == 0);
 	ASSERT(dde->dde_lead_zio[p] == zio);
@@ -1993,7 +2001,7 @@ zio_ddt_child_write_done(zio_t *zio)
 		ddt_phys_clear(ddp);
 	}
 
-	ddt_exit(ddt);
+	ddt_exit(ddt, &dde->dde_key);
 }
 
 static void
@@ -2007,7 +2015,7 @@ zio_ddt_ditto_write_done(zio_t *zio)
 	ddt_phys_t *ddp = &dde->dde_phys[p];
 	ddt_key_t *ddk = &dde->dde_key;
 
-	ddt_enter(ddt);
+	ddt_enter(ddt, &dde->dde_key);
 
 	ASSERT(ddp->ddp_refcnt == 0);
 	ASSERT(dde->dde_lead_zio[p] == zio);
@@ -2022,7 +2030,7 @@ zio_ddt_ditto_write_done(zio_t *zio)
 		ddt_phys_fill(ddp, bp);
 	}
 
-	ddt_exit(ddt);
+	ddt_exit(ddt, &dde->dde_key);
 }
 
 static int
@@ -2039,12 +2047,14 @@ zio_ddt_write(zio_t *zio)
 	ddt_t *ddt = ddt_select(spa, bp);
 	ddt_entry_t *dde;
 	ddt_phys_t *ddp;
+	ddt_key_t ddk;
 
 	ASSERT(BP_GET_DEDUP(bp));
 	ASSERT(BP_GET_CHECKSUM(bp) == zp->zp_checksum);
 	ASSERT(BP_IS_HOLE(bp) || zio->io_bp_override);
 
-	ddt_enter(ddt);
+	ddt_key_fill(&ddk, bp);
+	ddt_enter(ddt, &ddk);
 	dde = ddt_lookup(ddt, bp, B_TRUE);
 	ddp = &dde->dde_phys[p];
 
@@ -2064,7 +2074,7 @@ zio_ddt_write(zio_t *zio)
 			zp->zp_dedup = 0;
 		}
 		zio->io_pipeline = ZIO_WRITE_PIPELINE;
-		ddt_exit(ddt);
+		ddt_exit(ddt, &ddk);
 		return (ZIO_PIPELINE_CONTINUE);
 	}
 
@@ -2090,7 +2100,7 @@ zio_ddt_write(zio_t *zio)
 			zio->io_pipeline = ZIO_WRITE_PIPELINE;
 			zio->io_bp_override = NULL;
 			BP_ZERO(bp);
-			ddt_exit(ddt);
+			ddt_exit(ddt, &ddk);
 			return (ZIO_PIPELINE_CONTINUE);
 		}
 
@@ -2125,7 +2135,7 @@ zio_ddt_write(zio_t *zio)
 		dde->dde_lead_zio[p] = cio;
 	}
 
-	ddt_exit(ddt);
+	ddt_exit(ddt, &ddk);
 
 	if (cio)
 		zio_nowait(cio);
@@ -2145,15 +2155,17 @@ zio_ddt_free(zio_t *zio)
 	ddt_t *ddt = ddt_select(spa, bp);
 	ddt_entry_t *dde;
 	ddt_phys_t *ddp;
+	ddt_key_t ddk;
 
 	ASSERT(BP_GET_DEDUP(bp));
 	ASSERT(zio->io_child_type == ZIO_CHILD_LOGICAL);
 
-	ddt_enter(ddt);
+	ddt_key_fill(&ddk, bp);
+	ddt_enter(ddt, &ddk);
 	freedde = dde = ddt_lookup(ddt, bp, B_TRUE);
 	ddp = ddt_phys_select(dde, bp);
 	ddt_phys_decref(ddp);
-	ddt_exit(ddt);
+	ddt_exit(ddt, &ddk);
 
 	return (ZIO_PIPELINE_CONTINUE);
 }
@@ -2167,8 +2179,10 @@ static int
 zio_dva_allocate(zio_t *zio)
 {
 	spa_t *spa = zio->io_spa;
-	metaslab_class_t *mc = spa_normal_class(spa);
+	metaslab_class_t *mc;
+	zio_prop_t *zp = &zio->io_prop;
 	blkptr_t *bp = zio->io_bp;
+	boolean_t ismd;
 	int error;
 
 	if (zio->io_gang_leader == NULL) {
@@ -2182,8 +2196,25 @@ zio_dva_allocate(zio_t *zio)
 	ASSERT3U(zio->io_prop.zp_copies, <=, spa_max_replication(spa));
 	ASSERT3U(zio->io_size, ==, BP_GET_PSIZE(bp));
 
+	/*
+	 * Metadata and small blocks prefer the special class.  If it is
+	 * full, spill over to the normal class before resorting to ganging.
+	 */
+	ismd = (zp->zp_level > 0 || dmu_ot[zp->zp_type].ot_metadata);
+	mc = spa_preferred_class(spa, zio->io_size, ismd,
+	    zp->zp_special_smallblk);
+
 	error = metaslab_alloc(spa, mc, zio->io_size, bp,
-	    zio->io_prop.zp_copies, zio->io_txg, NULL, 0);
+	    zp->zp_copies, zio->io_txg, NULL, METASLAB_ALLOC_QUEUE);
+
+	if (error == ENOSPC && mc == spa_special_class(spa)) {
+		mc = spa_normal_class(spa);
+		error = metaslab_alloc(spa, mc, zio->io_size, bp,
+		    zp->zp_copies, zio->io_txg, NULL, METASLAB_ALLOC_QUEUE);
+	}
+
+	if (error == 0)
+		zio->io_flags |= ZIO_FLAG_IO_ALLOCATING;
 
 	if (error) {
 		if (error == ENOSPC && zio->io_size > SPA_MINBLOCKSIZE)
@@ -2472,6 +2503,16 @@ zio_vdev_io_assess(zio_t *zio)
 	if (zio_wait_for_children(zio, ZIO_CHILD_VDEV, ZIO_WAIT_DONE))
 		return (ZIO_PIPELINE_STOP);
 
+	/*
+	 * The block's writes have drained from its vdevs, so take it off
+	 * the allocation queues of its metaslab groups.
+	 */
+	if (zio->io_flags & ZIO_FLAG_IO_ALLOCATING) {
+		ASSERT(vd == NULL && zio->io_type == ZIO_TYPE_WRITE);
+		metaslab_alloc_queue_remove(zio->io_spa, zio->io_bp);
+		zio->io_flags &= ~ZIO_FLAG_IO_ALLOCATING;
+	}
+
 	if (vd == NULL && !(zio->io_flags & ZIO_FLAG_CONFIG_WRITER))
 		spa_config_exit(zio->io_spa, SCL_ZIO, zio);
 
@@ -2750,6 +2791,21 @@ zio_done(zio_t *zio)
 		for (int w = 0; w < ZIO_WAIT_TYPES; w++)
 			ASSERT(zio->io_children[c][w] == 0);
 
+	/*
+	 * If the write never reached zio_vdev_io_assess(), its block is
+	 * still on the allocation queues; take it off now.  The vdevs are
+	 * looked up under SCL_ZIO, as in zio_vdev_io_start().
+	 */
+	if (zio->io_flags & ZIO_FLAG_IO_ALLOCATING) {
+		ASSERT(zio->io_type == ZIO_TYPE_WRITE);
+		if (!(zio->io_flags & ZIO_FLAG_CONFIG_WRITER))
+			spa_config_enter(spa, SCL_ZIO, FTAG, RW_READER);
+		metaslab_alloc_queue_remove(spa, bp);
+		if (!(zio->io_flags & ZIO_FLAG_CONFIG_WRITER))
+			spa_config_exit(spa, SCL_ZIO, FTAG);
+		zio->io_flags &= ~ZIO_FLAG_IO_ALLOCATING;
+	}
+
 	if (bp != NULL) {
 		ASSERT(bp->blk_pad[0] == 0);
 		ASSERT(bp->blk_pad[1] == 0);
@@ -82,6 +82,11 @@ extern int optind, opterr, optopt;
 
 extern int zfs_vdev_cache_size; // in lib/libzpool/vdev_cache.c
 extern int zfs_prefetch_disable; // lib/libzpool/dmu_zfetch.c
+extern int zfs_arc_compressed; // lib/libzpool/arc.c
+extern int zfs_arc_warmstart; // lib/libzpool/arc.c
+extern char *zfs_vdev_raidz_impl; // lib/libzpool/vdev_raidz_math.c
+extern uint64_t zfs_dirty_data_max; // lib/libzpool/dsl_pool.c
+extern int zfs_txg_synctime_ms; // lib/libzpool/dsl_pool.c
 extern int arg_log_uberblocks, arg_min_uberblock_txg; // uberblock.c
 size_t stack_size = 0;
 
@@ -94,8 +99,13 @@ static struct option longopts[] = {
 	{ "disable-page-cache", 0, &cf_disable_page_cache, 1 },
 	{ "pidfile", 1, NULL, 'p' },
 	{ "max-arc-size", 1, NULL, 'm' },
+	{ "compressed-arc", 0, &zfs_arc_compressed, 1 },
+	{ "arc-warm-start", 0, &zfs_arc_warmstart, 1 },
+	{ "max-dirty-data", 1, NULL, 'D' },
+	{ "txg-sync-time", 1, NULL, 'S' },
 	{ "zfs-prefetch-disable", 0, &zfs_prefetch_disable, 1 },
 	{ "vdev-cache-size", 1, NULL, 'v' },
+	{ "raidz-impl", 1, NULL, 'R' },
 	{ "fuse-attr-timeout", 1, NULL, 'a' },
 	{ "fuse-entry-timeout", 1, NULL, 'e' },
 	{ "fuse-mount-options", 1, NULL, 'o' },
@@ -145,6 +155,20 @@ print_usage(int argc, char *argv[])
 		"  -m MB, --max-arc-size MB\n"
 		"			Forces the maximum ARC size (in megabytes).\n"
 		"			Minimum is 16 and also capped at 75%% of physical memory.\n"
+		"  --compressed-arc\n"
+		"			Keep compressed blocks compressed in the ARC and\n"
+		"			decompress them on access. Saves ram for a little cpu.\n"
+		"  --arc-warm-start\n"
+		"			Periodically record each pool's hot blocks and\n"
+		"			prefetch them when the pool is next imported.\n"
+		"  --max-dirty-data MB\n"
+		"			Data not yet written out above which writers are\n"
+		"			blocked. They are slowed down progressively from\n"
+		"			60%% of it. Default: 10%% of ram, at most 1/4 of ARC.\n"
+		"  --txg-sync-time MS\n"
+		"			Closes a transaction group early once it holds about\n"
+		"			MS milliseconds of writes, at the rate the pool has\n"
+		"			been syncing. Default : 1000\n"
 		"  -o OPT..., --fuse-mount-options OPT,OPT,OPT...\n"
 		"			Sets FUSE mount options for all filesystems.\n"
 		"			Format: comma-separated string of characters.\n"
@@ -152,6 +176,9 @@ print_usage(int argc, char *argv[])
 		"			Skips uberblocks with a TXG < MIN when mounting any fs\n"
 		"  -v MB, --vdev-cache-size MB\n"
 		"			adjust the size of the vdev cache. Default : 10\n"
+		"  --raidz-impl NAME\n"
+		"			Select the RAID-Z parity implementation: scalar,\n"
+		"			sse, avx2, avx512 or fastest. Default : fastest\n"
 		"  --zfs-prefetch-disable\n"
 		"			Disable the high level prefetch cache in zfs.\n"
 		"			This thing can eat up to 150 Mb of ram, maybe more\n"
@@ -229,6 +256,21 @@ parse_args(int argc, char *argv[])
 				    "value", optarg);
 			max_arc_size = max_arc_size << 20;
 			break;
+		case 'D':
+			check_opt(progname, "--max-dirty-data");
+			zfs_dirty_data_max = strtoull(optarg, &endp, 10);
+			if (endp == optarg || zfs_dirty_data_max == 0)
+				errx(64, "max_dirty_data: %s: invalid "
+				    "value", optarg);
+			zfs_dirty_data_max <<= 20;
+			break;
+		case 'S':
+			check_opt(progname, "--txg-sync-time");
+			zfs_txg_synctime_ms = strtol(optarg, &endp, 10);
+			if (endp == optarg || zfs_txg_synctime_ms <= 0)
+				errx(64, "txg_sync_time: %s: invalid "
+				    "value", optarg);
+			break;
 		case 'n':
 			cf_daemonize = 0;
 			break;
@@ -293,6 +335,10 @@ parse_args(int argc, char *argv[])
 		case 'x':
 			cf_enable_xattr = 1;
 			break;
+		case 'R':
+			check_opt(progname, "--raidz-impl");
+			zfs_vdev_raidz_impl = strdup(optarg);
+			break;
 		case 1: /* non-option argument passed (due to - in optstring) */
 		case 'h':
 		case '?':
@@ -3234,6 +3234,15 @@ zfs_check_settable(const char *dsname, nvpair_t *pair, cred_t *cr)
 			return (ENOTSUP);
 		break;
 
+	case ZFS_PROP_SPECIAL_SMALL_BLOCKS:
+		if (nvpair_type(pair) == DATA_TYPE_UINT64 &&
+		    nvpair_value_uint64(pair, &intval) == 0) {
+			if (intval != 0 && (intval < SPA_MINBLOCKSIZE ||
+			    intval > SPA_MAXBLOCKSIZE || !ISP2(intval)))
+				return (EDOM);
+		}
+		break;
+
 	case ZFS_PROP_SHARESMB:
 		if (zpl_earlier_version(dsname, ZPL_VERSION_FUID))
 			return (ENOTSUP);
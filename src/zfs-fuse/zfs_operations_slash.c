@@ -2420,6 +2420,31 @@ zfsslash2_wait_synced(uint64_t txg)
 	txg_wait_synced(dp, txg);
 }
 
+/*
+ * Asynchronous versions of zfsslash2_wait_synced(): func(arg, 0) is called,
+ * or fd (an eventfd) is bumped, once txg is on disk.  See
+ * txg_register_synced().
+ */
+int
+zfsslash2_register_synced(uint64_t txg, void (*func)(void *, int), void *arg)
+{
+	struct vfs *vfs = zfs_mounts[current_vfsid].zm_vfs;
+	zfsvfs_t *zfsvfs = vfs->vfs_data;
+
+	return (txg_register_synced(spa_get_dsl(zfsvfs->z_os->os_spa), txg,
+	    func, arg));
+}
+
+int
+zfsslash2_notify_synced(uint64_t txg, int fd)
+{
+	struct vfs *vfs = zfs_mounts[current_vfsid].zm_vfs;
+	zfsvfs_t *zfsvfs = vfs->vfs_data;
+
+	return (txg_notify_synced(spa_get_dsl(zfsvfs->z_os->os_spa), txg,
+	    fd));
+}
+
 uint64_t
 zfsslash2_return_synced(void)
 {
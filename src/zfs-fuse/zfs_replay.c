@@ -877,7 +877,9 @@ zfs_replay_acl(zfsvfs_t *zfsvfs, lr_acl_t *lr, boolean_t byteswap)
 }
 
 /*
- * Callback vectors for replaying records
+ * Callback vectors for replaying records.  zil_replay() applies the
+ * TX_WRITE, TX_TRUNCATE and TX_WRITE2 records of different objects
+ * concurrently, so those must not share state beyond their znode.
  */
 zil_replay_func_t *zfs_replay_vector[TX_MAX_TYPE] = {
 	zfs_replay_error,	/* 0 no such transaction type */
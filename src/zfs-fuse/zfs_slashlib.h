@@ -126,6 +126,8 @@ int	zfsslash2_replay_removexattr(int, slfid_t, const char *);
 uint64_t	zfsslash2_last_synced_txg(void);
 uint64_t	zfsslash2_return_synced(void);
 void		zfsslash2_wait_synced(uint64_t);
+int		zfsslash2_register_synced(uint64_t, void (*)(void *, int), void *);
+int		zfsslash2_notify_synced(uint64_t, int);
 
 extern int		zfs_nmounts;
 extern mount_info_t	zfs_mounts[];